@@ -0,0 +1,337 @@
+/*
+ * bench.cpp
+ * Benchmark harness for the interpreter
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o bench bench/bench.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  bench [--prog3 PATH] [--prog3-arg ARG]... [--json FILE] [--repeat N] [--label NAME] [--input CMD] [--batch FILE] program...
+ *
+ * Every program is measured three ways:
+ *   lex         getNextToken over the whole file, nothing else
+ *   interpret   Prog over the whole file in process, with program output discarded
+ *   end_to_end  the prog3 binary run as its own process, with stdout sent to /dev/null
+ *               and any --prog3-arg options passed along to it
+ *
+ * A program that reads standard input is given the output of the shell command in the --input before
+ * it, afresh for every run that executes it. A program with a --batch before it is run in batch mode
+ * over that batch input, see src/batch.h.
+ *
+ * Each measurement runs in a forked child so that peak RSS is that of the phase alone.
+ * The best time over --repeat runs is kept. Results are printed as a table and, with
+ * --json, written out as a JSON file that can be diffed between builds.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "parserInterp.h"
+
+using namespace std;
+
+
+//What a child process reports back about one run
+struct RunResult {
+	double seconds;
+	uint64_t tokens;
+	uint64_t statements;
+	int ok;
+};
+
+//The best of all repeats of one phase
+struct PhaseResult {
+	double seconds;
+	long peakRssKb;
+	bool ok;
+};
+
+struct ProgramResult {
+	string file;
+	uint64_t bytes;
+	uint64_t tokens;
+	uint64_t statements;
+	PhaseResult lex, interpret, endToEnd;
+};
+
+
+//Stream buffer that throws away everything written to it
+class NullBuf : public streambuf {
+protected:
+	int overflow(int ch) override { return ch; }
+	streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+
+static double Now(){
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//Only lex the program. Statements are counted by the tokens that start them
+static RunResult LexOnly(const string& file){
+	RunResult r = {};
+	ifstream in(file);
+	int line = 1;
+	double start = Now();
+	for (;;){
+		LexItem tok = getNextToken(in, line);
+		if (tok == DONE || tok == ERR){
+			r.ok = (tok == DONE);
+			break;
+		}
+		r.tokens++;
+		if (tok == ASSOP || tok == WRITE || tok == WRITELN || tok == READLN || tok == IF){
+			r.statements++;
+		}
+	}
+	r.seconds = Now() - start;
+	return r;
+}
+
+
+//Makes the output of the shell command cmd the standard input of this process, if there is one
+static void InputFrom(const string& cmd){
+	if (cmd.empty()){
+		return;
+	}
+	FILE* p = popen(cmd.c_str(), "r");
+	if (p == NULL){
+		perror("popen");
+		_exit(1);
+	}
+	dup2(fileno(p), 0);
+}
+
+
+//Parse and execute the program in this process, over the batch input if there is one
+static RunResult Interpret(const string& file, const string& batchFile){
+	RunResult r = {};
+	NullBuf null;
+	ifstream in(file);
+	int line = 1;
+	Batch batch;
+	if (!batchFile.empty()){
+		if (!batch.Open(batchFile)){
+			return r;
+		}
+		UseBatch(&batch);
+	}
+	streambuf* old = cout.rdbuf(&null);
+	double start = Now();
+	r.ok = Prog(in, line);
+	r.seconds = Now() - start;
+	cout.rdbuf(old);
+	return r;
+}
+
+
+//Runs fn in a forked child, returning what it reported and the child's peak RSS
+template <typename Fn>
+static RunResult InChild(Fn fn, long& peakRssKb){
+	int fds[2];
+	RunResult r = {};
+	if (pipe(fds) != 0){
+		perror("pipe");
+		exit(1);
+	}
+
+	pid_t pid = fork();
+	if (pid == 0){
+		close(fds[0]);
+		RunResult mine = fn();
+		if (write(fds[1], &mine, sizeof(mine)) != sizeof(mine)){
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &r, sizeof(r)) != sizeof(r)){
+		r.ok = 0;
+	}
+	close(fds[0]);
+
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	peakRssKb = usage.ru_maxrss;
+	return r;
+}
+
+
+//Runs the prog3 binary on the file as a separate process
+static RunResult EndToEnd(const string& prog3, const vector<string>& args, const string& file, const string& input,
+                          const string& batchFile, long& peakRssKb){
+	RunResult r = {};
+	vector<char*> argv;
+	argv.push_back((char*)prog3.c_str());
+	for (const string& arg : args){
+		argv.push_back((char*)arg.c_str());
+	}
+	string batchArg = "--batch=" + batchFile;
+	if (!batchFile.empty()){
+		argv.push_back((char*)batchArg.c_str());
+	}
+	argv.push_back((char*)file.c_str());
+	argv.push_back(NULL);
+
+	double start = Now();
+
+	pid_t pid = fork();
+	if (pid == 0){
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, 1);
+		InputFrom(input);
+		execv(prog3.c_str(), argv.data());
+		_exit(127);
+	}
+
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	r.seconds = Now() - start;
+	r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	peakRssKb = usage.ru_maxrss;
+	return r;
+}
+
+
+//Keep the fastest run and the largest footprint
+static void Merge(PhaseResult& into, const RunResult& r, long rss, bool first){
+	if (first || r.seconds < into.seconds){
+		into.seconds = r.seconds;
+	}
+	if (first || rss > into.peakRssKb){
+		into.peakRssKb = rss;
+	}
+	into.ok = (first ? true : into.ok) && r.ok;
+}
+
+
+static void PrintRow(const char* name, const PhaseResult& p, const ProgramResult& pr){
+	printf("  %-11s %10.4f s %14.0f tok/s %14.0f stmt/s %10ld KB%s\n", name, p.seconds,
+		pr.tokens / p.seconds, pr.statements / p.seconds, p.peakRssKb, p.ok ? "" : "  (FAILED)");
+}
+
+
+static void JsonPhase(FILE* f, const char* name, const PhaseResult& p, const ProgramResult& pr, bool last){
+	fprintf(f, "      \"%s\": {\"seconds\": %.6f, \"tokens_per_sec\": %.0f, \"statements_per_sec\": %.0f, \"peak_rss_kb\": %ld, \"ok\": %s}%s\n",
+		name, p.seconds, pr.tokens / p.seconds, pr.statements / p.seconds, p.peakRssKb, p.ok ? "true" : "false", last ? "" : ",");
+}
+
+
+int main(int argc, char* argv[]){
+	string prog3 = "./prog3";
+	vector<string> prog3Args;
+	string jsonFile;
+	string label = "default";
+	int repeat = 3;
+	vector<string> files;
+	//The --input for each file, empty if it had none
+	vector<string> inputs;
+	string input;
+	//And the same for --batch
+	vector<string> batches;
+	string batchFile;
+
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		if (arg == "--prog3" && i + 1 < argc){
+			prog3 = argv[++i];
+		} else if (arg == "--prog3-arg" && i + 1 < argc){
+			prog3Args.push_back(argv[++i]);
+		} else if (arg == "--json" && i + 1 < argc){
+			jsonFile = argv[++i];
+		} else if (arg == "--repeat" && i + 1 < argc){
+			repeat = atoi(argv[++i]);
+		} else if (arg == "--label" && i + 1 < argc){
+			label = argv[++i];
+		} else if (arg == "--input" && i + 1 < argc){
+			input = argv[++i];
+		} else if (arg == "--batch" && i + 1 < argc){
+			batchFile = argv[++i];
+		} else if (arg.rfind("--", 0) == 0){
+			cerr << "Usage: bench [--prog3 PATH] [--prog3-arg ARG]... [--json FILE] [--repeat N] [--label NAME] [--input CMD] [--batch FILE] program..." << endl;
+			return 1;
+		} else {
+			files.push_back(arg);
+			inputs.push_back(input);
+			input.clear();
+			batches.push_back(batchFile);
+			batchFile.clear();
+		}
+	}
+
+	if (files.empty() || repeat < 1){
+		cerr << "Usage: bench [--prog3 PATH] [--prog3-arg ARG]... [--json FILE] [--repeat N] [--label NAME] [--input CMD] [--batch FILE] program..." << endl;
+		return 1;
+	}
+
+	vector<ProgramResult> results;
+	for (size_t f = 0; f < files.size(); f++){
+		const string& file = files[f];
+		ProgramResult pr = {};
+		pr.file = file;
+
+		struct stat st;
+		if (stat(file.c_str(), &st) != 0){
+			cerr << "CANNOT OPEN " << file << endl;
+			return 1;
+		}
+		pr.bytes = st.st_size;
+
+		for (int rep = 0; rep < repeat; rep++){
+			long rss;
+			RunResult r = InChild([&]{ return LexOnly(file); }, rss);
+			pr.tokens = r.tokens;
+			pr.statements = r.statements;
+			Merge(pr.lex, r, rss, rep == 0);
+
+			r = InChild([&]{ InputFrom(inputs[f]); return Interpret(file, batches[f]); }, rss);
+			Merge(pr.interpret, r, rss, rep == 0);
+
+			r = EndToEnd(prog3, prog3Args, file, inputs[f], batches[f], rss);
+			Merge(pr.endToEnd, r, rss, rep == 0);
+		}
+
+		printf("%s: %llu bytes, %llu tokens, %llu statements\n", file.c_str(), (unsigned long long)pr.bytes,
+			(unsigned long long)pr.tokens, (unsigned long long)pr.statements);
+		PrintRow("lex", pr.lex, pr);
+		PrintRow("interpret", pr.interpret, pr);
+		PrintRow("end_to_end", pr.endToEnd, pr);
+		results.push_back(pr);
+	}
+
+	if (!jsonFile.empty()){
+		FILE* f = fopen(jsonFile.c_str(), "w");
+		if (f == NULL){
+			cerr << "CANNOT OPEN " << jsonFile << endl;
+			return 1;
+		}
+		fprintf(f, "{\n  \"label\": \"%s\",\n  \"repeat\": %d,\n  \"programs\": [\n", label.c_str(), repeat);
+		for (size_t i = 0; i < results.size(); i++){
+			const ProgramResult& pr = results[i];
+			fprintf(f, "    {\n      \"file\": \"%s\",\n      \"bytes\": %llu,\n      \"tokens\": %llu,\n      \"statements\": %llu,\n",
+				pr.file.c_str(), (unsigned long long)pr.bytes, (unsigned long long)pr.tokens, (unsigned long long)pr.statements);
+			JsonPhase(f, "lex", pr.lex, pr, false);
+			JsonPhase(f, "interpret", pr.interpret, pr, false);
+			JsonPhase(f, "end_to_end", pr.endToEnd, pr, true);
+			fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+		}
+		fprintf(f, "  ]\n}\n");
+		fclose(f);
+	}
+
+	return 0;
+}
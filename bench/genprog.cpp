@@ -0,0 +1,351 @@
+/*
+ * genprog.cpp
+ * Deterministic synthetic program generator for benchmarking the interpreter
+ *
+ * Build:  g++ -std=c++17 -O2 -o genprog bench/genprog.cpp
+ * Usage:  genprog [--size N[K|M|G]] [--seed N] [--shape SHAPE] [--depth N] > program.txt
+ *
+ * SHAPE is one of:
+ *   mixed    a blend of everything below (default)
+ *   decls    a huge declaration section with a short body
+ *   nested   deeply nested IF/BEGIN blocks
+ *   arith    long arithmetic chains
+ *   strings  string-heavy output and comments
+ *   wide     wide expressions with many parenthesized operands
+ *
+ * The same seed, shape and size always produce the same program byte for byte, and every
+ * program produced runs to completion without errors.
+ */
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+
+
+//xorshift64*, so that output never depends on the standard library's distributions
+static uint64_t rngState = 88172645463325252ULL;
+
+static uint64_t Next(){
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+//Uniform-ish integer in [lo, hi]
+static int Rand(int lo, int hi){
+	return lo + (int)(Next() % (uint64_t)(hi - lo + 1));
+}
+
+
+//The generated source is buffered and written out in large chunks
+static string out;
+static uint64_t written = 0;
+
+static void Emit(const string& s){
+	out += s;
+	if (out.size() > (1 << 20)){
+		fwrite(out.data(), 1, out.size(), stdout);
+		written += out.size();
+		out.clear();
+	}
+}
+
+static uint64_t Size(){
+	return written + out.size();
+}
+
+
+//How many variables of each type the program declares
+static int numInts = 64, numReals = 64, numBools = 32, numStrings = 32;
+
+static string IntVar(){ return "i" + to_string(Rand(0, numInts - 1)); }
+static string RealVar(){ return "r" + to_string(Rand(0, numReals - 1)); }
+static string BoolVar(){ return "b" + to_string(Rand(0, numBools - 1)); }
+static string StrVar(){ return "s" + to_string(Rand(0, numStrings - 1)); }
+
+static const char* words[] = {
+	"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+	"india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+	"quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey", "xray"
+};
+
+//A string constant of roughly n words
+static string Words(int n){
+	string s;
+	for (int i = 0; i < n; i++){
+		if (i){
+			s += ' ';
+		}
+		s += words[Rand(0, 23)];
+	}
+	return s;
+}
+
+
+//All integer variables hold values in [-999, 999], so every "i < 1000" condition is true
+//and no chain below can overflow
+
+//iK := (iA + iB - 7 + ...) mod 1000
+static string ArithChain(int len){
+	string s = IntVar() + " := (" + IntVar();
+	for (int i = 1; i < len; i++){
+		s += (Rand(0, 1) ? " + " : " - ");
+		s += (Rand(0, 3) ? IntVar() : to_string(Rand(0, 99)));
+	}
+	return s + ") mod 1000";
+}
+
+//rK := (rA + rB * 0.5 + ...) / len, which keeps reals bounded as well
+static string RealChain(int len){
+	string s = RealVar() + " := (" + RealVar();
+	for (int i = 1; i < len; i++){
+		s += (Rand(0, 1) ? " + " : " - ");
+		if (Rand(0, 2)){
+			s += RealVar();
+		} else {
+			s += RealVar() + " * " + to_string(Rand(1, 9)) + "." + to_string(Rand(0, 99));
+		}
+	}
+	return s + ") / " + to_string(len);
+}
+
+//A wide integer expression, a sum of products of parenthesized pairs
+static string WideArith(int width){
+	string s = IntVar() + " := (";
+	for (int i = 0; i < width; i++){
+		if (i){
+			s += " + ";
+		}
+		s += "(" + IntVar() + " + " + IntVar() + ") * (" + IntVar() + " - " + to_string(Rand(0, 9)) + ")";
+	}
+	return s + ") mod 1000";
+}
+
+//A wide boolean expression of relational comparisons joined by and/or
+static string WideLogic(int width){
+	string s = BoolVar() + " := ";
+	for (int i = 0; i < width; i++){
+		if (i){
+			s += (Rand(0, 1) ? " or " : " and ");
+		}
+		switch (Rand(0, 3)){
+			case 0:  s += "(" + IntVar() + " < " + IntVar() + ")"; break;
+			case 1:  s += "(" + RealVar() + " > " + RealVar() + ")"; break;
+			case 2:  s += "(" + IntVar() + " = " + to_string(Rand(0, 9)) + ")"; break;
+			default: s += BoolVar(); break;
+		}
+	}
+	return s;
+}
+
+static string WriteStmt(){
+	string s = Rand(0, 3) ? "writeln(" : "write(";
+	s += "'" + Words(Rand(1, 6)) + "'";
+	int n = Rand(1, 5);
+	for (int i = 0; i < n; i++){
+		switch (Rand(0, 4)){
+			case 0:  s += ", " + IntVar(); break;
+			case 1:  s += ", " + RealVar(); break;
+			case 2:  s += ", " + BoolVar(); break;
+			case 3:  s += ", " + StrVar(); break;
+			default: s += ", ' " + Words(Rand(1, 4)) + "'"; break;
+		}
+	}
+	return s + ")";
+}
+
+static string StringAssign(){
+	return StrVar() + " := '" + Words(Rand(2, 12)) + "'";
+}
+
+static string Comment(){
+	return "{ " + Words(Rand(4, 20)) + " }";
+}
+
+//A condition that is always true
+static string TrueCond(){
+	if (Rand(0, 1)){
+		return IntVar() + " < 1000";
+	}
+	return "(" + IntVar() + " < 1000) and (" + IntVar() + " > -1000)";
+}
+
+static string Indent(int depth){
+	return string(depth + 1, '\t');
+}
+
+
+enum Shape { MIXED, DECLS, NESTED, ARITH, STRINGS, WIDE };
+static Shape shape = MIXED;
+static int maxDepth = 64;
+
+static string SimpleStmt(){
+	int pick;
+	switch (shape){
+		case ARITH:   pick = Rand(0, 9) < 8 ? Rand(0, 1) : 4; break;
+		case STRINGS: pick = Rand(0, 9) < 8 ? Rand(2, 3) : 0; break;
+		case WIDE:    pick = Rand(0, 9) < 8 ? Rand(5, 6) : 0; break;
+		default:      pick = Rand(0, 6); break;
+	}
+
+	switch (pick){
+		case 0:  return ArithChain(shape == ARITH ? Rand(32, 256) : Rand(4, 32));
+		case 1:  return RealChain(shape == ARITH ? Rand(32, 128) : Rand(4, 16));
+		case 2:  return WriteStmt();
+		case 3:  return StringAssign();
+		case 5:  return WideArith(shape == WIDE ? Rand(16, 64) : Rand(2, 8));
+		case 6:  return WideLogic(shape == WIDE ? Rand(16, 64) : Rand(2, 8));
+		default: return "if " + IntVar() + " > 1000 then " + StrVar() + " := 'never' else " + ArithChain(4);
+	}
+}
+
+//A block of nested IF/BEGIN of the given depth. Every IF is followed by another statement,
+//since the interpreter skips the rest of a taken IF up to the next semicolon
+static void Nested(int depth, int levels){
+	Emit(Indent(depth) + "if " + TrueCond() + " then\n");
+	Emit(Indent(depth) + "begin\n");
+	Emit(Indent(depth + 1) + SimpleStmt() + ";\n");
+	if (levels > 1){
+		Nested(depth + 1, levels - 1);
+	}
+	Emit(Indent(depth + 1) + SimpleStmt() + "\n");
+	Emit(Indent(depth) + "end;\n");
+}
+
+//Declarations. Every variable is initialized so nothing is ever read uninitialized
+static void Declarations(uint64_t target){
+	Emit("var\n");
+	if (shape == DECLS){
+		//Grow the variable counts until the declaration section fills most of the target
+		numInts = numReals = numBools = numStrings = 0;
+		while (Size() < target * 9 / 10){
+			int n = Rand(1, 16);
+			string names;
+			string type;
+			string init;
+			int* counter;
+			char prefix;
+			switch (Rand(0, 3)){
+				case 0:  counter = &numInts; prefix = 'i'; type = "integer"; init = to_string(Rand(0, 9)); break;
+				case 1:  counter = &numReals; prefix = 'r'; type = "real"; init = to_string(Rand(0, 9)) + ".5"; break;
+				case 2:  counter = &numBools; prefix = 'b'; type = "boolean"; init = Rand(0, 1) ? "true" : "false"; break;
+				default: counter = &numStrings; prefix = 's'; type = "string"; init = "'" + Words(Rand(1, 3)) + "'"; break;
+			}
+			for (int i = 0; i < n; i++){
+				names += (i ? ", " : "") + string(1, prefix) + to_string((*counter)++);
+			}
+			Emit("\t" + names + " : " + type + " := " + init + ";\n");
+		}
+		//Make sure each kind of variable exists for the body
+		Emit("\ti" + to_string(numInts++) + " : integer := 0;\n");
+		Emit("\tr" + to_string(numReals++) + " : real := 1.0;\n");
+		Emit("\tb" + to_string(numBools++) + " : boolean := true;\n");
+		Emit("\ts" + to_string(numStrings++) + " : string := 'x';\n");
+		return;
+	}
+
+	for (int i = 0; i < numInts; i += 8){
+		string names;
+		for (int j = i; j < i + 8 && j < numInts; j++){
+			names += (j > i ? ", i" : "i") + to_string(j);
+		}
+		Emit("\t" + names + " : integer := " + to_string(Rand(0, 9)) + ";\n");
+	}
+	for (int i = 0; i < numReals; i += 8){
+		string names;
+		for (int j = i; j < i + 8 && j < numReals; j++){
+			names += (j > i ? ", r" : "r") + to_string(j);
+		}
+		Emit("\t" + names + " : real := " + to_string(Rand(0, 9)) + ".25;\n");
+	}
+	for (int i = 0; i < numBools; i++){
+		Emit("\tb" + to_string(i) + " : boolean := " + (Rand(0, 1) ? "true" : "false") + ";\n");
+	}
+	for (int i = 0; i < numStrings; i++){
+		Emit("\ts" + to_string(i) + " : string := '" + Words(Rand(1, 4)) + "';\n");
+	}
+}
+
+
+//Parses sizes like 512, 64K, 10M or 1G
+static uint64_t ParseSize(const string& s){
+	char* end;
+	uint64_t n = strtoull(s.c_str(), &end, 10);
+	switch (*end){
+		case 'k': case 'K': return n << 10;
+		case 'm': case 'M': return n << 20;
+		case 'g': case 'G': return n << 30;
+		default: return n;
+	}
+}
+
+
+int main(int argc, char* argv[]){
+	uint64_t target = 64 << 10;
+	uint64_t seed = 1;
+
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		string val = (i + 1 < argc) ? argv[i + 1] : "";
+
+		if (arg == "--size"){
+			target = ParseSize(val);
+			i++;
+		} else if (arg == "--seed"){
+			seed = strtoull(val.c_str(), NULL, 10);
+			i++;
+		} else if (arg == "--depth"){
+			maxDepth = atoi(val.c_str());
+			i++;
+		} else if (arg == "--shape"){
+			const char* names[] = { "mixed", "decls", "nested", "arith", "strings", "wide" };
+			int found = -1;
+			for (int s = 0; s < 6; s++){
+				if (val == names[s]){
+					found = s;
+				}
+			}
+			if (found < 0){
+				fprintf(stderr, "Unknown shape %s\n", val.c_str());
+				return 1;
+			}
+			shape = (Shape)found;
+			i++;
+		} else {
+			fprintf(stderr, "Usage: genprog [--size N[K|M|G]] [--seed N] [--shape mixed|decls|nested|arith|strings|wide] [--depth N]\n");
+			return 1;
+		}
+	}
+
+	//A zero state would make xorshift stick at zero forever
+	rngState ^= seed * 0x9E3779B97F4A7C15ULL;
+	if (rngState == 0){
+		rngState = 1;
+	}
+
+	Emit("program bench;\n");
+	Emit("{ generated by genprog, seed " + to_string(seed) + " }\n");
+	Declarations(target);
+	Emit("begin\n");
+
+	while (Size() < target){
+		int kind = Rand(0, 9);
+		if (shape == NESTED || (shape == MIXED && kind == 0)){
+			Nested(0, shape == NESTED ? maxDepth : Rand(1, maxDepth < 8 ? maxDepth : 8));
+		} else if ((shape == STRINGS && kind < 3) || (shape == MIXED && kind == 1)){
+			Emit(Indent(0) + Comment() + "\n");
+		} else {
+			Emit(Indent(0) + SimpleStmt() + ";\n");
+		}
+	}
+
+	Emit("\twriteln('done')\n");
+	Emit("end.\n");
+
+	fwrite(out.data(), 1, out.size(), stdout);
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * lexbench.cpp
+ * Lexer throughput benchmark, comparing plain character-at-a-time reading with the scalar,
+ * SSE2 and AVX2 scanning kernels
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o lexbench bench/lexbench.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  lexbench [--repeat N] [--block BYTES] program...
+ *
+ * Each program is read into memory once and then lexed from memory in every mode, so only the
+ * lexer is measured. The token streams of all modes, lexemes and line numbers included, are
+ * checked against the plain one and any mismatch is reported. A small --block size forces many
+ * refills and is useful for checking that tokens split across blocks come out the same.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lex.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+struct Tok {
+	Token tt;
+	string lexeme;
+	int line;
+
+	bool operator==(const Tok& o) const { return tt == o.tt && lexeme == o.lexeme && line == o.line; }
+};
+
+
+static double Now(){
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//Lexes the text, through a ScanBuf unless block is 0, and returns the tokens and the time taken
+static double Lex(const string& text, size_t block, vector<Tok>& toks){
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf(), block == 0 ? 1 : block);
+	istream scanned(&scan);
+	istream& in = (block == 0) ? (istream&)src : scanned;
+
+	toks.clear();
+	int line = 1;
+	double start = Now();
+	for (;;){
+		LexItem tok = getNextToken(in, line);
+		toks.push_back({ tok.GetToken(), tok.GetLexeme(), tok.GetLinenum() });
+		if (tok == DONE || tok == ERR){
+			break;
+		}
+	}
+	return Now() - start;
+}
+
+
+int main(int argc, char* argv[]){
+	int repeat = 3;
+	size_t block = 1 << 16;
+	vector<string> files;
+
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		if (arg == "--repeat" && i + 1 < argc){
+			repeat = atoi(argv[++i]);
+		} else if (arg == "--block" && i + 1 < argc){
+			block = strtoul(argv[++i], NULL, 10);
+		} else if (arg.rfind("--", 0) == 0){
+			cerr << "Usage: lexbench [--repeat N] [--block BYTES] program..." << endl;
+			return 1;
+		} else {
+			files.push_back(arg);
+		}
+	}
+
+	if (files.empty() || repeat < 1 || block == 0){
+		cerr << "Usage: lexbench [--repeat N] [--block BYTES] program..." << endl;
+		return 1;
+	}
+
+	const ScanMode modes[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+	bool allSame = true;
+
+	for (const string& file : files){
+		ifstream f(file, ios::binary);
+		if (!f.is_open()){
+			cerr << "CANNOT OPEN " << file << endl;
+			return 1;
+		}
+		ostringstream ss;
+		ss << f.rdbuf();
+		string text = ss.str();
+
+		vector<Tok> reference, toks;
+		double best = 0;
+		for (int rep = 0; rep < repeat; rep++){
+			double t = Lex(text, 0, reference);
+			best = (rep == 0 || t < best) ? t : best;
+		}
+
+		printf("%s: %zu bytes, %zu tokens\n", file.c_str(), text.size(), reference.size());
+		printf("  %-8s %10.4f s %10.1f MB/s %14.0f tok/s\n", "plain", best, text.size() / best / 1e6, reference.size() / best);
+
+		for (ScanMode want : modes){
+			ScanMode got = SetScanMode(want);
+			if (got != want){
+				printf("  %-8s not supported on this CPU\n", ScanModeName(want));
+				continue;
+			}
+
+			for (int rep = 0; rep < repeat; rep++){
+				double t = Lex(text, block, toks);
+				best = (rep == 0 || t < best) ? t : best;
+			}
+
+			bool same = (toks == reference);
+			allSame = allSame && same;
+			printf("  %-8s %10.4f s %10.1f MB/s %14.0f tok/s%s\n", ScanModeName(want), best,
+				text.size() / best / 1e6, toks.size() / best, same ? "" : "  (TOKENS DIFFER)");
+		}
+	}
+
+	SetScanMode(SCAN_AUTO);
+	return allSame ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# run.sh
+# Builds the interpreter, the generator and the harness, generates the standard benchmark
+# programs and writes the results to a JSON file that can be diffed between builds.
+#
+# Usage: bench/run.sh [results.json] [sizes...]
+# Sizes default to 64K 1M 16M. Run from the top of the repository.
+# The lexer is also measured on its own with each of the scanning kernels, and every program is run
+# on both the stack and the register machine to compare the instructions each one runs.
+# bench/countloop.txt, a 10^8 iteration counting loop, bench/arrays.txt, whole-array arithmetic on
+# 10^6 element arrays, bench/calls.txt, recursive calls, and bench/dispatch.txt, CASE statements against
+# IF chains, are run along with the generated programs, and so is bench/readnums.txt, which reads 10^8
+# numbers from standard input, and bench/sweep.txt, run in batch mode over 20000 sets of initial values.
+# Extra options for prog3 in the end-to-end runs can be given in PROG3_ARGS, e.g. PROG3_ARGS=--pipeline,
+# or PROG3_ARGS=--memo=off to time every call of bench/calls.txt rather than its memoized functions
+
+set -e
+
+OUT=${1:-bench_results.json}
+[ $# -gt 0 ] && shift
+SIZES=${*:-64K 1M 16M}
+WORK=${BENCH_DIR:-bench_work}
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--std=c++17 -O2 -pthread}
+
+mkdir -p "$WORK"
+$CXX $CXXFLAGS -o "$WORK/prog3" src/*.cpp
+$CXX $CXXFLAGS -o "$WORK/genprog" bench/genprog.cpp
+$CXX $CXXFLAGS -Isrc -o "$WORK/bench" bench/bench.cpp $(ls src/*.cpp | grep -v prog3.cpp)
+$CXX $CXXFLAGS -Isrc -o "$WORK/lexbench" bench/lexbench.cpp $(ls src/*.cpp | grep -v prog3.cpp)
+$CXX $CXXFLAGS -Isrc -o "$WORK/vmbench" bench/vmbench.cpp $(ls src/*.cpp | grep -v prog3.cpp)
+
+PROGRAMS=""
+for size in $SIZES; do
+	for shape in mixed decls nested arith strings wide; do
+		file="$WORK/$shape-$size.txt"
+		"$WORK/genprog" --shape $shape --size $size --seed 1 > "$file"
+		PROGRAMS="$PROGRAMS $file"
+	done
+done
+
+#Nothing but loop overhead, for the compiled form that loop bodies run from
+PROGRAMS="$PROGRAMS bench/countloop.txt"
+#Whole-array operations against the same work done one element at a time
+PROGRAMS="$PROGRAMS bench/arrays.txt"
+#Calls and returns, and tail calls
+PROGRAMS="$PROGRAMS bench/calls.txt"
+#Multi-way dispatch, with CASE and with IF ... ELSE IF
+PROGRAMS="$PROGRAMS bench/dispatch.txt"
+
+ARGS=""
+for arg in $PROG3_ARGS; do
+	ARGS="$ARGS --prog3-arg $arg"
+done
+
+#One program run for many instances at once
+(echo "seed rounds"; seq 1 20000 | awk '{ print $1, 1000 }') > "$WORK/sweep.batch"
+
+#Reading input, fed straight from seq so that it takes no disk space
+"$WORK/bench" --prog3 "$WORK/prog3" $ARGS --json "$OUT" --label "$(git rev-parse --short HEAD 2>/dev/null || echo local)" $PROGRAMS \
+	--input "seq 100000000" bench/readnums.txt --batch "$WORK/sweep.batch" bench/sweep.txt
+"$WORK/lexbench" $PROGRAMS
+"$WORK/vmbench" $PROGRAMS
@@ -0,0 +1,103 @@
+/*
+ * strbench.cpp
+ * Microbenchmarks for string comparison
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o strbench bench/strbench.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  strbench [--ops N]
+ *
+ * For a range of lengths, times equality and ordering of two strings that differ only in their
+ * last byte, which is the worst case for every kernel. std::string is the baseline, followed by the
+ * scalar, SSE2 and AVX2 kernels, and equality of two interned string constants, which never looks
+ * at the characters at all. Results are in nanoseconds per comparison. Every kernel's answers are
+ * checked against std::string's.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "rope.h"
+#include "scanbuf.h"
+#include "strops.h"
+#include "symtab.h"
+
+using namespace std;
+
+
+static double Now(){
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Keeps the compiler from throwing the comparisons away
+static volatile long sink;
+
+
+//Times ops calls of cmp, returning nanoseconds per call and the sum of the results
+template <typename Cmp>
+static double Time(long ops, Cmp cmp, long& sum){
+	sum = 0;
+	double start = Now();
+	for (long i = 0; i < ops; i++){
+		sum += cmp();
+	}
+	double ns = (Now() - start) * 1e9 / ops;
+	sink = sum;
+	return ns;
+}
+
+
+int main(int argc, char* argv[]){
+	long ops = 2000000;
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		if (arg == "--ops" && i + 1 < argc){
+			ops = atol(argv[++i]);
+		} else {
+			cerr << "Usage: strbench [--ops N]" << endl;
+			return 1;
+		}
+	}
+
+	const size_t lengths[] = { 1, 7, 15, 16, 31, 32, 63, 64, 100, 256, 1024, 4096, 65536 };
+	const ScanMode modes[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+	bool ok = true;
+
+	printf("%8s %-9s %12s %12s\n", "length", "kernel", "equal ns", "compare ns");
+	for (size_t len : lengths){
+		string a(len, 'x'), b(len, 'x');
+		for (size_t i = 0; i < len; i++){
+			a[i] = b[i] = 'a' + i % 26;
+		}
+		b[len - 1]++;
+		//Big strings get fewer operations so that every length takes about as long
+		long n = ops / (1 + len / 64);
+
+		long wantEq, wantCmp, eq, cmp;
+		double eqNs = Time(n, [&]{ return (long)(a == b); }, wantEq);
+		double cmpNs = Time(n, [&]{ return (long)(a.compare(b) < 0); }, wantCmp);
+		printf("%8zu %-9s %12.2f %12.2f\n", len, "string", eqNs, cmpNs);
+
+		for (ScanMode mode : modes){
+			if (SetScanMode(mode) != mode){
+				printf("%8zu %-9s %12s\n", len, ScanModeName(mode), "n/a");
+				continue;
+			}
+			eqNs = Time(n, [&]{ return (long)StrEqual(a.data(), b.data(), len); }, eq);
+			cmpNs = Time(n, [&]{ return (long)(StrCompare(a.data(), len, b.data(), len) < 0); }, cmp);
+			bool same = (eq == wantEq && cmp == wantCmp);
+			ok = ok && same;
+			printf("%8zu %-9s %12.2f %12.2f%s\n", len, ScanModeName(mode), eqNs, cmpNs, same ? "" : "  (WRONG)");
+		}
+
+		//Two string constants with the same text are the same symbol
+		Rope ra(Intern(a)), rb(Intern(a));
+		eqNs = Time(n, [&]{ return (long)ra.Equals(rb); }, eq);
+		ok = ok && eq == n;
+		printf("%8zu %-9s %12.2f %12s%s\n", len, "interned", eqNs, "-", eq == n ? "" : "  (WRONG)");
+	}
+
+	SetScanMode(SCAN_AUTO);
+	return ok ? 0 : 1;
+}
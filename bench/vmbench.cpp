@@ -0,0 +1,174 @@
+/*
+ * vmbench.cpp
+ * Benchmark of the register machine against the stack machine, in instructions run and time taken
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o vmbench bench/vmbench.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  vmbench [--repeat N] program...
+ *
+ * Each program is read into memory once and then run on each machine in a child process of its own,
+ * with its output going to a file and its input coming from /dev/null. The instructions counted in
+ * the stats are passed back, and the output of the register machine, errors included, is checked
+ * against the stack machine's and any mismatch is reported. The fastest of the runs on each machine
+ * is the one reported.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "parserInterp.h"
+#include "regvm.h"
+#include "scanbuf.h"
+#include "stats.h"
+
+using namespace std;
+
+
+static double Now(){
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//The instructions in a JSON report of the stats
+static uint64_t Instructions(const string& report){
+	size_t at = report.find("\"instructions\":");
+	return at == string::npos ? 0 : strtoull(report.c_str() + at + 15, NULL, 10);
+}
+
+static string Contents(const string& file){
+	ifstream in(file.c_str(), ios::binary);
+	return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+
+//Runs the text on the machine in a child process with its output going to out, and returns the time
+//taken and the instructions run, or a negative time if the child failed
+static double Run(const string& text, Machine machine, const string& out, uint64_t& instructions){
+	int pipes[2];
+	if (pipe(pipes) != 0){
+		return -1;
+	}
+
+	//Anything still buffered would be written again by the child
+	fflush(stdout);
+	cout.flush();
+	double start = Now();
+	pid_t pid = fork();
+	if (pid == 0){
+		close(pipes[0]);
+		int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		int from = open("/dev/null", O_RDONLY);
+		if (fd < 0 || from < 0){
+			_exit(2);
+		}
+		dup2(fd, 1);
+		dup2(from, 0);
+		close(fd);
+		close(from);
+
+		UseMachine(machine);
+		istringstream src(text);
+		ScanBuf scan(src.rdbuf());
+		istream in(&scan);
+		int line = 1;
+		Prog(in, line);
+		cout.flush();
+
+		ostringstream report;
+		Stats::Report(report, true);
+		uint64_t count = Instructions(report.str());
+		_exit(write(pipes[1], &count, sizeof(count)) == (ssize_t)sizeof(count) ? 0 : 2);
+	}
+	close(pipes[1]);
+
+	int status;
+	bool ok = pid > 0 && read(pipes[0], &instructions, sizeof(instructions)) == (ssize_t)sizeof(instructions);
+	ok = pid > 0 && waitpid(pid, &status, 0) == pid && ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	double taken = Now() - start;
+	close(pipes[0]);
+	return ok ? taken : -1;
+}
+
+
+int main(int argc, char* argv[]){
+	int repeat = 3;
+	vector<string> files;
+
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		if (arg == "--repeat" && i + 1 < argc){
+			repeat = atoi(argv[++i]);
+		} else if (arg.rfind("--", 0) == 0){
+			cerr << "Usage: vmbench [--repeat N] program..." << endl;
+			return 1;
+		} else {
+			files.push_back(arg);
+		}
+	}
+
+	if (files.empty() || repeat < 1){
+		cerr << "Usage: vmbench [--repeat N] program..." << endl;
+		return 1;
+	}
+
+	char tmp[] = "/tmp/vmbench-XXXXXX";
+	if (mkdtemp(tmp) == NULL){
+		cerr << "CANNOT MAKE A DIRECTORY FOR THE OUTPUT" << endl;
+		return 1;
+	}
+	const Machine machines[] = { VM_STACK, VM_REGISTER };
+	const char* names[] = { "stack", "register" };
+	string outs[] = { string(tmp) + "/stack", string(tmp) + "/register" };
+	bool allSame = true;
+
+	for (const string& file : files){
+		ifstream f(file, ios::binary);
+		if (!f.is_open()){
+			cerr << "CANNOT OPEN " << file << endl;
+			return 1;
+		}
+		ostringstream ss;
+		ss << f.rdbuf();
+		string text = ss.str();
+
+		printf("%s: %zu bytes\n", file.c_str(), text.size());
+		uint64_t counts[2] = { 0, 0 };
+		for (int m = 0; m < 2; m++){
+			double best = 0;
+			for (int rep = 0; rep < repeat; rep++){
+				double t = Run(text, machines[m], outs[m], counts[m]);
+				if (t < 0){
+					best = -1;
+					break;
+				}
+				best = (rep == 0 || t < best) ? t : best;
+			}
+			if (best < 0){
+				printf("  %-8s failed to run\n", names[m]);
+				allSame = false;
+				continue;
+			}
+
+			bool same = m == 0 || Contents(outs[m]) == Contents(outs[0]);
+			allSame = allSame && same;
+			printf("  %-8s %10.4f s %14llu instructions", names[m], best, (unsigned long long)counts[m]);
+			if (m > 0 && counts[0] > 0){
+				printf(" (%.1f%% of the stack machine's)", 100.0 * counts[m] / counts[0]);
+			}
+			printf("%s\n", same ? "" : "  (OUTPUT DIFFERS)");
+		}
+	}
+
+	unlink(outs[0].c_str());
+	unlink(outs[1].c_str());
+	rmdir(tmp);
+	return allSame ? 0 : 1;
+}
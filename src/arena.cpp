@@ -0,0 +1,51 @@
+/*
+ * arena.cpp
+ * Getting and freeing the blocks of an Arena
+ */
+
+#include "arena.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+
+//Starts a new block big enough for size bytes at align, and allocates them from it
+void* Arena::Grow(size_t size, size_t align){
+	//Anything that would take up most of a block gets a block of its own, so that the rest of the
+	//current one isn't wasted
+	size_t want = size + align + sizeof(Block);
+	bool own = want > blockSize / 2;
+	size_t bytes = own ? want : blockSize;
+
+	Block* block = (Block*)malloc(bytes);
+	if (block == NULL){
+		throw bad_alloc();
+	}
+
+	char* start = (char*)(block + 1);
+	char* p = (char*)(((size_t)start + align - 1) & ~(align - 1));
+	if (own && blocks != NULL){
+		//Keep allocating from the block we had, behind this one in the list
+		block->next = blocks->next;
+		blocks->next = block;
+		return p;
+	}
+
+	block->next = blocks;
+	blocks = block;
+	cur = p + size;
+	end = (char*)block + bytes;
+	return p;
+}
+
+
+void Arena::Release(){
+	while (blocks != NULL){
+		Block* next = blocks->next;
+		free(blocks);
+		blocks = next;
+	}
+	cur = end = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * arena.h
+ * Bump allocation out of large blocks, which are all freed together
+ * Allocating is a pointer increment, and nothing is freed on its own. Memory that lives as long as
+ * the program being interpreted, like the elements of its arrays, comes from one of these and is
+ * given back in one go when the program is done. Standard containers can allocate from one too,
+ * through an ArenaResource.
+*/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstddef>
+#include <memory_resource>
+
+using namespace std;
+
+
+class Arena {
+	struct Block {
+		Block* next;
+	};
+
+	//Every block allocated so far, the one being allocated from first
+	Block* blocks;
+	//The free part of the current block
+	char* cur;
+	char* end;
+	//How big a block is, unless something bigger is asked for
+	size_t blockSize;
+
+public:
+	explicit Arena(size_t blockSize = 1 << 16) : blocks(NULL), cur(NULL), end(NULL), blockSize(blockSize) {}
+	~Arena() { Release(); }
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	//Returns size bytes at a multiple of align, which must be a power of two. The memory is not cleared
+	void* Alloc(size_t size, size_t align = alignof(max_align_t)) {
+		char* p = (char*)(((size_t)cur + align - 1) & ~(align - 1));
+		//Aligning may take p past the end of the block, where end - p would be negative
+		if (cur == NULL || p > end || size > (size_t)(end - p)){
+			return Grow(size, align);
+		}
+		cur = p + size;
+		return p;
+	}
+
+	//Frees everything that was ever allocated
+	void Release();
+
+private:
+	void* Grow(size_t size, size_t align);
+};
+
+//An arena as a std::pmr memory resource. Deallocating does nothing, the memory goes back when the
+//arena is released, so this is usually the upstream of a pool that hands freed memory out again
+class ArenaResource : public pmr::memory_resource {
+	Arena& arena;
+
+public:
+	explicit ArenaResource(Arena& arena) : arena(arena) {}
+
+protected:
+	void* do_allocate(size_t bytes, size_t align) override { return arena.Alloc(bytes, align); }
+	void do_deallocate(void*, size_t, size_t) override {}
+	bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,261 @@
+/*
+ * arrayops.cpp
+ * Scalar, SSE2 and AVX2 elementwise kernels for arrays
+ * Every kernel is written once, over a vector type, using the compiler's vector extensions. The
+ * scalar versions use the element type itself as the "vector", the SSE2 versions 16 byte vectors
+ * and the AVX2 versions 32 byte vectors compiled for AVX2. What doesn't fit in a whole vector at
+ * the end is done one element at a time.
+ */
+
+#include "arrayops.h"
+
+#include <cstring>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARRAYOPS_X86 1
+#endif
+
+using namespace std;
+
+
+//The vector types, named after the elements they hold
+typedef int v2si __attribute__((vector_size(8)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef int v8si __attribute__((vector_size(32)));
+typedef float v2sf __attribute__((vector_size(8)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+typedef double v2df __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef unsigned char v16qi __attribute__((vector_size(16)));
+typedef unsigned char v32qi __attribute__((vector_size(32)));
+
+//The loops below are inlined into the functions that pick the vector types, so that they are
+//compiled for the same instruction set. Vectors are only ever passed by reference, as passing them
+//by value would depend on the instruction set
+#define KERNEL_INLINE inline __attribute__((always_inline))
+
+
+//x = x op y, for single values and vectors alike
+template <ElemOp OP, class X>
+static KERNEL_INLINE void Apply(X& x, const X& y){
+	if constexpr (OP == EOP_ADD){
+		x = x + y;
+	} else if constexpr (OP == EOP_SUB){
+		x = x - y;
+	} else if constexpr (OP == EOP_MUL){
+		x = x * y;
+	} else if constexpr (OP == EOP_DIV){
+		x = x / y;
+	} else if constexpr (OP == EOP_MOD){
+		x = x % y;
+	} else if constexpr (OP == EOP_AND){
+		//Booleans are 0 or 1, so the bitwise operators give the logical result
+		x = x & y;
+	} else {
+		x = x | y;
+	}
+}
+
+//d[i] = a[i] op b[i], a vector of V at a time and then one element at a time for the rest
+template <ElemOp OP, class V, class T>
+static KERNEL_INLINE void Map(T* d, const T* a, const T* b, size_t n){
+	const size_t w = sizeof(V) / sizeof(T);
+	size_t i = 0;
+	for (; i + w <= n; i += w){
+		V x, y;
+		memcpy(&x, a + i, sizeof(V));
+		memcpy(&y, b + i, sizeof(V));
+		Apply<OP>(x, y);
+		memcpy(d + i, &x, sizeof(V));
+	}
+	for (; i < n; i++){
+		T x = a[i];
+		Apply<OP>(x, b[i]);
+		d[i] = x;
+	}
+}
+
+//Converts a value or a vector of them, the way a C cast would
+template <class To, class From>
+static KERNEL_INLINE void Cast(To& to, const From& x){
+	if constexpr (is_arithmetic<From>::value){
+		to = (To)x;
+	} else {
+		to = __builtin_convertvector(x, To);
+	}
+}
+
+//d[i] = (To)(Via)a[i], a vector of VFrom at a time. VVia and VTo have as many elements as VFrom
+template <class VFrom, class VVia, class VTo, class To, class Via, class From>
+static KERNEL_INLINE void Convert(To* d, const From* a, size_t n){
+	const size_t w = sizeof(VFrom) / sizeof(From);
+	size_t i = 0;
+	for (; i + w <= n; i += w){
+		VFrom x;
+		VVia via;
+		VTo y;
+		memcpy(&x, a + i, sizeof(VFrom));
+		Cast(via, x);
+		Cast(y, via);
+		memcpy(d + i, &y, sizeof(VTo));
+	}
+	for (; i < n; i++){
+		d[i] = (To)(Via)a[i];
+	}
+}
+
+
+//One set of kernels for each choice of vector types. Integers can't be divided a vector at a time
+template <class VI, class VD, class VB>
+static KERNEL_INLINE void IntKernelT(ElemOp op, int* d, const int* a, const int* b, size_t n){
+	switch (op){
+		case EOP_ADD: Map<EOP_ADD, VI>(d, a, b, n); break;
+		case EOP_SUB: Map<EOP_SUB, VI>(d, a, b, n); break;
+		case EOP_MUL: Map<EOP_MUL, VI>(d, a, b, n); break;
+		case EOP_DIV: Map<EOP_DIV, int>(d, a, b, n); break;
+		case EOP_MOD: Map<EOP_MOD, int>(d, a, b, n); break;
+		default: break;
+	}
+}
+
+template <class VI, class VD, class VB>
+static KERNEL_INLINE void RealKernelT(ElemOp op, double* d, const double* a, const double* b, size_t n){
+	switch (op){
+		case EOP_ADD: Map<EOP_ADD, VD>(d, a, b, n); break;
+		case EOP_SUB: Map<EOP_SUB, VD>(d, a, b, n); break;
+		case EOP_MUL: Map<EOP_MUL, VD>(d, a, b, n); break;
+		case EOP_DIV: Map<EOP_DIV, VD>(d, a, b, n); break;
+		default: break;
+	}
+}
+
+template <class VI, class VD, class VB>
+static KERNEL_INLINE void BoolKernelT(ElemOp op, unsigned char* d, const unsigned char* a, const unsigned char* b, size_t n){
+	switch (op){
+		case EOP_AND: Map<EOP_AND, VB>(d, a, b, n); break;
+		case EOP_OR:  Map<EOP_OR, VB>(d, a, b, n); break;
+		default: break;
+	}
+}
+
+
+//The functions the kernel pointers point to. Each of them just picks the vector types
+#define DEFINE_KERNELS(SUFFIX, TARGET, VI, VD, VB, VI_D, VF_D, VD_I) \
+	TARGET static void IntKernel##SUFFIX(ElemOp op, int* d, const int* a, const int* b, size_t n){ \
+		IntKernelT<VI, VD, VB>(op, d, a, b, n); \
+	} \
+	TARGET static void RealKernel##SUFFIX(ElemOp op, double* d, const double* a, const double* b, size_t n){ \
+		RealKernelT<VI, VD, VB>(op, d, a, b, n); \
+	} \
+	TARGET static void BoolKernel##SUFFIX(ElemOp op, unsigned char* d, const unsigned char* a, const unsigned char* b, size_t n){ \
+		BoolKernelT<VI, VD, VB>(op, d, a, b, n); \
+	} \
+	TARGET static void IntToReal##SUFFIX(double* d, const int* a, size_t n){ \
+		Convert<VI_D, VF_D, VD, double, float>(d, a, n); \
+	} \
+	TARGET static void RealToInt##SUFFIX(int* d, const double* a, size_t n){ \
+		Convert<VD, VD, VD_I, int, double>(d, a, n); \
+	}
+
+//The integer vectors that match a vector of reals are half as wide
+DEFINE_KERNELS(Scalar, , int, double, unsigned char, int, float, int)
+DEFINE_KERNELS(SSE2, , v4si, v2df, v16qi, v2si, v2sf, v2si)
+#ifdef ARRAYOPS_X86
+DEFINE_KERNELS(AVX2, __attribute__((target("avx2"))), v8si, v4df, v32qi, v4si, v4sf, v4si)
+#endif
+
+
+//The kernels currently in use
+static void (*intKernel)(ElemOp, int*, const int*, const int*, size_t) = IntKernelScalar;
+static void (*realKernel)(ElemOp, double*, const double*, const double*, size_t) = RealKernelScalar;
+static void (*boolKernel)(ElemOp, unsigned char*, const unsigned char*, const unsigned char*, size_t) = BoolKernelScalar;
+static void (*intToReal)(double*, const int*, size_t) = IntToRealScalar;
+static void (*realToInt)(int*, const double*, size_t) = RealToIntScalar;
+
+
+void SetArrayKernels(ScanMode mode){
+	switch (mode){
+#ifdef ARRAYOPS_X86
+		case SCAN_AVX2:
+			intKernel = IntKernelAVX2;
+			realKernel = RealKernelAVX2;
+			boolKernel = BoolKernelAVX2;
+			intToReal = IntToRealAVX2;
+			realToInt = RealToIntAVX2;
+			break;
+
+		case SCAN_SSE2:
+			intKernel = IntKernelSSE2;
+			realKernel = RealKernelSSE2;
+			boolKernel = BoolKernelSSE2;
+			intToReal = IntToRealSSE2;
+			realToInt = RealToIntSSE2;
+			break;
+#endif
+		default:
+			intKernel = IntKernelScalar;
+			realKernel = RealKernelScalar;
+			boolKernel = BoolKernelScalar;
+			intToReal = IntToRealScalar;
+			realToInt = RealToIntScalar;
+			break;
+	}
+}
+
+
+void IntKernel(ElemOp op, int* d, const int* a, const int* b, size_t n){
+	intKernel(op, d, a, b, n);
+}
+
+void RealKernel(ElemOp op, double* d, const double* a, const double* b, size_t n){
+	realKernel(op, d, a, b, n);
+}
+
+void BoolKernel(ElemOp op, unsigned char* d, const unsigned char* a, const unsigned char* b, size_t n){
+	boolKernel(op, d, a, b, n);
+}
+
+void IntToReal(double* d, const int* a, size_t n){
+	intToReal(d, a, n);
+}
+
+void RealToInt(int* d, const double* a, size_t n){
+	realToInt(d, a, n);
+}
+
+
+//Zero checks are done 16 bytes at a time whatever the kernels are, by or-ing together the masks
+//that comparing with zero gives, and only looking at them once at the end
+template <class V, class M, class T>
+static KERNEL_INLINE bool HasZeroT(const T* a, size_t n){
+	const size_t w = sizeof(V) / sizeof(T);
+	M found = {};
+	size_t i = 0;
+	for (; i + w <= n; i += w){
+		V x;
+		memcpy(&x, a + i, sizeof(V));
+		found |= (x == 0);
+	}
+	for (size_t k = 0; k < w; k++){
+		if (found[k]){
+			return true;
+		}
+	}
+	for (; i < n; i++){
+		if (a[i] == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+bool HasZero(const int* a, size_t n){
+	return HasZeroT<v4si, v4si>(a, n);
+}
+
+bool HasZero(const double* a, size_t n){
+	return HasZeroT<v2df, v2di>(a, n);
+}
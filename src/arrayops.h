@@ -0,0 +1,64 @@
+/*
+ * arrayops.h
+ * Arrays and the elementwise kernels that whole-array operations run on
+ * Array elements are stored unboxed and contiguous: an integer is an int, a real a double and a
+ * boolean a single byte that is 0 or 1. The kernels work on n elements at a time, and leave all
+ * checking (sizes, types, division by zero) to their caller, so that nothing is checked per element.
+ * The kernels are picked along with the lexer's scanning kernels, see SetScanMode in scanbuf.h.
+*/
+
+#ifndef ARRAYOPS_H_
+#define ARRAYOPS_H_
+
+#include <cstddef>
+
+#include "scanbuf.h"
+
+using namespace std;
+
+
+enum ElemType { ELEM_INT, ELEM_REAL, ELEM_BOOL };
+
+//The operations a kernel can apply. EOP_DIV divides integers the way Values do, truncating
+enum ElemOp { EOP_ADD, EOP_SUB, EOP_MUL, EOP_DIV, EOP_MOD, EOP_AND, EOP_OR };
+
+//A declared array, with the elements lo..hi at data
+struct Array {
+	ElemType type;
+	int lo;
+	int hi;
+	void* data;
+
+	size_t Size() const { return (size_t)((long long)hi - lo + 1); }
+};
+
+//The most memory all of a program's arrays may take together
+#define MAX_ARRAY_BYTES ((size_t)1 << 30)
+
+//How many bytes one element of the type takes
+inline size_t ElemSize(ElemType type) {
+	return type == ELEM_INT ? sizeof(int) : type == ELEM_REAL ? sizeof(double) : 1;
+}
+
+
+//d[i] = a[i] op b[i] for the first n elements. d may be the same as a or b. Integer EOP_DIV and
+//EOP_MOD must not be given a zero in b, and reals don't do EOP_MOD
+extern void IntKernel(ElemOp op, int* d, const int* a, const int* b, size_t n);
+extern void RealKernel(ElemOp op, double* d, const double* a, const double* b, size_t n);
+//Only EOP_AND and EOP_OR
+extern void BoolKernel(ElemOp op, unsigned char* d, const unsigned char* a, const unsigned char* b, size_t n);
+
+//Conversions, just like those of single Values: an integer becomes a real by way of a float, and a
+//real is truncated to an integer
+extern void IntToReal(double* d, const int* a, size_t n);
+extern void RealToInt(int* d, const double* a, size_t n);
+
+//Whether any of the first n elements is zero, for checking divisors
+extern bool HasZero(const int* a, size_t n);
+extern bool HasZero(const double* a, size_t n);
+
+//Selects the kernels for a mode that SetScanMode has already resolved to one the CPU supports
+extern void SetArrayKernels(ScanMode mode);
+
+
+#endif /* ARRAYOPS_H_ */
@@ -0,0 +1,799 @@
+/*
+ * batch.cpp
+ * Running one program over many sets of initial values
+ */
+
+#include "batch.h"
+#include "parserInterp.h"
+#include "stats.h"
+
+#include <cctype>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <sstream>
+#include <strings.h>
+
+using namespace std;
+
+
+//How many instances run in lockstep
+#define LANES 16
+
+//A set of lanes, one bit for each
+typedef uint32_t Lanes;
+
+//Goes through the lanes of a set in order, as k
+#define FOR_LANES(k, set) for (Lanes m_ = (set); m_ != 0; m_ &= m_ - 1) if (int k = __builtin_ctz(m_); true)
+
+
+//Splits a row into its fields. A field that starts with a quote runs to the same quote again, whatever
+//is in between, anything else runs to whitespace. False if a quote is never closed
+static bool Fields(const string& text, vector<string>& fields){
+	fields.clear();
+	size_t i = 0;
+	for(;;){
+		while (i < text.size() && isspace((unsigned char)text[i])){
+			i++;
+		}
+		if (i == text.size()){
+			return true;
+		}
+
+		size_t start = i;
+		if (text[i] == '\'' || text[i] == '"'){
+			size_t end = text.find(text[i], i + 1);
+			if (end == string::npos){
+				return false;
+			}
+			i = end + 1;
+		} else {
+			while (i < text.size() && !isspace((unsigned char)text[i])){
+				i++;
+			}
+		}
+		fields.push_back(text.substr(start, i - start));
+	}
+}
+
+//The value a field gives a variable of the given type, false if it isn't one. Numbers and booleans are
+//written the way readln takes them, see input.h
+static bool ParseField(const string& field, Token type, Value& val){
+	const char* first = field.data();
+	const char* last = first + field.size();
+
+	switch(type){
+		case STRING:
+			if (*first == '\'' || *first == '"'){
+				val = Value(field.substr(1, field.size() - 2));
+			} else {
+				val = Value(field);
+			}
+			return true;
+
+		case INTEGER: {
+			int i;
+			//from_chars takes a minus sign but not a plus
+			if (last - first > 1 && *first == '+' && *(first + 1) != '-'){
+				first++;
+			}
+			from_chars_result r = from_chars(first, last, i);
+			if (r.ec != errc() || r.ptr != last){
+				return false;
+			}
+			val = Value(i);
+			return true;
+		}
+
+		case REAL: {
+			//Read as a float, the way the real constants of the program are, so that a value gives the same
+			//results as the same constant written in the declaration
+			float d;
+			if (last - first > 1 && *first == '+' && *(first + 1) != '-'){
+				first++;
+			}
+			from_chars_result r = from_chars(first, last, d);
+			if (r.ec != errc() || r.ptr != last){
+				return false;
+			}
+			val = Value((double)d);
+			return true;
+		}
+
+		case BOOLEAN:
+			if (field.size() == 4 && strncasecmp(first, "true", 4) == 0){
+				val = Value(true);
+				return true;
+			}
+			if (field.size() == 5 && strncasecmp(first, "false", 5) == 0){
+				val = Value(false);
+				return true;
+			}
+			return false;
+
+		default:
+			return false;
+	}
+}
+
+
+bool Batch::Open(const string& name){
+	file.open(name.c_str());
+	if (!file.is_open()){
+		return false;
+	}
+
+	string header;
+	while (columns.empty() && getline(file, header)){
+		istringstream names(header);
+		string n;
+		while (names >> n){
+			columns.push_back(BatchColumn{ n, ERR, -1 });
+		}
+	}
+	return !columns.empty();
+}
+
+bool Batch::NextRow(vector<Value>& values){
+	string text;
+	do {
+		if (!getline(file, text)){
+			return false;
+		}
+	} while (text.find_first_not_of(" \t\r") == string::npos);
+
+	static vector<string> fields;
+	bool whole = Fields(text, fields) && fields.size() == columns.size();
+	values.assign(columns.size(), Value());
+	for (size_t i = 0; whole && i < columns.size(); i++){
+		Value val;
+		if (ParseField(fields[i], columns[i].type, val)){
+			values[i] = move(val);
+		}
+	}
+	return true;
+}
+
+
+//Ends the output of an instance the way prog3 ends a run of the program
+static void Finish(ostream& out, int errors){
+	if (errors > 0){
+		out << "\nUnsuccessful Interpretation " << endl << "Number of Errors " << errors << endl;
+	} else {
+		out << "\nSuccessful Execution" << endl;
+	}
+}
+
+//Applies a binary operator to two Values, just like the stack machine does
+static Value Apply(int op, const Value& left, const Value& right){
+	switch(op){
+		case OP_OR:    return left || right;
+		case OP_AND:   return left && right;
+		case OP_EQ:    return left == right;
+		case OP_LTHAN: return left < right;
+		case OP_GTHAN: return left > right;
+		case OP_PLUS:  return left + right;
+		case OP_MINUS: return left - right;
+		case OP_MULT:  return left * right;
+		case OP_DIV:   return left / right;
+		case OP_IDIV:  return left.idiv(right);
+		default:       return left % right;
+	}
+}
+
+
+//Runs one instance on its own, over the slots and arrays of the program. Returns how many errors it had
+static int RunInstance(const vector<BatchUnit>& units, const vector<BatchColumn>& columns, const vector<Value>& values,
+                       const vector<Routine>& routines, vector<Value>& slots, vector<Array>& arrays){
+	int before = ErrCount();
+	//Everything starts out the way it was when the program was declared
+	for (Value& slot : slots){
+		slot = Value();
+	}
+	for (Array& arr : arrays){
+		memset(arr.data, 0, arr.Size() * ElemSize(arr.type));
+	}
+	for (size_t i = 0; i < columns.size(); i++){
+		slots[columns[i].slot] = values[i];
+	}
+
+	for (const BatchUnit& unit : units){
+		int line = 0;
+		if (!Run(unit.code, routines, slots, arrays, line)){
+			ParseError(line, unit.failure[0]);
+			ParseError(line, unit.failure[1]);
+			break;
+		}
+	}
+	return ErrCount() - before;
+}
+
+
+//A Value for each lane, split up by field so that an operator on numbers is a plain loop over arrays.
+//Booleans are in i, and only strings are in s
+struct Column {
+	ValType type[LANES];
+	int i[LANES];
+	double r[LANES];
+	Value s[LANES];
+};
+
+static inline Value Get(const Column& col, int k){
+	switch(col.type[k]){
+		case VINT:    return Value(col.i[k]);
+		case VREAL:   return Value(col.r[k]);
+		case VBOOL:   return Value(col.i[k] != 0);
+		case VSTRING: return col.s[k];
+		default:      return Value();
+	}
+}
+
+static inline void Set(Column& col, int k, const Value& val){
+	col.type[k] = val.GetType();
+	switch(val.GetType()){
+		case VINT:    col.i[k] = val.GetInt(); break;
+		case VREAL:   col.r[k] = val.GetReal(); break;
+		case VBOOL:   col.i[k] = val.GetBool(); break;
+		case VSTRING: col.s[k] = val; break;
+		default:      break;
+	}
+}
+
+//Stores lane k of val in a variable of the given type, converting it like OP_STORE does. False if it
+//can't be
+static inline bool Store(Column& var, const Column& val, int k, int type){
+	switch(val.type[k]){
+		case VINT:
+			if (type == INTEGER){
+				var.i[k] = val.i[k];
+			} else if (type == REAL){
+				var.r[k] = (float)val.i[k];
+			} else {
+				return false;
+			}
+			break;
+
+		case VREAL:
+			if (type == REAL){
+				var.r[k] = val.r[k];
+			} else if (type == INTEGER){
+				var.i[k] = (int)val.r[k];
+			} else {
+				return false;
+			}
+			break;
+
+		case VBOOL:
+			if (type != BOOLEAN){
+				return false;
+			}
+			var.i[k] = val.i[k];
+			break;
+
+		case VSTRING:
+			if (type != STRING){
+				return false;
+			}
+			var.s[k] = val.s[k];
+			break;
+
+		default:
+			return false;
+	}
+	var.type[k] = type == INTEGER ? VINT : type == REAL ? VREAL : type == BOOLEAN ? VBOOL : VSTRING;
+	return true;
+}
+
+//Whether every running lane of a column holds a Value of the given type. on is 1 for the lanes that
+//are running and 0 for the others, which lets this and the loops like it go without a branch
+static inline bool AllOf(const Column& col, ValType type, const int* on){
+	int all = 1;
+	for (int k = 0; k < LANES; k++){
+		all &= (col.type[k] == type) | !on[k];
+	}
+	return all;
+}
+
+//Whether any running lane of a column holds a Value of the given type
+static inline bool AnyOf(const Column& col, ValType type, const int* on){
+	int any = 0;
+	for (int k = 0; k < LANES; k++){
+		any |= (col.type[k] == type) & on[k];
+	}
+	return any;
+}
+
+//Applies a binary operator to every lane of left and right at once, if they are all integers, reals
+//or booleans where it matters and it is an operator that can't fail on them. Lanes that aren't running
+//hold nothing that is needed, so they are worked on too, which keeps the loops free of branches
+static bool ApplyLanes(int op, Column& left, const Column& right, const int* on){
+	if (AllOf(left, VINT, on) && AllOf(right, VINT, on)){
+		switch(op){
+			case OP_PLUS:
+				//Wrapping round, as the int arithmetic of Values does on everything this runs on
+				for (int k = 0; k < LANES; k++) left.i[k] = (int)((unsigned)left.i[k] + (unsigned)right.i[k]);
+				return true;
+			case OP_MINUS:
+				for (int k = 0; k < LANES; k++) left.i[k] = (int)((unsigned)left.i[k] - (unsigned)right.i[k]);
+				return true;
+			case OP_MULT:
+				for (int k = 0; k < LANES; k++) left.i[k] = (int)((unsigned)left.i[k] * (unsigned)right.i[k]);
+				return true;
+			case OP_EQ:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] == right.i[k];
+				break;
+			case OP_LTHAN:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] < right.i[k];
+				break;
+			case OP_GTHAN:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] > right.i[k];
+				break;
+			default:
+				return false;
+		}
+		for (int k = 0; k < LANES; k++) left.type[k] = VBOOL;
+		return true;
+	}
+
+	if (AllOf(left, VREAL, on) && AllOf(right, VREAL, on)){
+		switch(op){
+			case OP_PLUS:
+				for (int k = 0; k < LANES; k++) left.r[k] = left.r[k] + right.r[k];
+				return true;
+			case OP_MINUS:
+				for (int k = 0; k < LANES; k++) left.r[k] = left.r[k] - right.r[k];
+				return true;
+			case OP_MULT:
+				for (int k = 0; k < LANES; k++) left.r[k] = left.r[k] * right.r[k];
+				return true;
+			case OP_EQ:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.r[k] == right.r[k];
+				break;
+			case OP_LTHAN:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.r[k] < right.r[k];
+				break;
+			case OP_GTHAN:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.r[k] > right.r[k];
+				break;
+			default:
+				return false;
+		}
+		for (int k = 0; k < LANES; k++) left.type[k] = VBOOL;
+		return true;
+	}
+
+	if (AllOf(left, VBOOL, on) && AllOf(right, VBOOL, on)){
+		switch(op){
+			case OP_AND:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] & right.i[k];
+				return true;
+			case OP_OR:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] | right.i[k];
+				return true;
+			case OP_EQ:
+				for (int k = 0; k < LANES; k++) left.i[k] = left.i[k] == right.i[k];
+				return true;
+			default:
+				return false;
+		}
+	}
+	return false;
+}
+
+//Whether code only does what lanes can do: nothing with routines, arrays or input
+static bool Lockstep(const Code& code){
+	for (const Instr& instr : code.code){
+		switch(instr.op){
+			case OP_LLOAD:
+			case OP_LSTORE:
+			case OP_INDEX:
+			case OP_ISTORE:
+			case OP_AEVAL:
+			case OP_READ:
+			case OP_READLN:
+			case OP_EOF:
+			case OP_CALL:
+			case OP_TAILCALL:
+			case OP_RET:
+				return false;
+
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+
+//The state of up to LANES instances running in lockstep. Everything is kept from one group of
+//instances to the next
+class Lockstepper {
+	const vector<BatchUnit>& units;
+	//The variables, the value stack and the FOR loop counters
+	vector<Column> vars;
+	vector<Column> stack;
+	vector<int> counterValue;
+	vector<int> counterFinal;
+	vector<int> counterSlot;
+	//What each lane prints, and how many errors it had
+	ostringstream out[LANES];
+	int errors[LANES];
+	//The lanes of instances that haven't failed, and those of them that run the next instruction, which
+	//are also in on, see AllOf
+	Lanes live;
+	Lanes active;
+	int on[LANES];
+	//Counted here and added to the statistics once a group is done, which is much cheaper than
+	//counting each operator there
+	uint64_t vectorOps;
+	uint64_t scalarOps;
+
+	void Activate(Lanes set);
+	//Lane k fails at pc, and its pc is set to INT_MAX
+	void Fail(const BatchUnit& unit, const Instr* pc, int k, int* pcs);
+	void RunUnit(const BatchUnit& unit);
+
+public:
+	Lockstepper(const vector<BatchUnit>& units, size_t slots);
+
+	//Runs n instances, whose values are put in the slots of the columns, and prints what each one printed
+	//under its number, counting from first. Returns how many of them failed
+	int RunGroup(const vector<BatchColumn>& columns, const vector<Value>* values, int n, int first);
+};
+
+Lockstepper::Lockstepper(const vector<BatchUnit>& units, size_t slots) : units(units), vars(slots), live(0), active(0),
+                                                                       vectorOps(0), scalarOps(0) {
+	int depth = 0;
+	int counters = 0;
+	for (const BatchUnit& unit : units){
+		depth = max(depth, unit.code.maxStack);
+		counters = max(counters, unit.code.counters);
+	}
+	stack.resize(depth);
+	counterValue.resize((size_t)counters * LANES);
+	counterFinal.resize((size_t)counters * LANES);
+	counterSlot.resize(counters);
+}
+
+void Lockstepper::Activate(Lanes set){
+	active = set;
+	for (int k = 0; k < LANES; k++){
+		on[k] = (set >> k) & 1;
+	}
+}
+
+void Lockstepper::Fail(const BatchUnit& unit, const Instr* pc, int k, int* pcs){
+	//The report goes where the lane's output goes
+	streambuf* old = cout.rdbuf(out[k].rdbuf());
+	int before = ErrCount();
+	int line;
+	Report(unit.code, pc, line, NULL);
+	ParseError(line, unit.failure[0]);
+	ParseError(line, unit.failure[1]);
+	cout.rdbuf(old);
+	errors[k] += ErrCount() - before;
+	live &= ~((Lanes)1 << k);
+	active &= ~((Lanes)1 << k);
+	on[k] = 0;
+	pcs[k] = INT_MAX;
+}
+
+void Lockstepper::RunUnit(const BatchUnit& unit){
+	const Code& code = unit.code;
+	const Instr* start = code.code.data();
+	//Every unit ends with its only OP_HALT
+	int halt = code.code.size() - 1;
+
+	//Each lane has a pc of its own. The lanes whose pc is the smallest run, and the others wait for
+	//them. Lanes only go separate ways by jumping, always from one statement to the start or the end of
+	//another one, where nothing is left on the stack. So the lanes that run next have the stack to
+	//themselves, and lanes that went different ways through an IF are back together after it
+	//The lanes that run are all at at, and pcs only has the pcs of the others, the smallest of which is
+	//waiting
+	int pcs[LANES];
+	int waiting = INT_MAX;
+	for (int k = 0; k < LANES; k++){
+		pcs[k] = ((live >> k) & 1) ? 0 : INT_MAX;
+	}
+	int at = 0;
+	Activate(live);
+	//How many values are on the stack, which is the same for every lane at the same pc
+	int sp = 0;
+
+	while (live != 0 && at != halt){
+		const Instr* pc = start + at;
+		//The lanes that jump to pc->a, while the others that ran go on to the next instruction. A CASE
+		//statement scatters the lanes, and puts where each one goes in pcs itself
+		Lanes taken = 0;
+		bool scattered = false;
+
+		switch(pc->op){
+			case OP_CONST: {
+				Column& top = stack[sp++];
+				const Value& val = code.consts[pc->a];
+				for (int k = 0; k < LANES; k++){
+					top.type[k] = val.GetType();
+				}
+				if (val.IsString()){
+					FOR_LANES(k, active){
+						top.s[k] = val;
+					}
+				} else {
+					Set(top, 0, val);
+					for (int k = 1; k < LANES; k++){
+						top.i[k] = top.i[0];
+						top.r[k] = top.r[0];
+					}
+				}
+				break;
+			}
+
+			case OP_LOAD:
+			case OP_DUP: {
+				const Column& from = pc->op == OP_LOAD ? vars[pc->a] : stack[sp - 1];
+				Column& top = stack[sp++];
+				memcpy(top.type, from.type, sizeof(top.type));
+				memcpy(top.i, from.i, sizeof(top.i));
+				memcpy(top.r, from.r, sizeof(top.r));
+				//Strings and variables that were never assigned are rare, and only they need a lane at a time
+				if (AnyOf(from, VSTRING, on) || AnyOf(from, VERR, on)){
+					FOR_LANES(k, active){
+						if (from.type[k] == VSTRING){
+							top.s[k] = from.s[k];
+						} else if (from.type[k] == VERR){
+							Fail(unit, pc, k, pcs);
+						}
+					}
+				}
+				break;
+			}
+
+			case OP_STORE: {
+				const Column& val = stack[--sp];
+				Column& var = vars[pc->a];
+				//When every lane already has the type of the variable, the lanes that run take their values
+				//without a branch, and the others keep theirs
+				ValType type = pc->b == INTEGER ? VINT : pc->b == REAL ? VREAL : pc->b == BOOLEAN ? VBOOL : VSTRING;
+				if (type != VSTRING && AllOf(val, type, on)){
+					for (int k = 0; k < LANES; k++){
+						var.type[k] = on[k] ? type : var.type[k];
+						var.i[k] = on[k] ? val.i[k] : var.i[k];
+						var.r[k] = on[k] ? val.r[k] : var.r[k];
+					}
+					break;
+				}
+				FOR_LANES(k, active){
+					if (!Store(var, val, k, pc->b)){
+						Fail(unit, pc, k, pcs);
+					}
+				}
+				break;
+			}
+
+			case OP_OR:
+			case OP_AND:
+			case OP_EQ:
+			case OP_LTHAN:
+			case OP_GTHAN:
+			case OP_PLUS:
+			case OP_MINUS:
+			case OP_MULT:
+			case OP_DIV:
+			case OP_IDIV:
+			case OP_MOD: {
+				const Column& right = stack[--sp];
+				Column& left = stack[sp - 1];
+				if (ApplyLanes(pc->op, left, right, on)){
+					vectorOps += __builtin_popcount(active);
+					break;
+				}
+				//Anything else is done a lane at a time by the Value operators
+				scalarOps += __builtin_popcount(active);
+				FOR_LANES(k, active){
+					Value result = Apply(pc->op, Get(left, k), Get(right, k));
+					if (result.IsErr()){
+						Fail(unit, pc, k, pcs);
+					} else {
+						Set(left, k, result);
+					}
+				}
+				break;
+			}
+
+			case OP_WRITE:
+			case OP_WRITELN:
+				sp -= pc->a;
+				FOR_LANES(k, active){
+					for (int i = 0; i < pc->a; i++){
+						out[k] << Get(stack[sp + i], k);
+					}
+					if (pc->op == OP_WRITELN){
+						out[k] << endl;
+					}
+				}
+				break;
+
+			case OP_JUMP:
+				taken = active;
+				break;
+
+			case OP_JUMPF: {
+				const Column& cond = stack[--sp];
+				FOR_LANES(k, active){
+					if (cond.type[k] != VBOOL){
+						Fail(unit, pc, k, pcs);
+					} else if (!cond.i[k]){
+						taken |= (Lanes)1 << k;
+					}
+				}
+				break;
+			}
+
+			case OP_FORPREP: {
+				sp -= 2;
+				const Column& initial = stack[sp];
+				const Column& final = stack[sp + 1];
+				int* value = &counterValue[(size_t)pc->b * LANES];
+				int* last = &counterFinal[(size_t)pc->b * LANES];
+				counterSlot[pc->b] = pc->c;
+				Column& var = vars[pc->c];
+				FOR_LANES(k, active){
+					if (initial.type[k] != VINT || final.type[k] != VINT){
+						Fail(unit, pc, k, pcs);
+						continue;
+					}
+					value[k] = initial.i[k];
+					last[k] = final.i[k];
+					if (value[k] > last[k]){
+						taken |= (Lanes)1 << k;
+						continue;
+					}
+					var.type[k] = VINT;
+					var.i[k] = value[k];
+				}
+				break;
+			}
+
+			case OP_FORNEXT: {
+				int* value = &counterValue[(size_t)pc->b * LANES];
+				const int* last = &counterFinal[(size_t)pc->b * LANES];
+				//The body can't assign the control variable, so it is still an integer
+				Column& var = vars[counterSlot[pc->b]];
+				int again[LANES];
+				for (int k = 0; k < LANES; k++){
+					again[k] = on[k] & (value[k] < last[k]);
+					value[k] += again[k];
+					var.i[k] = again[k] ? value[k] : var.i[k];
+				}
+				for (int k = 0; k < LANES; k++){
+					taken |= (Lanes)again[k] << k;
+				}
+				break;
+			}
+
+			case OP_CASE: {
+				const Column& sel = stack[--sp];
+				FOR_LANES(k, active){
+					int target = CaseTarget(code, pc, Get(sel, k));
+					if (target < 0){
+						Fail(unit, pc, k, pcs);
+					} else {
+						pcs[k] = target;
+					}
+				}
+				scattered = true;
+				break;
+			}
+
+			//None of these are in code that runs in lockstep, see Lockstep
+			default:
+				break;
+		}
+
+		if (!scattered){
+			Lanes fell = active & ~taken;
+			if (taken == 0 || fell == 0){
+				//The lanes that ran all went the same way, and they run next again unless that brought them
+				//as far as lanes that are waiting
+				at = taken == 0 ? at + 1 : pc->a;
+				if (at < waiting){
+					continue;
+				}
+				FOR_LANES(k, active){
+					pcs[k] = at;
+				}
+			} else {
+				FOR_LANES(k, taken){
+					pcs[k] = pc->a;
+				}
+				FOR_LANES(k, fell){
+					pcs[k] = at + 1;
+				}
+			}
+		}
+
+		//The lanes that failed are out of the way at INT_MAX
+		at = INT_MAX;
+		for (int k = 0; k < LANES; k++){
+			at = min(at, pcs[k]);
+		}
+		Lanes next = 0;
+		waiting = INT_MAX;
+		for (int k = 0; k < LANES; k++){
+			on[k] = pcs[k] == at;
+			next |= (Lanes)on[k] << k;
+			waiting = min(waiting, on[k] ? INT_MAX : pcs[k]);
+		}
+		active = next;
+	}
+}
+
+
+int Lockstepper::RunGroup(const vector<BatchColumn>& columns, const vector<Value>* values, int n, int first){
+	for (Column& var : vars){
+		for (int k = 0; k < LANES; k++){
+			var.type[k] = VERR;
+		}
+	}
+	live = 0;
+	for (int k = 0; k < n; k++){
+		for (size_t i = 0; i < columns.size(); i++){
+			Set(vars[columns[i].slot], k, values[k][i]);
+		}
+		out[k].str(string());
+		errors[k] = 0;
+		live |= (Lanes)1 << k;
+	}
+
+	for (const BatchUnit& unit : units){
+		RunUnit(unit);
+	}
+
+	int failed = 0;
+	for (int k = 0; k < n; k++){
+		cout << "--- Instance " << first + k << " ---" << endl << out[k].str();
+		Finish(cout, errors[k]);
+		failed += errors[k] > 0;
+	}
+	Stats::Counters& stats = Stats::Local();
+	stats.batchLockstep += n;
+	stats.batchVector += vectorOps;
+	stats.batchScalar += scalarOps;
+	vectorOps = scalarOps = 0;
+	return failed;
+}
+
+
+void Batch::RunAll(const vector<Routine>& routines, vector<Value>& slots, vector<Array>& arrays){
+	Stats::PhaseTimer timer(PH_EXECUTE);
+	bool lockstep = true;
+	for (const BatchUnit& unit : units){
+		lockstep = lockstep && Lockstep(unit.code);
+	}
+
+	vector<Value> values[LANES];
+	if (!lockstep){
+		while (NextRow(values[0])){
+			instances++;
+			cout << "--- Instance " << instances << " ---" << endl;
+			int errors = RunInstance(units, columns, values[0], routines, slots, arrays);
+			Finish(cout, errors);
+			failed += errors > 0;
+			Stats::Local().batchSerial++;
+		}
+		return;
+	}
+
+	Lockstepper lanes(units, slots.size());
+	for(;;){
+		int n = 0;
+		while (n < LANES && NextRow(values[n])){
+			n++;
+		}
+		if (n == 0){
+			break;
+		}
+		failed += lanes.RunGroup(columns, values, n, instances + 1);
+		instances += n;
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * batch.h
+ * Running one program over many sets of initial values
+ * In batch mode the program is compiled once, with nothing run while it is read, and then run once
+ * for each row of a batch input file. The first line of the file names variables of the program, and
+ * each line after it is one instance of the program, giving those variables their values: a
+ * variable named there gets the value from the row as soon as its declaration has run, in place of
+ * the one its declaration gave it. Values are separated by whitespace, and a string is either a word
+ * or quoted like a string of the program.
+ * Instances run LANES at a time in lockstep, with every variable and stack entry held as one array per
+ * field across the lanes, so that arithmetic on them is a loop the compiler vectorizes. Where lanes
+ * take different branches, the lanes that have fallen furthest behind run on their own until the
+ * others catch up with them. Programs that call routines, use arrays or read input run one instance at
+ * a time instead.
+ * The output of each instance is printed under a heading of its own, ending with what a run of the
+ * program on its own would have ended with, whatever order the instances finished in.
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "bytecode.h"
+#include "lex.h"
+#include "val.h"
+
+
+//A variable named by the batch input. The parser fills in its type and the slot each instance's value
+//is put in when the variable is declared, which is -1 until then
+struct BatchColumn {
+	string name;
+	Token type;
+	int slot;
+};
+
+//A declaration or a statement of the program body, compiled to run once for each instance, with what
+//the parse functions around it report after it fails
+struct BatchUnit {
+	Code code;
+	const char* const* failure;
+};
+
+class Batch {
+	ifstream file;
+
+	//Reads the next row into the values of an instance, which are left with no value where the row
+	//does not have one of the right type. False at the end of the file
+	bool NextRow(vector<Value>& values);
+
+public:
+	vector<BatchColumn> columns;
+	vector<BatchUnit> units;
+	//How many instances ran and how many of them failed
+	int instances;
+	int failed;
+	//When set, the compiled program is saved there as an image instead of being run, see image.h
+	string* image;
+
+	Batch() : instances(0), failed(0), image(NULL) {}
+
+	//Opens a batch input file and reads the names of its columns. False if it can't be read or has no
+	//names
+	bool Open(const string& name);
+
+	//Runs every instance of the compiled program over the variable slots and arrays, printing what each
+	//one prints
+	void RunAll(const vector<Routine>& routines, vector<Value>& slots, vector<Array>& arrays);
+};
+
+
+#endif /* BATCH_H_ */
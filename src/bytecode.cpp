@@ -0,0 +1,970 @@
+/*
+ * bytecode.cpp
+ * The stack machine that compiled statements run on
+ */
+
+#include "bytecode.h"
+#include "input.h"
+#include "parserInterp.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+using namespace std;
+
+
+//A call that has not returned yet: the routine it was made from, NULL for the program, its code and
+//where the call is in it, and its frame and loop counters. These are offsets, since the stacks they
+//are in may grow
+struct Frame {
+	const Routine* routine;
+	const Code* code;
+	const Instr* call;
+	size_t fp;
+	size_t counters;
+};
+
+
+//The value stack, which the frames of calls are part of, the loop counters and the calls that are
+//running. Each statement of the program body is run on its own, so these are kept from one to the
+//next rather than allocated every time
+static vector<Value> stack;
+static vector<Counter> counters;
+static vector<Frame> frames;
+//The register machine's registers. Nothing that runs other code comes between the instruction that
+//writes one and the one that reads it, so a single set of them does for every call
+static Value registers[REGISTERS];
+
+//How many Values the stack may grow to, which is what limits how deep calls can go
+static const size_t MAX_STACK = ((size_t)64 << 20) / sizeof(Value);
+
+//Loops go round this many more times before the next checkpoint is saved, see CheckpointEvery
+static long untilCheckpoint = LONG_MAX;
+static long checkpointEvery = 0;
+static void (*saveCheckpoint)(const MachineState& state) = NULL;
+//Where the next Run carries on from, see ResumeAt
+static const MachineState* resumeAt = NULL;
+//Set while Fold runs code ahead of time, which leaves a failure for the program to report when it runs
+static bool folding = false;
+//How much room the stacks start out with, enough for calls a few dozen deep before they have to grow
+static const size_t START_STACK = 4096;
+static const size_t START_FRAMES = 64;
+
+
+void Report(const Code& code, const Instr* pc, int& line, const char* msg){
+	const Site& site = code.sites[pc->site];
+	line = pc->line;
+	ParseError(line, msg != NULL ? msg : site.msg);
+	for (int i = 0; i < site.count; i++){
+		ParseError(line, code.unwinds[site.first + i]);
+	}
+	for (int i = site.context; i >= 0; i = code.contexts[i].outer){
+		ParseError(line, code.contexts[i].msg);
+	}
+}
+
+//Reports the failure of the instruction at pc, see Site. An instruction that can fail in more than one
+//way may report msg in place of the site's own message
+//Every call that is running fails along with it, innermost first. A run of calls that were all made
+//from the same place, as in a recursion, is only reported once
+static bool Fail(const Code& code, const Instr* pc, int& line, const char* msg = NULL){
+	if (!folding){
+		Report(code, pc, line, msg);
+	}
+	const Instr* last = pc;
+	while (!frames.empty()){
+		const Frame& frame = frames.back();
+		if (frame.call != last){
+			Report(*frame.code, frame.call, line, NULL);
+			last = frame.call;
+		}
+		frames.pop_back();
+	}
+	return false;
+}
+
+//Converts val for a variable of the given type. Integers and reals are converted to the type of the
+//variable, any other mismatch fails
+static inline bool Convert(Value& val, int type){
+	switch(type){
+		case STRING:
+			return val.IsString();
+
+		case BOOLEAN:
+			return val.IsBool();
+
+		case REAL:
+			//An integer is converted to the type of the variable
+			if (val.IsInt()){
+				val.SetReal((float)val.GetInt());
+				val.SetType(VREAL);
+				return true;
+			}
+			return val.IsReal();
+
+		case INTEGER:
+			//A real is truncated to fit an integer variable
+			if (val.IsReal()){
+				val.SetInt((int)val.GetReal());
+				val.SetType(VINT);
+				return true;
+			}
+			return val.IsInt();
+
+		default:
+			return false;
+	}
+}
+
+
+//Applies a binary operator, whose result is an error if the operands can't be used with it
+static inline Value Apply(int op, const Value& left, const Value& right){
+	switch(op){
+		case OP_OR:    return left || right;
+		case OP_AND:   return left && right;
+		case OP_EQ:    return left == right;
+		case OP_LTHAN: return left < right;
+		case OP_GTHAN: return left > right;
+		case OP_PLUS:  return left + right;
+		case OP_MINUS: return left - right;
+		case OP_MULT:  return left * right;
+		case OP_DIV:   return left / right;
+		case OP_IDIV:  return left.idiv(right);
+		default:       return left % right;
+	}
+}
+
+Value Operate(int op, const Value& left, const Value& right){
+	return Apply(op, left, right);
+}
+
+bool ConvertFor(Value& val, int type){
+	return Convert(val, type);
+}
+
+//The register an operand of the register machine reads, see RegKind
+static inline const Value& Source(int x, const Value* sp, const Value* fp, const vector<Value>& slots, const Code& code){
+	switch(KindOf(x)){
+		case RK_TEMP:  return sp[-IndexOf(x)];
+		case RK_SLOT:  return slots[IndexOf(x)];
+		case RK_LOCAL: return fp[IndexOf(x)];
+		case RK_REG:   return registers[IndexOf(x)];
+		default:       return code.consts[IndexOf(x)];
+	}
+}
+
+//How many temporaries an instruction of the register machine reads
+static inline int Temps(const Instr* pc){
+	return (KindOf(pc->b) == RK_TEMP) + (KindOf(pc->c) == RK_TEMP);
+}
+
+//How many of its operands it reads in place, which are what the stack machine would have loaded.
+//Temporaries and registers hold results, which always have a value
+static inline int InPlace(const Instr* pc){
+	auto inPlace = [](int x){ return KindOf(x) == RK_SLOT || KindOf(x) == RK_LOCAL || KindOf(x) == RK_CONST; };
+	return inPlace(pc->b) + inPlace(pc->c);
+}
+
+
+int CaseTarget(const Code& code, const Instr* pc, const Value& sel){
+	const CaseTable& table = code.caseTables[pc->a];
+	int at = -1;
+	if (table.type == STRING){
+		if (!sel.IsString()){
+			return -1;
+		}
+		size_t entry = CaseHash(sel.GetString(), table.seed) & (table.count - 1);
+		int key = code.caseKeys[table.first + entry];
+		if (key >= 0 && sel.GetRope().Equals(code.consts[key].GetRope())){
+			at = table.first + entry;
+		}
+	} else {
+		if (table.type == BOOLEAN ? !sel.IsBool() : !sel.IsInt()){
+			return -1;
+		}
+		int val = sel.IsBool() ? sel.GetBool() : sel.GetInt();
+		if (table.kind == CK_DENSE){
+			//Below low wraps round to a huge offset, so one comparison covers both ends
+			unsigned offset = (unsigned)val - (unsigned)table.low;
+			if (offset < (unsigned)table.count){
+				at = table.first + offset;
+			}
+		} else {
+			const int* keys = code.caseKeys.data() + table.first;
+			const int* key = lower_bound(keys, keys + table.count, val);
+			if (key != keys + table.count && *key == val){
+				at = key - code.caseKeys.data();
+			}
+		}
+	}
+	return at >= 0 ? code.caseTargets[at] : table.otherwise;
+}
+
+
+//Finds element i of an array for OP_INDEX and OP_ISTORE, or says why it can't
+static const char* CheckIndex(const Array& arr, const Value& index, int& i){
+	if (!index.IsInt()){
+		return "Array index must be of type Integer";
+	}
+	i = index.GetInt();
+	if (i < arr.lo || i > arr.hi){
+		return "Array index out of bounds";
+	}
+	i -= arr.lo;
+	return NULL;
+}
+
+
+//Whole-array assignments go through their arrays this many elements at a time, operator by operator,
+//so that intermediate results stay in the cache however long the arrays are
+#define CHUNK 512
+
+//Room for intermediate results, converted operands and scalars spread out to a whole chunk, CHUNK
+//doubles for each. Kept from one assignment to the next
+static vector<double> chunks;
+
+//An operand in the chunk being worked on
+struct Operand {
+	ElemType type;
+	const void* p;
+};
+
+//The type of every step of a whole-array expression, the steps whose results are pending while they
+//are typed, and the operands pending while a chunk is worked on. Kept like chunks
+static vector<ElemType> stepTypes;
+static vector<int> pendingSteps;
+static vector<Operand> operands;
+
+//The type of the result of a whole-array operator, or -1 if the operands can't be used with it. The
+//rules are those of the Value operators
+static int ResultType(int op, ElemType left, ElemType right){
+	bool numeric = left != ELEM_BOOL && right != ELEM_BOOL;
+	switch (op){
+		case OP_AND:
+		case OP_OR:
+			return (left == ELEM_BOOL && right == ELEM_BOOL) ? ELEM_BOOL : -1;
+
+		case OP_PLUS:
+		case OP_MINUS:
+		case OP_MULT:
+		case OP_DIV:
+			if (!numeric){
+				return -1;
+			}
+			return (left == ELEM_INT && right == ELEM_INT) ? ELEM_INT : ELEM_REAL;
+
+		case OP_IDIV:
+			return numeric ? ELEM_INT : -1;
+
+		case OP_MOD:
+			return (left == ELEM_INT && right == ELEM_INT) ? ELEM_INT : -1;
+
+		default:
+			return -1;
+	}
+}
+
+//The elements of an operand as the given type, converted into scratch if they aren't already
+static const void* As(ElemType type, const Operand& x, void* scratch, size_t n){
+	if (x.type == type){
+		return x.p;
+	}
+	if (type == ELEM_REAL){
+		IntToReal((double*)scratch, (const int*)x.p, n);
+	} else {
+		RealToInt((int*)scratch, (const double*)x.p, n);
+	}
+	return scratch;
+}
+
+//Applies one operator to n elements of each operand, putting the result of the given type in out
+//Returns false if something would be divided by zero
+static bool ApplyChunk(int op, ElemType type, const Operand& left, const Operand& right, void* out, size_t n,
+                       void* scratchLeft, void* scratchRight){
+	if (op == OP_AND || op == OP_OR){
+		BoolKernel(op == OP_AND ? EOP_AND : EOP_OR, (unsigned char*)out, (const unsigned char*)left.p,
+		           (const unsigned char*)right.p, n);
+		return true;
+	}
+
+	//DIV and MOD work on integers whatever the operands are, everything else on the type of the result
+	ElemType work = (op == OP_IDIV || op == OP_MOD) ? ELEM_INT : type;
+	const void* a = As(work, left, scratchLeft, n);
+	const void* b = As(work, right, scratchRight, n);
+
+	ElemOp eop = op == OP_PLUS ? EOP_ADD : op == OP_MINUS ? EOP_SUB : op == OP_MULT ? EOP_MUL
+	           : op == OP_MOD ? EOP_MOD : EOP_DIV;
+	if (work == ELEM_INT){
+		if ((eop == EOP_DIV || eop == EOP_MOD) && HasZero((const int*)b, n)){
+			return false;
+		}
+		IntKernel(eop, (int*)out, (const int*)a, (const int*)b, n);
+	} else {
+		if (eop == EOP_DIV && HasZero((const double*)b, n)){
+			return false;
+		}
+		RealKernel(eop, (double*)out, (const double*)a, (const double*)b, n);
+	}
+	return true;
+}
+
+//Puts n elements of x into an array's elements at to, converting them to its type
+static void StoreChunk(ElemType type, void* to, const Operand& x, size_t n){
+	if (x.type == type){
+		memmove(to, x.p, n * ElemSize(type));
+	} else if (type == ELEM_REAL){
+		IntToReal((double*)to, (const int*)x.p, n);
+	} else {
+		RealToInt((int*)to, (const double*)x.p, n);
+	}
+}
+
+//Runs the whole-array assignment at pc, see OP_AEVAL. Every size and type is checked before any
+//element is touched, so the work on each chunk is nothing but kernels. Returns false if it fails, with
+//what to report in msg, or NULL for the site's own message
+static bool AssignArray(const Code& code, const Instr* pc, const Value* scalars, vector<Array>& arrays, const char*& msg){
+	const ArrayExpr& expr = code.arrayExprs[pc->b];
+	const VecNode* nodes = code.vecNodes.data() + expr.first;
+	Array& target = arrays[pc->a];
+	size_t n = target.Size();
+
+	//The type of every step, worked out with a stack of the steps whose results are pending
+	vector<ElemType>& types = stepTypes;
+	vector<int>& pending = pendingSteps;
+	types.resize(expr.count);
+	pending.clear();
+	for (int k = 0; k < expr.count; k++){
+		const VecNode& node = nodes[k];
+		if (node.kind == VN_ARRAY){
+			if (arrays[node.arg].Size() != n){
+				msg = "Arrays in a whole-array operation must have the same number of elements";
+				return false;
+			}
+			types[k] = arrays[node.arg].type;
+
+		} else if (node.kind == VN_SCALAR){
+			const Value& val = scalars[node.arg];
+			if (val.IsInt()){
+				types[k] = ELEM_INT;
+			} else if (val.IsReal()){
+				types[k] = ELEM_REAL;
+			} else if (val.IsBool()){
+				types[k] = ELEM_BOOL;
+			} else {
+				msg = "Illegal operand in whole-array operation";
+				return false;
+			}
+
+		} else {
+			int right = pending.back();
+			pending.pop_back();
+			int type = ResultType(node.arg, types[pending.back()], types[right]);
+			if (type < 0){
+				msg = "Illegal operand in whole-array operation";
+				return false;
+			}
+			types[k] = (ElemType)type;
+			pending.pop_back();
+		}
+		pending.push_back(k);
+	}
+
+	//Booleans only go into booleans, and numbers into numbers
+	ElemType result = types[expr.count - 1];
+	if ((result == ELEM_BOOL) != (target.type == ELEM_BOOL)){
+		msg = NULL;
+		return false;
+	}
+
+	//A chunk for each pending result, two for converted operands and one for each scalar
+	int scalarCount = pc->c;
+	size_t want = (size_t)(expr.depth + 2 + scalarCount) * CHUNK;
+	if (chunks.size() < want){
+		chunks.resize(want);
+	}
+	double* scratchLeft = chunks.data() + expr.depth * CHUNK;
+	double* scratchRight = scratchLeft + CHUNK;
+	double* spread = scratchRight + CHUNK;
+
+	//Scalars are the same in every chunk, so they only need spreading out once
+	size_t first = n < CHUNK ? n : CHUNK;
+	for (int k = 0; k < expr.count; k++){
+		if (nodes[k].kind != VN_SCALAR){
+			continue;
+		}
+		const Value& val = scalars[nodes[k].arg];
+		void* to = spread + nodes[k].arg * CHUNK;
+		for (size_t i = 0; i < first; i++){
+			if (types[k] == ELEM_INT){
+				((int*)to)[i] = val.GetInt();
+			} else if (types[k] == ELEM_REAL){
+				((double*)to)[i] = val.GetReal();
+			} else {
+				((unsigned char*)to)[i] = val.GetBool();
+			}
+		}
+	}
+
+	vector<Operand>& stack = operands;
+	stack.resize(expr.depth);
+	size_t size = ElemSize(target.type);
+	for (size_t base = 0; base < n; base += CHUNK){
+		size_t count = (n - base < CHUNK) ? n - base : CHUNK;
+		char* into = (char*)target.data + base * size;
+		int top = 0;
+
+		for (int k = 0; k < expr.count; k++){
+			const VecNode& node = nodes[k];
+			if (node.kind == VN_ARRAY){
+				const Array& arr = arrays[node.arg];
+				stack[top++] = Operand{ arr.type, (const char*)arr.data + base * ElemSize(arr.type) };
+
+			} else if (node.kind == VN_SCALAR){
+				stack[top++] = Operand{ types[k], spread + node.arg * CHUNK };
+
+			} else {
+				top--;
+				//The last operator can put its result straight into the array, if it needs no converting
+				void* out = (k == expr.count - 1 && types[k] == target.type) ? (void*)into
+				          : (void*)(chunks.data() + (top - 1) * CHUNK);
+				if (!ApplyChunk(node.arg, types[k], stack[top - 1], stack[top], out, count, scratchLeft, scratchRight)){
+					msg = "Division by zero in whole-array operation";
+					return false;
+				}
+				stack[top - 1] = Operand{ types[k], out };
+			}
+		}
+
+		if (stack[0].p != into){
+			StoreChunk(target.type, into, stack[0], count);
+		}
+	}
+
+	return true;
+}
+
+
+void Reserve(const Code& code){
+	if (stack.size() < max((size_t)code.maxStack, START_STACK)){
+		stack.resize(max((size_t)code.maxStack, START_STACK));
+	}
+	frames.reserve(START_FRAMES);
+	if (counters.size() < (size_t)code.counters){
+		counters.resize(code.counters);
+	}
+}
+
+bool Reserve(const MachineSize& size){
+	if (size.stack > MAX_STACK){
+		return false;
+	}
+	//Run itself makes sure of the room the stacks start out with
+	if (stack.size() < max(size.stack, START_STACK)){
+		stack.resize(max(size.stack, START_STACK));
+	}
+	if (counters.size() < size.counters){
+		counters.resize(size.counters);
+	}
+	frames.reserve(max(size.frames, START_FRAMES));
+	stepTypes.reserve(size.arraySteps);
+	pendingSteps.reserve(size.arraySteps);
+	operands.reserve(size.arraySteps);
+	if (chunks.size() < (size_t)size.arrayChunks * CHUNK){
+		chunks.resize((size_t)size.arrayChunks * CHUNK);
+	}
+	return true;
+}
+
+bool Fold(const Code& code, vector<Value>& slots){
+	//The slots it stores to, and what they held before it, in case it fails partway
+	vector<pair<int, Value>> stored;
+	for (const Instr& in : code.code){
+		switch(in.op){
+			case OP_STORE:
+				stored.emplace_back(in.a, slots[in.a]);
+				break;
+			case OP_CONST: case OP_LOAD: case OP_DUP: case OP_HALT:
+			case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+			case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_IDIV: case OP_MOD:
+				break;
+			default:
+				return false;
+		}
+	}
+
+	static const vector<Routine> routines;
+	static vector<Array> arrays;
+	int line = 0;
+	folding = true;
+	bool ran = Run(code, routines, slots, arrays, line);
+	folding = false;
+	if (!ran){
+		for (auto i = stored.rbegin(); i != stored.rend(); ++i){
+			slots[i->first] = i->second;
+		}
+	}
+	return ran;
+}
+
+void CheckpointEvery(long n, void (*save)(const MachineState& state)){
+	checkpointEvery = (n > 0 && save != NULL) ? n : 0;
+	saveCheckpoint = save;
+	untilCheckpoint = checkpointEvery > 0 ? checkpointEvery : LONG_MAX;
+}
+
+void ResumeAt(const MachineState* state){
+	resumeAt = state;
+}
+
+//The index of a routine, -1 for the program's own code
+static int RoutineIndex(const Routine* routine, const vector<Routine>& routines){
+	return routine != NULL ? (int)(routine - routines.data()) : -1;
+}
+
+//Saves where the program is, at the instruction at pc, which hasn't run yet. Kept from one checkpoint
+//to the next, like the stacks
+static void Checkpoint(const vector<Routine>& routines, const Routine* running, const Code* code, const Instr* pc, const Value* sp, const Value* fp, const Counter* cnt){
+	static MachineState state;
+	state.routine = RoutineIndex(running, routines);
+	state.pc = pc - code->code.data();
+	state.fp = fp - stack.data();
+	state.cnt = cnt - counters.data();
+	state.frames.clear();
+	for (const Frame& frame : frames){
+		state.frames.push_back(SavedFrame{ RoutineIndex(frame.routine, routines), (int)(frame.call - frame.code->code.data()), (uint32_t)frame.fp, (uint32_t)frame.counters });
+	}
+	state.stack.assign((const Value*)stack.data(), sp);
+	state.counters.assign((const Counter*)counters.data(), cnt + code->counters);
+	saveCheckpoint(state);
+	untilCheckpoint = checkpointEvery;
+}
+
+bool Run(const Code& program, const vector<Routine>& routines, vector<Value>& slots, vector<Array>& arrays, int& line){
+	Stats::PhaseTimer timer(PH_EXECUTE);
+	Reserve(program);
+	frames.clear();
+
+	//The routine and code that are running, which change with every call and return
+	const Routine* running = NULL;
+	const Code* code = &program;
+	//sp is the first free entry of the stack, fp is the frame of the running routine and cnt its first
+	//loop counter. The program's own code has no frame
+	Value* sp = stack.data();
+	Value* fp = sp;
+	Counter* cnt = counters.data();
+	const Instr* start = code->code.data();
+	const Instr* pc = start;
+
+	//Carrying on from a checkpoint puts back the stacks and calls as they were
+	if (resumeAt != NULL){
+		const MachineState& at = *resumeAt;
+		resumeAt = NULL;
+		if (stack.size() < at.stack.size()){
+			stack.resize(at.stack.size());
+		}
+		if (counters.size() < at.counters.size()){
+			counters.resize(at.counters.size());
+		}
+		copy(at.stack.begin(), at.stack.end(), stack.begin());
+		copy(at.counters.begin(), at.counters.end(), counters.begin());
+		for (const SavedFrame& saved : at.frames){
+			const Routine* routine = saved.routine >= 0 ? &routines[saved.routine] : NULL;
+			const Code* from = routine != NULL ? &routine->code : &program;
+			frames.push_back(Frame{ routine, from, from->code.data() + saved.call, saved.fp, saved.counters });
+		}
+		running = at.routine >= 0 ? &routines[at.routine] : NULL;
+		code = running != NULL ? &running->code : &program;
+		start = code->code.data();
+		pc = start + at.pc;
+		sp = stack.data() + at.stack.size();
+		fp = stack.data() + at.fp;
+		cnt = counters.data() + at.cnt;
+	}
+
+	//Counted here and added to the stats however the code ends
+	struct Executed {
+		uint64_t n = 0;
+		~Executed() { Stats::Local().instructions += n; }
+	} executed;
+
+	for(;;){
+		executed.n++;
+		switch(pc->op){
+			case OP_CONST:
+				*sp++ = code->consts[pc->a];
+				break;
+
+			case OP_LOAD:
+				if (slots[pc->a].IsErr()){
+					return Fail(*code, pc, line);
+				}
+				*sp++ = slots[pc->a];
+				break;
+
+			case OP_STORE: {
+				Value& val = *--sp;
+				if (!Convert(val, pc->b)){
+					return Fail(*code, pc, line);
+				}
+				slots[pc->a] = move(val);
+				break;
+			}
+
+			case OP_DUP:
+				*sp = sp[-1];
+				sp++;
+				break;
+
+			case OP_LLOAD:
+				if (fp[pc->a].IsErr()){
+					return Fail(*code, pc, line);
+				}
+				*sp++ = fp[pc->a];
+				break;
+
+			case OP_LSTORE: {
+				Value& val = *--sp;
+				if (!Convert(val, pc->b)){
+					return Fail(*code, pc, line);
+				}
+				fp[pc->a] = move(val);
+				break;
+			}
+
+			case OP_INDEX: {
+				const Array& arr = arrays[pc->a];
+				int i;
+				const char* msg = CheckIndex(arr, sp[-1], i);
+				if (msg != NULL){
+					return Fail(*code, pc, line, msg);
+				}
+				switch (arr.type){
+					case ELEM_INT:  sp[-1] = Value(((const int*)arr.data)[i]); break;
+					case ELEM_REAL: sp[-1] = Value(((const double*)arr.data)[i]); break;
+					default:        sp[-1] = Value(((const unsigned char*)arr.data)[i] != 0); break;
+				}
+				break;
+			}
+
+			case OP_ISTORE: {
+				sp -= 2;
+				Array& arr = arrays[pc->a];
+				const Value& val = sp[1];
+				int i;
+				const char* msg = CheckIndex(arr, sp[0], i);
+				if (msg != NULL){
+					return Fail(*code, pc, line, msg);
+				}
+				//Integers and reals are converted just like they are for a variable
+				if (arr.type == ELEM_INT && (val.IsInt() || val.IsReal())){
+					((int*)arr.data)[i] = val.IsInt() ? val.GetInt() : (int)val.GetReal();
+				} else if (arr.type == ELEM_REAL && (val.IsInt() || val.IsReal())){
+					((double*)arr.data)[i] = val.IsReal() ? val.GetReal() : (float)val.GetInt();
+				} else if (arr.type == ELEM_BOOL && val.IsBool()){
+					((unsigned char*)arr.data)[i] = val.GetBool();
+				} else {
+					return Fail(*code, pc, line);
+				}
+				break;
+			}
+
+			case OP_AEVAL: {
+				sp -= pc->c;
+				const char* msg;
+				if (!AssignArray(*code, pc, sp, arrays, msg)){
+					return Fail(*code, pc, line, msg);
+				}
+				break;
+			}
+
+			case OP_OR:
+			case OP_AND:
+			case OP_EQ:
+			case OP_LTHAN:
+			case OP_GTHAN:
+			case OP_PLUS:
+			case OP_MINUS:
+			case OP_MULT:
+			case OP_DIV:
+			case OP_IDIV:
+			case OP_MOD: {
+				const Value& val = *--sp;
+				Value& retVal = sp[-1];
+				retVal = Apply(pc->op, retVal, val);
+				if (retVal.IsErr()){
+					return Fail(*code, pc, line);
+				}
+				break;
+			}
+
+			//A variable the stack machine would have loaded fails where it would have, then the operator,
+			//then the store of the result. Temporaries and registers always have a value
+			case OP_RMOVE: {
+				const Value& from = Source(pc->b, sp, fp, slots, *code);
+				if (from.IsErr()){
+					return Fail(*code, &code->origins[pc->site], line);
+				}
+				Value val = from;
+				if (!Convert(val, DestTypeOf(pc->a))){
+					return Fail(*code, &code->origins[pc->site + 1], line);
+				}
+				(KindOf(pc->a) == RK_SLOT ? slots[DestIndexOf(pc->a)] : fp[DestIndexOf(pc->a)]) = move(val);
+				break;
+			}
+
+			case OP_ROR:
+			case OP_RAND:
+			case OP_REQ:
+			case OP_RLTHAN:
+			case OP_RGTHAN:
+			case OP_RPLUS:
+			case OP_RMINUS:
+			case OP_RMULT:
+			case OP_RDIV:
+			case OP_RIDIV:
+			case OP_RMOD: {
+				const Value& left = Source(pc->b, sp, fp, slots, *code);
+				const Value& right = Source(pc->c, sp, fp, slots, *code);
+				int loaded = InPlace(pc);
+				if (left.IsErr()){
+					return Fail(*code, &code->origins[pc->site], line);
+				}
+				if (right.IsErr()){
+					return Fail(*code, &code->origins[pc->site + loaded - 1], line);
+				}
+				Value result = Apply(pc->op - OP_ROR + OP_OR, left, right);
+				if (result.IsErr()){
+					return Fail(*code, &code->origins[pc->site + loaded], line);
+				}
+				sp -= Temps(pc);
+				if (KindOf(pc->a) == RK_REG){
+					registers[IndexOf(pc->a)] = move(result);
+					break;
+				}
+				if (KindOf(pc->a) == RK_TEMP){
+					*sp++ = move(result);
+					break;
+				}
+				if (!Convert(result, DestTypeOf(pc->a))){
+					return Fail(*code, &code->origins[pc->site + loaded + 1], line);
+				}
+				(KindOf(pc->a) == RK_SLOT ? slots[DestIndexOf(pc->a)] : fp[DestIndexOf(pc->a)]) = move(result);
+				break;
+			}
+
+			case OP_WRITE:
+			case OP_WRITELN:
+				sp -= pc->a;
+				for (int i = 0; i < pc->a; i++){
+					cout << sp[i];
+				}
+				if (pc->op == OP_WRITELN){
+					cout << endl;
+				}
+				break;
+
+			case OP_READ:
+				if (!ReadInput((Token)pc->a, *sp)){
+					return Fail(*code, pc, line, InputEof() ? "Missing input for ReadLn statement" : NULL);
+				}
+				sp++;
+				break;
+
+			case OP_READLN:
+				SkipInputLine();
+				break;
+
+			case OP_EOF:
+				*sp++ = Value(InputEof());
+				break;
+
+			case OP_JUMP:
+				//Going back is going round a loop
+				if (pc->a < pc - start && --untilCheckpoint == 0){
+					Checkpoint(routines, running, code, pc, sp, fp, cnt);
+				}
+				pc = start + pc->a;
+				continue;
+
+			case OP_JUMPF: {
+				const Value& cond = *--sp;
+				if (!cond.IsBool()){
+					return Fail(*code, pc, line);
+				}
+				if (!cond.GetBool()){
+					pc = start + pc->a;
+					continue;
+				}
+				break;
+			}
+
+			case OP_JUMPT: {
+				const Value& cond = *--sp;
+				if (!cond.IsBool()){
+					return Fail(*code, pc, line);
+				}
+				if (cond.GetBool()){
+					pc = start + pc->a;
+					continue;
+				}
+				break;
+			}
+
+			case OP_JUMPEQ:
+			case OP_JUMPLT:
+			case OP_JUMPGT: {
+				sp -= 2;
+				Value cond = Apply(pc->op - OP_JUMPEQ + OP_EQ, sp[0], sp[1]);
+				if (cond.IsErr()){
+					return Fail(*code, pc, line);
+				}
+				if (cond.GetBool() == (pc->b != 0)){
+					pc = start + pc->a;
+					continue;
+				}
+				break;
+			}
+
+			case OP_FORPREP: {
+				sp -= 2;
+				if (!sp[0].IsInt() || !sp[1].IsInt()){
+					return Fail(*code, pc, line);
+				}
+				Counter& counter = cnt[pc->b];
+				counter.value = sp[0].GetInt();
+				counter.final = sp[1].GetInt();
+				counter.slot = pc->c;
+				if (counter.value > counter.final){
+					pc = start + pc->a;
+					continue;
+				}
+				(counter.slot >= 0 ? slots[counter.slot] : fp[-1 - counter.slot]) = Value(counter.value);
+				break;
+			}
+
+			case OP_FORNEXT: {
+				//The body can't assign the control variable, so its slot is still an integer
+				Counter& counter = cnt[pc->b];
+				if (counter.value < counter.final){
+					if (--untilCheckpoint == 0){
+						Checkpoint(routines, running, code, pc, sp, fp, cnt);
+					}
+					counter.value++;
+					(counter.slot >= 0 ? slots[counter.slot] : fp[-1 - counter.slot]).SetInt(counter.value);
+					pc = start + pc->a;
+					continue;
+				}
+				break;
+			}
+
+			case OP_CASE: {
+				int at = CaseTarget(*code, pc, *--sp);
+				if (at < 0){
+					return Fail(*code, pc, line);
+				}
+				pc = start + at;
+				continue;
+			}
+
+			case OP_CALL:
+			case OP_TAILCALL: {
+				const Routine& routine = routines[pc->a];
+				Value* args = sp - pc->b;
+				for (int i = 0; i < pc->b; i++){
+					if (!Convert(args[i], routine.params[i])){
+						ParseError(pc->line, "Incompatible argument type in call");
+						return Fail(*code, pc, line);
+					}
+				}
+
+				//A result from the cache takes the place of the arguments like a returned one would. What
+				//comes after a tail call is still there, so it carries on from there as an ordinary call
+				if (routine.memo){
+					const Value* result = routine.memo->Find(args);
+					if (result != NULL){
+						sp = args;
+						*sp++ = *result;
+						break;
+					}
+				}
+
+				//The new frame, and the stack and loop counters it needs, must fit. A tail call's frame
+				//replaces the running one, anything else goes on top of it
+				bool tail = (pc->op == OP_TAILCALL);
+				Value* frame = tail ? fp : args;
+				size_t needStack = (frame - stack.data()) + routine.frameSize + routine.code.maxStack;
+				size_t needCounters = (cnt - counters.data()) + (tail ? 0 : code->counters) + routine.code.counters;
+				if (needStack > MAX_STACK){
+					ParseError(pc->line, "Call stack overflow");
+					return Fail(*code, pc, line);
+				}
+				if (needStack > stack.size()){
+					Value* old = stack.data();
+					stack.resize(min(max(needStack, 2 * stack.size()), MAX_STACK));
+					sp = stack.data() + (sp - old);
+					fp = stack.data() + (fp - old);
+					args = stack.data() + (args - old);
+					frame = stack.data() + (frame - old);
+				}
+				if (needCounters > counters.size()){
+					size_t at = cnt - counters.data();
+					counters.resize(max(needCounters, 2 * counters.size()));
+					cnt = counters.data() + at;
+				}
+
+				if (tail){
+					for (int i = 0; i < pc->b; i++){
+						fp[i] = move(args[i]);
+					}
+				} else {
+					frames.push_back(Frame{ running, code, pc, (size_t)(fp - stack.data()), (size_t)(cnt - counters.data()) });
+					cnt += code->counters;
+					fp = frame;
+				}
+
+				//Everything but the parameters starts out with no value
+				for (Value* slot = fp + pc->b; slot < fp + routine.frameSize; slot++){
+					*slot = Value();
+				}
+				sp = fp + routine.frameSize;
+				running = &routine;
+				code = &routine.code;
+				start = pc = code->code.data();
+				continue;
+			}
+
+			case OP_RET: {
+				//A function's result takes the place of its frame, which was where its arguments were
+				Value* frame = fp;
+				if (pc->a >= 0){
+					if (fp[pc->a].IsErr()){
+						return Fail(*code, pc, line);
+					}
+					//A memoized function never assigns its parameters, so they are still its arguments
+					if (running->memo){
+						running->memo->Insert(fp, fp[pc->a]);
+					}
+					Value result = move(fp[pc->a]);
+					*frame++ = move(result);
+				}
+				sp = frame;
+
+				const Frame& caller = frames.back();
+				running = caller.routine;
+				code = caller.code;
+				start = code->code.data();
+				pc = caller.call;
+				fp = stack.data() + caller.fp;
+				cnt = counters.data() + caller.counters;
+				frames.pop_back();
+				break;
+			}
+
+			case OP_HALT:
+				return true;
+		}
+		pc++;
+	}
+}
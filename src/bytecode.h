@@ -0,0 +1,380 @@
+/*
+ * bytecode.h
+ * The compiled form of statements
+ * The parser compiles every statement into code for a small stack machine and runs it from there.
+ * A statement of the program body runs as soon as all of it has been compiled, so a program still
+ * executes as it is read, but the body of a loop is compiled once and then runs as many times as
+ * the loop goes round without going back to the source. Procedures and functions are compiled once, when
+ * they are declared, and each call runs with a frame of its own on the value stack.
+ * Runtime errors are reported exactly as the parse functions used to report them: each instruction
+ * that can fail carries the line it was compiled on and the messages of every statement it was
+ * compiled inside of.
+*/
+
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "arrayops.h"
+#include "lex.h"
+#include "memo.h"
+#include "val.h"
+
+
+enum OpCode {
+	//Push consts[a]
+	OP_CONST,
+	//Push the value of slot a, failing if the variable was never assigned
+	OP_LOAD,
+	//Pop a value into slot a, whose variable has type b. Integers and reals are converted to the
+	//variable's type, any other mismatch fails
+	OP_STORE,
+	//Push a copy of the top of the stack
+	OP_DUP,
+	//OP_LOAD and OP_STORE for slot a of the running routine's frame
+	OP_LLOAD,
+	OP_LSTORE,
+
+	//Replace the index on top of the stack with that element of array a, failing if it is not an
+	//integer within the array's bounds
+	OP_INDEX,
+	//Pop a value and an index, and store the value as that element of array a. The value is converted
+	//to the type of the elements like OP_STORE does
+	OP_ISTORE,
+	//Assign the whole-array expression arrayExprs[b] to array a, popping its c scalar operands.
+	//Fails if the arrays involved differ in size, an operand has the wrong type for its operator,
+	//something is divided by zero, or the result does not fit the elements of a
+	OP_AEVAL,
+
+	//Binary operators, popping the right operand and replacing the left one with the result
+	OP_OR, OP_AND, OP_EQ, OP_LTHAN, OP_GTHAN,
+	OP_PLUS, OP_MINUS, OP_MULT, OP_DIV, OP_IDIV, OP_MOD,
+
+	//Pop and print a values, then a newline for OP_WRITELN
+	OP_WRITE, OP_WRITELN,
+	//Push a value of type a read from standard input, failing if there is none or it is not of that
+	//type. See input.h
+	OP_READ,
+	//Skip the rest of the input line
+	OP_READLN,
+	//Push whether there is no input left
+	OP_EOF,
+
+	//Continue at a
+	OP_JUMP,
+	//Pop a boolean and continue at a if it is false, failing if it is not a boolean
+	OP_JUMPF,
+	//Pop a boolean and continue at a if it is true, failing if it is not a boolean
+	OP_JUMPT,
+	//Pop two values and compare them like OP_EQ, OP_LTHAN and OP_GTHAN, continuing at a if the result
+	//is b (0 for false). The peephole pass (see peephole.h) makes these from a comparison and a branch
+	OP_JUMPEQ, OP_JUMPLT, OP_JUMPGT,
+	//Pop the final and initial values of a FOR loop over slot c into counter b, continuing at a if
+	//the loop does not run at all. Both must be integers. A negative c is slot -1 - c of the frame
+	OP_FORPREP,
+	//Step counter b and continue at a if it has not passed the final value yet
+	OP_FORNEXT,
+	//Pop the selector of a CASE statement and continue where caseTables[a] says it goes, failing if it
+	//is not of the type of the labels
+	OP_CASE,
+
+	//Call routine a with the b values on top of the stack as its arguments, each converted to the
+	//type of its parameter like OP_STORE does. c is 1 for a function, whose result replaces them.
+	//A memoized function that was called with the same arguments before isn't run again
+	OP_CALL,
+	//OP_CALL made just before the running routine returns. The call takes over the running routine's
+	//frame and returns straight to its caller, so a chain of these runs in constant memory
+	OP_TAILCALL,
+	//Return from the running routine. A function's result is in slot a of its frame, and it fails if
+	//it was never assigned. A memoized function remembers the result for its arguments
+	OP_RET,
+
+	//The register machine's instructions, see regvm.h. Their operands are registers (see RegKind),
+	//and site is the first of the stack machine's instructions in Code::origins that they do the work
+	//of, which are what a failure reports
+	//Copy register b to register a
+	OP_RMOVE,
+	//Apply a binary operator to registers b and c, putting the result in register a
+	OP_ROR, OP_RAND, OP_REQ, OP_RLTHAN, OP_RGTHAN,
+	OP_RPLUS, OP_RMINUS, OP_RMULT, OP_RDIV, OP_RIDIV, OP_RMOD,
+
+	OP_HALT
+};
+
+//What a register of the register machine is, in the low three bits of an operand, with its index above
+//them. A temporary is an entry of the value stack counted back from the top, 1 for the top, and the
+//temporaries an instruction reads are popped. A temporary it writes is pushed. RK_REG is one of the
+//machine's REGISTERS registers, which hold the results of operators that are operands of other
+//operators. A variable an instruction writes also has its type, as a Token counted from INTEGER, in
+//the two bits above the kind
+enum RegKind { RK_TEMP, RK_SLOT, RK_LOCAL, RK_CONST, RK_REG };
+
+//How many registers the register machine has. A result that can't have one stays on the value stack
+#define REGISTERS 16
+
+inline int RegOperand(RegKind kind, int index){
+	return index << 3 | kind;
+}
+
+inline int RegDest(RegKind kind, int index, int type){
+	return index << 5 | (type - INTEGER) << 3 | kind;
+}
+
+inline RegKind KindOf(int x){
+	return (RegKind)(x & 7);
+}
+
+//The index of an operand, and of one that is written
+inline int IndexOf(int x){
+	return x >> 3;
+}
+
+inline int DestIndexOf(int x){
+	return x >> 5;
+}
+
+//The type of a variable that is written
+inline int DestTypeOf(int x){
+	return INTEGER + ((x >> 3) & 3);
+}
+
+
+struct Instr {
+	OpCode op;
+	int a;
+	int b;
+	int c;
+	//The entry in Code::sites describing how a failure is reported, -1 if this can't fail
+	int site;
+	//The line this was compiled on
+	int line;
+};
+
+//What a failing instruction reports: its own message, then those of the expression it is part of,
+//which are count entries of Code::unwinds starting at first, and then those of each statement it
+//was compiled inside of, starting with Code::contexts[context]
+struct Site {
+	const char* msg;
+	int first;
+	int count;
+	int context;
+};
+
+//The message of a parse function that something was compiled inside of, and the one around it or -1
+struct Context {
+	const char* msg;
+	int outer;
+};
+
+//A step of a whole-array expression. They are in postfix order, each one pushing an operand or
+//replacing the top two with the result of an operator
+enum VecKind {
+	//The elements of array arg
+	VN_ARRAY,
+	//The scalar operand arg, which is the same for every element. Scalars are numbered in the order
+	//they appear, which is the order their code left them on the stack
+	VN_SCALAR,
+	//The binary operator arg, one of the binary opcodes
+	VN_OP
+};
+
+struct VecNode {
+	VecKind kind;
+	int arg;
+};
+
+//A whole-array expression: count entries of Code::vecNodes starting at first, with at most depth
+//operands pending at once
+struct ArrayExpr {
+	int first;
+	int count;
+	int depth;
+};
+
+//How OP_CASE finds the label that matches the selector
+enum CaseKind {
+	//Integer or boolean labels that cover at least half of the range between the smallest and the
+	//largest. Entry selector - low of the table is where it goes, the end of the statement or its
+	//ELSE if no label has that value
+	CK_DENSE,
+	//Integer labels spread too thin for that, which are searched for in sorted order
+	CK_SORTED,
+	//String labels, which have a perfect hash: no two of them hash to the same entry with the table's
+	//seed, so a selector can only be the label in its own entry
+	CK_STRING
+};
+
+//The labels of a CASE statement: count entries of Code::caseKeys and Code::caseTargets starting at
+//first. The keys are the labels for CK_SORTED, and the consts holding them for CK_STRING, -1 where
+//there is none. A key of CK_DENSE is unused
+struct CaseTable {
+	CaseKind kind;
+	//INTEGER, BOOLEAN or STRING, which the selector must be
+	Token type;
+	//The smallest label of CK_DENSE
+	int low;
+	//The seed of CK_STRING's hash, whose table has a power of two entries
+	uint32_t seed;
+	int first;
+	int count;
+	//Where a selector that matches no label goes
+	int otherwise;
+};
+
+//The hash of a CASE statement's string labels, see CK_STRING
+inline uint32_t CaseHash(const string& s, uint32_t seed){
+	uint32_t h = 2166136261u ^ seed;
+	for (unsigned char c : s){
+		h = (h ^ c) * 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+struct Code {
+	vector<Instr> code;
+	vector<Value> consts;
+	vector<Site> sites;
+	vector<const char*> unwinds;
+	vector<Context> contexts;
+	vector<VecNode> vecNodes;
+	vector<ArrayExpr> arrayExprs;
+	vector<CaseTable> caseTables;
+	vector<int> caseKeys;
+	vector<int> caseTargets;
+	//The code as it was compiled for the stack machine, once it has been fused for the register
+	//machine, empty until then
+	vector<Instr> origins;
+	//How deep the value stack gets, and how many FOR loop counters are live at once
+	int maxStack;
+	int counters;
+
+	Code() : maxStack(0), counters(0) {}
+
+	//Empties the code so that it can be compiled into again, keeping the memory it has
+	void Clear() {
+		code.clear();
+		consts.clear();
+		sites.clear();
+		unwinds.clear();
+		contexts.clear();
+		vecNodes.clear();
+		arrayExprs.clear();
+		caseTables.clear();
+		caseKeys.clear();
+		caseTargets.clear();
+		origins.clear();
+		maxStack = counters = 0;
+	}
+};
+
+
+//A procedure or function. Its frame holds its parameters, then a function's result, then its local
+//variables, and the stack it computes on comes after that
+struct Routine {
+	Code code;
+	//The types of its parameters, in order
+	vector<Token> params;
+	//The type of a function's result, PROCEDURE for a procedure
+	Token type;
+	//The frame slot of a function's result, -1 for a procedure
+	int result;
+	int frameSize;
+	//Whether all it does is compute from its parameters, see IsPure in parserInterp.cpp
+	bool pure;
+	//The results of earlier calls to a pure function, NULL if it isn't memoized
+	unique_ptr<MemoCache> memo;
+
+	Routine() : type(PROCEDURE), result(-1), frameSize(0), pure(false) {}
+};
+
+
+//The state of a running FOR loop. The counter is a plain int, only its slot holds a Value
+struct Counter {
+	int value;
+	int final;
+	//As in OP_FORPREP, negative for a slot of the frame
+	int slot;
+};
+
+//Where a running program is, in a form that can be saved and carried on from later (see
+//checkpoint.h). Routines are given as indexes, -1 for the code Run was given, and instructions as
+//offsets in their code. A call that hasn't returned is where it was made from and its frame and loop
+//counters, like Run keeps them
+struct SavedFrame {
+	int routine;
+	int call;
+	uint32_t fp;
+	uint32_t counters;
+};
+
+struct MachineState {
+	int routine;
+	//The instruction to run next
+	int pc;
+	uint32_t fp;
+	uint32_t cnt;
+	vector<SavedFrame> frames;
+	//Everything on the value stack, and every loop counter up to those of the running code
+	vector<Value> stack;
+	vector<Counter> counters;
+};
+
+//Runs code over the variable slots and arrays, calling the routines it calls. A runtime error is
+//reported along with the failures it causes in the statements around it and in each call that was
+//running, line is set to the line it was found on, or that of the outermost call it was found inside
+//of, and false is returned. Code that is running can't run other code
+extern bool Run(const Code& code, const vector<Routine>& routines, vector<Value>& slots, vector<Array>& arrays, int& line);
+
+//Makes room for code on the machine's stacks, which Run would otherwise do when it starts. The stacks
+//only grow from then on, for calls and whole-array expressions
+extern void Reserve(const Code& code);
+
+//The most a program can need of the machine at once: how deep the value stack gets, how many FOR
+//loop counters and calls are live, and the most steps and chunks of any whole-array expression
+struct MachineSize {
+	size_t stack;
+	size_t counters;
+	size_t frames;
+	int arraySteps;
+	int arrayChunks;
+};
+
+//Makes room for all of it, so that nothing a program runs ever has to grow the machine. False, making
+//no room at all, if the value stack would be deeper than calls are allowed to go
+extern bool Reserve(const MachineSize& size);
+
+//Runs code ahead of time over the variable slots, if all it does is compute from constants and
+//variables and store the results, as the initial value of a declaration does. Returns false if it
+//does anything else, or if it fails, in which case nothing is reported and the slots are left as
+//they were, and it has to run along with the rest of the program
+extern bool Fold(const Code& code, vector<Value>& slots);
+
+//Has Run call save every n times a loop goes round, just before it goes round again, with where the
+//program is. 0 stops it
+extern void CheckpointEvery(long n, void (*save)(const MachineState& state));
+
+//Has the next Run carry on from where state says, rather than from the start of its code. The state
+//must be one saved while that code ran
+extern void ResumeAt(const MachineState* state);
+
+//Reports what the instruction at pc reports when it fails, see Site, or msg in place of its own message,
+//and sets line to the line it was compiled on
+extern void Report(const Code& code, const Instr* pc, int& line, const char* msg);
+
+//Where the CASE statement at pc goes for the selector, -1 if it is not of the type of the labels
+extern int CaseTarget(const Code& code, const Instr* pc, const Value& sel);
+
+//Applies a binary opcode to two values as the machine does, giving an error if it fails on them
+extern Value Operate(int op, const Value& left, const Value& right);
+
+//Converts a value for a variable of the given type as OP_STORE does, false if that fails
+extern bool ConvertFor(Value& val, int type);
+
+
+#endif /* BYTECODE_H_ */
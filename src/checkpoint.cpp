@@ -0,0 +1,308 @@
+/*
+ * checkpoint.cpp
+ * Snapshots of running programs
+ */
+
+#include "checkpoint.h"
+#include "input.h"
+#include "parserInterp.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+//Marks a snapshot, and changes whenever the layout of one does
+static const uint32_t SNAPSHOT_MAGIC = 0x50334353;
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+//What is being checkpointed, set while RunCheckpointed runs
+static LoadedImage* program = NULL;
+static uint64_t programKey = 0;
+static size_t unit = 0;
+static string snapshotFile;
+//The snapshot is built here, kept from one to the next so that it only allocates when it grows
+static string snapshot;
+
+
+template <typename T>
+static void Put(const T& x){
+	snapshot.append((const char*)&x, sizeof(x));
+}
+
+//A vector of plain structs, copied as they are
+template <typename T>
+static void PutPod(const vector<T>& v){
+	Put((uint32_t)v.size());
+	snapshot.append((const char*)v.data(), v.size() * sizeof(T));
+}
+
+static void PutValue(const Value& val){
+	Put((uint32_t)val.GetType());
+	switch(val.GetType()){
+		case VINT:
+			Put(val.GetInt());
+			break;
+		case VREAL:
+			Put(val.GetReal());
+			break;
+		case VBOOL:
+			Put((uint8_t)val.GetBool());
+			break;
+		case VSTRING: {
+			const string& s = val.GetString();
+			Put((uint32_t)s.size());
+			snapshot += s;
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+//Writes a snapshot of where the program is, see CheckpointEvery. A snapshot that can't be written is
+//given up on, and the program goes on regardless
+static void Save(const MachineState& state){
+	//Whatever was printed up to here has to be in the file before how much there is can be known
+	cout.flush();
+	off_t out = lseek(1, 0, SEEK_CUR);
+
+	snapshot.clear();
+	Put(SNAPSHOT_MAGIC);
+	Put(SNAPSHOT_VERSION);
+	Put(programKey);
+	Put((uint32_t)unit);
+	Put((int64_t)out);
+	Put((int64_t)InputOffset());
+
+	Put((int32_t)state.routine);
+	Put((int32_t)state.pc);
+	Put(state.fp);
+	Put(state.cnt);
+	PutPod(state.frames);
+	PutPod(state.counters);
+	Put((uint32_t)state.stack.size());
+	for (const Value& val : state.stack){
+		PutValue(val);
+	}
+
+	Put((uint32_t)program->slots.size());
+	for (const Value& val : program->slots){
+		PutValue(val);
+	}
+	for (const Array& arr : program->arrays){
+		snapshot.append((const char*)arr.data, arr.Size() * ElemSize(arr.type));
+	}
+
+	//A single write of the whole of it, to a file that only takes the place of the last one once it
+	//is all there
+	string temp = snapshotFile + ".tmp";
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0){
+		return;
+	}
+	bool written = write(fd, snapshot.data(), snapshot.size()) == (ssize_t)snapshot.size();
+	close(fd);
+	if (!written || rename(temp.c_str(), snapshotFile.c_str()) != 0){
+		unlink(temp.c_str());
+	}
+}
+
+
+//Takes a snapshot apart again, failing rather than reading past its end
+class SnapshotReader {
+	const char* at;
+	const char* end;
+
+public:
+	bool ok;
+
+	SnapshotReader(const string& data) : at(data.data()), end(data.data() + data.size()), ok(true) {}
+
+	const char* Bytes(size_t n) {
+		if (!ok || n > (size_t)(end - at)){
+			ok = false;
+			return NULL;
+		}
+		const char* p = at;
+		at += n;
+		return p;
+	}
+
+	template <typename T>
+	T Get() {
+		T x = T();
+		const char* p = Bytes(sizeof(x));
+		if (p != NULL){
+			memcpy((void*)&x, p, sizeof(x));
+		}
+		return x;
+	}
+
+	template <typename T>
+	void Pod(vector<T>& v) {
+		uint32_t n = Get<uint32_t>();
+		const char* p = Bytes((size_t)n * sizeof(T));
+		if (p != NULL){
+			v.resize(n);
+			memcpy((void*)v.data(), p, (size_t)n * sizeof(T));
+		}
+	}
+
+	Value Val() {
+		switch(Get<uint32_t>()){
+			case VINT:
+				return Value(Get<int>());
+			case VREAL:
+				return Value(Get<double>());
+			case VBOOL:
+				return Value(Get<uint8_t>() != 0);
+			case VSTRING: {
+				uint32_t n = Get<uint32_t>();
+				const char* p = Bytes(n);
+				return p != NULL ? Value(string(p, n)) : Value();
+			}
+			case VERR:
+				return Value();
+			default:
+				ok = false;
+				return Value();
+		}
+	}
+
+	bool AtEnd() const { return ok && at == end; }
+};
+
+//Whether an instruction offset is in the code of routine, -1 for the unit's own
+static bool InCode(const LoadedImage& prog, const Code& own, int routine, int pc){
+	if (routine < -1 || routine >= (int)prog.routines.size()){
+		return false;
+	}
+	const Code& code = routine >= 0 ? prog.routines[routine].code : own;
+	return pc >= 0 && pc < (int)code.code.size();
+}
+
+//Reads the snapshot in file back into the program, setting first to the statement it was taken in
+//and state to where in it. Returns NULL if it did, or why it can't be restored
+static const char* Restore(const string& file, LoadedImage& prog, uint64_t key, size_t& first, MachineState& state){
+	ifstream f(file.c_str(), ios::binary);
+	if (!f.is_open()){
+		return "it can't be opened";
+	}
+	string data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+	SnapshotReader in(data);
+
+	if (in.Get<uint32_t>() != SNAPSHOT_MAGIC){
+		return "it isn't a snapshot";
+	}
+	if (in.Get<uint32_t>() != SNAPSHOT_VERSION){
+		return "it was taken by another version of the interpreter";
+	}
+	if (in.Get<uint64_t>() != key){
+		return "it was taken of another program";
+	}
+	first = in.Get<uint32_t>();
+	int64_t out = in.Get<int64_t>();
+	int64_t input = in.Get<int64_t>();
+
+	state.routine = in.Get<int32_t>();
+	state.pc = in.Get<int32_t>();
+	state.fp = in.Get<uint32_t>();
+	state.cnt = in.Get<uint32_t>();
+	in.Pod(state.frames);
+	in.Pod(state.counters);
+	state.stack.resize(in.Get<uint32_t>());
+	for (Value& val : state.stack){
+		val = in.Val();
+	}
+
+	if (in.Get<uint32_t>() != prog.slots.size()){
+		return "it is damaged";
+	}
+	for (Value& val : prog.slots){
+		val = in.Val();
+	}
+	for (Array& arr : prog.arrays){
+		size_t bytes = arr.Size() * ElemSize(arr.type);
+		const char* p = in.Bytes(bytes);
+		if (p != NULL){
+			memcpy(arr.data, p, bytes);
+		}
+	}
+
+	//Everything it points at has to be in the program, so that a damaged one can't send the machine
+	//off somewhere else
+	if (!in.AtEnd() || first >= prog.units.size()){
+		return "it is damaged";
+	}
+	const Code& own = prog.units[first].code;
+	bool fits = InCode(prog, own, state.routine, state.pc) && state.fp <= state.stack.size() && state.cnt <= state.counters.size();
+	for (const SavedFrame& frame : state.frames){
+		fits = fits && InCode(prog, own, frame.routine, frame.call) && frame.fp <= state.stack.size() && frame.counters <= state.counters.size();
+	}
+	if (!fits){
+		return "it is damaged";
+	}
+
+	if (input >= 0 && !SeekInput(input)){
+		return "standard input can't be read from where it was";
+	}
+	//Output appended to what the run that took the snapshot printed is cut back to where it was then,
+	//since whatever came after is printed again
+	struct stat st;
+	if (out >= 0 && fstat(1, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= out){
+		cout.flush();
+		if (ftruncate(1, out) == 0){
+			lseek(1, out, SEEK_SET);
+		}
+	}
+	return NULL;
+}
+
+
+int RunCheckpointed(LoadedImage& prog, uint64_t key, long every, const string& file, const string& from){
+	int before = ErrCount();
+	size_t first = 0;
+	MachineState state;
+
+	if (!from.empty()){
+		const char* why = Restore(from, prog, key, first, state);
+		if (why != NULL){
+			cerr << "CANNOT RESTORE FROM " << from << ", " << why << endl;
+			return -1;
+		}
+		ResumeAt(&state);
+	} else {
+		prog.slots = prog.initial;
+		for (Array& arr : prog.arrays){
+			memset(arr.data, 0, arr.Size() * ElemSize(arr.type));
+		}
+	}
+
+	program = &prog;
+	programKey = key;
+	snapshotFile = file;
+	CheckpointEvery(every, Save);
+	for (unit = first; unit < prog.units.size(); unit++){
+		int line = 0;
+		if (!Run(prog.units[unit].code, prog.routines, prog.slots, prog.arrays, line)){
+			ParseError(line, prog.units[unit].failure[0]);
+			ParseError(line, prog.units[unit].failure[1]);
+			break;
+		}
+	}
+	CheckpointEvery(0, NULL);
+	program = NULL;
+
+	//Once the program has ended there is nothing to carry on from
+	if (every > 0){
+		unlink(file.c_str());
+	}
+	return ErrCount() - before;
+}
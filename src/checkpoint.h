@@ -0,0 +1,37 @@
+/*
+ * checkpoint.h
+ * Saving a running program to a snapshot, and carrying on from one later
+ * A program run with checkpoints is compiled as a whole and runs from its image (see image.h). Every
+ * so many times a loop goes round, everything the program has got to is written to a snapshot file:
+ * which statement of the program body is running and where the machine is in it, the calls that
+ * haven't returned and everything on the stacks, the variables and the elements of every array, and
+ * how far into standard output and standard input it has got. The snapshot is built in memory and
+ * written with a single write, to a new file that then takes the old one's place, so a program that
+ * dies while one is being written still has the one before.
+ * A snapshot is tied to the program it was taken of, by a hash of its text, and to the layout of
+ * snapshots, by a version number. Restoring one carries on from exactly where it was taken. If
+ * standard output is the same file the first run wrote to, appended to, it is cut back to where it
+ * was at the snapshot, so that nothing is printed twice. The results kept for pure functions (see
+ * memo.h) aren't saved, they are only worked out again.
+*/
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+#include "image.h"
+
+
+//Runs a loaded program whose text has the key (see ImageKey), writing a snapshot of it to file every
+//time loops have gone round every times, or never if every is 0. If from isn't empty, the program
+//carries on from the snapshot in it rather than starting over. The file is removed once the program
+//has ended. Returns how many errors were reported, or -1 if the snapshot can't be restored, having
+//said why on standard error
+extern int RunCheckpointed(LoadedImage& prog, uint64_t key, long every, const string& file, const string& from);
+
+
+#endif /* CHECKPOINT_H_ */
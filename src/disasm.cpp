@@ -0,0 +1,191 @@
+/*
+ * disasm.cpp
+ * Listing compiled code
+ */
+
+#include "disasm.h"
+
+#include <cstdio>
+#include <sstream>
+
+using namespace std;
+
+
+static ostream* listing = NULL;
+
+void ListCodeTo(ostream* out){
+	listing = out;
+}
+
+ostream* CodeListing(){
+	return listing;
+}
+
+
+//The names of the opcodes, in the order they are declared in
+static const char* const opNames[] = {
+	"CONST", "LOAD", "STORE", "DUP", "LLOAD", "LSTORE",
+	"INDEX", "ISTORE", "AEVAL",
+	"OR", "AND", "EQ", "LTHAN", "GTHAN",
+	"PLUS", "MINUS", "MULT", "DIV", "IDIV", "MOD",
+	"WRITE", "WRITELN", "READ", "READLN", "EOF",
+	"JUMP", "JUMPF", "JUMPT", "JUMPEQ", "JUMPLT", "JUMPGT",
+	"FORPREP", "FORNEXT", "CASE",
+	"CALL", "TAILCALL", "RET",
+	"RMOVE",
+	"ROR", "RAND", "REQ", "RLTHAN", "RGTHAN",
+	"RPLUS", "RMINUS", "RMULT", "RDIV", "RIDIV", "RMOD",
+	"HALT"
+};
+
+static_assert(sizeof(opNames) / sizeof(opNames[0]) == OP_HALT + 1, "every opcode has a name");
+
+
+static const char* TypeName(int type){
+	switch(type){
+		case INTEGER: return "integer";
+		case REAL:    return "real";
+		case BOOLEAN: return "boolean";
+		case STRING:  return "string";
+		default:      return "?";
+	}
+}
+
+//The name of what number refers to, or the number itself with a prefix if it has none
+static string Name(const vector<string>& names, int number, const char* prefix){
+	if (number >= 0 && number < (int)names.size() && !names[number].empty()){
+		return names[number];
+	}
+	return prefix + to_string(number);
+}
+
+//A constant as it would be written in a program, with a real always having a point so that it can't
+//be taken for an integer
+static string Constant(const Value& val){
+	ostringstream s;
+	if (val.IsReal()){
+		s.precision(9);
+		s << val.GetReal();
+		string text = s.str();
+		if (text.find_first_of(".eni") == string::npos){
+			text += ".0";
+		}
+		return text;
+	}
+	if (val.IsString()){
+		s << '\'' << val << '\'';
+	} else {
+		s << val;
+	}
+	return s.str();
+}
+
+//A variable, the program's or the frame's
+static string Variable(const CodeNames& names, bool local, int slot){
+	return local ? Name(names.frame, slot, "local ") : Name(names.globals, slot, "slot ");
+}
+
+//An operand of the register machine, see RegKind. A temporary that an instruction writes is pushed
+static string Register(const Code& code, const CodeNames& names, int x, bool dest){
+	switch(KindOf(x)){
+		case RK_TEMP:
+			return dest ? "push" : "t" + to_string(IndexOf(x));
+		case RK_REG:
+			return "r" + to_string(IndexOf(x));
+		case RK_CONST:
+			return Constant(code.consts[IndexOf(x)]);
+		default:
+			return Variable(names, KindOf(x) == RK_LOCAL, dest ? DestIndexOf(x) : IndexOf(x));
+	}
+}
+
+//The operands of an instruction
+static string Operands(const Code& code, const Instr& in, const CodeNames& names){
+	switch(in.op){
+		case OP_CONST:
+			return Constant(code.consts[in.a]);
+
+		case OP_LOAD:
+		case OP_LLOAD:
+			return Variable(names, in.op == OP_LLOAD, in.a);
+
+		case OP_STORE:
+		case OP_LSTORE:
+			return Variable(names, in.op == OP_LSTORE, in.a) + " : " + TypeName(in.b);
+
+		case OP_INDEX:
+		case OP_ISTORE:
+			return Name(names.arrays, in.a, "array ");
+
+		case OP_AEVAL:
+			return Name(names.arrays, in.a, "array ") + " := expression " + to_string(in.b) + " of " + to_string(in.c) + " scalars";
+
+		case OP_WRITE:
+		case OP_WRITELN:
+			return to_string(in.a) + " values";
+
+		case OP_READ:
+			return TypeName(in.a);
+
+		case OP_JUMP:
+		case OP_JUMPF:
+		case OP_JUMPT:
+			return "-> " + to_string(in.a);
+
+		case OP_JUMPEQ:
+		case OP_JUMPLT:
+		case OP_JUMPGT:
+			return "-> " + to_string(in.a) + (in.b ? " if true" : " if false");
+
+		case OP_FORPREP:
+			return Variable(names, in.c < 0, in.c < 0 ? -1 - in.c : in.c) + " with counter " + to_string(in.b) + ", -> " + to_string(in.a) + " if it doesn't run";
+
+		case OP_FORNEXT:
+			return "counter " + to_string(in.b) + ", -> " + to_string(in.a) + " until it is done";
+
+		case OP_CASE: {
+			const CaseTable& table = code.caseTables[in.a];
+			string text = "table " + to_string(in.a) + ":";
+			for (int k = 0; k < table.count; k++){
+				int at = code.caseTargets[table.first + k];
+				if (at >= 0){
+					text += " " + to_string(at);
+				}
+			}
+			return text + ", otherwise -> " + to_string(table.otherwise);
+		}
+
+		case OP_CALL:
+		case OP_TAILCALL:
+			return Name(names.routines, in.a, "routine ") + ", " + to_string(in.b) + " arguments";
+
+		case OP_RET:
+			return in.a >= 0 ? Variable(names, true, in.a) : "";
+
+		case OP_RMOVE:
+			return Register(code, names, in.a, true) + " := " + Register(code, names, in.b, false);
+
+		case OP_ROR: case OP_RAND: case OP_REQ: case OP_RLTHAN: case OP_RGTHAN:
+		case OP_RPLUS: case OP_RMINUS: case OP_RMULT: case OP_RDIV: case OP_RIDIV: case OP_RMOD:
+			return Register(code, names, in.a, true) + " := " + Register(code, names, in.b, false) + ", "
+				+ Register(code, names, in.c, false);
+
+		default:
+			return "";
+	}
+}
+
+void Disassemble(ostream& out, const string& heading, const Code& code, const CodeNames& names){
+	out << "---- " << heading << " ----" << endl;
+	char buf[64];
+	for (size_t i = 0; i < code.code.size(); i++){
+		const Instr& in = code.code[i];
+		string operands = Operands(code, in, names);
+		if (operands.empty()){
+			snprintf(buf, sizeof(buf), "%5zu  line %-5d %s", i, in.line, opNames[in.op]);
+		} else {
+			snprintf(buf, sizeof(buf), "%5zu  line %-5d %-9s ", i, in.line, opNames[in.op]);
+		}
+		out << buf << operands << endl;
+	}
+}
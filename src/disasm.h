@@ -0,0 +1,41 @@
+/*
+ * disasm.h
+ * Listings of compiled code, for seeing what the optimizer (see opt.h and peephole.h) made of a program
+ * With listing on, each piece of code is printed once it has been compiled and optimized, just before
+ * it first runs: each statement of the program body and each declaration as it is read, each routine
+ * when its declaration ends, and all of a program compiled as a whole (see batch.h and image.h) once
+ * it has been. Every instruction is printed on a line of its own, with where it is in its code, the
+ * line of the source it was compiled from and its operands, with variables, arrays and routines
+ * given by name. Code fused for the register machine (see regvm.h) is printed as it runs there.
+*/
+
+#ifndef DISASM_H_
+#define DISASM_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "bytecode.h"
+
+
+//The names of what code refers to by number: the program's variables by slot, the slots of the frame
+//of the routine it belongs to, the arrays and the routines. Anything without a name is given by number
+struct CodeNames {
+	vector<string> globals;
+	vector<string> frame;
+	vector<string> arrays;
+	vector<string> routines;
+};
+
+//Where code is listed from now on, NULL for nowhere, which is where it goes unless told otherwise
+extern void ListCodeTo(ostream* out);
+extern ostream* CodeListing();
+
+//Prints a listing of code under a heading
+extern void Disassemble(ostream& out, const string& heading, const Code& code, const CodeNames& names);
+
+
+#endif /* DISASM_H_ */
@@ -0,0 +1,637 @@
+/*
+ * image.cpp
+ * Compiled program images and the machine-wide cache of them
+ */
+
+#include "image.h"
+#include "opt.h"
+#include "parserInterp.h"
+#include "regvm.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+
+
+//Changes whenever the layout of an image does
+static const uint32_t IMAGE_MAGIC = 0x50334933;
+
+//Marks a message that is NULL rather than a string
+static const uint32_t NO_TEXT = 0xFFFFFFFF;
+
+
+//Appends the parts of an image. Every message and string is written once, in a table at the start of
+//the image, and referred to by its index. Messages are string literals and string constants share
+//the interned text, so the same text is nearly always at the same address
+class ImageWriter {
+	string body;
+	string texts;
+	unordered_map<const char*, uint32_t> indexes;
+
+public:
+	void Bytes(const void* p, size_t n) {
+		body.append((const char*)p, n);
+	}
+
+	void U32(uint32_t x) {
+		Bytes(&x, sizeof(x));
+	}
+
+	//A vector of plain structs, copied as they are
+	template <typename T>
+	void Pod(const vector<T>& v) {
+		U32(v.size());
+		Bytes(v.data(), v.size() * sizeof(T));
+	}
+
+	void Text(const char* s) {
+		if (s == NULL){
+			U32(NO_TEXT);
+			return;
+		}
+		auto found = indexes.emplace(s, indexes.size());
+		if (found.second){
+			//With its terminating NUL, so that a loaded image can point at it
+			uint32_t n = strlen(s);
+			texts.append((const char*)&n, sizeof(n));
+			texts.append(s, n + 1);
+		}
+		U32(found.first->second);
+	}
+
+	//The table of texts followed by everything else
+	void Finish(string& image) {
+		uint32_t n = indexes.size();
+		image.append((const char*)&n, sizeof(n));
+		image += texts;
+		image += body;
+	}
+
+	void Const(const Value& val) {
+		U32(val.GetType());
+		switch(val.GetType()){
+			case VINT: {
+				int i = val.GetInt();
+				Bytes(&i, sizeof(i));
+				break;
+			}
+			case VREAL: {
+				double d = val.GetReal();
+				Bytes(&d, sizeof(d));
+				break;
+			}
+			case VBOOL:
+				U32(val.GetBool());
+				break;
+			case VSTRING:
+				Text(val.GetString().c_str());
+				break;
+			default:
+				break;
+		}
+	}
+
+	void CodeOf(const Code& code) {
+		Pod(code.code);
+		U32(code.consts.size());
+		for (const Value& val : code.consts){
+			Const(val);
+		}
+		U32(code.sites.size());
+		for (const Site& site : code.sites){
+			Text(site.msg);
+			U32(site.first);
+			U32(site.count);
+			U32(site.context);
+		}
+		U32(code.unwinds.size());
+		for (const char* msg : code.unwinds){
+			Text(msg);
+		}
+		U32(code.contexts.size());
+		for (const Context& context : code.contexts){
+			Text(context.msg);
+			U32(context.outer);
+		}
+		Pod(code.vecNodes);
+		Pod(code.arrayExprs);
+		Pod(code.caseTables);
+		Pod(code.caseKeys);
+		Pod(code.caseTargets);
+		U32(code.maxStack);
+		U32(code.counters);
+	}
+};
+
+//Takes an image apart again, failing rather than reading past its end
+class ImageReader {
+	const char* at;
+	const char* end;
+	vector<const char*> texts;
+
+public:
+	bool ok;
+
+	ImageReader(const char* data, size_t size) : at(data), end(data + size), ok(true) {}
+
+	const char* Bytes(size_t n) {
+		if (!ok || n > (size_t)(end - at)){
+			ok = false;
+			return NULL;
+		}
+		const char* p = at;
+		at += n;
+		return p;
+	}
+
+	uint32_t U32() {
+		uint32_t x = 0;
+		const char* p = Bytes(sizeof(x));
+		if (p != NULL){
+			memcpy(&x, p, sizeof(x));
+		}
+		return x;
+	}
+
+	template <typename T>
+	void Pod(vector<T>& v) {
+		uint32_t n = U32();
+		const char* p = Bytes((size_t)n * sizeof(T));
+		if (p != NULL){
+			v.resize(n);
+			//An empty vector's data() may be NULL, which memcpy mustn't be given even for nothing
+			if (n > 0){
+				memcpy((void*)v.data(), p, (size_t)n * sizeof(T));
+			}
+		}
+	}
+
+	//The table of texts at the start of the image, which are pointed at where they lie
+	void Texts() {
+		texts.resize(U32());
+		for (const char*& text : texts){
+			uint32_t n = U32();
+			text = Bytes((size_t)n + 1);
+			if (text == NULL || text[n] != '\0'){
+				ok = false;
+				return;
+			}
+		}
+	}
+
+	const char* Text() {
+		uint32_t i = U32();
+		if (i == NO_TEXT){
+			return NULL;
+		}
+		if (i >= texts.size()){
+			ok = false;
+			return "";
+		}
+		return texts[i];
+	}
+
+	Value Const() {
+		uint32_t type = U32();
+		switch(type){
+			case VINT: {
+				int i = 0;
+				const char* p = Bytes(sizeof(i));
+				if (p != NULL){
+					memcpy(&i, p, sizeof(i));
+				}
+				return Value(i);
+			}
+			case VREAL: {
+				double d = 0;
+				const char* p = Bytes(sizeof(d));
+				if (p != NULL){
+					memcpy(&d, p, sizeof(d));
+				}
+				return Value(d);
+			}
+			case VBOOL:
+				return Value(U32() != 0);
+			case VSTRING: {
+				//Interned again, just like the lexer would have, so that constants still compare by symbol
+				const char* s = Text();
+				return s != NULL ? Value(Rope(Intern(s, strlen(s)))) : Value();
+			}
+			default:
+				return Value();
+		}
+	}
+
+	void CodeOf(Code& code) {
+		Pod(code.code);
+		code.consts.resize(U32());
+		for (Value& val : code.consts){
+			val = Const();
+		}
+		code.sites.resize(U32());
+		for (Site& site : code.sites){
+			site.msg = Text();
+			site.first = U32();
+			site.count = U32();
+			site.context = U32();
+		}
+		code.unwinds.resize(U32());
+		for (const char*& msg : code.unwinds){
+			msg = Text();
+		}
+		code.contexts.resize(U32());
+		for (Context& context : code.contexts){
+			context.msg = Text();
+			context.outer = U32();
+		}
+		Pod(code.vecNodes);
+		Pod(code.arrayExprs);
+		Pod(code.caseTables);
+		Pod(code.caseKeys);
+		Pod(code.caseTargets);
+		code.maxStack = U32();
+		code.counters = U32();
+	}
+};
+
+
+void SaveImage(string& image, const vector<BatchUnit>& units, const vector<Routine>& routines, const vector<Value>& slots, const vector<Array>& arrays){
+	ImageWriter out;
+	out.U32(slots.size());
+	for (const Value& val : slots){
+		out.Const(val);
+	}
+
+	out.U32(arrays.size());
+	for (const Array& arr : arrays){
+		out.U32(arr.type);
+		out.U32(arr.lo);
+		out.U32(arr.hi);
+	}
+
+	out.U32(routines.size());
+	for (const Routine& routine : routines){
+		out.Pod(routine.params);
+		out.U32(routine.type);
+		out.U32(routine.result);
+		out.U32(routine.frameSize);
+		out.U32(routine.pure);
+		out.U32(routine.memo != NULL);
+		out.CodeOf(routine.code);
+	}
+
+	out.U32(units.size());
+	for (const BatchUnit& unit : units){
+		out.Text(unit.failure[0]);
+		out.Text(unit.failure[1]);
+		out.CodeOf(unit.code);
+	}
+
+	uint32_t magic = IMAGE_MAGIC;
+	image.assign((const char*)&magic, sizeof(magic));
+	out.Finish(image);
+}
+
+bool LoadImage(const char* data, size_t size, LoadedImage& prog){
+	ImageReader in(data, size);
+	if (in.U32() != IMAGE_MAGIC){
+		return false;
+	}
+	in.Texts();
+	prog.initial.resize(in.U32());
+	for (Value& val : prog.initial){
+		val = in.Const();
+	}
+	prog.slots = prog.initial;
+
+	prog.arrays.resize(in.U32());
+	for (Array& arr : prog.arrays){
+		arr.type = (ElemType)in.U32();
+		arr.lo = in.U32();
+		arr.hi = in.U32();
+		if (!in.ok || arr.hi < arr.lo){
+			return false;
+		}
+		//Laid out the way DeclareArray lays them out
+		arr.data = prog.memory.Alloc(arr.Size() * ElemSize(arr.type), 64);
+	}
+
+	prog.routines.resize(in.U32());
+	for (Routine& routine : prog.routines){
+		in.Pod(routine.params);
+		routine.type = (Token)in.U32();
+		routine.result = in.U32();
+		routine.frameSize = in.U32();
+		routine.pure = in.U32() != 0;
+		if (in.U32() != 0){
+			routine.memo.reset(new MemoCache(routine.params.size(), MemoSize()));
+		}
+		in.CodeOf(routine.code);
+	}
+
+	prog.units.resize(in.U32());
+	prog.failures.resize(prog.units.size() * 2);
+	for (size_t i = 0; i < prog.units.size() && in.ok; i++){
+		prog.failures[2 * i] = in.Text();
+		prog.failures[2 * i + 1] = in.Text();
+		prog.units[i].failure = &prog.failures[2 * i];
+		in.CodeOf(prog.units[i].code);
+		//So that the program can run without growing them
+		Reserve(prog.units[i].code);
+	}
+
+	//Images are always of code for the stack machine
+	if (in.ok && CurrentMachine() == VM_REGISTER){
+		for (Routine& routine : prog.routines){
+			FuseOperands(routine.code);
+		}
+		for (BatchUnit& unit : prog.units){
+			FuseOperands(unit.code);
+		}
+	}
+	return in.ok;
+}
+
+int RunImage(LoadedImage& prog){
+	int before = ErrCount();
+	prog.slots = prog.initial;
+	for (Array& arr : prog.arrays){
+		memset(arr.data, 0, arr.Size() * ElemSize(arr.type));
+	}
+
+	for (const BatchUnit& unit : prog.units){
+		int line = 0;
+		if (!Run(unit.code, prog.routines, prog.slots, prog.arrays, line)){
+			ParseError(line, unit.failure[0]);
+			ParseError(line, unit.failure[1]);
+			break;
+		}
+	}
+	return ErrCount() - before;
+}
+
+//64-bit FNV-1a
+static uint64_t Hash(const char* p, size_t n, uint64_t h = 14695981039346656037ull){
+	for (size_t i = 0; i < n; i++){
+		h = (h ^ (unsigned char)p[i]) * 1099511628211ull;
+	}
+	return h;
+}
+
+uint64_t ImageKey(const string& text){
+	uint64_t h = Hash(text.data(), text.size());
+	h = Hash((const char*)&IMAGE_MAGIC, sizeof(IMAGE_MAGIC), h);
+	//The same text compiles to different code without the optimizer
+	char optimized = OptimizerOn();
+	h = Hash(&optimized, 1, h);
+	return h != 0 ? h : 1;
+}
+
+
+//The size of the cache's table, a power of two, and how much room its images get. Shared memory is only
+//taken up as it is written, so the room costs nothing until it is used
+static const size_t CACHE_ENTRIES = 4096;
+static const size_t CACHE_DATA = (size_t)256 << 20;
+
+enum EntryState { ENTRY_BUILDING, ENTRY_READY, ENTRY_UNCACHEABLE, ENTRY_NOROOM };
+
+//The segment starts with this, then the table, then the images. Everything in it is found by offset,
+//since each process maps it wherever it likes
+struct ImageCache::Header {
+	//The build of the interpreter that made it, set before ready is
+	uint64_t build;
+	atomic<uint32_t> ready;
+	//How much of the room for images has been handed out
+	atomic<uint64_t> used;
+	//Ticks once for every lookup that finds or claims an entry, for telling which was used longest ago
+	atomic<uint64_t> clock;
+};
+
+//A program's image. Its key is 0 while the entry is free. Claiming it, whether it was free or is taken
+//over from another program, bumps its generation first, after which only the process that claimed it
+//writes to it. A reader checks that the generation didn't change while it read the entry
+struct ImageCache::Entry {
+	atomic<uint64_t> key;
+	atomic<uint32_t> state;
+	atomic<uint32_t> generation;
+	//The process compiling the image while it is ENTRY_BUILDING
+	atomic<int32_t> builder;
+	atomic<uint64_t> offset;
+	atomic<uint64_t> size;
+	//The header's clock when it was last found or claimed
+	atomic<uint64_t> touched;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "the cache is shared between processes");
+
+uint64_t BuildId(){
+	//Worked out once, from the executable's identity and when it was last written rather than all of
+	//its bytes, since every run of a cached program asks for it
+	static uint64_t id = 0;
+	if (id == 0){
+		struct stat st = {};
+		stat("/proc/self/exe", &st);
+		uint64_t parts[] = { IMAGE_MAGIC, (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+		                     (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+		id = Hash((const char*)parts, sizeof(parts));
+		id = id != 0 ? id : 1;
+	}
+	return id;
+}
+
+ImageCache::~ImageCache(){
+	if (header != NULL){
+		munmap(header, mapped);
+	}
+}
+
+bool ImageCache::Open(){
+	size_t size = sizeof(Header) + CACHE_ENTRIES * sizeof(Entry) + CACHE_DATA;
+	string name = "/prog3-images-" + to_string(getuid());
+	uint64_t build = BuildId();
+
+	//The first try may find a cache made by another build, which is thrown away for a new one
+	for (int attempt = 0; attempt < 2; attempt++){
+		bool made = true;
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST){
+			made = false;
+			fd = shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0){
+			return false;
+		}
+
+		struct stat st;
+		if (made && ftruncate(fd, size) != 0){
+			close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+		if (!made && (fstat(fd, &st) != 0 || (size_t)st.st_size != size)){
+			//Laid out by a build with a cache of another size
+			close(fd);
+			shm_unlink(name.c_str());
+			continue;
+		}
+
+		void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED){
+			return false;
+		}
+		header = (Header*)base;
+		entries = (Entry*)(header + 1);
+		data = (char*)(entries + CACHE_ENTRIES);
+		mapped = size;
+
+		//A new segment is all zeroes, which is an empty table
+		if (made){
+			header->build = build;
+			header->ready.store(1, memory_order_release);
+			return true;
+		}
+		bool ready = header->ready.load(memory_order_acquire) == 1;
+		if (ready && header->build == build){
+			return true;
+		}
+
+		munmap(header, mapped);
+		header = NULL;
+		//One that another process is still making can't be used yet, but one made by another build
+		//is replaced
+		if (!ready){
+			return false;
+		}
+		shm_unlink(name.c_str());
+	}
+	return false;
+}
+
+//Whether the process building an entry has gone without finishing it, having crashed or been killed
+static bool Abandoned(int32_t builder){
+	return builder > 0 && kill(builder, 0) != 0 && errno == ESRCH;
+}
+
+//Starts building an entry that is ours, whether it was free or has just been taken over
+void ImageCache::Build(Entry& e){
+	e.builder.store(getpid(), memory_order_relaxed);
+	e.touched.store(header->clock.fetch_add(1, memory_order_relaxed), memory_order_relaxed);
+	e.state.store(ENTRY_BUILDING, memory_order_release);
+}
+
+bool ImageCache::TakeOver(int entry, uint32_t generation, uint64_t key){
+	Entry& e = entries[entry];
+	if (!e.generation.compare_exchange_strong(generation, generation + 1, memory_order_acq_rel)){
+		return false;
+	}
+	Build(e);
+	e.key.store(key, memory_order_release);
+	return true;
+}
+
+CacheResult ImageCache::Find(uint64_t key, const char*& found, size_t& size, int& entry){
+	if (header == NULL){
+		return CACHE_BUSY;
+	}
+
+	for (size_t i = 0; i < CACHE_ENTRIES; i++){
+		int at = (key + i) & (CACHE_ENTRIES - 1);
+		Entry& e = entries[at];
+		uint32_t generation = e.generation.load(memory_order_acquire);
+		uint64_t k = e.key.load(memory_order_acquire);
+		if (k == 0){
+			//A free entry is ENTRY_BUILDING with no builder, which nobody takes over
+			if (e.key.compare_exchange_strong(k, key, memory_order_acq_rel)){
+				Build(e);
+				entry = at;
+				return CACHE_CLAIMED;
+			}
+			//Someone else claimed it first, k is now what they claimed it for
+		}
+		if (k != key){
+			continue;
+		}
+
+		uint32_t state = e.state.load(memory_order_acquire);
+		if (state == ENTRY_READY){
+			found = data + e.offset.load(memory_order_relaxed);
+			size = e.size.load(memory_order_relaxed);
+		}
+		int32_t builder = e.builder.load(memory_order_relaxed);
+		//Taken over by another program while it was being read
+		atomic_thread_fence(memory_order_acquire);
+		if (e.generation.load(memory_order_relaxed) != generation){
+			return CACHE_BUSY;
+		}
+
+		switch(state){
+			case ENTRY_READY:
+				e.touched.store(header->clock.fetch_add(1, memory_order_relaxed), memory_order_relaxed);
+				return CACHE_HIT;
+			case ENTRY_UNCACHEABLE:
+				return CACHE_UNCACHEABLE;
+			case ENTRY_BUILDING:
+				//Whoever was compiling it is gone, so it is compiled again here
+				if (Abandoned(builder) && TakeOver(at, generation, key)){
+					entry = at;
+					return CACHE_CLAIMED;
+				}
+				return CACHE_BUSY;
+			default:
+				return CACHE_BUSY;
+		}
+	}
+
+	//The table is full and the program isn't in it, so it takes the place of the one used longest ago.
+	//An image is never moved or written over, so a process still running one that is evicted goes on
+	//reading it where it is; only its entry is used again
+	int victim = -1;
+	uint32_t victimGeneration = 0;
+	uint64_t oldest = UINT64_MAX;
+	for (size_t i = 0; i < CACHE_ENTRIES; i++){
+		Entry& e = entries[i];
+		uint32_t generation = e.generation.load(memory_order_acquire);
+		if (e.state.load(memory_order_acquire) == ENTRY_BUILDING && !Abandoned(e.builder.load(memory_order_relaxed))){
+			continue;
+		}
+		uint64_t touched = e.touched.load(memory_order_relaxed);
+		if (touched < oldest){
+			oldest = touched;
+			victim = i;
+			victimGeneration = generation;
+		}
+	}
+	if (victim >= 0 && TakeOver(victim, victimGeneration, key)){
+		entry = victim;
+		return CACHE_CLAIMED;
+	}
+	return CACHE_BUSY;
+}
+
+void ImageCache::Publish(int entry, const string& image){
+	Entry& e = entries[entry];
+	//Aligned so that images can be read in place
+	uint64_t room = (image.size() + 63) & ~(uint64_t)63;
+	uint64_t offset = header->used.fetch_add(room, memory_order_relaxed);
+	if (offset + room > CACHE_DATA){
+		e.state.store(ENTRY_NOROOM, memory_order_release);
+		return;
+	}
+	memcpy(data + offset, image.data(), image.size());
+	e.offset.store(offset, memory_order_relaxed);
+	e.size.store(image.size(), memory_order_relaxed);
+	e.state.store(ENTRY_READY, memory_order_release);
+}
+
+void ImageCache::Refuse(int entry){
+	entries[entry].state.store(ENTRY_UNCACHEABLE, memory_order_release);
+}
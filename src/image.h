@@ -0,0 +1,112 @@
+/*
+ * image.h
+ * Compiled programs saved as images, and a cache of them shared by every process on the machine
+ * An image is everything a program needs to run once it has been compiled as a whole (see batch.h):
+ * the code of its declarations, statements and routines, the initial values of its variables and
+ * which arrays it has. Declarations that only compute from constants and variables declared before
+ * them are run as the program is compiled, and rather than their code, the image holds the values they
+ * give, so that a program starts out with all of them in place at the cost of a single copy. It is one block of bytes with no pointers in it, so it can be kept in shared memory and run by
+ * any process without lexing, parsing or compiling the program again. The messages a failure reports
+ * are kept in the image too, and a loaded image points at them where they lie.
+ * The cache is a POSIX shared memory segment holding a table of images keyed by a hash of the
+ * program's text, so that each program is compiled once per machine rather than once per process. It
+ * is tied to the build of the interpreter that made it: a different build starts it over. An entry
+ * whose compiling process died before it was done is compiled again by the next process to look it
+ * up, and once the table is full a new program takes the entry that was used longest ago.
+*/
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "arena.h"
+#include "batch.h"
+#include "bytecode.h"
+#include "val.h"
+
+
+//Writes the image of a compiled program to image, whose variables start out with the values in slots
+extern void SaveImage(string& image, const vector<BatchUnit>& units, const vector<Routine>& routines, const vector<Value>& slots, const vector<Array>& arrays);
+
+//A program loaded from an image, which must outlive it
+struct LoadedImage {
+	vector<BatchUnit> units;
+	vector<Routine> routines;
+	vector<Value> slots;
+	//What the variables start out with each time the program runs
+	vector<Value> initial;
+	vector<Array> arrays;
+	//Where the units' failure messages point, two for each of them
+	vector<const char*> failures;
+	Arena memory;
+};
+
+//Loads an image, false if it is not one that SaveImage wrote
+extern bool LoadImage(const char* data, size_t size, LoadedImage& prog);
+
+//Runs a loaded program from the start, just as Prog would have run it, and returns how many errors
+//it reported
+extern int RunImage(LoadedImage& prog);
+
+//The hash a program's text is cached under, never 0. It depends on whether the optimizer is on as well
+extern uint64_t ImageKey(const string& text);
+
+//Identifies the build of the interpreter by its own executable: which file it is, its size and when it
+//was written
+extern uint64_t BuildId();
+
+
+//What ImageCache::Find found
+enum CacheResult {
+	//The image is there
+	CACHE_HIT,
+	//It is not, and the caller is to compile it and Publish or Refuse it
+	CACHE_CLAIMED,
+	//The program doesn't compile as a whole, and has to run as it is read
+	CACHE_UNCACHEABLE,
+	//Another process is compiling it, or it can't be kept. The caller compiles it for itself
+	CACHE_BUSY
+};
+
+class ImageCache {
+	struct Header;
+	struct Entry;
+
+	Header* header;
+	Entry* entries;
+	char* data;
+	size_t mapped;
+
+	void Build(Entry& e);
+	//Claims an entry for another key, as long as nobody else has since the generation was read
+	bool TakeOver(int entry, uint32_t generation, uint64_t key);
+
+public:
+	ImageCache() : header(NULL), entries(NULL), data(NULL), mapped(0) {}
+	~ImageCache();
+
+	ImageCache(const ImageCache&) = delete;
+	ImageCache& operator=(const ImageCache&) = delete;
+
+	//Maps the machine's cache, making it if there isn't one yet or it was made by another build. False
+	//if it can't be used, in which case every Find is CACHE_BUSY
+	bool Open();
+
+	//Looks up the image of a program. For CACHE_HIT, data and size are set to where it is, and for
+	//CACHE_CLAIMED, entry is what to Publish or Refuse
+	CacheResult Find(uint64_t key, const char*& data, size_t& size, int& entry);
+
+	//Keeps the image of a claimed program, if there is room for it
+	void Publish(int entry, const string& image);
+	//Marks a claimed program as one that doesn't compile as a whole
+	void Refuse(int entry);
+};
+
+
+#endif /* IMAGE_H_ */
@@ -0,0 +1,229 @@
+/*
+ * input.cpp
+ * Standard input for readln and eof
+ */
+
+#include "input.h"
+
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <strings.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+//How much input is held at once. A number or boolean must fit in this, a string may be longer
+static const size_t BLOCK = 1 << 20;
+
+static char* block = NULL;
+//The unread input is [pos, len) of the block
+static size_t pos = 0;
+static size_t len = 0;
+//Set once the file descriptor has no more to give
+static bool ended = false;
+//Set once the program has asked for any input at all
+static bool used = false;
+
+
+//Moves what is left to the front of the block and reads more after it. False if nothing more could be
+//read, because the input has ended or the block is full
+static bool Fill(){
+	used = true;
+	if (ended){
+		return false;
+	}
+	ReserveInput();
+
+	memmove(block, block + pos, len - pos);
+	len -= pos;
+	pos = 0;
+	if (len == BLOCK){
+		return false;
+	}
+
+	//Whatever the program printed before it asks for input, such as a prompt, should be seen first
+	cout.flush();
+
+	ssize_t n;
+	do {
+		n = read(0, block + len, BLOCK - len);
+	} while (n < 0 && errno == EINTR);
+
+	if (n <= 0){
+		ended = true;
+		return false;
+	}
+	len += n;
+	return true;
+}
+
+//Skips whitespace, line ends included. False if the input ends first
+static bool SkipSpace(){
+	for(;;){
+		while (pos < len && isspace((unsigned char)block[pos])){
+			pos++;
+		}
+		if (pos < len){
+			return true;
+		}
+		if (!Fill()){
+			return false;
+		}
+	}
+}
+
+//Finds the end of the whitespace-separated word at pos, reading more if it runs to the end of the
+//block. False if the word doesn't fit in a block
+static bool Word(size_t& end){
+	end = pos;
+	for(;;){
+		while (end < len && !isspace((unsigned char)block[end])){
+			end++;
+		}
+		if (end < len || ended){
+			return true;
+		}
+
+		size_t at = end - pos;
+		if (!Fill()){
+			end = pos + at;
+			return ended;
+		}
+		end = pos + at;
+	}
+}
+
+
+bool InputEof(){
+	return pos == len && !Fill();
+}
+
+bool ReadInput(Token type, Value& val){
+	//A string is the rest of the line, which may be empty and may not fit in one block
+	if (type == STRING){
+		if (InputEof()){
+			return false;
+		}
+
+		string s;
+		for(;;){
+			const char* start = block + pos;
+			const char* nl = (const char*)memchr(start, '\n', len - pos);
+			if (nl != NULL){
+				s.append(start, nl - start);
+				pos = nl - block;
+				break;
+			}
+			s.append(start, len - pos);
+			pos = len;
+			if (!Fill()){
+				break;
+			}
+		}
+		if (!s.empty() && s.back() == '\r'){
+			s.pop_back();
+		}
+		val = Value(s);
+		return true;
+	}
+
+	size_t end;
+	if (!SkipSpace() || !Word(end)){
+		return false;
+	}
+
+	const char* first = block + pos;
+	const char* last = block + end;
+	pos = end;
+
+	switch(type){
+		case INTEGER: {
+			int i;
+			//from_chars takes a minus sign but not a plus
+			if (last - first > 1 && *first == '+' && *(first + 1) != '-'){
+				first++;
+			}
+			from_chars_result r = from_chars(first, last, i);
+			if (r.ec != errc() || r.ptr != last){
+				return false;
+			}
+			val = Value(i);
+			return true;
+		}
+
+		case REAL: {
+			double d;
+			if (last - first > 1 && *first == '+' && *(first + 1) != '-'){
+				first++;
+			}
+			//from_chars also takes inf and nan, which aren't numbers the language can write
+			from_chars_result r = from_chars(first, last, d);
+			if (r.ec != errc() || r.ptr != last || !isfinite(d)){
+				return false;
+			}
+			val = Value(d);
+			return true;
+		}
+
+		case BOOLEAN:
+			if (last - first == 4 && strncasecmp(first, "true", 4) == 0){
+				val = Value(true);
+				return true;
+			}
+			if (last - first == 5 && strncasecmp(first, "false", 5) == 0){
+				val = Value(false);
+				return true;
+			}
+			return false;
+
+		default:
+			return false;
+	}
+}
+
+void SkipInputLine(){
+	while (!InputEof()){
+		const char* nl = (const char*)memchr(block + pos, '\n', len - pos);
+		if (nl != NULL){
+			pos = nl - block + 1;
+			return;
+		}
+		pos = len;
+	}
+}
+
+void ReserveInput(){
+	if (block == NULL){
+		block = new char[BLOCK];
+	}
+}
+
+bool InputUsed(){
+	return used;
+}
+
+long long InputOffset(){
+	if (block == NULL){
+		return -1;
+	}
+	off_t at = lseek(0, 0, SEEK_CUR);
+	if (at < 0){
+		return -1;
+	}
+	//What has been read into the block but not used yet doesn't count
+	return (long long)at - (long long)(len - pos);
+}
+
+bool SeekInput(long long offset){
+	if (lseek(0, offset, SEEK_SET) < 0){
+		return false;
+	}
+	pos = len = 0;
+	ended = false;
+	return true;
+}
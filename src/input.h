@@ -0,0 +1,44 @@
+/*
+ * input.h
+ * Standard input for readln and eof
+ * Input is read straight from the file descriptor in large blocks and values are parsed where they
+ * lie in the block with from_chars, without going through iostream extraction. Only one block is ever
+ * held, so a program can stream through any amount of input in constant memory.
+ * Numbers and booleans are separated by whitespace, including line ends, and a string is the rest of
+ * the line it starts on.
+*/
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include "lex.h"
+#include "val.h"
+
+using namespace std;
+
+
+//Whether there is no input left
+extern bool InputEof();
+
+//Reads the next value of the given type, INTEGER, REAL, BOOLEAN or STRING. Returns false if the input
+//ran out first, which InputEof tells apart, or if what was there is not a value of that type
+extern bool ReadInput(Token type, Value& val);
+
+//Skips the rest of the line, along with the line end
+extern void SkipInputLine();
+
+//Allocates the block input is read into, which the first read would otherwise do
+extern void ReserveInput();
+
+//Whether the program has read any input or asked whether there is any left, since what it did next
+//could depend on it
+extern bool InputUsed();
+
+//How far into standard input the program has read, -1 if it hasn't read any or it is not a file that
+//can be sought in
+extern long long InputOffset();
+//Carries on reading from that far into standard input, false if it can't
+extern bool SeekInput(long long offset);
+
+
+#endif /* INPUT_H_ */
@@ -3,54 +3,33 @@
  * Lexical Analyzer for Simple Pascal-Like Language
  */
 
-#include <cctype>
 #include <map>
 
 using std::map;
 using namespace std;
 
 #include "lex.h"
+#include "scanbuf.h"
+#include "stats.h"
 //Keywords or reserved words mapping
+//The reserved words are the first symbols interned, so their IDs index straight into this table
+static const Token kwTokens[SYM_PREDEFINED] = {
+	IDENT,
+	WRITELN, WRITE, IF, ELSE, THEN, IDIV, MOD,
+	AND, OR, NOT, BCONST, BCONST, INTEGER, REAL,
+	STRING, BOOLEAN, BEGIN, END, VAR, PROGRAM,
+	WHILE, DO, FOR, TO, ARRAY, OF, PROCEDURE, FUNCTION, CASE, READLN,
+	//eof is a builtin function rather than a reserved word, so it may be declared as something else
+	IDENT
+};
+
 LexItem id_or_kw(const string& lexeme , int linenum)
 {
-	map<string,Token> kwmap = {
-		{ "writeln", WRITELN},
-		{ "write", WRITE},
-		{ "if", IF },
-		{ "else", ELSE },
-		{ "then", THEN },
-		{ "div", IDIV },
-		{ "mod", MOD },
-		{ "and", AND },
-		{ "or", OR },
-		{ "not", NOT },
-		{ "true", TRUE },
-		{ "false", FALSE },
-		{ "integer", INTEGER },
-		{ "real", REAL },
-		{ "string", STRING },
-		{ "boolean", BOOLEAN },
-		{ "begin", BEGIN },
-		{ "end", END },
-		{ "var", VAR },
-		{ "program", PROGRAM }
-	};
-	Token tt ;
-	//cout << "inside id_or_kw " << lexeme << endl;
-	if(lexeme == "true" || lexeme == "false")
-	{
-		tt= BCONST;
-	}	
-	else
-	{
-		tt = IDENT;
-		auto kIt = kwmap.find(lexeme);
-		if( kIt != kwmap.end() )
-		{
-			tt = kIt->second;
-		}
-	}	
-	return LexItem(tt, lexeme, linenum);
+	SymbolId sym = Intern(lexeme);
+	Token tt = IDENT;
+	if( sym < SYM_PREDEFINED )
+		tt = kwTokens[sym];
+	return LexItem(tt, sym, linenum);
 }
 
 map<Token,string> tokenPrint = {
@@ -74,6 +53,16 @@ map<Token,string> tokenPrint = {
 		{ TRUE, "TRUE" },
 		{ FALSE, "FALSE" },
 		{ THEN, "THEN" },
+		{ WHILE, "WHILE" },
+		{ DO, "DO" },
+		{ FOR, "FOR" },
+		{ TO, "TO" },
+		{ ARRAY, "ARRAY" },
+		{ OF, "OF" },
+		{ PROCEDURE, "PROCEDURE" },
+		{ FUNCTION, "FUNCTION" },
+		{ CASE, "CASE" },
+		{ READLN, "READLN" },
 		
 			
 		{ PLUS, "PLUS" },
@@ -94,8 +83,11 @@ map<Token,string> tokenPrint = {
 		{ COMMA, "COMMA" },
 		{ LPAREN, "LPAREN" },
 		{ RPAREN, "RPAREN" },
+		{ LBRACKET, "LBRACKET" },
+		{ RBRACKET, "RBRACKET" },
 		{ SEMICOL, "SEMICOL" },
 		{ DOT, "DOT" },
+		{ DOTDOT, "DOTDOT" },
 		{ COLON, "COLON" },
 		{ ERR, "ERR" },
 
@@ -112,198 +104,285 @@ ostream& operator<<(ostream& out, const LexItem& tok) {
 	return out;
 }
 
-LexItem getNextToken(istream& in, int& linenum)
+//The lexer is a DFA driven by two tables that are built at compile time. Every input byte is first
+//mapped to a character class, and the current state and that class give the next state
+enum CharClass : unsigned char {
+	CC_OTHER, CC_SPACE, CC_NEWLINE, CC_ALPHA, CC_DIGIT, CC_IDEXTRA, CC_QUOTE, CC_LBRACE, CC_RBRACE,
+	CC_DOT, CC_COLON, CC_EQ, CC_PLUS, CC_MINUS, CC_MULT, CC_DIV, CC_LPAREN, CC_RPAREN,
+	CC_LBRACKET, CC_RBRACKET, CC_SEMICOL, CC_COMMA, CC_GTHAN, CC_LTHAN,
+	CC_COUNT
+};
+
+enum LexState : unsigned char {
+	//Between tokens, and inside a comment
+	S_START, S_COMMENTOPEN, S_COMMENT,
+	//Identifiers and numbers. S_INTDOT is an integer followed by a '.', S_REALDOT a real followed by a second '.'
+	//and S_INTRANGE an integer followed by '..', as in the bounds 1..10
+	S_ID, S_INT, S_INTDOT, S_REAL, S_REALDOT, S_INTRANGE,
+	//String constants, closed by a quote or broken off by a newline
+	S_STRING, S_STREND, S_STRNL,
+	//Operators and delimiters
+	S_COLON, S_ASSOP, S_PLUS, S_MINUS, S_MULT, S_DIV, S_EQ, S_LPAREN, S_RPAREN,
+	S_LBRACKET, S_RBRACKET, S_SEMICOL, S_COMMA, S_GTHAN, S_LTHAN, S_DOT, S_DOTDOT,
+	//Any character that can't start a token
+	S_BAD,
+	S_COUNT,
+	//No transition, the token ends before the current character
+	S_STOP = 0xFF
+};
+
+//What each state means to the lexer
+struct StateInfo {
+	//The token for a lexeme that ends in this state
+	Token accept;
+	//What to return if the input ends in this state. Partly read identifiers, numbers and strings
+	//are dropped, as they always have been
+	Token atEof;
+	//Whether the character that leads into this state is part of the lexeme
+	bool keep;
+	//Whether a newline read in this state counts towards the line number
+	bool countLines;
+};
+
+static constexpr StateInfo stateInfo[S_COUNT] = {
+	/* S_START       */ { DONE,    DONE,   false, true  },
+	/* S_COMMENTOPEN */ { DONE,    DONE,   false, false },
+	/* S_COMMENT     */ { DONE,    DONE,   false, true  },
+	/* S_ID          */ { IDENT,   DONE,   true,  false },
+	/* S_INT         */ { ICONST,  DONE,   true,  false },
+	/* S_INTDOT      */ { RCONST,  RCONST, true,  false },
+	/* S_REAL        */ { RCONST,  DONE,   true,  false },
+	/* S_REALDOT     */ { ERR,     ERR,    true,  false },
+	/* S_INTRANGE    */ { ICONST,  ICONST, true,  false },
+	/* S_STRING      */ { DONE,    DONE,   true,  false },
+	/* S_STREND      */ { SCONST,  SCONST, true,  false },
+	/* S_STRNL       */ { ERR,     ERR,    false, false },
+	/* S_COLON       */ { COLON,   COLON,  true,  false },
+	/* S_ASSOP       */ { ASSOP,   ASSOP,  true,  false },
+	/* S_PLUS        */ { PLUS,    PLUS,   true,  false },
+	/* S_MINUS       */ { MINUS,   MINUS,  true,  false },
+	/* S_MULT        */ { MULT,    MULT,   true,  false },
+	/* S_DIV         */ { DIV,     DIV,    true,  false },
+	/* S_EQ          */ { EQ,      EQ,     true,  false },
+	/* S_LPAREN      */ { LPAREN,  LPAREN, true,  false },
+	/* S_RPAREN      */ { RPAREN,  RPAREN, true,  false },
+	/* S_LBRACKET    */ { LBRACKET,LBRACKET,true, false },
+	/* S_RBRACKET    */ { RBRACKET,RBRACKET,true, false },
+	/* S_SEMICOL     */ { SEMICOL, SEMICOL,true,  false },
+	/* S_COMMA       */ { COMMA,   COMMA,  true,  false },
+	/* S_GTHAN       */ { GTHAN,   GTHAN,  true,  false },
+	/* S_LTHAN       */ { LTHAN,   LTHAN,  true,  false },
+	/* S_DOT         */ { DOT,     DOT,    true,  false },
+	/* S_DOTDOT      */ { DOTDOT,  DOTDOT, true,  false },
+	/* S_BAD         */ { ERR,     ERR,    true,  false },
+};
+
+struct LexTables {
+	unsigned char charClass[256];
+	unsigned char next[S_COUNT][CC_COUNT];
+	//A state with no way out ends its token as soon as it is entered, without looking any further
+	bool final[S_COUNT];
+};
+
+static constexpr LexTables BuildLexTables(){
+	LexTables t = {};
+
+	//Character classes. isspace, isalpha and isdigit in the "C" locale
+	for( int c = 0; c < 256; c++ )
+		t.charClass[c] = CC_OTHER;
+	for( int c = 'a'; c <= 'z'; c++ )
+		t.charClass[c] = CC_ALPHA;
+	for( int c = 'A'; c <= 'Z'; c++ )
+		t.charClass[c] = CC_ALPHA;
+	for( int c = '0'; c <= '9'; c++ )
+		t.charClass[c] = CC_DIGIT;
+	t.charClass[(int)' '] = t.charClass[(int)'\t'] = t.charClass[(int)'\v'] = CC_SPACE;
+	t.charClass[(int)'\f'] = t.charClass[(int)'\r'] = CC_SPACE;
+	t.charClass[(int)'\n'] = CC_NEWLINE;
+	t.charClass[(int)'_'] = t.charClass[(int)'$'] = CC_IDEXTRA;
+	t.charClass[(int)'\''] = CC_QUOTE;
+	t.charClass[(int)'{'] = CC_LBRACE;
+	t.charClass[(int)'}'] = CC_RBRACE;
+	t.charClass[(int)'.'] = CC_DOT;
+	t.charClass[(int)':'] = CC_COLON;
+	t.charClass[(int)'='] = CC_EQ;
+	t.charClass[(int)'+'] = CC_PLUS;
+	t.charClass[(int)'-'] = CC_MINUS;
+	t.charClass[(int)'*'] = CC_MULT;
+	t.charClass[(int)'/'] = CC_DIV;
+	t.charClass[(int)'('] = CC_LPAREN;
+	t.charClass[(int)')'] = CC_RPAREN;
+	t.charClass[(int)'['] = CC_LBRACKET;
+	t.charClass[(int)']'] = CC_RBRACKET;
+	t.charClass[(int)';'] = CC_SEMICOL;
+	t.charClass[(int)','] = CC_COMMA;
+	t.charClass[(int)'>'] = CC_GTHAN;
+	t.charClass[(int)'<'] = CC_LTHAN;
+
+	for( int s = 0; s < S_COUNT; s++ )
+		for( int c = 0; c < CC_COUNT; c++ )
+			t.next[s][c] = S_STOP;
+
+	//Between tokens, whitespace is skipped and every other character starts something
+	for( int c = 0; c < CC_COUNT; c++ )
+		t.next[S_START][c] = S_BAD;
+	t.next[S_START][CC_SPACE] = S_START;
+	t.next[S_START][CC_NEWLINE] = S_START;
+	t.next[S_START][CC_ALPHA] = S_ID;
+	t.next[S_START][CC_DIGIT] = S_INT;
+	t.next[S_START][CC_QUOTE] = S_STRING;
+	t.next[S_START][CC_LBRACE] = S_COMMENTOPEN;
+	t.next[S_START][CC_DOT] = S_DOT;
+	t.next[S_START][CC_COLON] = S_COLON;
+	t.next[S_START][CC_EQ] = S_EQ;
+	t.next[S_START][CC_PLUS] = S_PLUS;
+	t.next[S_START][CC_MINUS] = S_MINUS;
+	t.next[S_START][CC_MULT] = S_MULT;
+	t.next[S_START][CC_DIV] = S_DIV;
+	t.next[S_START][CC_LPAREN] = S_LPAREN;
+	t.next[S_START][CC_RPAREN] = S_RPAREN;
+	t.next[S_START][CC_LBRACKET] = S_LBRACKET;
+	t.next[S_START][CC_RBRACKET] = S_RBRACKET;
+	t.next[S_START][CC_SEMICOL] = S_SEMICOL;
+	t.next[S_START][CC_COMMA] = S_COMMA;
+	t.next[S_START][CC_GTHAN] = S_GTHAN;
+	t.next[S_START][CC_LTHAN] = S_LTHAN;
+
+	//The character right after the { is taken without being looked at, even a } or a newline
+	for( int c = 0; c < CC_COUNT; c++ ){
+		t.next[S_COMMENTOPEN][c] = S_COMMENT;
+		t.next[S_COMMENT][c] = S_COMMENT;
+	}
+	t.next[S_COMMENT][CC_RBRACE] = S_START;
+
+	t.next[S_ID][CC_ALPHA] = S_ID;
+	t.next[S_ID][CC_DIGIT] = S_ID;
+	t.next[S_ID][CC_IDEXTRA] = S_ID;
+
+	//2 is an integer, 2. and 2.3 are reals, and a second '.' as in 2.3. is an error
+	//2.. is the integer 2 followed by a '..'
+	t.next[S_INT][CC_DIGIT] = S_INT;
+	t.next[S_INT][CC_DOT] = S_INTDOT;
+	t.next[S_INTDOT][CC_DIGIT] = S_REAL;
+	t.next[S_INTDOT][CC_DOT] = S_INTRANGE;
+	t.next[S_REAL][CC_DIGIT] = S_REAL;
+	t.next[S_REAL][CC_DOT] = S_REALDOT;
+
+	for( int c = 0; c < CC_COUNT; c++ )
+		t.next[S_STRING][c] = S_STRING;
+	t.next[S_STRING][CC_QUOTE] = S_STREND;
+	t.next[S_STRING][CC_NEWLINE] = S_STRNL;
+
+	t.next[S_COLON][CC_EQ] = S_ASSOP;
+	t.next[S_DOT][CC_DOT] = S_DOTDOT;
+
+	for( int s = 0; s < S_COUNT; s++ ){
+		t.final[s] = true;
+		for( int c = 0; c < CC_COUNT; c++ )
+			if( t.next[s][c] != S_STOP )
+				t.final[s] = false;
+	}
+	return t;
+}
+
+static constexpr LexTables lexTables = BuildLexTables();
+
+static_assert(lexTables.final[S_PLUS] && lexTables.final[S_ASSOP] && lexTables.final[S_REALDOT], "operators end at once");
+static_assert(!lexTables.final[S_COLON] && !lexTables.final[S_INTDOT], "':' and '2.' need one character of lookahead");
+static_assert(lexTables.final[S_INTRANGE] && lexTables.final[S_DOTDOT], "'2..' and '..' end at once");
+
+
+//An integer that ran into a '..' has read the '..' as well, which is then the next token. It is
+//per thread, like the lexer that read it
+static thread_local bool pendingRange = false;
+
+
+//Makes the token for a lexeme that ended in the given state
+static LexItem Accept(Token tt, string& lexeme, int linenum)
 {
-	enum TokState { START, INID, INSTRING, ININT, INREAL, INCOMMENT } 
-	lexstate = START;
-	string lexeme;
-	char ch, nextchar;
-	Token tt;
-	bool decimal = false;
-	       
-	
-    while(in.get(ch)) {
-    	
-		switch( lexstate ) {
-		case START:
-			if( ch == '\n' ){
-				linenum++;
-				
-			}	
-                
-			if( isspace(ch) )
-				continue;
-
-			lexeme = ch;
-
-			if( isalpha(ch) ) {
-				lexeme = ch;
-				lexstate = INID;
-				//cout << "in ID " << endl;
-			}
-			else if( ch == '\'' ) {
-				lexstate = INSTRING;
-				
-			}
-			
-			else if( isdigit(ch) ) {
-				lexstate = ININT;
-			}
-			else if( ch == '{' ) {
-				//lexeme += ch;
-				lexstate = INCOMMENT;
-				in.get(ch);
-			}				
-			else {
-				tt = ERR;
-				switch( ch ) {
-				case '+':
-					tt = PLUS;
-                    break;  
-					
-				case '-':
-					tt = MINUS;
-                    break; 
-					
-				case '*':
-								
-					tt = MULT;
-					break;
-
-				case '/':
-					tt = DIV;
-					break;
-									
-				case ':':
-					tt = COLON;
-					nextchar = in.peek();
-					if(nextchar == '='){
-						in.get(ch);
-						lexeme += ch;
-						tt = ASSOP;
-						break;
-					}
-					//error
-					break;
-				
-				case '=':
-					tt = EQ;
-					break;
-				case '(':
-					tt = LPAREN;
-					break;			
-				case ')':
-					tt = RPAREN;
-					break;
-				
-				case ';':
-					tt = SEMICOL;
-					break;
-					
-				case ',':
-					tt = COMMA;
-					break;
-					
-				case '>':
-					tt = GTHAN;
-					break;
-				
-				case '<':
-					tt = LTHAN;
-					break;
-					
-				case '.':
-					tt = DOT;
-					break;
-				
-				}
-				return LexItem(tt, lexeme, linenum);
-			}
-			break;	
+	if( tt == ICONST && lexeme.back() == '.' ) {
+		lexeme.resize(lexeme.size() - 2);
+		pendingRange = true;
+	}
+	if( tt == IDENT )
+		return id_or_kw(lexeme, linenum);
+	if( tt == SCONST )
+		return LexItem(SCONST, Intern(lexeme.data() + 1, lexeme.length() - 2), linenum);
+	return LexItem(tt, lexeme, linenum);
+}
 
-		case INID:
-			if( isalpha(ch) || isdigit(ch) || ch == '_' || ch == '$') {
-		
-				lexeme += ch;
-			}
-			else {
-				in.putback(ch);
 
-				return id_or_kw(lexeme, linenum);
-				
-			}
-			break;
-					
-		case INSTRING:
-                          
-			if( ch == '\n' ) {
-				return LexItem(ERR, lexeme, linenum);
-			}
-			lexeme += ch;
-			if( ch == '\'' ) {
-				lexeme = lexeme.substr(1, lexeme.length()-2);
-				return LexItem(SCONST, lexeme, linenum);
-			}
-			break;
+//The lexer itself, getNextToken wraps it with instrumentation
+static LexItem lexToken(istream& in, int& linenum)
+{
+	Stats::Counters& st = Stats::Local();
+	if( pendingRange ) {
+		pendingRange = false;
+		return LexItem(DOTDOT, "..", linenum);
+	}
+	streambuf* sb = in.rdbuf();
+	if( sb == NULL || (!in.good() && !in.eof()) )
+		return LexItem(ERR, "some strange I/O error", linenum);
 
-		case ININT:
-			if( isdigit(ch) ) {
-				lexeme += ch;
-			}
-			else if(ch == '.') {
-				lexstate = INREAL;
-				in.putback(ch);
-			}
-			else {
-				in.putback(ch);
-				return LexItem(ICONST, lexeme, linenum);
-			}
-			break;
-		
-		case INREAL:
-				
-			if( ch == '.' && isdigit(in.peek()) && !decimal) {
-				lexeme += ch; decimal = true;
-				
-			}
-			else if(ch == '.' && !isdigit(in.peek()) && !decimal){
-				lexeme += ch;
-				
-				return LexItem(RCONST, lexeme, linenum);
-			}
-			else if(isdigit(ch) && decimal){
-				lexeme += ch;
-			}
-			
-			else if(ch == '.' && decimal){
-				lexeme += ch;
-				return LexItem(ERR, lexeme, linenum);
-			}
-			else {
-				in.putback(ch);
-				return LexItem(RCONST, lexeme, linenum);
-			}
-			
-			break;
-		
-					
-		case INCOMMENT:
-			if(ch == '\n') 
-				linenum++;
-				
-			else if( ch == '}' ) {
-               	//in.get(ch);
-				lexstate = START;
+	//Reading through a ScanBuf lets whole runs of whitespace, comments and strings be skipped at once
+	ScanBuf* scan = dynamic_cast<ScanBuf*>(sb);
+	unsigned char state = S_START;
+	//Kept from one token to the next, so that a long lexeme only allocates the first time
+	static thread_local string lexeme;
+	lexeme.clear();
+
+	for(;;) {
+		if( scan != NULL ) {
+			const char* p = scan->Cur();
+			size_t n = 0;
+			if( state == S_START )
+				n = ScanSpace(p, scan->End(), linenum);
+			else if( state == S_COMMENT )
+				n = ScanComment(p, scan->End(), linenum);
+			else if( state == S_STRING ) {
+				n = ScanString(p, scan->End());
+				lexeme.append(p, n);
 			}
-					
-			break;
-			
-		
+			scan->Skip(n);
+			st.charsRead += n;
 		}
-	}//end of while loop
-	
-	if( in.eof() )
-		return LexItem(DONE, "", linenum);
-		
-	return LexItem(ERR, "some strange I/O error", linenum);
-}
\ No newline at end of file
+
+		int ch = sb->sgetc();
+		if( ch == streambuf::traits_type::eof() ) {
+			in.setstate(ios::eofbit | ios::failbit);
+			Token tt = stateInfo[state].atEof;
+			if( tt == DONE )
+				return LexItem(DONE, "", linenum);
+			return Accept(tt, lexeme, linenum);
+		}
+
+		unsigned char next = lexTables.next[state][lexTables.charClass[ch]];
+		if( next == S_STOP )
+			return Accept(stateInfo[state].accept, lexeme, linenum);
+
+		sb->sbumpc();
+		st.charsRead++;
+		if( ch == '\n' && stateInfo[state].countLines )
+			linenum++;
+		if( stateInfo[next].keep )
+			lexeme += (char)ch;
+		state = next;
+
+		if( lexTables.final[state] )
+			return Accept(stateInfo[state].accept, lexeme, linenum);
+	}
+}
+
+
+void resetLexer()
+{
+	pendingRange = false;
+}
+
+LexItem getNextToken(istream& in, int& linenum)
+{
+	Stats::PhaseTimer timer(PH_LEX);
+	LexItem tok = lexToken(in, linenum);
+	Stats::Local().tokens[tok.GetToken()]++;
+	return tok;
+}
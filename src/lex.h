@@ -10,12 +10,15 @@
 #include <map>
 using namespace std;
 
+#include "symtab.h"
+
 
 //Definition of all the possible token types
 enum Token {
 	// keywords OR RESERVED WORDS
 	IF, ELSE, WRITELN, WRITE, INTEGER, REAL,
 	BOOLEAN, STRING, BEGIN, END, VAR, THEN, PROGRAM,
+	WHILE, DO, FOR, TO, ARRAY, OF, PROCEDURE, FUNCTION, CASE, READLN,
 
 	// identifiers
 	IDENT, TRUE, FALSE,
@@ -27,7 +30,7 @@ enum Token {
 	PLUS, MINUS, MULT, DIV, IDIV, MOD, ASSOP, EQ, 
 	GTHAN, LTHAN, AND, OR, NOT, 
 	//Delimiters
-	COMMA, SEMICOL, LPAREN, RPAREN, DOT, COLON,
+	COMMA, SEMICOL, LPAREN, RPAREN, LBRACKET, RBRACKET, DOT, DOTDOT, COLON,
 	// any error returns this token
 	ERR,
 
@@ -37,19 +40,34 @@ enum Token {
 
 
 //Class definition of LexItem
+//Names, strings, reserved words and operators are kept as their interned symbol, so they are cheap to
+//copy and compare. Numeric constants and error messages are kept as text instead: there can be any
+//number of different ones, and the interning table never lets go of anything
 class LexItem {
 	Token	token;
-	string	lexeme;
+	SymbolId	sym;
 	int	lnum;
+	string	text;
 
 public:
 	LexItem() {
 		token = ERR;
+		sym = SYM_EMPTY;
 		lnum = -1;
 	}
-	LexItem(Token token, string lexeme, int line) {
+	LexItem(Token token, const string& lexeme, int line) {
+		this->token = token;
+		this->lnum = line;
+		if (token == ICONST || token == RCONST || token == ERR) {
+			this->sym = SYM_EMPTY;
+			this->text = lexeme;
+		}
+		else
+			this->sym = Intern(lexeme);
+	}
+	LexItem(Token token, SymbolId sym, int line) {
 		this->token = token;
-		this->lexeme = lexeme;
+		this->sym = sym;
 		this->lnum = line;
 	}
 
@@ -57,7 +75,8 @@ public:
 	bool operator!=(const Token token) const { return this->token != token; }
 
 	Token	GetToken() const { return token; }
-	string	GetLexeme() const { return lexeme; }
+	const string&	GetLexeme() const { return sym == SYM_EMPTY ? text : SymbolName(sym); }
+	SymbolId	GetSymbol() const { return sym; }
 	int	GetLinenum() const { return lnum; }
 };
 
@@ -66,6 +85,8 @@ public:
 extern ostream& operator<<(ostream& out, const LexItem& tok);
 extern LexItem id_or_kw(const string& lexeme, int linenum);
 extern LexItem getNextToken(istream& in, int& linenum);
+//Forgets anything the lexer read ahead of the last token, before lexing another input
+extern void resetLexer();
 
 
 #endif /* LEX_H_ */
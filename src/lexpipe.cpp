@@ -0,0 +1,63 @@
+/*
+ * lexpipe.cpp
+ * The lexer thread and the parser's side of the token pipeline
+ */
+
+#include "lexpipe.h"
+
+using namespace std;
+
+//How many times to spin on an empty or full ring before giving up the time slice
+#define SPIN_LIMIT 256
+
+
+LexPipeline::LexPipeline(istream& in, int line, size_t capacity) : ring(capacity), finished(false) {
+	lexer = thread(&LexPipeline::Produce, this, ref(in), line);
+}
+
+
+LexPipeline::~LexPipeline(){
+	//Tell the lexer to stop in case it is waiting on a full ring
+	ring.Close();
+	lexer.join();
+}
+
+
+//Runs on the lexer thread until the end of the input, an I/O error, or the ring is closed
+void LexPipeline::Produce(istream& in, int line){
+	for(;;){
+		LexItem tok = getNextToken(in, line);
+		bool final = (tok == DONE) || (tok == ERR && in.fail());
+		Entry e = { move(tok), line, final };
+
+		int spins = 0;
+		while (!ring.TryPush(move(e))){
+			if (ring.IsClosed()){
+				return;
+			}
+			if (++spins > SPIN_LIMIT){
+				this_thread::yield();
+			}
+		}
+
+		if (final){
+			return;
+		}
+	}
+}
+
+
+LexItem LexPipeline::Next(int& line){
+	if (!finished){
+		int spins = 0;
+		while (!ring.TryPop(last)){
+			if (++spins > SPIN_LIMIT){
+				this_thread::yield();
+			}
+		}
+		finished = last.final;
+	}
+
+	line = last.line;
+	return last.tok;
+}
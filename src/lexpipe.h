@@ -0,0 +1,50 @@
+/*
+ * lexpipe.h
+ * Pipelined lexing: a dedicated thread runs getNextToken over the input and hands the
+ * tokens to the parser through a bounded ring, so that reading and lexing overlap with
+ * parsing and execution. Memory stays bounded by the ring no matter how large the input is.
+*/
+
+#ifndef LEXPIPE_H_
+#define LEXPIPE_H_
+
+#include <iostream>
+#include <thread>
+
+#include "lex.h"
+#include "spscring.h"
+
+using namespace std;
+
+
+class LexPipeline {
+	//A token along with the lexer's line number right after reading it
+	//The final token is DONE, or the ERR that getNextToken returns when the stream breaks
+	struct Entry {
+		LexItem tok;
+		int line;
+		bool final;
+	};
+
+	SpscRing<Entry> ring;
+	thread lexer;
+
+	//Once the final token has been taken it is handed out again on every call,
+	//exactly like getNextToken keeps returning DONE at the end of the stream
+	bool finished;
+	Entry last;
+
+	void Produce(istream& in, int line);
+
+public:
+	//Starts lexing in from the given line number on a new thread
+	LexPipeline(istream& in, int line, size_t capacity = 4096);
+	//Stops the lexer thread, even if the parser did not read everything
+	~LexPipeline();
+
+	//Consumer side of getNextToken, updating line just as the lexer would have
+	LexItem Next(int& line);
+};
+
+
+#endif /* LEXPIPE_H_ */
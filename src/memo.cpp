@@ -0,0 +1,197 @@
+/*
+ * memo.cpp
+ * Result caches for pure functions
+ */
+
+#include "memo.h"
+#include "stats.h"
+
+#include <cstring>
+#include <functional>
+
+using namespace std;
+
+
+//Mixes the bits of x so that nearby values land far apart in the table
+static inline uint64_t Mix(uint64_t x){
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+//Arguments that are the same hash alike
+static uint64_t HashValue(const Value& val){
+	uint64_t bits = 0;
+	switch(val.GetType()){
+		case VINT:
+			bits = (uint64_t)(int64_t)val.GetInt();
+			break;
+
+		case VREAL: {
+			//By its bits, since 0.0 and -0.0 print differently and so are different arguments
+			double d = val.GetReal();
+			memcpy(&bits, &d, sizeof(bits));
+			break;
+		}
+
+		case VBOOL:
+			bits = val.GetBool();
+			break;
+
+		case VSTRING:
+			bits = hash<string>()(val.GetString());
+			break;
+
+		default:
+			break;
+	}
+	return Mix(bits + (uint64_t)val.GetType());
+}
+
+static bool SameValue(const Value& a, const Value& b){
+	if (a.GetType() != b.GetType()){
+		return false;
+	}
+	switch(a.GetType()){
+		case VINT:
+			return a.GetInt() == b.GetInt();
+
+		case VREAL: {
+			double x = a.GetReal();
+			double y = b.GetReal();
+			return memcmp(&x, &y, sizeof(x)) == 0;
+		}
+
+		case VBOOL:
+			return a.GetBool() == b.GetBool();
+
+		case VSTRING:
+			return a.GetString() == b.GetString();
+
+		default:
+			return false;
+	}
+}
+
+static uint64_t HashArgs(const Value* args, int n){
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < n; i++){
+		h = Mix(h ^ HashValue(args[i]));
+	}
+	//0 marks an empty slot
+	return h | 1;
+}
+
+
+MemoCache::MemoCache(int params, size_t capacity) : params(params), capacity(capacity), count(0), hand(0) {
+	size_t slots = 16;
+	while (slots < 2 * capacity){
+		slots *= 2;
+	}
+	mask = slots - 1;
+	hashes.assign(slots, 0);
+	referenced.assign(slots, 0);
+	keys.resize(slots * params);
+	results.resize(slots);
+}
+
+bool MemoCache::Matches(size_t slot, const Value* args) const {
+	const Value* key = &keys[slot * params];
+	for (int i = 0; i < params; i++){
+		if (!SameValue(key[i], args[i])){
+			return false;
+		}
+	}
+	return true;
+}
+
+const Value* MemoCache::Find(const Value* args){
+	//A tail recursion that hasn't returned yet looks up every step, and none of them can be here
+	if (count == 0){
+		Stats::Local().memoMisses++;
+		return NULL;
+	}
+
+	uint64_t h = HashArgs(args, params);
+	for (size_t slot = h & mask; hashes[slot] != 0; slot = (slot + 1) & mask){
+		if (hashes[slot] == h && Matches(slot, args)){
+			referenced[slot] = 1;
+			Stats::Local().memoHits++;
+			return &results[slot];
+		}
+	}
+	Stats::Local().memoMisses++;
+	return NULL;
+}
+
+void MemoCache::Remove(size_t slot){
+	//Backward shift: an entry further along the run can take the empty slot if the slot is between
+	//its home and where it is now, otherwise probing for it would stop at the hole
+	size_t hole = slot;
+	for (size_t next = (hole + 1) & mask; hashes[next] != 0; next = (next + 1) & mask){
+		size_t home = hashes[next] & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask)){
+			hashes[hole] = hashes[next];
+			referenced[hole] = referenced[next];
+			for (int i = 0; i < params; i++){
+				keys[hole * params + i] = move(keys[next * params + i]);
+			}
+			results[hole] = move(results[next]);
+			hole = next;
+		}
+	}
+	hashes[hole] = 0;
+	referenced[hole] = 0;
+	for (int i = 0; i < params; i++){
+		keys[hole * params + i] = Value();
+	}
+	results[hole] = Value();
+	count--;
+}
+
+void MemoCache::Insert(const Value* args, const Value& result){
+	if (capacity == 0){
+		return;
+	}
+
+	uint64_t h = HashArgs(args, params);
+	size_t slot = h & mask;
+	for (; hashes[slot] != 0; slot = (slot + 1) & mask){
+		if (hashes[slot] == h && Matches(slot, args)){
+			results[slot] = result;
+			return;
+		}
+	}
+
+	if (count == capacity){
+		//Go round the table, giving every result that was used a second chance
+		for (;;){
+			hand = (hand + 1) & mask;
+			if (hashes[hand] == 0){
+				continue;
+			}
+			if (referenced[hand]){
+				referenced[hand] = 0;
+				continue;
+			}
+			break;
+		}
+		Remove(hand);
+		Stats::Local().memoEvictions++;
+
+		//That may have moved the end of the run these arguments go in
+		for (slot = h & mask; hashes[slot] != 0; slot = (slot + 1) & mask){
+		}
+	}
+
+	hashes[slot] = h;
+	referenced[slot] = 0;
+	for (int i = 0; i < params; i++){
+		keys[slot * params + i] = args[i];
+	}
+	results[slot] = result;
+	count++;
+}
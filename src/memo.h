@@ -0,0 +1,54 @@
+/*
+ * memo.h
+ * Result caches for pure functions
+ * A function that does nothing but compute its result from its parameters gives the same result every
+ * time it is called with the same arguments, so a call can be answered from the results of earlier
+ * ones instead of being run again. Each cache holds a bounded number of results in an open addressing
+ * table. Once it is full, the CLOCK policy picks what to replace: a result that was used since the
+ * hand last came past it is given another round, and the first one that wasn't goes.
+*/
+
+#ifndef MEMO_H_
+#define MEMO_H_
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+#include "val.h"
+
+
+class MemoCache {
+	//How many arguments a key has, and how many results are kept at most
+	int params;
+	size_t capacity;
+	size_t count;
+	//The table has a power of two slots, at least twice the capacity so that probe runs stay short
+	size_t mask;
+	//Where the CLOCK hand is
+	size_t hand;
+
+	//Per slot: the hash of its arguments, which is never 0 so that 0 can mean the slot is empty,
+	//whether it was used since the hand came past it, its params arguments and its result
+	vector<uint64_t> hashes;
+	vector<unsigned char> referenced;
+	vector<Value> keys;
+	vector<Value> results;
+
+	bool Matches(size_t slot, const Value* args) const;
+	//Empties a slot, moving up the entries after it that would no longer be found otherwise
+	void Remove(size_t slot);
+
+public:
+	//A cache for a function of params parameters, keeping at most capacity results
+	MemoCache(int params, size_t capacity);
+
+	//The result of an earlier call with these arguments, NULL if there is none
+	const Value* Find(const Value* args);
+	//Remembers the result of a call with these arguments, making room for it if the cache is full
+	void Insert(const Value* args, const Value& result);
+};
+
+
+#endif /* MEMO_H_ */
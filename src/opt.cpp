@@ -0,0 +1,1249 @@
+/*
+ * opt.cpp
+ * The SSA form of compiled code, and the passes that optimize it
+ * Nothing here allocates once it has seen code as big as what it is given, since every statement of
+ * the program body is optimized as it is read (see tests/allocs.cpp)
+ */
+
+#include "opt.h"
+
+#include <cstring>
+
+using namespace std;
+
+
+static bool optimizing = true;
+
+void UseOptimizer(bool on){
+	optimizing = on;
+}
+
+bool OptimizerOn(){
+	return optimizing;
+}
+
+//What the passes have done to all the code optimized so far
+static struct {
+	uint64_t pieces;
+	uint64_t skipped;
+	uint64_t before;
+	uint64_t after;
+	uint64_t values;
+	uint64_t repeated;
+	uint64_t folded;
+	uint64_t common;
+	uint64_t commonInstrs;
+	uint64_t copies;
+	uint64_t dead;
+	uint64_t deadInstrs;
+	uint64_t kept;
+} counts;
+
+//Code whose blocks times variables come to more than this is left as it is
+static const size_t MAX_STATE = (size_t)1 << 22;
+//How many times dead stores are looked for, since taking one out can leave another with no reader
+static const int DEAD_ROUNDS = 4;
+
+
+//A variable the code uses: a slot of the program's variables, or of the frame for a local one
+struct Var {
+	bool local;
+	int slot;
+	Token type;
+};
+
+static vector<Var> vars;
+//The variable of each slot, -1 for one the code doesn't use
+static vector<int> globalVar;
+static vector<int> localVar;
+//Whether the code calls a routine, which may read and assign any of the program's variables
+static bool calls;
+
+
+enum ValueKind {
+	//Entry constant of constants
+	SV_CONST,
+	//What variable op holds when the code starts
+	SV_ENTRY,
+	//What variable op holds when control gets to block left, where it may come in holding different values
+	SV_PHI,
+	//Binary operator op applied to values left and right
+	SV_OP,
+	//Value left converted for a variable of type op, as a store does
+	SV_CONVERT,
+	//Something the code can't tell, such as what is read from input. No two of them are the same value
+	SV_UNKNOWN
+};
+
+struct SsaValue {
+	ValueKind kind;
+	int op;
+	int left;
+	int right;
+	//What type it has, ERR if that can't be told
+	Token type;
+	//The first variable found holding it, -1 for none
+	int home;
+	//The const of the code that holds it, -1 if there is none yet
+	int index;
+	uint64_t hash;
+	int constant;
+};
+
+//Every value of the code, numbered by where they are, and a hash table of them so that the same value
+//is only numbered once
+static vector<SsaValue> values;
+static vector<Value> constants;
+static vector<int> table;
+static size_t tableMask;
+//Whether numbering is counted in counts, which it only is once for each piece of code
+static bool counting;
+//A run of instructions that control only comes into at the first and leaves from the last
+
+//A run of instructions that ends a block, or starts one, and the instructions control can go to
+struct Block {
+	int first;
+	int last;
+	//The last instruction of the loop this is the head of, -1 if it is not one
+	int loopEnd;
+};
+
+static vector<Block> blocks;
+//The block each instruction starts, -1 if it doesn't start one
+static vector<int> blockAt;
+//The blocks each block goes on to and comes from, succs[succFirst[b]] on
+static vector<int> succs;
+static vector<int> succFirst;
+static vector<int> preds;
+static vector<int> predFirst;
+//The OP_FORPREP of each OP_FORNEXT, whose variable it steps
+static vector<int> forOf;
+static vector<int> targets;
+
+
+//A value on the stack, pushed by the instructions from start on. It is pure if they do nothing but compute
+//from constants and variables, checked if the variables they load are sure to have values, and safe if
+//nothing they do can fail. A shared value has been copied by OP_DUP, which the copy still needs
+struct Entry {
+	int value;
+	int start;
+	bool pure;
+	bool checked;
+	bool safe;
+	bool shared;
+};
+
+//A change to the code: the instructions from first to last are replaced with one instruction, or taken
+//out. A constant pushed in their place is value, which may not be one of the code's consts yet
+enum EditKind { EDIT_COMMON, EDIT_COPY, EDIT_DEAD };
+
+struct Edit {
+	int first;
+	int last;
+	EditKind kind;
+	Instr with;
+	int value;
+};
+
+//A store of the code, whose value is pushed by the instructions from start on. It is removable if
+//neither it nor they can fail and nothing else needs the value
+struct Store {
+	int at;
+	int start;
+	bool removable;
+};
+
+static vector<Entry> stack;
+static vector<Edit> edits;
+static vector<Store> stores;
+//What each variable holds, and whether it is sure to have a value, where the walk through the code is
+static vector<int> content;
+static vector<char> assigned;
+//The same at the end of each block, for each variable
+static vector<int> endContent;
+static vector<char> endAssigned;
+static vector<char> modified;
+
+
+//Which variables may be read at the start of each block, as bits, and which stores store what nothing reads
+static size_t words;
+static vector<uint64_t> liveIn;
+static vector<uint64_t> live;
+static vector<uint64_t> globalMask;
+static vector<uint64_t> haltMask;
+static vector<char> deadAt;
+
+
+static Token TypeOf(const Value& val){
+	switch(val.GetType()){
+		case VINT:    return INTEGER;
+		case VREAL:   return REAL;
+		case VSTRING: return STRING;
+		case VBOOL:   return BOOLEAN;
+		default:      return ERR;
+	}
+}
+
+static bool Numeric(Token type){
+	return type == INTEGER || type == REAL;
+}
+
+//The type of what a binary operator gives for operands of these types, ERR if it fails on them or if
+//that can't be told. See val.cpp
+static Token ResultType(int op, Token left, Token right){
+	switch(op){
+		case OP_OR:
+		case OP_AND:
+			return left == BOOLEAN && right == BOOLEAN ? BOOLEAN : ERR;
+
+		case OP_EQ:
+			return (left == right && left != ERR) || (Numeric(left) && Numeric(right)) ? BOOLEAN : ERR;
+
+		case OP_LTHAN:
+		case OP_GTHAN:
+			return (Numeric(left) && Numeric(right)) || (left == STRING && right == STRING) ? BOOLEAN : ERR;
+
+		case OP_PLUS:
+			if (left == STRING && right == STRING){
+				return STRING;
+			}
+			//Numbers add like they subtract
+			[[fallthrough]];
+		case OP_MINUS:
+		case OP_MULT:
+		case OP_DIV:
+			if (!Numeric(left) || !Numeric(right)){
+				return ERR;
+			}
+			return left == INTEGER && right == INTEGER ? INTEGER : REAL;
+
+		case OP_IDIV:
+			return Numeric(left) && Numeric(right) ? INTEGER : ERR;
+
+		default:
+			return left == INTEGER && right == INTEGER ? INTEGER : ERR;
+	}
+}
+
+//Whether a division by the value can't fail. Dividing the smallest integer by -1 doesn't fit an
+//integer, and a real divisor of DIV or MOD is truncated to an integer first, which may be 0
+static bool SafeDivisor(int op, const SsaValue& divisor){
+	if (divisor.kind != SV_CONST){
+		return false;
+	}
+	const Value& d = constants[divisor.constant];
+	if (d.IsInt()){
+		return d.GetInt() != 0 && d.GetInt() != -1;
+	}
+	return op == OP_DIV && d.IsReal() && d.GetReal() != 0.0;
+}
+
+//Whether a store of a value of type from to a variable of type to can't fail
+static bool SafeConvert(Token from, Token to){
+	return to != ERR && (from == to || (Numeric(from) && Numeric(to)));
+}
+
+
+static uint64_t Mix(uint64_t h, uint64_t x){
+	h ^= x + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	return h * 0xff51afd7ed558ccdull;
+}
+
+static uint64_t ConstHash(const Value& val){
+	switch(val.GetType()){
+		case VINT:
+			return Mix(SV_CONST, (uint32_t)val.GetInt());
+		case VREAL: {
+			double d = val.GetReal();
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			return Mix(SV_CONST + 16, bits);
+		}
+		case VBOOL:
+			return Mix(SV_CONST + 32, val.GetBool());
+		case VSTRING:
+			return Mix(SV_CONST + 48, CaseHash(val.GetString(), 0));
+		default:
+			return SV_CONST;
+	}
+}
+
+//Whether two constants are the same, down to the bits of a real
+static bool SameConst(const Value& a, const Value& b){
+	if (a.GetType() != b.GetType()){
+		return false;
+	}
+	switch(a.GetType()){
+		case VINT:
+			return a.GetInt() == b.GetInt();
+		case VREAL: {
+			double x = a.GetReal(), y = b.GetReal();
+			return memcmp(&x, &y, sizeof(x)) == 0;
+		}
+		case VBOOL:
+			return a.GetBool() == b.GetBool();
+		case VSTRING:
+			return a.GetRope().Equals(b.GetRope());
+		default:
+			return true;
+	}
+}
+
+//Empties the hash table, with room for about as many values as there will be
+static void StartNumbering(size_t expected){
+	size_t size = 64;
+	while (size < expected * 2){
+		size *= 2;
+	}
+	table.assign(size, -1);
+	tableMask = size - 1;
+	values.clear();
+	constants.clear();
+}
+
+//Where the value with the hash is in the table, or the empty entry it would go in
+static size_t Slot(uint64_t hash, const SsaValue& key, const Value* constant){
+	size_t at = hash & tableMask;
+	while (table[at] >= 0){
+		const SsaValue& v = values[table[at]];
+		if (v.hash == hash && v.kind == key.kind && v.op == key.op && v.left == key.left && v.right == key.right
+			&& (constant == NULL || SameConst(constants[v.constant], *constant))){
+			return at;
+		}
+		at = (at + 1) & tableMask;
+	}
+	return at;
+}
+
+//Adds a value, which goes in the table at the entry given unless that is -1
+static int Add(const SsaValue& key, size_t at){
+	int id = values.size();
+	values.push_back(key);
+	if (at == (size_t)-1){
+		return id;
+	}
+	table[at] = id;
+
+	//Keeps the table at most half full
+	if (values.size() * 2 > table.size()){
+		table.assign(table.size() * 2, -1);
+		tableMask = table.size() - 1;
+		for (size_t i = 0; i < values.size(); i++){
+			if (values[i].kind == SV_UNKNOWN){
+				continue;
+			}
+			size_t to = values[i].hash & tableMask;
+			while (table[to] >= 0){
+				to = (to + 1) & tableMask;
+			}
+			table[to] = i;
+		}
+	}
+	return id;
+}
+
+//The number of a value that isn't a constant, numbering it if it is new
+static int Number(ValueKind kind, int op, int left, int right, Token type, int home){
+	SsaValue key{ kind, op, left, right, type, home, -1, 0, -1 };
+	key.hash = Mix(Mix(Mix(kind, op), left), right);
+	size_t at = Slot(key.hash, key, NULL);
+	if (table[at] >= 0){
+		if (counting && (kind == SV_OP || kind == SV_CONVERT)){
+			counts.repeated++;
+		}
+		return table[at];
+	}
+	return Add(key, at);
+}
+
+static int Constant(const Value& val){
+	SsaValue key{ SV_CONST, 0, 0, 0, TypeOf(val), -1, -1, ConstHash(val), (int)constants.size() };
+	size_t at = Slot(key.hash, key, &val);
+	if (table[at] >= 0){
+		return table[at];
+	}
+	constants.push_back(val);
+	return Add(key, at);
+}
+
+static int Unknown(Token type, int home){
+	return Add(SsaValue{ SV_UNKNOWN, 0, 0, 0, type, home, -1, 0, -1 }, (size_t)-1);
+}
+
+//The value of a binary operator, worked out if its operands are constants and it can't fail on them
+static int Operation(int op, int left, int right, Token type, bool safe){
+	if (safe && values[left].kind == SV_CONST && values[right].kind == SV_CONST){
+		Value result = Operate(op, constants[values[left].constant], constants[values[right].constant]);
+		if (!result.IsErr()){
+			if (counting){
+				counts.folded++;
+			}
+			return Constant(result);
+		}
+	}
+
+	//The operands of one that can't fail on them may go either way round
+	bool commutes = op == OP_MULT || op == OP_EQ || op == OP_AND || op == OP_OR || (op == OP_PLUS && Numeric(type));
+	if (commutes && type != ERR && left > right){
+		swap(left, right);
+	}
+	return Number(SV_OP, op, left, right, type, -1);
+}
+
+//A value as it is stored to a variable of the type
+static int Converted(int value, Token type){
+	const SsaValue& v = values[value];
+	if (v.type == type){
+		return value;
+	}
+	if (v.kind == SV_CONST){
+		Value val = constants[v.constant];
+		if (ConvertFor(val, type)){
+			return Constant(val);
+		}
+	}
+	return Number(SV_CONVERT, type, value, 0, type, -1);
+}
+
+
+//Finds the variables the code uses. False if it has instructions the optimizer doesn't know
+static bool FindVars(const Code& code, const OptScope& scope){
+	vars.clear();
+	calls = false;
+	for (const Instr& in : code.code){
+		bool local;
+		int slot;
+		switch(in.op){
+			case OP_LOAD:
+			case OP_STORE:
+				local = false;
+				slot = in.a;
+				break;
+
+			case OP_LLOAD:
+			case OP_LSTORE:
+				local = true;
+				slot = in.a;
+				break;
+
+			case OP_FORPREP:
+				local = in.c < 0;
+				slot = local ? -1 - in.c : in.c;
+				break;
+
+			case OP_CALL:
+			case OP_TAILCALL:
+				calls = true;
+				continue;
+
+			//Code the peephole pass has been over already (see peephole.h) is left as it is
+			case OP_JUMPT:
+			case OP_JUMPEQ:
+			case OP_JUMPLT:
+			case OP_JUMPGT:
+				return false;
+
+			default:
+				if (in.op >= OP_RMOVE && in.op < OP_HALT){
+					return false;
+				}
+				continue;
+		}
+
+		vector<int>& of = local ? localVar : globalVar;
+		if ((size_t)slot >= of.size()){
+			of.resize(slot + 1, -1);
+		}
+		if (of[slot] >= 0){
+			continue;
+		}
+		of[slot] = vars.size();
+		const vector<Token>* types = local ? scope.frame : scope.globals;
+		Token type = types != NULL && (size_t)slot < types->size() ? (*types)[slot] : ERR;
+		vars.push_back(Var{ local, slot, type });
+	}
+	return true;
+}
+
+//Forgets the variables, ready for the next code
+static void ForgetVars(){
+	for (const Var& var : vars){
+		(var.local ? localVar : globalVar)[var.slot] = -1;
+	}
+	vars.clear();
+}
+
+//The variable an instruction loads, stores or steps
+static int VarOf(const Code& code, int i){
+	const Instr& in = code.code[i];
+	switch(in.op){
+		case OP_LOAD:
+		case OP_STORE:
+			return globalVar[in.a];
+		case OP_LLOAD:
+		case OP_LSTORE:
+			return localVar[in.a];
+		case OP_FORPREP:
+			return in.c < 0 ? localVar[-1 - in.c] : globalVar[in.c];
+		default:
+			return VarOf(code, forOf[i]);
+	}
+}
+
+
+static bool EndsBlock(OpCode op){
+	return op == OP_JUMP || op == OP_JUMPF || op == OP_FORPREP || op == OP_FORNEXT || op == OP_CASE
+		|| op == OP_RET || op == OP_HALT;
+}
+
+//Adds where control can go after instruction i to targets
+static void Successors(const Code& code, int i){
+	const Instr& in = code.code[i];
+	switch(in.op){
+		case OP_JUMP:
+			targets.push_back(in.a);
+			return;
+
+		case OP_JUMPF:
+		case OP_FORPREP:
+		case OP_FORNEXT:
+			targets.push_back(in.a);
+			targets.push_back(i + 1);
+			return;
+
+		case OP_CASE: {
+			const CaseTable& t = code.caseTables[in.a];
+			for (int k = 0; k < t.count; k++){
+				if (code.caseTargets[t.first + k] >= 0){
+					targets.push_back(code.caseTargets[t.first + k]);
+				}
+			}
+			targets.push_back(t.otherwise);
+			return;
+		}
+
+		case OP_RET:
+		case OP_HALT:
+			return;
+
+		default:
+			targets.push_back(i + 1);
+			return;
+	}
+}
+
+//Splits the code into blocks and finds the loops. False if it doesn't look like compiled code
+static bool BuildBlocks(const Code& code){
+	const vector<Instr>& instrs = code.code;
+	int n = instrs.size();
+	if (n == 0 || (instrs[n - 1].op != OP_HALT && instrs[n - 1].op != OP_RET)){
+		return false;
+	}
+
+	//blockAt first marks where blocks start
+	blockAt.assign(n + 1, -1);
+	blockAt[0] = 0;
+	forOf.assign(n, -1);
+	for (int i = 0; i < n; i++){
+		if (!EndsBlock(instrs[i].op)){
+			continue;
+		}
+		targets.clear();
+		Successors(code, i);
+		for (int t : targets){
+			if (t < 0 || t >= n){
+				return false;
+			}
+			blockAt[t] = 0;
+		}
+		blockAt[i + 1] = 0;
+		if (instrs[i].op == OP_FORPREP){
+			if (instrs[i].a < 1 || instrs[instrs[i].a - 1].op != OP_FORNEXT){
+				return false;
+			}
+			forOf[instrs[i].a - 1] = i;
+		}
+	}
+
+	blocks.clear();
+	for (int i = 0; i < n; i++){
+		if (blockAt[i] == 0){
+			if (!blocks.empty()){
+				blocks.back().last = i - 1;
+			}
+			blockAt[i] = blocks.size();
+			blocks.push_back(Block{ i, n - 1, -1 });
+		}
+	}
+
+	int count = blocks.size();
+	succs.clear();
+	succFirst.assign(count + 1, 0);
+	predFirst.assign(count + 1, 0);
+	for (int b = 0; b < count; b++){
+		succFirst[b] = succs.size();
+		targets.clear();
+		Successors(code, blocks[b].last);
+		for (int t : targets){
+			if (blockAt[t] < 0){
+				return false;
+			}
+			succs.push_back(blockAt[t]);
+			predFirst[blockAt[t]]++;
+		}
+	}
+	succFirst[count] = succs.size();
+
+	//Counts of predecessors into where each block's start in preds
+	int sum = 0;
+	for (int b = 0; b <= count; b++){
+		int c = predFirst[b];
+		predFirst[b] = sum;
+		sum += c;
+	}
+	preds.assign(sum, 0);
+	targets.assign(predFirst.begin(), predFirst.end());
+	for (int b = 0; b < count; b++){
+		for (int k = succFirst[b]; k < succFirst[b + 1]; k++){
+			int s = succs[k];
+			preds[targets[s]++] = b;
+			//A jump back is what makes a loop
+			if (s <= b){
+				blocks[s].loopEnd = max(blocks[s].loopEnd, blocks[b].last);
+			}
+		}
+	}
+
+	for (int i = 0; i < n; i++){
+		if (instrs[i].op == OP_FORNEXT && forOf[i] < 0){
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//Sets what each variable holds at the start of block b, from what its predecessors left them holding
+static void Enter(const Code& code, int b, const OptScope& scope){
+	int nv = vars.size();
+	const Block& block = blocks[b];
+	int forward = 0, only = -1;
+	for (int k = predFirst[b]; k < predFirst[b + 1]; k++){
+		if (preds[k] < b){
+			forward++;
+			only = preds[k];
+		}
+	}
+
+	if (forward == 1){
+		//Coming straight from the block before, everything still holds what that left it holding
+		if (only != b - 1){
+			copy_n(&endContent[(size_t)only * nv], nv, content.begin());
+			copy_n(&endAssigned[(size_t)only * nv], nv, assigned.begin());
+		}
+	} else if (forward > 1){
+		bool joins = false;
+		forward = 0;
+		for (int k = predFirst[b]; k < predFirst[b + 1]; k++){
+			int p = preds[k];
+			if (p >= b){
+				continue;
+			}
+			const int* from = &endContent[(size_t)p * nv];
+			const char* set = &endAssigned[(size_t)p * nv];
+			if (forward++ == 0){
+				copy_n(from, nv, content.begin());
+				copy_n(set, nv, assigned.begin());
+				continue;
+			}
+			for (int v = 0; v < nv; v++){
+				if (content[v] != from[v]){
+					content[v] = -1;
+					joins = true;
+				}
+				assigned[v] = assigned[v] && set[v];
+			}
+		}
+		for (int v = 0; joins && v < nv; v++){
+			if (content[v] < 0){
+				content[v] = Number(SV_PHI, v, b, 0, vars[v].type, v);
+			}
+		}
+	} else {
+		for (int v = 0; v < nv; v++){
+			const Var& var = vars[v];
+			if (b == 0){
+				content[v] = Number(SV_ENTRY, v, 0, 0, var.type, v);
+				if (var.local){
+					assigned[v] = var.slot < scope.params;
+				} else {
+					assigned[v] = scope.values != NULL && (size_t)var.slot < scope.values->size() && !(*scope.values)[var.slot].IsErr();
+				}
+			} else {
+				//Only jumped back to, which compiled code never is
+				content[v] = Number(SV_PHI, v, b, 0, var.type, v);
+				assigned[v] = false;
+			}
+		}
+	}
+
+	//The head of a loop can't know what anything assigned inside the loop holds
+	if (block.loopEnd >= 0){
+		modified.assign(nv, 0);
+		for (int i = block.first; i <= block.loopEnd; i++){
+			switch(code.code[i].op){
+				case OP_STORE:
+				case OP_LSTORE:
+				case OP_FORPREP:
+				case OP_FORNEXT:
+					modified[VarOf(code, i)] = 1;
+					break;
+
+				case OP_CALL:
+				case OP_TAILCALL:
+					for (int v = 0; v < nv; v++){
+						modified[v] = modified[v] || !vars[v].local;
+					}
+					break;
+
+				default:
+					break;
+			}
+		}
+		for (int v = 0; v < nv; v++){
+			if (modified[v]){
+				content[v] = Number(SV_PHI, v, b, 0, vars[v].type, v);
+			}
+		}
+	}
+
+	//The body of a FOR loop runs with its variable assigned
+	if (block.first > 0 && code.code[block.first - 1].op == OP_FORPREP){
+		assigned[VarOf(code, block.first - 1)] = true;
+	}
+}
+
+
+static void Push(int value, int start, bool pure, bool checked, bool safe){
+	stack.push_back(Entry{ value, start, pure, checked, safe, false });
+}
+
+//Replaces the instructions from first to last, along with any changes made inside of them already
+static void Replace(int first, int last, EditKind kind, const Instr& with, int value){
+	while (!edits.empty() && edits.back().first >= first){
+		edits.pop_back();
+	}
+	edits.push_back(Edit{ first, last, kind, with, value });
+}
+
+//Replaces a load of variable x, at i, that holds a constant or a copy of another variable
+static void Propagate(const Code& code, int i, int x, int value){
+	const SsaValue& v = values[value];
+	Instr with = code.code[i];
+	if (v.kind == SV_CONST){
+		with.op = OP_CONST;
+		with.site = -1;
+	} else if (v.home >= 0 && v.home != x && content[v.home] == value && assigned[v.home]){
+		with.op = vars[v.home].local ? OP_LLOAD : OP_LOAD;
+		with.a = vars[v.home].slot;
+	} else {
+		return;
+	}
+	Replace(i, i, EDIT_COPY, with, value);
+}
+
+//Replaces the expression on top of the stack, which endContent at i, if its value is at hand already
+static void Common(const Code& code, int i){
+	Entry& e = stack.back();
+	if (e.start == i || !e.pure || !e.checked){
+		return;
+	}
+
+	const SsaValue& v = values[e.value];
+	Instr with = code.code[i];
+	with.a = with.b = with.c = 0;
+	with.site = -1;
+	Entry* below = stack.size() >= 2 ? &stack[stack.size() - 2] : NULL;
+	if (v.kind == SV_CONST){
+		with.op = OP_CONST;
+	} else if (below != NULL && below->value == e.value){
+		//Having been computed once it can't fail the second time
+		with.op = OP_DUP;
+		below->shared = true;
+	} else if (v.home >= 0 && content[v.home] == e.value && assigned[v.home]){
+		with.op = vars[v.home].local ? OP_LLOAD : OP_LOAD;
+		with.a = vars[v.home].slot;
+	} else {
+		return;
+	}
+	Replace(e.start, i, EDIT_COMMON, with, e.value);
+	e.checked = e.safe = true;
+}
+
+//Pops count entries off the stack, returning where the first of them starts or -1 if there aren't enough
+static int Pop(int count, int at){
+	if ((int)stack.size() < count){
+		return -1;
+	}
+	int start = count > 0 ? stack[stack.size() - count].start : at;
+	stack.resize(stack.size() - count);
+	return start;
+}
+
+//Steps through instruction i, keeping track of the values on the stack and in the variables. When rewrite
+//is set, expressions that are at hand and copies are replaced, otherwise the stores are noted. False if
+//the code doesn't use the stack like compiled code does
+static bool Step(const Code& code, int i, bool rewrite){
+	const Instr& in = code.code[i];
+	switch(in.op){
+		case OP_CONST: {
+			int v = Constant(code.consts[in.a]);
+			if (values[v].index < 0){
+				values[v].index = in.a;
+			}
+			Push(v, i, true, true, true);
+			return true;
+		}
+
+		case OP_LOAD:
+		case OP_LLOAD: {
+			int x = VarOf(code, i);
+			int v = content[x];
+			bool safe = assigned[x];
+			if (rewrite && safe){
+				Propagate(code, i, x, v);
+			}
+			//Once it has been loaded it has a value, or the code has failed
+			assigned[x] = true;
+			Push(v, i, true, safe, safe);
+			return true;
+		}
+
+		case OP_STORE:
+		case OP_LSTORE: {
+			if (stack.empty()){
+				return false;
+			}
+			Entry e = stack.back();
+			stack.pop_back();
+			int x = VarOf(code, i);
+			Token type = (Token)in.b;
+			if (!rewrite){
+				bool convertible = SafeConvert(values[e.value].type, type);
+				stores.push_back(Store{ i, e.start, e.pure && e.safe && convertible && !e.shared });
+			}
+			int w = Converted(e.value, type);
+			if (values[w].home < 0){
+				values[w].home = x;
+			}
+			content[x] = w;
+			assigned[x] = true;
+			return true;
+		}
+
+		case OP_DUP: {
+			if (stack.empty()){
+				return false;
+			}
+			stack.back().shared = true;
+			int v = stack.back().value;
+			Push(v, i, true, true, true);
+			return true;
+		}
+
+		case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+		case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_IDIV: case OP_MOD: {
+			if (stack.size() < 2){
+				return false;
+			}
+			Entry r = stack.back();
+			stack.pop_back();
+			Entry l = stack.back();
+			stack.pop_back();
+			Token type = ResultType(in.op, values[l.value].type, values[r.value].type);
+			bool divides = in.op == OP_DIV || in.op == OP_IDIV || in.op == OP_MOD;
+			bool safe = type != ERR && (!divides || SafeDivisor(in.op, values[r.value]));
+			int v = Operation(in.op, l.value, r.value, type, safe);
+			Push(v, l.start, l.pure && r.pure, l.checked && r.checked, l.safe && r.safe && safe);
+			if (rewrite){
+				Common(code, i);
+			}
+			return true;
+		}
+
+		case OP_INDEX: {
+			int start = Pop(1, i);
+			if (start < 0){
+				return false;
+			}
+			Push(Unknown(ERR, -1), start, false, false, false);
+			return true;
+		}
+
+		case OP_ISTORE:
+			return Pop(2, i) >= 0;
+
+		case OP_AEVAL:
+			return Pop(in.c, i) >= 0;
+
+		case OP_WRITE:
+		case OP_WRITELN:
+			return Pop(in.a, i) >= 0;
+
+		case OP_READ:
+			Push(Unknown((Token)in.a, -1), i, false, false, false);
+			return true;
+
+		case OP_EOF:
+			Push(Unknown(BOOLEAN, -1), i, false, true, true);
+			return true;
+
+		case OP_JUMPF:
+		case OP_CASE:
+			return Pop(1, i) >= 0;
+
+		case OP_FORPREP:
+		case OP_FORNEXT: {
+			if (in.op == OP_FORPREP && Pop(2, i) < 0){
+				return false;
+			}
+			int x = VarOf(code, i);
+			content[x] = Unknown(INTEGER, x);
+			return true;
+		}
+
+		case OP_CALL:
+		case OP_TAILCALL: {
+			int start = Pop(in.b, i);
+			if (start < 0){
+				return false;
+			}
+			for (size_t v = 0; v < vars.size(); v++){
+				if (!vars[v].local){
+					content[v] = Unknown(vars[v].type, v);
+				}
+			}
+			if (in.c == 1){
+				Push(Unknown(ERR, -1), start, false, false, false);
+			}
+			return true;
+		}
+
+		case OP_READLN:
+		case OP_JUMP:
+		case OP_RET:
+		case OP_HALT:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+//Walks through the code block by block in SSA form, see Step
+static bool Walk(const Code& code, const OptScope& scope, bool rewrite){
+	size_t nv = vars.size();
+	StartNumbering(code.code.size() + nv * 2);
+	content.assign(nv, -1);
+	assigned.assign(nv, 0);
+	endContent.resize(blocks.size() * nv);
+	endAssigned.resize(blocks.size() * nv);
+	edits.clear();
+	stores.clear();
+
+	for (size_t b = 0; b < blocks.size(); b++){
+		Enter(code, b, scope);
+		stack.clear();
+		for (int i = blocks[b].first; i <= blocks[b].last; i++){
+			if (!Step(code, i, rewrite)){
+				return false;
+			}
+		}
+		//Statements leave nothing on the stack, and control only goes from one to another
+		if (!stack.empty()){
+			return false;
+		}
+		if (nv > 0){
+			copy(content.begin(), content.end(), endContent.begin() + b * nv);
+			copy(assigned.begin(), assigned.end(), endAssigned.begin() + b * nv);
+		}
+	}
+	return true;
+}
+
+
+//Makes the edits, moving jumps to where what they jumped to is now
+static void ApplyEdits(Code& code){
+	static vector<Instr> old;
+	static vector<int> where;
+	old.swap(code.code);
+	code.code.clear();
+	int n = old.size();
+	where.assign(n + 1, 0);
+
+	size_t e = 0;
+	for (int i = 0; i < n; ){
+		if (e < edits.size() && edits[e].first == i){
+			const Edit& edit = edits[e++];
+			for (int k = i; k <= edit.last; k++){
+				where[k] = code.code.size();
+			}
+			if (edit.kind != EDIT_DEAD){
+				Instr with = edit.with;
+				if (with.op == OP_CONST){
+					SsaValue& v = values[edit.value];
+					if (v.index < 0){
+						v.index = code.consts.size();
+						code.consts.push_back(constants[v.constant]);
+					}
+					with.a = v.index;
+				}
+				with.line = old[edit.last].line;
+				code.code.push_back(with);
+			}
+			i = edit.last + 1;
+			continue;
+		}
+		where[i] = code.code.size();
+		code.code.push_back(old[i]);
+		i++;
+	}
+	where[n] = code.code.size();
+
+	for (Instr& in : code.code){
+		if (in.op == OP_JUMP || in.op == OP_JUMPF || in.op == OP_FORPREP || in.op == OP_FORNEXT){
+			in.a = where[in.a];
+		}
+	}
+	for (int& t : code.caseTargets){
+		if (t >= 0){
+			t = where[t];
+		}
+	}
+	for (CaseTable& t : code.caseTables){
+		t.otherwise = where[t.otherwise];
+	}
+}
+
+
+static void SetBit(vector<uint64_t>& bits, size_t at, int v){
+	bits[at + v / 64] |= (uint64_t)1 << (v % 64);
+}
+
+static bool Bit(const vector<uint64_t>& bits, size_t at, int v){
+	return (bits[at + v / 64] >> (v % 64)) & 1;
+}
+
+//Takes live, which is what is read after block b, back to the start of the block. When note is set,
+//the stores to variables nothing reads are noted in deadAt
+static void Transfer(const Code& code, int b, bool note){
+	for (int i = blocks[b].last; i >= blocks[b].first; i--){
+		const Instr& in = code.code[i];
+		switch(in.op){
+			case OP_LOAD:
+			case OP_LLOAD:
+				SetBit(live, 0, VarOf(code, i));
+				break;
+
+			case OP_STORE:
+			case OP_LSTORE: {
+				int v = VarOf(code, i);
+				if (note){
+					deadAt[i] = !Bit(live, 0, v);
+				}
+				live[v / 64] &= ~((uint64_t)1 << (v % 64));
+				break;
+			}
+
+			case OP_CALL:
+			case OP_TAILCALL:
+				for (size_t w = 0; w < words; w++){
+					live[w] |= globalMask[w];
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+//Sets live to what is read after block b
+static void LiveOut(const Code& code, int b){
+	const Instr& last = code.code[blocks[b].last];
+	if (last.op == OP_HALT){
+		copy(haltMask.begin(), haltMask.end(), live.begin());
+	} else if (last.op == OP_RET){
+		//A routine returns to code that may read any of the program's variables, and its result
+		copy(globalMask.begin(), globalMask.end(), live.begin());
+		if (last.a >= 0 && (size_t)last.a < localVar.size() && localVar[last.a] >= 0){
+			SetBit(live, 0, localVar[last.a]);
+		}
+	} else {
+		fill(live.begin(), live.end(), 0);
+	}
+	for (int k = succFirst[b]; k < succFirst[b + 1]; k++){
+		size_t at = (size_t)succs[k] * words;
+		for (size_t w = 0; w < words; w++){
+			live[w] |= liveIn[at + w];
+		}
+	}
+}
+
+//Works out which variables each block may read, and which stores nothing reads
+static void FindLive(const Code& code, const Liveness* after){
+	int nv = vars.size();
+	words = (nv + 63) / 64;
+	live.assign(words, 0);
+	globalMask.assign(words, 0);
+	haltMask.assign(words, 0);
+	for (int v = 0; v < nv; v++){
+		if (!vars[v].local){
+			SetBit(globalMask, 0, v);
+			if (after == NULL || (size_t)vars[v].slot >= after->Size() || after->Live(vars[v].slot)){
+				SetBit(haltMask, 0, v);
+			}
+		}
+	}
+
+	liveIn.assign(blocks.size() * words, 0);
+	for (bool changed = true; changed; ){
+		changed = false;
+		for (int b = blocks.size() - 1; b >= 0; b--){
+			LiveOut(code, b);
+			Transfer(code, b, false);
+			//data(), since with no variables tracked there are no words and liveIn is empty
+			uint64_t* in = liveIn.data() + (size_t)b * words;
+			if (!equal(live.begin(), live.end(), in)){
+				copy(live.begin(), live.end(), in);
+				changed = true;
+			}
+		}
+	}
+
+	deadAt.assign(code.code.size(), 0);
+	for (size_t b = 0; b < blocks.size(); b++){
+		LiveOut(code, b);
+		Transfer(code, b, true);
+	}
+}
+
+
+//Tells after what is read before the code, from the start of its first block
+static void Tell(Liveness* after){
+	if (calls){
+		after->ReadAll();
+	}
+	for (size_t v = 0; v < vars.size(); v++){
+		if (vars[v].local || (size_t)vars[v].slot >= after->Size()){
+			continue;
+		}
+		if (Bit(liveIn, 0, v)){
+			after->Read(vars[v].slot);
+		} else {
+			after->Stored(vars[v].slot);
+		}
+	}
+}
+
+void Optimize(Code& code, const OptScope& scope, Liveness* after){
+	if (!optimizing || !code.origins.empty()){
+		if (after != NULL){
+			after->ReadAll();
+		}
+		return;
+	}
+
+	counts.pieces++;
+	counts.before += code.code.size();
+	counting = true;
+	bool ok = FindVars(code, scope) && BuildBlocks(code) && blocks.size() * vars.size() <= MAX_STATE
+		&& Walk(code, scope, true);
+	counting = false;
+	if (!ok){
+		counts.skipped++;
+		counts.after += code.code.size();
+		ForgetVars();
+		if (after != NULL){
+			after->ReadAll();
+		}
+		return;
+	}
+
+	counts.values += values.size();
+	for (const Edit& edit : edits){
+		if (edit.kind == EDIT_COMMON){
+			counts.common++;
+			counts.commonInstrs += edit.last - edit.first;
+		} else {
+			counts.copies++;
+		}
+	}
+	if (!edits.empty()){
+		ApplyEdits(code);
+	}
+
+	//Taking out a dead store may leave the loads of its expression the only reads of stores before it
+	uint64_t kept = 0;
+	for (int round = 0; ; round++){
+		if (!BuildBlocks(code)){
+			ok = false;
+			break;
+		}
+		FindLive(code, after);
+		//Only the stores nothing reads need walking through the code again for
+		if (find(deadAt.begin(), deadAt.end(), 1) == deadAt.end()){
+			kept = 0;
+			break;
+		}
+		if (!Walk(code, scope, false)){
+			ok = false;
+			break;
+		}
+
+		edits.clear();
+		kept = 0;
+		for (const Store& store : stores){
+			if (!deadAt[store.at]){
+				continue;
+			}
+			if (store.removable){
+				edits.push_back(Edit{ store.start, store.at, EDIT_DEAD, Instr(), -1 });
+			} else {
+				kept++;
+			}
+		}
+		if (edits.empty() || round == DEAD_ROUNDS){
+			break;
+		}
+		for (const Edit& edit : edits){
+			counts.dead++;
+			counts.deadInstrs += edit.last - edit.first + 1;
+		}
+		ApplyEdits(code);
+	}
+	counts.kept += kept;
+	counts.after += code.code.size();
+
+	if (after != NULL){
+		if (ok){
+			Tell(after);
+		} else {
+			after->ReadAll();
+		}
+	}
+	ForgetVars();
+}
+
+
+void ReportOptimizer(ostream& out){
+	out << "---- Optimizer Report ----" << endl;
+	out << "Code optimized: " << counts.pieces << " pieces, " << counts.skipped << " of them left as they were" << endl;
+	out << "Instructions: " << counts.before << " before, " << counts.after << " after" << endl;
+	out << "Value numbering: " << counts.values << " values, " << counts.repeated << " computed more than once, "
+		<< counts.folded << " worked out from constants" << endl;
+	out << "Common subexpressions: " << counts.common << " replaced, removing " << counts.commonInstrs << " instructions" << endl;
+	out << "Copy propagation: " << counts.copies << " loads replaced" << endl;
+	out << "Dead stores: " << counts.dead << " removed, removing " << counts.deadInstrs << " instructions, "
+		<< counts.kept << " kept since they could fail" << endl;
+}
@@ -0,0 +1,89 @@
+/*
+ * opt.h
+ * The optimizer, which takes out work that compiled code would do for nothing
+ * Each statement of the program body, each declaration and each routine is optimized once it has been
+ * compiled for the stack machine (see bytecode.h), before it runs. Its code is put in SSA form first:
+ * every value it computes is defined once, each variable is bound to the value it holds at every point
+ * of the code, and where control flow joins, a variable that may come in holding different values is
+ * given a phi value of its own. The only joins are where the branches of IF and CASE statements meet
+ * again and at the heads of loops, so a phi goes where branches meet for each variable they leave
+ * holding different values, and at the head of a loop for each variable assigned inside of it.
+ * Value numbering then gives values that are bound to be equal the same number: the same operator on
+ * the same values, the same constant, and an operator on constants, which is worked out there and then.
+ * The passes that use it are:
+ *  - common subexpressions: an expression whose value is already on top of the stack, held in a
+ *    variable or is a constant is replaced with a copy of the top of the stack, a load or the constant
+ *  - copy propagation: a load of a variable that holds a copy of another variable, or a constant,
+ *    loads that or pushes the constant instead, so that the copy may not need storing at all
+ *  - dead stores: a store to a variable that is stored to again before anything can read it, or is
+ *    never read again, is removed along with the expression it stores
+ * Nothing a program prints or reports may change. An expression is only replaced by a value it was
+ * worked out as before, which can't fail, and a dead store only goes if neither it nor its expression
+ * could fail: a division by zero stored in a variable that is never read still fails, just where it did.
+ * A statement of the program body can't tell what the statements after it read, since they haven't
+ * been read yet, so it keeps its stores to the program's variables unless it stores them again itself.
+ * When the program is compiled as a whole (see batch.h and image.h), its statements are optimized from
+ * the last one back, each knowing which variables the ones after it may read.
+*/
+
+#ifndef OPT_H_
+#define OPT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+#include "bytecode.h"
+#include "lex.h"
+#include "val.h"
+
+
+//What the optimizer is told about the variables of the code it is given
+struct OptScope {
+	//The types of the program's variables by slot, ERR for none
+	const vector<Token>* globals;
+	//The types of the slots of the frame of the routine the code belongs to, NULL for the program's own
+	const vector<Token>* frame;
+	//How many of the frame's slots are parameters, which have their values when the routine starts
+	int params;
+	//The program's variables as they are before the code runs, or NULL if that isn't known. A variable
+	//that has a value keeps having one, so a load of it can't fail
+	const vector<Value>* values;
+};
+
+//Which of the program's variables may still be read, worked out going back from the end of the program
+//one statement at a time. Nothing is read after the end
+class Liveness {
+	//When each variable was last found to be read and to be stored, counting back from the end
+	vector<uint64_t> readAt;
+	vector<uint64_t> storedAt;
+	uint64_t allReadAt;
+	uint64_t now;
+
+public:
+	explicit Liveness(size_t slots) : readAt(slots, 0), storedAt(slots, 0), allReadAt(0), now(0) {}
+
+	size_t Size() const { return readAt.size(); }
+	bool Live(int slot) const { return max(readAt[slot], allReadAt) > storedAt[slot]; }
+	void Read(int slot) { readAt[slot] = ++now; }
+	void Stored(int slot) { storedAt[slot] = ++now; }
+	//Code that may read any variable, such as a call
+	void ReadAll() { allReadAt = ++now; }
+};
+
+//Optimizes code, see above. If live is not NULL it holds which of the program's variables may be read
+//after the code, and is changed to hold those that may be read before it
+extern void Optimize(Code& code, const OptScope& scope, Liveness* live);
+
+//Whether code compiled from now on is optimized, which it is unless told otherwise
+extern void UseOptimizer(bool on);
+extern bool OptimizerOn();
+
+//Prints what each pass has taken out of the code optimized so far
+extern void ReportOptimizer(ostream& out);
+
+
+#endif /* OPT_H_ */
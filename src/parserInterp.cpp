@@ -5,30 +5,88 @@
 */
 
 #include "parserInterp.h"
+#include "arena.h"
+#include "batch.h"
+#include "image.h"
+#include "bytecode.h"
+#include "disasm.h"
+#include "lexpipe.h"
+#include "opt.h"
+#include "peephole.h"
+#include "regvm.h"
+#include "stats.h"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstring>
 #include <iostream>
-#include <set>
-
-// defVar keeps track of all variables that have been defined in the program thus far
-map<string, bool> defVar;
-// SymTable keeps track of the type for all of our variables
-map<string, Token> SymTable;
+#include <memory_resource>
+#include <unordered_set>
+#include <vector>
+
+//What a name stands for, and where its slot is
+enum VarKind {
+	//A variable of the program, in TempsResults
+	VK_GLOBAL,
+	//A parameter or local variable of the routine being compiled, in the frame of each call
+	VK_LOCAL,
+	//An array, in Arrays
+	VK_ARRAY,
+	//A procedure or function, in Routines
+	VK_ROUTINE
+};
+
+//What we know about a variable: its type, and the slot that holds its value
+//An array has the type of its elements, and a function the type of its result
+struct VarEntry {
+	Token type;
+	VarKind kind;
+	int slot;
+};
+// SymTable keeps track of every variable that has been defined in the program thus far
+//It is indexed by the symbol ID of the variable's name, names that were never declared have a slot of -1
+vector<VarEntry> SymTable;
 //Container of temporary locations of Value objects for results of expressions, variables values and constants 
-//Key is a variable name, value is its Value. Holds all variables defined by assign statements
-map<string, Value> TempsResults;
-//declare a pointer variable to a queue of Value objects
-queue <Value> * ValQue;
+//Holds the values of all declared variables, a variable that was never assigned holds an error Value
+vector<Value> TempsResults;
+//The type of the variable each slot of TempsResults holds, for the optimizer
+static vector<Token> SlotTypes;
+//Every declared array. Their elements are not Values, they are stored unboxed in runMemory
+vector<Array> Arrays;
+//How much of runMemory their elements take, which may be at most MAX_ARRAY_BYTES
+static size_t arrayBytes = 0;
+//Memory that lasts as long as the program does, given back all at once when it ends
+static Arena runMemory;
+static ArenaResource runResource(runMemory);
+//Memory for what the parse functions need only while they compile a statement, such as the stacks of
+//an expression. What they free goes back to a pool and is handed out again, so once the first few
+//statements have been compiled, compiling more of them never calls malloc
+static pmr::unsynchronized_pool_resource scratch(&runResource);
+template <typename T>
+using ScratchVec = pmr::vector<T>;
+//Every declared procedure and function, compiled when it was declared
+vector<Routine> Routines;
+//How many results of each pure function are kept, 0 for none
+static size_t memoEntries = 4096;
+//When set, the program is compiled into it to be run once for each of its instances, see batch.h
+static Batch* batch = NULL;
 
 
 //The parser namespace that interacts with lex for us
 namespace Parser {
 	bool pushed_back = false;
 	LexItem	pushed_token;
+	//When set, tokens come from the lexer thread instead of being lexed here
+	LexPipeline* pipeline = NULL;
 
 	static LexItem GetNextToken(istream& in, int& line) {
 		if( pushed_back ) {
 			pushed_back = false;
 			return pushed_token;
 		}
+		if( pipeline ) {
+			return pipeline->Next(line);
+		}
 		return getNextToken(in, line);
 	}
 
@@ -41,6 +99,364 @@ namespace Parser {
 	}
 }
 
+//Take tokens from a lexer thread from now on, or lex in this thread again if pipe is NULL
+void UsePipeline(LexPipeline* pipe){
+	Parser::pipeline = pipe;
+}
+
+//Compile the program into b and run it for each instance of its input, or run it as it is read again
+//if b is NULL
+void UseBatch(Batch* b){
+	batch = b;
+}
+
+//Keep at most entries results of each pure function declared from now on, 0 to run every call
+void SetMemoSize(size_t entries){
+	memoEntries = entries;
+}
+
+size_t MemoSize(){
+	return memoEntries;
+}
+
+
+//The state of the statement being compiled, see bytecode.h
+namespace Gen {
+	//The code statements are compiled into, NULL when no statement is being compiled
+	Code* code = NULL;
+	//How many values the code compiled so far leaves on the stack
+	int depth = 0;
+	//What the innermost parse function reports when something inside of it fails, as an entry of
+	//code->contexts, or -1 at the top of the statement being compiled
+	int context = -1;
+	//The slots of the control variables of the FOR loops being compiled, innermost last, as given to
+	//OP_FORPREP
+	vector<int> forSlots;
+	//The routine whose body is being compiled, -1 for the program's own statements
+	int routine = -1;
+	//What the names the routine has declared meant before, to be restored when it ends
+	vector<pair<SymbolId, VarEntry>> hidden;
+	//The types of the slots of the routine's frame declared so far
+	vector<Token> frameTypes;
+}
+
+
+//Finds a declared variable by the symbol of its name, NULL if there is no such variable
+static VarEntry* FindVar(SymbolId sym){
+	Stats::Local().symLookups++;
+	if (sym < SymTable.size() && SymTable[sym].slot >= 0){
+		return &SymTable[sym];
+	}
+	return NULL;
+}
+
+//Gives a name a new meaning, making room for it in SymTable if need be
+static void Declare(SymbolId sym, const VarEntry& entry){
+	if (sym >= SymTable.size()){
+		SymTable.resize(sym + 1, VarEntry{ ERR, VK_GLOBAL, -1 });
+	}
+	SymTable[sym] = entry;
+}
+
+//Declares a new variable of the given type, giving it a slot for its value. Inside of a routine that
+//is a slot of its frame, and the name hides whatever it meant until the routine ends
+static void DeclareVar(SymbolId sym, Token type){
+	if (Gen::routine >= 0){
+		Routine& routine = Routines[Gen::routine];
+		Gen::hidden.push_back(make_pair(sym, sym < SymTable.size() ? SymTable[sym] : VarEntry{ ERR, VK_GLOBAL, -1 }));
+		Declare(sym, VarEntry{ type, VK_LOCAL, routine.frameSize++ });
+		Gen::frameTypes.push_back(type);
+		return;
+	}
+	Declare(sym, VarEntry{ type, VK_GLOBAL, (int)TempsResults.size() });
+	TempsResults.emplace_back();
+	SlotTypes.push_back(type);
+}
+
+//Declares a new array with elements of the given type, all of which start out as 0, 0.0 or false
+static void DeclareArray(SymbolId sym, Token type, int lo, int hi){
+	Array arr{ type == INTEGER ? ELEM_INT : type == REAL ? ELEM_REAL : ELEM_BOOL, lo, hi, NULL };
+	//Aligned to a cache line, so that the kernels' loads split as few lines as they can
+	size_t bytes = arr.Size() * ElemSize(arr.type);
+	arr.data = runMemory.Alloc(bytes, 64);
+	arrayBytes += bytes;
+	memset(arr.data, 0, bytes);
+
+	Declare(sym, VarEntry{ type, VK_ARRAY, (int)Arrays.size() });
+	Arrays.push_back(arr);
+}
+
+//Whether a name has been declared already where it is being declared again. A routine may hide the
+//program's names with its own, just not its own name or ones it has declared itself
+static bool Declared(SymbolId sym){
+	VarEntry* entry = FindVar(sym);
+	if (entry == NULL || Gen::routine < 0){
+		return entry != NULL;
+	}
+	return entry->kind == VK_LOCAL || (entry->kind == VK_ROUTINE && entry->slot == Gen::routine);
+}
+
+
+//While one of these is alive, code that fails at run time also reports msg, just like the function
+//that creates it does when a statement or expression it parses fails. Functions outside of the
+//statement being compiled report a failure themselves once it has run
+class OnFailure {
+	int outer;
+
+public:
+	explicit OnFailure(const char* msg) : outer(Gen::context) {
+		if (Gen::code != NULL){
+			Gen::code->contexts.push_back(Context{ msg, outer });
+			Gen::context = Gen::code->contexts.size() - 1;
+		}
+	}
+	~OnFailure() { Gen::context = outer; }
+};
+
+
+//Appends an instruction to the code being compiled and returns where it is
+static int Emit(int line, OpCode op, int a = 0, int b = 0, int c = 0){
+	Code& code = *Gen::code;
+	code.code.push_back(Instr{ op, a, b, c, -1, line });
+
+	switch(op){
+		case OP_CONST:
+		case OP_LOAD:
+		case OP_LLOAD:
+		case OP_DUP:
+		case OP_READ:
+		case OP_EOF:
+			Gen::depth++;
+			break;
+
+		case OP_WRITE:
+		case OP_WRITELN:
+			Gen::depth -= a;
+			break;
+
+		case OP_AEVAL:
+			Gen::depth -= c;
+			break;
+
+		case OP_ISTORE:
+			Gen::depth -= 2;
+			break;
+
+		case OP_FORPREP:
+			Gen::depth -= 2;
+			break;
+
+		//The arguments are replaced with a function's result
+		case OP_CALL:
+		case OP_TAILCALL:
+			Gen::depth += c - b;
+			break;
+
+		case OP_RET:
+		case OP_INDEX:
+		case OP_READLN:
+		case OP_JUMP:
+		case OP_FORNEXT:
+		case OP_HALT:
+			break;
+
+		//Stores, binary operators and conditional jumps all take one value off
+		default:
+			Gen::depth--;
+			break;
+	}
+	code.maxStack = max(code.maxStack, Gen::depth);
+
+	return code.code.size() - 1;
+}
+
+//Appends an instruction that pushes a constant
+static int EmitConst(int line, const Value& val){
+	Gen::code->consts.push_back(val);
+	return Emit(line, OP_CONST, Gen::code->consts.size() - 1);
+}
+
+//Appends an instruction that pushes the value of a variable, or one that pops a value into it
+static int EmitLoad(int line, const VarEntry& entry){
+	return Emit(line, entry.kind == VK_LOCAL ? OP_LLOAD : OP_LOAD, entry.slot);
+}
+
+static int EmitStore(int line, const VarEntry& entry){
+	return Emit(line, entry.kind == VK_LOCAL ? OP_LSTORE : OP_STORE, entry.slot, entry.type);
+}
+
+//The slot of a variable as OP_FORPREP and Gen::forSlots have it
+static int ForSlot(const VarEntry& entry){
+	return entry.kind == VK_LOCAL ? -1 - entry.slot : entry.slot;
+}
+
+//What Expr reports on its way out when something fails while ops are pending, see the end of Expr
+template <typename Msgs>
+static void Unwind(const ScratchVec<Token>& ops, Msgs& msgs);
+
+//Expr, which may also be a whole-array expression if whole is not NULL, see Expr
+static bool CompileExpr(istream& in, int& line, ScratchVec<VecNode>* whole);
+
+//The index of an array element, see the definition
+static bool Index(istream& in, int& line, const ScratchVec<Token>& ops);
+
+//Lets the instruction at at fail at run time with msg. It then goes on to report what Expr would
+//with ops pending, if it is part of an expression, and the messages of every statement it was
+//compiled inside of
+static int Check(int at, const char* msg, const ScratchVec<Token>* ops = NULL){
+	Code& code = *Gen::code;
+	Site site{ msg, (int)code.unwinds.size(), 0, Gen::context };
+	if (ops != NULL){
+		Unwind(*ops, code.unwinds);
+		site.count = code.unwinds.size() - site.first;
+	}
+
+	code.sites.push_back(site);
+	code.code[at].site = code.sites.size() - 1;
+	return at;
+}
+
+//While one of these is alive, code that fails at run time also reports what Expr would with ops
+//pending, like OnFailure does for a statement. This is for an expression inside of an operand, such as
+//an array index, whose failures are also failures of the expression around it
+class InsideOperand {
+	int outer;
+
+public:
+	explicit InsideOperand(const ScratchVec<Token>& ops) : outer(Gen::context) {
+		//The enclosing expression's messages go around the operand's own, outermost first
+		ScratchVec<const char*> msgs(&scratch);
+		Unwind(ops, msgs);
+		for (auto msg = msgs.rbegin(); msg != msgs.rend(); msg++){
+			Gen::code->contexts.push_back(Context{ *msg, Gen::context });
+			Gen::context = Gen::code->contexts.size() - 1;
+		}
+	}
+	~InsideOperand() { Gen::context = outer; }
+};
+
+//Points the jump at at to the next instruction to be compiled
+static void Land(int at){
+	Gen::code->code[at].a = Gen::code->code.size();
+}
+
+//Appends the assignment of a whole-array expression to the array in slot, see OP_AEVAL. The code for
+//its scalar operands has already been compiled, in the order they appear in nodes
+static int EmitArrayAssign(int line, int slot, const ScratchVec<VecNode>& nodes){
+	Code& code = *Gen::code;
+	ArrayExpr expr{ (int)code.vecNodes.size(), (int)nodes.size(), 0 };
+	int scalars = 0;
+	int depth = 0;
+	for (VecNode node : nodes){
+		if (node.kind == VN_SCALAR){
+			node.arg = scalars++;
+		}
+		depth += (node.kind == VN_OP) ? -1 : 1;
+		expr.depth = max(expr.depth, depth);
+		code.vecNodes.push_back(node);
+	}
+
+	code.arrayExprs.push_back(expr);
+	return Emit(line, OP_AEVAL, slot, code.arrayExprs.size() - 1, scalars);
+}
+
+//What DeclPart and Prog report when a declaration fails, and CompoundStmt and Prog when a statement of
+//the program body does
+static const char* const declFailure[] = { "Syntactic error in Declaration Block.", "Incorrect Declaration Section." };
+static const char* const stmtFailure[] = { "Invalid Statement in Compound Statement", "Incorrect Program Body." };
+
+
+//Lists code that is ready to run, if listing is on (see disasm.h). A declaration or statement is
+//headed by what it is and its line, a routine by what it is and its name
+static void List(const Code& code, const char* what, const string& name){
+	ostream* out = CodeListing();
+	if (out == NULL){
+		return;
+	}
+
+	CodeNames names;
+	for (SymbolId sym = 0; sym < SymTable.size(); sym++){
+		const VarEntry& entry = SymTable[sym];
+		vector<string>& of = entry.kind == VK_GLOBAL ? names.globals : entry.kind == VK_LOCAL ? names.frame
+			: entry.kind == VK_ARRAY ? names.arrays : names.routines;
+		if (entry.slot < 0){
+			continue;
+		}
+		if ((int)of.size() <= entry.slot){
+			of.resize(entry.slot + 1);
+		}
+		of[entry.slot] = SymbolName(sym);
+	}
+	//A function's result is assigned under its own name
+	if (Gen::routine >= 0 && Routines[Gen::routine].result >= 0){
+		int result = Routines[Gen::routine].result;
+		names.frame.resize(max((int)names.frame.size(), result + 1));
+		names.frame[result] = names.routines[Gen::routine];
+	}
+	if (batch != NULL){
+		for (const BatchColumn& column : batch->columns){
+			if (column.slot >= 0){
+				names.globals.resize(max((int)names.globals.size(), column.slot + 1));
+				names.globals[column.slot] = "batch " + column.name;
+			}
+		}
+	}
+
+	string heading = string(what) + " " + (name.empty() ? "at line " + to_string(code.code.empty() ? 0 : code.code[0].line) : name);
+	Disassemble(*out, heading, code, names);
+}
+
+//Lists the declarations and statements of a program compiled as a whole
+static void ListUnits(){
+	for (const BatchUnit& unit : batch->units){
+		List(unit.code, unit.failure == declFailure ? "Declaration" : "Statement", string());
+	}
+}
+
+//Compiles something with compile and then runs it. Something inside of a statement that is still
+//being compiled is only compiled, it runs along with the rest of that statement. So each statement
+//of the program body and each declaration runs as soon as all of it has been read, and the program
+//still executes in the order that it is read
+//In batch mode nothing runs yet. What was compiled is kept, along with failure, the messages of the
+//parse functions around it that it would have failed through
+static bool CompileAndRun(istream& in, int& line, bool (*compile)(istream&, int&), const char* const* failure){
+	if (Gen::code != NULL){
+		return compile(in, line);
+	}
+
+	//Only one statement is compiled at a time, so they can all share the memory for it
+	static Code code;
+	code.Clear();
+	if (batch != NULL){
+		batch->units.push_back(BatchUnit{ Code(), failure });
+	}
+	Gen::code = batch != NULL ? &batch->units.back().code : &code;
+	Gen::depth = 0;
+	Gen::context = -1;
+	bool status = compile(in, line);
+	if (status){
+		Emit(line, OP_HALT);
+	}
+	Gen::code = NULL;
+	//The variables it can see have their values by now, unless they were never assigned
+	if (status && batch == NULL){
+		OptScope scope{ &SlotTypes, NULL, 0, &TempsResults };
+		Optimize(code, scope, NULL);
+		Peephole(code, scope, CurrentMachine() == VM_REGISTER);
+	}
+	if (status && batch == NULL && CurrentMachine() == VM_REGISTER){
+		FuseOperands(code);
+	}
+	if (status && batch == NULL){
+		List(code, failure == declFailure ? "Declaration" : "Statement", string());
+	}
+
+	if (batch != NULL){
+		return status;
+	}
+	return status && Run(code, Routines, TempsResults, Arrays, line);
+}
+
 //Initialize error count to be 0
 static int error_count = 0;
 
@@ -53,20 +469,76 @@ int ErrCount(){
 
 //A simple error wrapper that incrememnts error count, and prints out the error
 void ParseError(int line, string msg)
+{
+	ParseError(line, msg.c_str());
+}
+
+//Most messages are constants, which this prints without making a string of them first
+void ParseError(int line, const char* msg)
 {
 	++error_count;
 	cout << line << ": " << msg << endl;
 }
 
 
+//Forgets the program that was interpreted last, along with the errors it had, so that another one
+//can be interpreted by the same process
+void ResetProg(){
+	SymTable.clear();
+	TempsResults.clear();
+	SlotTypes.clear();
+	Arrays.clear();
+	arrayBytes = 0;
+	scratch.release();
+	runMemory.Release();
+	Routines.clear();
+	error_count = 0;
+	Parser::pushed_back = false;
+	Gen::code = NULL;
+	Gen::depth = 0;
+	Gen::context = -1;
+	Gen::forSlots.clear();
+	Gen::routine = -1;
+	Gen::hidden.clear();
+	Gen::frameTypes.clear();
+	resetLexer();
+}
+
+//Compiles the whole program into an image without running any of it, see image.h. Returns false,
+//having reported why, if it doesn't compile
+bool CompileImage(istream& in, int& line, string& image){
+	Batch whole;
+	whole.image = &image;
+	batch = &whole;
+	bool status = Prog(in, line);
+	batch = NULL;
+	return status;
+}
+
+
 /**
  * Prog is the entry point to our entire interpreter, the "root" of our parse tree
  * To start, the program must use the keyword Program and give an identifier name.
  * It must then go into the Declaritive part followed by a compound statement
- * Prog ::= PROGRAM IDENT ; DeclPart CompoundStmt
+ * Prog ::= PROGRAM IDENT ; DeclPart { RoutineDecl ; } CompoundStmt
 */
 bool Prog(istream& in, int& line){
+	Stats::PhaseTimer timer(PH_PARSE);
 	bool status = false;
+	//How many of the units compiled in batch mode are declarations
+	size_t declarations = 0;
+
+	//However the program ends, the memory of its arrays and everything else it compiled with is given
+	//back all at once when it does, and its routines go with it
+	struct FreeArrays {
+		~FreeArrays() {
+			Arrays.clear();
+			arrayBytes = 0;
+			scratch.release();
+			runMemory.Release();
+			Routines.clear();
+		}
+	} freeArrays;
 
 	//This should be the keyword "program"
 	LexItem l = Parser::GetNextToken(in, line);
@@ -105,8 +577,28 @@ bool Prog(istream& in, int& line){
 		}
 
 		//Up to here we have gotten PROGRAM IDENT ; DeclPart
-		//Check for the compound statement, make sure that there actually is a BEGIN
+		if (batch != NULL){
+			declarations = batch->units.size();
+		}
+		//Then come any procedures and functions, each followed by a semicolon
 		l = Parser::GetNextToken(in, line);
+		while (l == PROCEDURE || l == FUNCTION){
+			Parser::PushBackToken(l);
+			if (!RoutineDecl(in, line)){
+				ParseError(line, "Incorrect Declaration Section.");
+				return false;
+			}
+
+			l = Parser::GetNextToken(in, line);
+			if (l != SEMICOL){
+				ParseError(line, "Syntactic error in Declaration Block.");
+				ParseError(line, "Incorrect Declaration Section.");
+				return false;
+			}
+			l = Parser::GetNextToken(in, line);
+		}
+
+		//Check for the compound statement, make sure that there actually is a BEGIN
 		if (l != BEGIN){
 			ParseError(line, "Syntactic Error in Declaration Block.");
 			ParseError(line, "Incorrect Declaration Section");
@@ -131,6 +623,52 @@ bool Prog(istream& in, int& line){
 		return false; 
 	}
 
+	//In batch mode the program has only been compiled so far, and now runs for each instance
+	if (batch != NULL && status){
+		for (const BatchColumn& column : batch->columns){
+			if (column.slot < 0){
+				ParseError(line, "No variable named " + column.name + " to give batch input to");
+				status = false;
+			}
+		}
+		//Each statement and declaration is optimized knowing which variables the ones after it read, so
+		//they are optimized from the last one back
+		if (status){
+			Liveness live(TempsResults.size());
+			for (size_t i = batch->units.size(); i-- > 0; ){
+				Optimize(batch->units[i].code, OptScope{ &SlotTypes, NULL, 0, NULL }, &live);
+			}
+		}
+		if (status && batch->image != NULL){
+			//Declarations that only compute from constants and the variables before them are run now,
+			//and the image starts out with what they stored. The rest run along with the program. A
+			//declaration can only use the variables declared before it, so one that runs later can't see
+			//any difference
+			size_t kept = 0;
+			for (size_t i = 0; i < batch->units.size(); i++){
+				if (i < declarations && Fold(batch->units[i].code, TempsResults)){
+					continue;
+				}
+				if (kept != i){
+					batch->units[kept] = move(batch->units[i]);
+				}
+				kept++;
+			}
+			batch->units.resize(kept);
+			//An image runs one instance at a time on the stack machine, so unlike a batch that runs in
+			//lockstep, its code can have what the peephole pass makes of it
+			for (BatchUnit& unit : batch->units){
+				Peephole(unit.code, OptScope{ &SlotTypes, NULL, 0, NULL }, false);
+			}
+			ListUnits();
+			SaveImage(*batch->image, batch->units, Routines, TempsResults, Arrays);
+		}
+		else if (status){
+			ListUnits();
+			batch->RunAll(Routines, TempsResults, Arrays);
+		}
+	}
+
 	//If we reach here, status will be true and parsing will have been successful
 	return status;
 }
@@ -139,6 +677,7 @@ bool Prog(istream& in, int& line){
 /**
  * The declarative part must start with the var keyword, followed by one or more colon separated declStmt's
  * There will be no actual value processing, that is handled further down the parse tree
+ * The local variables of a procedure or function are declared the same way, see RoutineDecl
  * DeclPart ::= VAR DeclStmt; { DeclStmt ; }
 */
 bool DeclPart(istream& in, int& line){
@@ -193,10 +732,97 @@ bool DeclPart(istream& in, int& line){
 /**
  * A delcaration statement can have one or more comma separated identifiers, followed by a valid type and an optional assignment
  * DeclStmt ::= IDENT {, IDENT } : Type [:= Expr]
+ * Type ::= INTEGER | REAL | STRING | BOOLEAN | ArrayType
+ * The statement is compiled and then run, which is when the variables get their initial value
 */
+static bool CompileDeclStmt(istream& in, int& line);
+
+
+//One bound of an array, which must be an integer constant
+//Bound ::= [ ( - | + ) ] ICONST
+static bool Bound(istream& in, int& line, int& bound){
+	LexItem l = Parser::GetNextToken(in, line);
+	bool negative = (l == MINUS);
+	if (l == MINUS || l == PLUS){
+		l = Parser::GetNextToken(in, line);
+	}
+
+	if (l != ICONST){
+		ParseError(line, "Array bounds must be integer constants");
+		return false;
+	}
+
+	//A bound too big for a long long is out of range as well
+	const string& text = l.GetLexeme();
+	long long value = 0;
+	bool read = from_chars(text.data(), text.data() + text.size(), value).ec == errc();
+	value = negative ? -value : value;
+	if (!read || value < INT_MIN || value > INT_MAX){
+		ParseError(line, "Array bounds must be integer constants");
+		return false;
+	}
+	bound = (int)value;
+	return true;
+}
+
+//The type of an array: its bounds, and the type of its elements, which must fit unboxed
+//ArrayType ::= ARRAY [ Bound .. Bound ] OF ( INTEGER | REAL | BOOLEAN )
+static bool ArrayType(istream& in, int& line, Token& type, int& lo, int& hi){
+	//The ARRAY has been consumed already
+	LexItem l = Parser::GetNextToken(in, line);
+	if (l != LBRACKET){
+		ParseError(line, "Missing Left Bracket");
+		return false;
+	}
+
+	if (!Bound(in, line, lo)){
+		return false;
+	}
+
+	l = Parser::GetNextToken(in, line);
+	if (l != DOTDOT){
+		ParseError(line, "Missing .. in array bounds");
+		return false;
+	}
+
+	if (!Bound(in, line, hi)){
+		return false;
+	}
+
+	if (lo > hi){
+		ParseError(line, "Array lower bound is greater than its upper bound");
+		return false;
+	}
+
+	l = Parser::GetNextToken(in, line);
+	if (l != RBRACKET){
+		ParseError(line, "Missing Right Bracket");
+		return false;
+	}
+
+	l = Parser::GetNextToken(in, line);
+	if (l != OF){
+		ParseError(line, "Missing OF in array type");
+		return false;
+	}
+
+	l = Parser::GetNextToken(in, line);
+	if (l != INTEGER && l != REAL && l != BOOLEAN){
+		ParseError(line, "Array elements must be of type Integer, Real or Boolean");
+		return false;
+	}
+	type = l.GetToken();
+	return true;
+}
+
 bool DeclStmt(istream& in, int& line){
-	//All of the variables in a declstmt are going to have the same type, store in a set for type assignment
-	set<string> tempSet;
+	return CompileAndRun(in, line, CompileDeclStmt, declFailure);
+}
+
+static bool CompileDeclStmt(istream& in, int& line){
+	//All of the variables in a declstmt are going to have the same type, keep them for type assignment
+	//Redefinitions are rejected below, so no variable is in here twice
+	ScratchVec<SymbolId> tempSet(&scratch);
     //The token that may be used for type checking after the optional ASSOP
     Token t;
 
@@ -213,17 +839,15 @@ bool DeclStmt(istream& in, int& line){
 			return false;
 		}
 
-		//If this variable is already in defVars, we have a redeclaration, throw error
-		if (defVar.find(l.GetLexeme()) -> second){
+		//If this variable is already in the symbol table or earlier in the list, we have a redeclaration, throw error
+		if (Declared(l.GetSymbol()) || find(tempSet.begin(), tempSet.end(), l.GetSymbol()) != tempSet.end()){
 			ParseError(line, "Variable Redefinition");
 			ParseError(line, "Incorrect identifiers list in Declaration Statement.");
 			return false;
 		}
 
-		//If we get here, it wasn't in defVars, so we should add it
-		defVar.insert(pair<string, bool> (l.GetLexeme(), true));
-        //Put the variable name into the tempSet for type processing
-		tempSet.insert(l.GetLexeme());
+        //Put the variable name into the tempSet, they are all declared once their type is known
+		tempSet.push_back(l.GetSymbol());
 
 		lookAhead = Parser::GetNextToken(in, line);
 	}
@@ -247,14 +871,40 @@ bool DeclStmt(istream& in, int& line){
 	//following this, we need to have a type for our variables
 	//The next token should be a valid type
 	l = Parser::GetNextToken(in, line);
-	//allowed to be integer, boolean, real, string
+	bool isArray = (l == ARRAY);
+	//allowed to be integer, boolean, real, string, or an array
 	if (l == STRING || l == INTEGER || l == REAL || l == BOOLEAN){
+        //Save the token value for type checking
+        t = l.GetToken();
 		for(auto i : tempSet){
             //symtable keeps track of the type for all variables
-			SymTable[i] = l.GetToken();
+			Stats::Local().symLookups++;
+			DeclareVar(i, t);
+		}
+	} else if (isArray){
+		//Every variable gets an array of its own, and t is the type of their elements. Arrays belong
+		//to the program, a routine's frame only holds scalars
+		int lo, hi;
+		if (Gen::routine >= 0){
+			ParseError(line, "Arrays can not be declared inside of a procedure or function");
+			ParseError(line, "Incorrect Declaration Type.");
+			return false;
+		}
+		if (!ArrayType(in, line, t, lo, hi)){
+			ParseError(line, "Incorrect Declaration Type.");
+			return false;
+		}
+		//The bounds are ints, so the size of one array can't overflow, but all of them together may
+		size_t bytes = ((size_t)((long long)hi - lo + 1) * ElemSize(t == INTEGER ? ELEM_INT : t == REAL ? ELEM_REAL : ELEM_BOOL));
+		if (bytes > (MAX_ARRAY_BYTES - arrayBytes) / tempSet.size()){
+			ParseError(line, "Arrays are too large to be allocated");
+			ParseError(line, "Incorrect Declaration Type.");
+			return false;
+		}
+		for(auto i : tempSet){
+			Stats::Local().symLookups++;
+			DeclareArray(i, t, lo, hi);
 		}
-        //Save the token value for type checking
-        t = l.GetToken();
 	} else {
 		//Unrecognized type
 		ParseError(line, "Incorrect Declaration Type.");
@@ -268,9 +918,13 @@ bool DeclStmt(istream& in, int& line){
 
 	//If we find the optional ASSOP, process it
 	if (l == ASSOP){
-        //This is the value reference that we will pass into our expr
-        Value val;
-		bool status = Expr(in, line, val);
+		bool status;
+		//Arrays can be given the value of a whole-array expression
+		ScratchVec<VecNode> nodes(&scratch);
+		{
+			OnFailure context("Invalid expression following assignment operator.");
+			status = CompileExpr(in, line, isArray ? &nodes : NULL);
+		}
 
         //Throw an error if Expr fails
 		if (!status) {
@@ -278,85 +932,26 @@ bool DeclStmt(istream& in, int& line){
 			return false;
 		}
 
-        //If we get here, we need to do type checking and then assign every variable the value found by expr
-        switch(t){
-            case STRING:
-                //Types must match for this to work
-                if(val.IsString()){
-                    for(auto var : tempSet){
-                        //Everything in our declstmt will have the same type, so set it all to that type
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                } else {
-                    //Otherwise we fail here
-                    ParseError(line, "Illegal Assignment Operation");
-                    return false;
-                }
-
-            case BOOLEAN:
-                //Types also must match for booleans
-                if(val.IsBool()){
-                    for(auto var : tempSet){
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                } else {
-                    ParseError(line, "Illegal Assignment Operation");
-                    return false;
-                }
-
-            case REAL:
-                //they match, nothing to do here
-                if(val.IsReal()){
-                    for(auto var : tempSet){
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                //here is the special case, cast to the type of the LHS(t in our case)
-                } else if(val.IsInt()){
-                    val.SetReal((float)val.GetInt());
-                    val.SetType(VREAL);
-
-                    for(auto var : tempSet){
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                } else {
-                    ParseError(line, "Illegal Assignment Operation");
-                    return false;
-                }
-
-            case INTEGER:
-                //they match, nothing to do here
-                if(val.IsInt()){
-                    for(auto var : tempSet){
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                //another special case here, cast to the LHS of INT in this case
-                } else if(val.IsReal()) {
-                    val.SetInt((int)val.GetReal());
-                    val.SetType(VINT);
-
-                    for(auto var : tempSet){
-                        TempsResults[var] = val;
-                    }
-					break;
-
-                } else {
-                    ParseError(line, "Illegal Assignment Operation");
-                    return false;
-                }
-
-            default:
-                ParseError(line, "Illegal Assignment Operation");
-                return false;
+		//A scalar sets every element. The first array gets the value and the others a copy of it
+		if (isArray){
+			if (nodes.empty()){
+				nodes.push_back(VecNode{ VN_SCALAR, 0 });
+			}
+			int first = SymTable[tempSet[0]].slot;
+			Check(EmitArrayAssign(line, first, nodes), "Illegal Assignment Operation");
+			for(size_t i = 1; i < tempSet.size(); i++){
+				Check(EmitArrayAssign(line, SymTable[tempSet[i]].slot, { VecNode{ VN_ARRAY, first } }), "Illegal Assignment Operation");
+			}
+			return true;
+		}
+
+        //Every variable in our declstmt gets the value. Its type is checked as it is stored, just like in
+        //an assignment, with integers and reals converted to the type of the variables
+        for(size_t i = 0; i < tempSet.size(); i++){
+            if(i + 1 < tempSet.size()){
+                Emit(line, OP_DUP);
+            }
+            Check(EmitStore(line, SymTable[tempSet[i]]), "Illegal Assignment Operation");
         }
 
 	//If its unrecognized throw and error
@@ -370,94 +965,438 @@ bool DeclStmt(istream& in, int& line){
 		Parser::PushBackToken(l);
 	}
 
+	//In batch mode, a variable of the program named by the batch input then takes the value its
+	//instance gives it, which is put in a slot of its own before the instance runs
+	if (batch != NULL && Gen::routine < 0){
+		for (SymbolId sym : tempSet){
+			for (BatchColumn& column : batch->columns){
+				if (column.name != SymbolName(sym)){
+					continue;
+				}
+				column.type = t;
+				column.slot = TempsResults.size();
+				TempsResults.emplace_back();
+				SlotTypes.push_back(t);
+				Check(Emit(line, OP_LOAD, column.slot), "Invalid value in batch input");
+				Check(EmitStore(line, SymTable[sym]), "Illegal Assignment Operation");
+			}
+		}
+	}
+
 	return true;
 }
 
 
-/** 
- * Stmt is responsible for determining what kind of stmt we have and making appropriate calls
-* Grammar Rules
-* Stmt ::= SimpleStmt | StructuredStmtStmt
-* SimpleStmt ::= AssignStmt | WriteLnStmt | WriteStmt
-* StructuredStmt ::= IfStmt | CompoundStmt
+/**
+ * Procedures and functions are declared after the variables of the program. Each one is compiled as it
+ * is read and runs whenever it is called, with a frame of its own that holds its parameters and local
+ * variables, which may hide the program's variables of the same names. A function sets its result by
+ * assigning to its name, and recurses by calling itself
+ * RoutineDecl ::= PROCEDURE IDENT [ ( ParamList ) ] ; [ DeclPart ] CompoundStmt
+ *               | FUNCTION IDENT [ ( ParamList ) ] : Type ; [ DeclPart ] CompoundStmt
+ * ParamList ::= IDENT {, IDENT } : Type { ; IDENT {, IDENT } : Type }
+ * Parameters, local variables and results are of the types INTEGER, REAL, BOOLEAN or STRING
 */
-bool Stmt(istream& in, int& line) {
-	bool status;
-	// Get the next lexItem from the instream and analyze it
-	LexItem l = Parser::GetNextToken(in, line);
-
-	// If l is uncrecognizable, no use in checking anything
-	if (l == ERR){
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")";
-		return false;
-	}
-
-	// Check if we have a structured statement
-	if (l == BEGIN || l == IF){
-		//Put token back to be reprocessed
-		Parser::PushBackToken(l);
-		return StructuredStmt(in, line);
-	}
 
-	// Check to see if we have a simple statement
-	// Assignments start with IDENT
-	if (l == IDENT || l == WRITE || l == WRITELN){
-		//Put token back to be reprocessed
-		Parser::PushBackToken(l);
-		status = SimpleStmt(in, line);
-
-		if(!status){
-			ParseError(line, "Incorrect Simple Statement.");
-			return false;
+//While one of these is alive, statements are compiled into the code of a routine rather than run, and
+//the names that are declared belong to it. Everything is put back the way it was when it goes
+class InRoutine {
+	Code* code;
+	int depth;
+	int context;
+	int routine;
+	size_t hidden;
+
+public:
+	InRoutine(int index, Code& into)
+		: code(Gen::code), depth(Gen::depth), context(Gen::context), routine(Gen::routine), hidden(Gen::hidden.size()) {
+		Gen::code = &into;
+		Gen::depth = 0;
+		Gen::context = -1;
+		Gen::routine = index;
+		Gen::frameTypes.clear();
+	}
+	~InRoutine() {
+		while (Gen::hidden.size() > hidden){
+			SymTable[Gen::hidden.back().first] = Gen::hidden.back().second;
+			Gen::hidden.pop_back();
 		}
-
-		return status;
+		Gen::code = code;
+		Gen::depth = depth;
+		Gen::context = context;
+		Gen::routine = routine;
 	}
+};
 
-	//We didn't find anything so push the token back
-	Parser::PushBackToken(l);
-	//Stmt was not successful if we got here
-	return false;
+static bool IsScalarType(const LexItem& l){
+	return l == INTEGER || l == REAL || l == BOOLEAN || l == STRING;
 }
 
+//The parameters of the routine being compiled, from after the ( up to and including the )
+static bool ParamList(istream& in, int& line){
+	Routine& routine = Routines[Gen::routine];
+	LexItem l;
 
-/**
-* stmt will call StructuredStmt if appropriate according to our grammar rules
-* StructuredStmt ::= IfStmt | CompoundStmt
-*/
-bool StructuredStmt(istream& in, int& line){
-	bool status;
-	LexItem strd = Parser::GetNextToken(in, line);
+	do {
+		//Every name in a group has the same type, and they are declared once it is known
+		ScratchVec<SymbolId> names(&scratch);
+		LexItem lookAhead = LexItem(COMMA, ",", 0);
+		while (lookAhead == COMMA){
+			l = Parser::GetNextToken(in, line);
+			if (l != IDENT){
+				ParseError(line, "Non-indentifier declaration.");
+				return false;
+			}
 
-	switch (strd.GetToken()){
-		case IF:
-			status = IfStmt(in, line);
-			if (!status) {
-				ParseError(line, "Bad structured statement.");
+			if (Declared(l.GetSymbol()) || find(names.begin(), names.end(), l.GetSymbol()) != names.end()){
+				ParseError(line, "Variable Redefinition");
 				return false;
 			}
-			return true;
+			names.push_back(l.GetSymbol());
 
-		//Compound statements begin with in
-		case BEGIN:
-			return CompoundStmt(in, line);
+			lookAhead = Parser::GetNextToken(in, line);
+		}
 
-		default:
-			//we won't ever get here, added to remove compile warnings
+		if (lookAhead != COLON){
+			ParseError(line, "Missing Colon in Parameter List");
 			return false;
-	}
-}
-
+		}
 
-/**
+		l = Parser::GetNextToken(in, line);
+		if (!IsScalarType(l)){
+			ParseError(line, "Incorrect Declaration Type.");
+			return false;
+		}
+
+		//The parameters are the first slots of the frame, in order
+		for (SymbolId sym : names){
+			DeclareVar(sym, l.GetToken());
+			routine.params.push_back(l.GetToken());
+		}
+
+		l = Parser::GetNextToken(in, line);
+	} while (l == SEMICOL);
+
+	if (l != RPAREN){
+		ParseError(line, "Missing Right Parenthesis");
+		return false;
+	}
+	return true;
+}
+
+//Turns each call that the routine returns from straight after into a tail call. For a function that
+//means that the call's result is assigned to its own with nothing to convert, and then there is
+//nothing but jumps on the way to its return
+static void MarkTailCalls(Code& code, const Routine& routine){
+	vector<Instr>& instrs = code.code;
+	for (Instr& call : instrs){
+		if (call.op != OP_CALL || call.c != (routine.result >= 0 ? 1 : 0)){
+			continue;
+		}
+
+		size_t next = &call - instrs.data() + 1;
+		if (routine.result >= 0){
+			const Instr& store = instrs[next];
+			if (Routines[call.a].type != routine.type || store.op != OP_LSTORE || store.a != routine.result){
+				continue;
+			}
+			next++;
+		}
+
+		for (size_t hops = 0; instrs[next].op == OP_JUMP && hops < instrs.size(); hops++){
+			next = instrs[next].a;
+		}
+		if (instrs[next].op == OP_RET){
+			call.op = OP_TAILCALL;
+		}
+	}
+}
+
+//Whether the routine does nothing but compute from its parameters: it doesn't touch the program's
+//variables or arrays, doesn't print or read input, and only calls routines that are pure as well. Calling such a
+//function again with the same arguments is bound to give the same result, so its results are kept.
+//It must not assign its parameters either, since they are what its results are kept under
+static bool IsPure(const Code& code, int index){
+	int params = Routines[index].params.size();
+	for (const Instr& instr : code.code){
+		switch(instr.op){
+			case OP_LOAD:
+			case OP_STORE:
+			case OP_INDEX:
+			case OP_ISTORE:
+			case OP_AEVAL:
+			case OP_WRITE:
+			case OP_WRITELN:
+			case OP_READ:
+			case OP_READLN:
+			case OP_EOF:
+				return false;
+
+			case OP_LSTORE:
+				if (instr.a < params){
+					return false;
+				}
+				break;
+
+			case OP_FORPREP:
+				if (instr.c < 0 && -1 - instr.c < params){
+					return false;
+				}
+				break;
+
+			//A routine can only call itself and those declared before it
+			case OP_CALL:
+			case OP_TAILCALL:
+				if (instr.a != index && !Routines[instr.a].pure){
+					return false;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+//Everything after the PROCEDURE or FUNCTION, see RoutineDecl
+static bool CompileRoutine(istream& in, int& line, bool function){
+	LexItem l = Parser::GetNextToken(in, line);
+	if (l != IDENT){
+		ParseError(line, function ? "Missing Function name." : "Missing Procedure name.");
+		return false;
+	}
+
+	if (FindVar(l.GetSymbol()) != NULL){
+		ParseError(line, "Identifier Redefinition");
+		return false;
+	}
+
+	//The name is known from here on, so that the body can call itself
+	SymbolId name = l.GetSymbol();
+	int index = Routines.size();
+	Routines.emplace_back();
+	Declare(name, VarEntry{ PROCEDURE, VK_ROUTINE, index });
+	Routine& routine = Routines[index];
+
+	Code code;
+	InRoutine scope(index, code);
+
+	l = Parser::GetNextToken(in, line);
+	if (l == LPAREN){
+		if (!ParamList(in, line)){
+			ParseError(line, "Incorrect Parameter List.");
+			return false;
+		}
+		l = Parser::GetNextToken(in, line);
+	}
+
+	//A function's result comes right after its parameters in the frame
+	if (function){
+		if (l != COLON){
+			ParseError(line, "Missing Function Result Type.");
+			return false;
+		}
+
+		l = Parser::GetNextToken(in, line);
+		if (!IsScalarType(l)){
+			ParseError(line, "Incorrect Declaration Type.");
+			return false;
+		}
+		routine.type = l.GetToken();
+		routine.result = routine.frameSize++;
+		Gen::frameTypes.push_back(routine.type);
+		SymTable[name].type = routine.type;
+
+		l = Parser::GetNextToken(in, line);
+	}
+
+	if (l != SEMICOL){
+		ParseError(line, "Syntax Error.");
+		return false;
+	}
+
+	//The local variables, whose initial values are assigned every time the routine is called
+	l = Parser::GetNextToken(in, line);
+	if (l == VAR){
+		Parser::PushBackToken(l);
+		if (!DeclPart(in, line)){
+			return false;
+		}
+		l = Parser::GetNextToken(in, line);
+	}
+
+	if (l != BEGIN){
+		ParseError(line, "Missing BEGIN in Procedure or Function Body.");
+		return false;
+	}
+
+	const char* body = function ? "Incorrect Function Body." : "Incorrect Procedure Body.";
+	bool status;
+	{
+		OnFailure context(body);
+		status = CompoundStmt(in, line);
+	}
+
+	if (!status){
+		ParseError(line, body);
+		return false;
+	}
+
+	//A function that gets to the end without a result fails
+	int ret = Emit(line, OP_RET, routine.result);
+	if (function){
+		Check(ret, "Function ended without assigning its result");
+	}
+
+	//Nothing has run in batch mode, so no variable is known to have a value yet
+	OptScope optScope{ &SlotTypes, &Gen::frameTypes, (int)routine.params.size(), batch == NULL ? &TempsResults : NULL };
+	Optimize(code, optScope, NULL);
+	MarkTailCalls(code, routine);
+	routine.pure = IsPure(code, index);
+	if (function && routine.pure && memoEntries > 0){
+		routine.memo.reset(new MemoCache(routine.params.size(), memoEntries));
+	}
+	//Batch mode keeps it for the stack machine, as images do
+	bool fuse = batch == NULL && CurrentMachine() == VM_REGISTER;
+	Peephole(code, optScope, fuse);
+	if (fuse){
+		FuseOperands(code);
+	}
+	List(code, function ? "Function" : "Procedure", SymbolName(name));
+	routine.code = move(code);
+	return true;
+}
+
+bool RoutineDecl(istream& in, int& line){
+	//This is PROCEDURE or FUNCTION
+	LexItem l = Parser::GetNextToken(in, line);
+	bool function = (l == FUNCTION);
+
+	if (!CompileRoutine(in, line, function)){
+		ParseError(line, function ? "Incorrect Function Declaration." : "Incorrect Procedure Declaration.");
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Stmt is responsible for determining what kind of stmt we have and making appropriate calls
+* Grammar Rules
+* Stmt ::= SimpleStmt | StructuredStmtStmt
+* SimpleStmt ::= AssignStmt | WriteLnStmt | WriteStmt | ReadLnStmt | CallStmt
+* StructuredStmt ::= IfStmt | WhileStmt | ForStmt | CaseStmt | CompoundStmt
+* The statement is compiled and then run, see CompileAndRun
+*/
+static bool CompileStmt(istream& in, int& line);
+
+bool Stmt(istream& in, int& line) {
+	return CompileAndRun(in, line, CompileStmt, stmtFailure);
+}
+
+static bool CompileStmt(istream& in, int& line) {
+	bool status;
+	// Get the next lexItem from the instream and analyze it
+	LexItem l = Parser::GetNextToken(in, line);
+
+	// If l is uncrecognizable, no use in checking anything
+	if (l == ERR){
+		ParseError(line, "Unrecognized input pattern.");
+		cout << "(" << l.GetLexeme() << ")";
+		return false;
+	}
+
+	// Check if we have a structured statement
+	if (l == BEGIN || l == IF || l == WHILE || l == FOR || l == CASE){
+		//Put token back to be reprocessed
+		Parser::PushBackToken(l);
+		return StructuredStmt(in, line);
+	}
+
+	// Check to see if we have a simple statement
+	// Assignments start with IDENT
+	if (l == IDENT || l == WRITE || l == WRITELN || l == READLN){
+		//Put token back to be reprocessed
+		Parser::PushBackToken(l);
+		{
+			OnFailure context("Incorrect Simple Statement.");
+			status = SimpleStmt(in, line);
+		}
+
+		if(!status){
+			ParseError(line, "Incorrect Simple Statement.");
+			return false;
+		}
+
+		return status;
+	}
+
+	//We didn't find anything so push the token back
+	Parser::PushBackToken(l);
+	//Stmt was not successful if we got here
+	return false;
+}
+
+
+/**
+* stmt will call StructuredStmt if appropriate according to our grammar rules
+* StructuredStmt ::= IfStmt | WhileStmt | ForStmt | CaseStmt | CompoundStmt
+*/
+bool StructuredStmt(istream& in, int& line){
+	bool status;
+	LexItem strd = Parser::GetNextToken(in, line);
+
+	//Compound statements begin with in, and report their own errors
+	if (strd == BEGIN){
+		return CompoundStmt(in, line);
+	}
+
+	{
+		OnFailure context("Bad structured statement.");
+		switch (strd.GetToken()){
+			case IF:
+				status = IfStmt(in, line);
+				break;
+
+			case WHILE:
+				status = WhileStmt(in, line);
+				break;
+
+			case FOR:
+				status = ForStmt(in, line);
+				break;
+
+			case CASE:
+				status = CaseStmt(in, line);
+				break;
+
+			default:
+				//we won't ever get here, added to remove compile warnings
+				return false;
+		}
+	}
+
+	if (!status) {
+		ParseError(line, "Bad structured statement.");
+		return false;
+	}
+	return true;
+}
+
+
+/**
  * Compound statements start with BEGIN and stop with END
  * CompoundStmt ::= BEGIN Stmt {; Stmt } END
 */
 bool CompoundStmt(istream& in, int& line){
 	LexItem l;
+	bool status;
 	//If we got here we already have consumed a BEGIN
-	bool status = Stmt(in, line);
+	{
+		OnFailure context("Invalid Statement in Compound Statement");
+		status = Stmt(in, line);
+	}
 
 	//If status was bad, no point in continuing
 	if(!status){
@@ -471,7 +1410,10 @@ bool CompoundStmt(istream& in, int& line){
 	//While we have a semicol, keep processing stmts
 	while(l == SEMICOL){
 		//Process the next stmt
-		status = Stmt(in, line);
+		{
+			OnFailure context("Invalid Statement in Compound Statement");
+			status = Stmt(in, line);
+		}
 
 		//If status was bad, no point in continuing
 		if(!status){
@@ -504,23 +1446,31 @@ bool CompoundStmt(istream& in, int& line){
 
 /**
 * stmt will call SimpleStmt if appropriate according to our grammar rules
-* SimpleStmt ::= AssignStmt | WriteLnStmt | WriteStmt
+* SimpleStmt ::= AssignStmt | WriteLnStmt | WriteStmt | ReadLnStmt | CallStmt
 */
 bool SimpleStmt(istream& in, int& line){
 	LexItem smpl = Parser::GetNextToken(in, line);
 
 	switch (smpl.GetToken()){
-		//Assignments start with identifiers
-		case IDENT:
+		//Assignments and procedure calls start with identifiers
+		case IDENT: {
+			VarEntry* entry = FindVar(smpl.GetSymbol());
 			Parser::PushBackToken(smpl);
+			if (entry != NULL && entry->kind == VK_ROUTINE && entry->type == PROCEDURE){
+				return CallStmt(in, line);
+			}
 			return AssignStmt(in, line);
+		}
 
 		case WRITELN:
 			return WriteLnStmt(in, line);
 
-		case WRITE: 
+		case WRITE:
 			return WriteStmt(in, line);
-		
+
+		case READLN:
+			return ReadLnStmt(in, line);
+
 		//We won't ever get here, added for compile safety on Vocareum
 		default:
 			return false;
@@ -531,46 +1481,42 @@ bool SimpleStmt(istream& in, int& line){
 /**
  * WriteLnStmt
  * WriteLnStmt ::= writeln (ExprList)
- * */ 
+ * */
 bool WriteLnStmt(istream& in, int& line) {
 	LexItem t;
+	//How many values ExprList leaves on the stack to be printed
+	int count = 0;
+	bool ex;
 
-    //A queue to be used to print out all of the values from exprList
-	ValQue = new queue<Value>;
-	
     //Get the first token and ensure its an LPAREN
 	t = Parser::GetNextToken(in, line);
 	if( t != LPAREN ) {
 		ParseError(line, "Missing Left Parenthesis");
 		return false;
 	}
-	
-    //Call ExprList to populate the ValQueue using our pointer
-	bool ex = ExprList(in, line);
-	
+
+    //Call ExprList to compile every expression in the list
+	{
+		OnFailure context("Missing expression list for WriteLn statement");
+		ex = ExprList(in, line, count);
+	}
+
     //If ExprList fails we have an error
 	if( !ex ) {
 		ParseError(line, "Missing expression list for WriteLn statement");
 		return false;
 	}
-	
+
     //finally check for the required RPAREN
 	t = Parser::GetNextToken(in, line);
 	if(t != RPAREN ) {
-		
+
 		ParseError(line, "Missing Right Parenthesis");
 		return false;
 	}
-	
-	//Evaluate: print out the list of expressions' values once all syntax works
-	while (!(*ValQue).empty())
-	{
-		Value nextVal = (*ValQue).front();
-		cout << nextVal;
-		ValQue->pop();
-	}
-    //Print the endl since this is a writeln statement
-	cout << endl;
+
+	//Print out the list of expressions' values, followed by the endl since this is a writeln statement
+	Emit(line, OP_WRITELN, count);
 
 	return ex;
 }
@@ -581,8 +1527,9 @@ bool WriteLnStmt(istream& in, int& line) {
  * WriteStmt ::= write (ExprList)
 */
 bool WriteStmt(istream& in, int& line){
-    //A queue to be used to print out all of the values from exprList
-	ValQue = new queue<Value>;
+	//How many values ExprList leaves on the stack to be printed
+	int count = 0;
+	bool expr;
 
 	//Get the token after the word "write" and check if its an lparen
 	LexItem t = Parser::GetNextToken(in, line);
@@ -594,7 +1541,10 @@ bool WriteStmt(istream& in, int& line){
 	}
 
 	//Generate the ExprList recursively
-	bool expr = ExprList(in, line);
+	{
+		OnFailure context("Missing expression list for Write statement");
+		expr = ExprList(in, line, count);
+	}
 
 	//If no ExprList was gotten create a different error
 	if (!expr){
@@ -604,35 +1554,96 @@ bool WriteStmt(istream& in, int& line){
 
 	//Check for a right parenthesis
 	t = Parser::GetNextToken(in, line);
-	
+
     //If no RPAREN, syntax error
 	if (t != RPAREN) {
 		ParseError(line, "Missing right Parenthesis");
 		return false;
 	}
 
-    //Evaluate: print out the list of expressions' values once all syntax works
-	while (!(*ValQue).empty())
-	{
-		Value nextVal = (*ValQue).front();
-		cout << nextVal;
-		ValQue->pop();
-	}
+    //Print out the list of expressions' values
+	Emit(line, OP_WRITE, count);
 
 	return expr;
 }
 
 
+/**
+ * ReadLnStmt reads a value from standard input into each variable in turn, and then skips the rest of
+ * the input line. Without any variables it only skips the line
+ * ReadLnStmt ::= readln [ ( Var {, Var } ) ]
+ * Each variable reads a value of its own type, see input.h. It may be an element of an array
+*/
+bool ReadLnStmt(istream& in, int& line){
+	LexItem t = Parser::GetNextToken(in, line);
+	if (t != LPAREN){
+		Parser::PushBackToken(t);
+		Emit(line, OP_READLN);
+		return true;
+	}
+
+	do {
+		LexItem idtok;
+		if (!Var(in, line, idtok)){
+			ParseError(line, "Missing variable list for ReadLn statement");
+			return false;
+		}
+
+		const VarEntry& target = SymTable[idtok.GetSymbol()];
+		bool element = (target.kind == VK_ARRAY);
+		if (element){
+			t = Parser::GetNextToken(in, line);
+			if (t != LBRACKET){
+				ParseError(line, "Illegal use of a whole array");
+				return false;
+			}
+			if (!Index(in, line, ScratchVec<Token>())){
+				return false;
+			}
+
+		} else if (target.kind == VK_ROUTINE){
+			ParseError(line, "Illegal assignment to a procedure or function");
+			return false;
+
+		} else if (find(Gen::forSlots.begin(), Gen::forSlots.end(), ForSlot(target)) != Gen::forSlots.end()){
+			ParseError(line, "Illegal assignment to FOR statement control variable");
+			return false;
+		}
+
+		//The value read is always of the variable's type, so only an element's index can be wrong
+		Check(Emit(line, OP_READ, target.type), "Invalid input for ReadLn statement");
+		if (element){
+			Check(Emit(line, OP_ISTORE, target.slot), "Mismatched types in assignment operation");
+		} else {
+			Check(EmitStore(line, target), "Mismatched types in assignment operation");
+		}
+
+		t = Parser::GetNextToken(in, line);
+	} while (t == COMMA);
+
+	if (t != RPAREN){
+		ParseError(line, "Missing Right Parenthesis");
+		return false;
+	}
+
+	Emit(line, OP_READLN);
+	return true;
+}
+
+
 // Processing all IF statements
 // IfStmt ::= IF Expr THEN Stmt [ ELSE Stmt ]
+//Both branches are compiled, and the condition decides which one runs
 bool IfStmt(istream& in, int& line){
 	LexItem l;
-	//The val value to be used with Expr
-	Value val;
+	bool status;
 
 	//Once this function is called, the IF token has been consumed already
 	//We should see a valid expression at this point
-	bool status = Expr(in, line, val);
+	{
+		OnFailure context("Invalid expression in IF statement.");
+		status = Expr(in, line);
+	}
 
 	//if expression is not valid, throw an error
 	if(!status){
@@ -640,13 +1651,10 @@ bool IfStmt(istream& in, int& line){
 		return false;
 	}
 
-	//If val is not a boolean, that's an error
-	if(val.GetType() != VBOOL){
-		ParseError(line, "Expression in IF Statement must be of type Boolean");
-		return false;
-	}
+	//If val is false, jump over the THEN branch. It is an error if val is not a boolean
+	int jumpElse = Check(Emit(line, OP_JUMPF), "Expression in IF Statement must be of type Boolean");
 
-	l = Parser::GetNextToken(in, line); 
+	l = Parser::GetNextToken(in, line);
 
 	//If its unknown, throw error
 	if (l == ERR ){
@@ -661,643 +1669,882 @@ bool IfStmt(istream& in, int& line){
 		return false;
 	}
 
-	//Once we're here we know we have ::= IF expr = true THEN stmt 
-	
-	//If val is true, execute the stmt and return
-	if (val.GetBool()){
-		//Exceute the stmt
+	//Once we're here we know we have ::= IF expr THEN stmt, which runs if val is true
+	{
+		OnFailure context("Bad Statement in IF Statement");
 		status = Stmt(in, line);
-		
-		//Potential for a bad stmt here
-		if(!status){
-			ParseError(line, "Bad Statement in IF Statement");
-			return false;
-		}
+	}
 
-		//we also need to "skip over" the entire else statement if this is the case
-		l = Parser::GetNextToken(in, line);
-		
-		//Skip over until l is a semicol
-		while(l != SEMICOL) {
-			//Catch any errors we might see while we're at it
-			if (l == ERR){
-				ParseError(line, "Unrecognized Input Pattern");
-				cout << "(" << l.GetToken() << ")" << endl;
-				return false;
-			}
+	//Potential for a bad stmt here
+	if(!status){
+		ParseError(line, "Bad Statement in IF Statement");
+		return false;
+	}
 
-			//we are in a compound statement, skip until we see end
-			if (l == BEGIN){
-				LexItem cs;
-				while(cs != END){
-					cs = Parser::GetNextToken(in, line);
-				}
-			}
+	//There may or may not be an ELSE
+	l = Parser::GetNextToken(in, line);
 
-			l = Parser::GetNextToken(in, line);
-		}
-		
-		//We will have consumed one extra token by here, so return it
+	//Without one, a false val just carries on after the stmt
+	if (l != ELSE){
+		//put the token back, it's not this function's job to procees it
 		Parser::PushBackToken(l);
-	
-	} else {
-		//If we get here the val was false, so there are 2 options based on whether or not there is an ELSE
-		l = Parser::GetNextToken(in, line);
+		Land(jumpElse);
+		return true;
+	}
 
-		//We want to skip over the statement after then, as it is not being executed
-		while(l != SEMICOL && l != ELSE){
-			//Catch any errors we might see while we're at it
-			if (l == ERR){
-				ParseError(line, "Unrecognized Input Pattern");
-				cout << "(" << l.GetToken() << ")" << endl;
-				return false;
-			}
+	//Otherwise the THEN branch has to jump over the else stmt, which is where a false val goes
+	int jumpEnd = Emit(line, OP_JUMP);
+	Land(jumpElse);
 
-			//we are in a compound statement, skip until we see end
-			if (l == BEGIN){
-				LexItem cs;
-				while(cs != END){
-					cs = Parser::GetNextToken(in, line);
-				}
-			}
+	{
+		OnFailure context("Invalid stmt in IF-ELSE stmt else block");
+		status = Stmt(in, line);
+	}
 
-			l = Parser::GetNextToken(in, line);
-		}
+	//If it fails return false
+	if(!status){
+		ParseError(line, "Invalid stmt in IF-ELSE stmt else block");
+		return false;
+	}
+	Land(jumpEnd);
 
-		//If we get here, we know l is either a SEMICOL or an ELSE
-		
-		//If we just have a semicol, return and be done
-		if(l == SEMICOL) {
-			//put the semicol back, it's not this function's job to procees it
-			Parser::PushBackToken(l);
-			return true;
-		} 
+	//If we make it here, everything worked
+	return true;
+}
 
-		//otherwise if we have an else stmt, keep the token and process the stmt
-		if (l == ELSE){
-			//Execute the else stmt
-			status = Stmt(in, line);
 
-			//If it fails return false
-			if(!status){
-				ParseError(line, "Invalid stmt in IF-ELSE stmt else block");
-				return false;
-			}
-		}
+// Processing all WHILE loops
+// WhileStmt ::= WHILE Expr DO Stmt
+//The condition is tested before every time round, so the loop starts with it
+bool WhileStmt(istream& in, int& line){
+	LexItem l;
+	bool status;
+	int top = Gen::code->code.size();
+
+	//Once this function is called, the WHILE token has been consumed already
+	{
+		OnFailure context("Invalid expression in WHILE statement.");
+		status = Expr(in, line);
 	}
 
-	//If we make it here, everything worked
+	if(!status){
+		ParseError(line, "Invalid expression in WHILE statement.");
+		return false;
+	}
+
+	//Leave the loop once val is false. It is an error if val is not a boolean
+	int jumpExit = Check(Emit(line, OP_JUMPF), "Expression in WHILE Statement must be of type Boolean");
+
+	l = Parser::GetNextToken(in, line);
+
+	if (l == ERR){
+		ParseError(line, "Unrecognized Input Pattern");
+		cout << "(" << l.GetToken() << ")" << endl;
+		return false;
+	}
+
+	if (l != DO){
+		ParseError(line, "Missing DO in WHILE statement.");
+		return false;
+	}
+
+	//The body, after which we go back and test the condition again
+	{
+		OnFailure context("Bad Statement in WHILE Statement");
+		status = Stmt(in, line);
+	}
+
+	if(!status){
+		ParseError(line, "Bad Statement in WHILE Statement");
+		return false;
+	}
+
+	Emit(line, OP_JUMP, top);
+	Land(jumpExit);
+
 	return true;
 }
 
 
-/**
- * Assignment Statements take in a var, ASSOP and expression
- * AssignStmt ::= Var := Expr
-*/
-bool AssignStmt(istream& in, int& line){
-	bool status = false;
-	bool varStatus = false;
+// Processing all FOR loops
+// ForStmt ::= FOR Var := Expr TO Expr DO Stmt
+//The control variable counts up from the first value to the second, and the loop does not run at all
+//if the first one is larger. It is counted as a plain int rather than a Value, so it must be an
+//integer, and the body may not assign to it
+bool ForStmt(istream& in, int& line){
 	LexItem l;
-	//This will be used for finding types from var
 	LexItem idtok;
-	//This will be used for Expr
-	Value val;
+	bool status;
 
-	//Check to see the status of the identifier that we have(was it already declared?)
-	varStatus = Var(in, line, idtok);
+	//Once this function is called, the FOR token has been consumed already
+	if(!Var(in, line, idtok)){
+		ParseError(line, "Missing control variable in FOR statement.");
+		return false;
+	}
 
-	//If the variable wasn't correct, we essentially have no variable
-	if(!varStatus){
-		ParseError(line, "Missing Left-Hand Side Variable in Assignment statement");
+	const VarEntry& entry = SymTable[idtok.GetSymbol()];
+	if(idtok != INTEGER || (entry.kind != VK_GLOBAL && entry.kind != VK_LOCAL)){
+		ParseError(line, "Control variable in FOR statement must be of type Integer");
+		return false;
+	}
+
+	//A loop inside of another one can't take over its control variable either
+	int slot = ForSlot(entry);
+	if(find(Gen::forSlots.begin(), Gen::forSlots.end(), slot) != Gen::forSlots.end()){
+		ParseError(line, "Illegal assignment to FOR statement control variable");
 		return false;
 	}
 
-	//If we get here, we know we have a valid Var
-	//Get the next token(should be assop)
 	l = Parser::GetNextToken(in, line);
 
-	//If we have an error token, throw error and exit
 	if (l == ERR){
 		ParseError(line, "Unrecognized Input Pattern");
-		//print out the unrecognized input
 		cout << "(" << l.GetLexeme() << ")" << endl;
 		return false;
 	}
 
-	//If we don't have an assop here, no reason in continuing
 	if (l != ASSOP){
-		ParseError(line, "Missing Assignment Operator in AssignStmt");
+		ParseError(line, "Missing Assignment Operator in FOR statement");
 		return false;
 	}
 
-	//Once we're here, we know we have Valid Var :=, now analyze the expr
-	status = Expr(in, line, val);
+	//The initial value
+	{
+		OnFailure context("Invalid initial value in FOR statement.");
+		status = Expr(in, line);
+	}
 
-	//If there's no expression, thats an error
-	if (!status){
-		ParseError(line, "Missing Expression in Assignment Statement");
+	if(!status){
+		ParseError(line, "Invalid initial value in FOR statement.");
 		return false;
 	}
 
-	//Once we're here, we know we have Var := Expr, but we don't know if our types match, so do type checking
+	l = Parser::GetNextToken(in, line);
 
-	//using our idtok, which has the variable name as its lexeme
-	string var = idtok.GetLexeme();
+	if (l != TO){
+		ParseError(line, "Missing TO in FOR statement.");
+		return false;
+	}
 
-	//right now, idtok is holding the type of the valid variable, and val is holding the the value gotten from some valid expr
-	switch(idtok.GetToken()){
-		case STRING:
-			//Types must match for this to work
-			if(val.IsString()){
-				TempsResults[var] = val;
-				return true;
-			}
-			break;
+	//The final value
+	{
+		OnFailure context("Invalid final value in FOR statement.");
+		status = Expr(in, line);
+	}
 
-		case BOOLEAN:
-			//Types also must match for booleans
-			if(val.IsBool()){
-				TempsResults[var] = val;
-				return true;
-			}
-			break;
+	if(!status){
+		ParseError(line, "Invalid final value in FOR statement.");
+		return false;
+	}
 
-		case REAL:
-			//they match, nothing to do here
-			if(val.IsReal()){
-				TempsResults[var] = val;
-				return true;
-			} 
-			
-			//here is the special case, cast to the type of the LHS(t in our case)
-			if(val.IsInt()){
-				val.SetReal((float)val.GetInt());
-				val.SetType(VREAL);
-
-				TempsResults[var] = val;
-				return true;
-			}
-			break;
+	l = Parser::GetNextToken(in, line);
 
-		case INTEGER:
-			//they match, nothing to do here
-			if(val.IsInt()){
-				TempsResults[var] = val;
-				return true;
-			} 
-		
-			//another special case here, cast to the LHS of INT in this case
-			if(val.IsReal()) {
-				val.SetInt((int)val.GetReal());
-				val.SetType(VINT);
+	if (l != DO){
+		ParseError(line, "Missing DO in FOR statement.");
+		return false;
+	}
 
-				TempsResults[var] = val;
-				return true;
-			}
-			break;
+	//Both values are evaluated once, before the loop starts. Each loop that is running at the same time
+	//needs a counter of its own
+	int counter = Gen::forSlots.size();
+	Gen::code->counters = max(Gen::code->counters, counter + 1);
+	int prep = Check(Emit(line, OP_FORPREP, 0, counter, slot), "Values in FOR statement must be of type Integer");
 
-		//We should never get here in theory, added to remove compile warnings
-		default:
-			ParseError(line, "Illegal Assignment Operation");
-			return false;
+	Gen::forSlots.push_back(slot);
+	{
+		OnFailure context("Bad Statement in FOR Statement");
+		status = Stmt(in, line);
 	}
+	Gen::forSlots.pop_back();
 
-	//if we get here, we know there must have been some mismatched types
-	ParseError(line, "Mismatched types in assignment operation");
-	return false;
+	if(!status){
+		ParseError(line, "Bad Statement in FOR Statement");
+		return false;
+	}
+
+	//Count, and go round again unless that was the final value
+	Emit(line, OP_FORNEXT, prep + 1, counter);
+	Land(prep);
+
+	return true;
 }
 
 
-// Check to see if the variable is valid and has previously been declared
-// Var ::= IDENT
-bool Var(istream& in, int& line, LexItem& idtok){
-	//get the token, check to see if var was declared
-	LexItem l = Parser::GetNextToken(in, line);
+//The label at l of a CASE statement, as the type of the labels and a key that is the same for the same
+//label: the value of an integer or boolean and the interned symbol of a string
+//Label ::= [ + | - ] ICONST | BCONST | SCONST
+static bool CaseLabel(istream& in, int& line, LexItem l, Token& type, int& key){
+	int sign = 1;
+	if (l == PLUS || l == MINUS){
+		sign = (l == MINUS) ? -1 : 1;
+		l = Parser::GetNextToken(in, line);
+		if (l != ICONST){
+			ParseError(line, "Illegal use of a sign before a CASE label.");
+			return false;
+		}
+	}
 
-	//If we can find the variable, return true
-	if(defVar.find(l.GetLexeme())-> second){
-		//Use idtok to conveniently store the type of the variable using symTable
-		idtok = LexItem(SymTable[l.GetLexeme()], l.GetLexeme(), line);
-		return true;
+	switch(l.GetToken()){
+		case ICONST: {
+			const string& text = l.GetLexeme();
+			long long value = 0;
+			bool read = from_chars(text.data(), text.data() + text.size(), value).ec == errc();
+			value *= sign;
+			if (!read || value < INT_MIN || value > INT_MAX){
+				ParseError(line, "CASE label out of range.");
+				return false;
+			}
+			type = INTEGER;
+			key = (int)value;
+			return true;
+		}
 
-	//If lexeme is unrecognized, then give this error
-	} else if (l == ERR) {
-		ParseError(line, "Unrecognized Input Pattern");
-		cout << "(" << l.GetToken() << ")" << endl;
-		return false;
+		case BCONST:
+			type = BOOLEAN;
+			key = (l.GetSymbol() == SYM_TRUE);
+			return true;
 
-	//If we get here, we have a valid variable name that was just not declared. Show appropriate error
+		case SCONST:
+			type = STRING;
+			key = l.GetSymbol();
+			return true;
+
+		default:
+			ParseError(line, "Illegal CASE label.");
+			return false;
+	}
+}
+
+//Builds the table OP_CASE uses to find where each label's statement starts, for labels of the given
+//type that are (key, start) pairs, see CaseKind, sorting them. Anything else goes to otherwise
+static int EmitCaseTable(Token type, ScratchVec<pair<int, int>>& labels, int otherwise){
+	Code& code = *Gen::code;
+	CaseTable table{ CK_SORTED, type, 0, 0, (int)code.caseKeys.size(), (int)labels.size(), otherwise };
+
+	if (type == STRING){
+		//Try a few seeds at each size until one puts every label in an entry of its own. Each time
+		//the table doubles that gets more likely, and a handful of labels rarely needs more than twice
+		//as many entries as there are labels
+		size_t size = 1;
+		while (size < labels.size()){
+			size *= 2;
+		}
+		ScratchVec<char> taken(&scratch);
+		for (;; size *= 2){
+			bool found = false;
+			for (uint32_t seed = 0; seed < 32 && !found; seed++){
+				taken.assign(size, 0);
+				found = true;
+				for (const pair<int, int>& label : labels){
+					char& entry = taken[CaseHash(SymbolName(label.first), seed) & (size - 1)];
+					if (entry){
+						found = false;
+						break;
+					}
+					entry = 1;
+				}
+				table.seed = seed;
+			}
+			if (found){
+				break;
+			}
+		}
+
+		table.kind = CK_STRING;
+		table.count = size;
+		code.caseKeys.resize(table.first + size, -1);
+		code.caseTargets.resize(table.first + size, otherwise);
+		for (const pair<int, int>& label : labels){
+			size_t entry = table.first + (CaseHash(SymbolName(label.first), table.seed) & (size - 1));
+			code.consts.push_back(Value(Rope(label.first)));
+			code.caseKeys[entry] = code.consts.size() - 1;
+			code.caseTargets[entry] = label.second;
+		}
+		code.caseTables.push_back(table);
+		return code.caseTables.size() - 1;
+	}
+
+	sort(labels.begin(), labels.end());
+	long long low = labels.front().first;
+	long long range = labels.back().first - low + 1;
+	if (range <= 2 * (long long)labels.size()){
+		table.kind = CK_DENSE;
+		table.low = low;
+		table.count = range;
+		code.caseKeys.resize(table.first + range, -1);
+		code.caseTargets.resize(table.first + range, otherwise);
+		for (const pair<int, int>& label : labels){
+			code.caseTargets[table.first + (label.first - low)] = label.second;
+		}
 	} else {
-		ParseError(line, "Undeclared Variable");
-		return false;
+		for (const pair<int, int>& label : labels){
+			code.caseKeys.push_back(label.first);
+			code.caseTargets.push_back(label.second);
+		}
 	}
 
-	//We should never get here, added to remove compile warnings
-	return false;
+	code.caseTables.push_back(table);
+	return code.caseTables.size() - 1;
 }
 
+// Processing all CASE statements
+// CaseStmt ::= CASE Expr OF CaseArm { ; CaseArm } [ ; ] [ ELSE Stmt [ ; ] ] END
+// CaseArm ::= Label {, Label } : Stmt
+//The labels are constants of one type, INTEGER, BOOLEAN or STRING, and no label may appear twice. The
+//selector goes straight to the statement of the label it matches, or to the ELSE statement if it
+//matches none, and it is an error if it is not of the labels' type
+bool CaseStmt(istream& in, int& line){
+	LexItem l;
+	bool status;
 
-//Simply calls expr recursively, so long as there are more commas. This will be used in our writeln
-//ExprList:= Expr {,Expr}
-bool ExprList(istream& in, int& line) {
-	bool status = false;
-	Value retVal;
-
-	//Call expr, passing in retVal so we can have a result
-	status = Expr(in, line, retVal);
+	//Once this function is called, the CASE token has been consumed already
+	{
+		OnFailure context("Invalid expression in CASE statement.");
+		status = Expr(in, line);
+	}
 
-	//If expr is bad, no point in continuing
 	if(!status){
-		ParseError(line, "Missing Expression");
+		ParseError(line, "Invalid expression in CASE statement.");
 		return false;
 	}
 
-	//Push the value to the queue of values to be printed
-	ValQue->push(retVal);
+	//Where it goes is only known once every label has been read
+	int dispatch = Check(Emit(line, OP_CASE), "Expression in CASE Statement must be of the same type as its labels");
 
-	//get and analyze next token, if it is a comma we should recursively call this function again
-	LexItem tok = Parser::GetNextToken(in, line);
-	
-	if (tok == COMMA) {
-		status = ExprList(in, line);
+	l = Parser::GetNextToken(in, line);
 
-	} else if(tok.GetToken() == ERR){
+	if (l == ERR){
 		ParseError(line, "Unrecognized Input Pattern");
-		cout << "(" << tok.GetLexeme() << ")" << endl;
+		cout << "(" << l.GetLexeme() << ")" << endl;
 		return false;
+	}
 
-	} else {
-		Parser::PushBackToken(tok);
-		return true;
+	if (l != OF){
+		ParseError(line, "Missing OF in CASE statement.");
+		return false;
 	}
 
-	return status;
-}
+	//Every label with where its statement starts, the keys of the labels so far for finding one that
+	//appears twice, and the jumps from the end of each statement
+	ScratchVec<pair<int, int>> labels(&scratch);
+	pmr::unordered_set<int> keys(&scratch);
+	ScratchVec<int> jumpsEnd(&scratch);
+	Token type = ERR;
 
+	l = Parser::GetNextToken(in, line);
+	do {
+		int start = Gen::code->code.size();
+		for(;;){
+			Token labelType;
+			int key;
+			if (!CaseLabel(in, line, l, labelType, key)){
+				return false;
+			}
 
-//Expr ::= LogOrExpr ::= LogAndExpr { OR LogAndExpr }
-//So essentially: Expr ::= LogANDExpr { OR LogAndExpr}
-bool Expr(istream& in, int& line, Value& retVal){
-	bool status = false;
-	LexItem l;
-	
-	//Once we get here, first thing to do is call LogAndExpr
-	status = LogANDExpr(in, line, retVal);
-	//If this is all that we have, it doesn't matter the type of retVal
+			if (type != ERR && labelType != type){
+				ParseError(line, "Mixed types of CASE labels.");
+				return false;
+			}
+			type = labelType;
 
-	//If expression is bad, return false
-	if (!status){
-		return false;
-	}
+			if (!keys.insert(key).second){
+				ParseError(line, "Duplicate CASE label.");
+				return false;
+			}
+			labels.push_back(make_pair(key, start));
 
-	//Once we're here, we can either have nothing or one or more OR's followed by more LogAndExpr
-	//Get the next token
-	l = Parser::GetNextToken(in, line);
+			l = Parser::GetNextToken(in, line);
+			if (l != COMMA){
+				break;
+			}
+			l = Parser::GetNextToken(in, line);
+		}
 
-	//While we have an OR, keep processing LogAndExpr's
-	while (l == OR){
-		Value val;
-		status = LogANDExpr(in, line, val);
+		if (l != COLON){
+			ParseError(line, "Missing Colon in CASE statement.");
+			return false;
+		}
 
-		//If expression is bad, return error
-		if (!status){
+		{
+			OnFailure context("Bad Statement in CASE Statement");
+			status = Stmt(in, line);
+		}
+
+		if(!status){
+			ParseError(line, "Bad Statement in CASE Statement");
 			return false;
 		}
+		jumpsEnd.push_back(Emit(line, OP_JUMP));
 
-		//perform the "OR"ing for retval and val and reassign it to retVal
-		retVal = retVal || val;
+		l = Parser::GetNextToken(in, line);
+		if (l == SEMICOL){
+			l = Parser::GetNextToken(in, line);
+		}
+	} while (l != END && l != ELSE && l != ERR && l != DONE);
+
+	//Without an ELSE, a selector that matches nothing carries on after the statement
+	int otherwise = -1;
+	if (l == ELSE){
+		otherwise = Gen::code->code.size();
+		{
+			OnFailure context("Invalid stmt in CASE stmt else block");
+			status = Stmt(in, line);
+		}
 
-		//If this doesn't work, we had a bad or operation(i.e. we either val or retval isn't a boolean)
-		if(retVal.IsErr()){
-			ParseError(line, "Illegal use of non-boolean operand with OR");
+		if(!status){
+			ParseError(line, "Invalid stmt in CASE stmt else block");
 			return false;
 		}
 
-		//refresh the value of l
 		l = Parser::GetNextToken(in, line);
+		if (l == SEMICOL){
+			l = Parser::GetNextToken(in, line);
+		}
 	}
 
-	// if we have an ERR token, throw error
-	if (l == ERR) {
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")";
+	if (l != END){
+		ParseError(line, "Missing END in CASE statement.");
 		return false;
 	}
 
-	//Once we get here, l was not an OR, so put it back and we're done
-	Parser::PushBackToken(l);
+	for (int jump : jumpsEnd){
+		Land(jump);
+	}
+	int end = Gen::code->code.size();
+	Gen::code->code[dispatch].a = EmitCaseTable(type, labels, otherwise >= 0 ? otherwise : end);
+
+	return true;
+}
+
+
+//Compiles the index of an array element, from after the [ up to and including the ]. If it fails at
+//run time, what the expression around it has pending in ops is reported as well, just like it is when
+//it fails to compile
+static bool Index(istream& in, int& line, const ScratchVec<Token>& ops){
+	bool status;
+	{
+		InsideOperand operand(ops);
+		OnFailure failure("Invalid array index.");
+		status = Expr(in, line);
+	}
+
+	if (!status){
+		ParseError(line, "Invalid array index.");
+		return false;
+	}
 
-	//If we end up here, everything worked
+	LexItem l = Parser::GetNextToken(in, line);
+	if (l != RBRACKET){
+		ParseError(line, "Missing Right Bracket");
+		return false;
+	}
 	return true;
 }
 
 
-// LogAndExpr ::= RelExpr {AND RelExpr }
-bool LogANDExpr(istream& in, int& line, Value& retVal){
+/**
+ * Assignment Statements take in a var, ASSOP and expression
+ * AssignStmt ::= Var [ [ Expr ] ] := Expr
+ * An array is assigned either one element at a time, or as a whole from a whole-array expression or
+ * a scalar that every element is set to. Inside of a function, assigning to its name sets its result
+*/
+bool AssignStmt(istream& in, int& line){
 	bool status = false;
+	bool varStatus = false;
 	LexItem l;
+	//This will be used for finding types from var
+	LexItem idtok;
+
+	//Check to see the status of the identifier that we have(was it already declared?)
+	varStatus = Var(in, line, idtok);
+
+	//If the variable wasn't correct, we essentially have no variable
+	if(!varStatus){
+		ParseError(line, "Missing Left-Hand Side Variable in Assignment statement");
+		return false;
+	}
+
+	VarEntry target = SymTable[idtok.GetSymbol()];
+	if (target.kind == VK_ROUTINE){
+		//The result of the function whose body this is
+		if (target.slot != Gen::routine || target.type == PROCEDURE){
+			ParseError(line, "Illegal assignment to a procedure or function");
+			return false;
+		}
+		target = VarEntry{ target.type, VK_LOCAL, Routines[target.slot].result };
+	}
+
+	int slot = target.slot;
+	bool array = (target.kind == VK_ARRAY);
+	bool element = false;
+
+	if (array){
+		//An element of the array, or else all of it
+		l = Parser::GetNextToken(in, line);
+		if (l == LBRACKET){
+			if (!Index(in, line, ScratchVec<Token>())){
+				return false;
+			}
+			element = true;
+		} else {
+			Parser::PushBackToken(l);
+		}
+
+	//The control variable of a FOR loop only changes as the loop counts
+	} else if(find(Gen::forSlots.begin(), Gen::forSlots.end(), ForSlot(target)) != Gen::forSlots.end()){
+		ParseError(line, "Illegal assignment to FOR statement control variable");
+		return false;
+	}
+
+	//If we get here, we know we have a valid Var
+	//Get the next token(should be assop)
+	l = Parser::GetNextToken(in, line);
+
+	//If we have an error token, throw error and exit
+	if (l == ERR){
+		ParseError(line, "Unrecognized Input Pattern");
+		//print out the unrecognized input
+		cout << "(" << l.GetLexeme() << ")" << endl;
+		return false;
+	}
+
+	//If we don't have an assop here, no reason in continuing
+	if (l != ASSOP){
+		ParseError(line, "Missing Assignment Operator in AssignStmt");
+		return false;
+	}
 
-	//Once we get here, the first thing we should do is check for a relational expression
-	status = RelExpr(in, line, retVal);
-	//If we there are no AND operations, it's fine if retVal isn't a boolean
+	//Once we're here, we know we have Valid Var :=, now analyze the expr
+	ScratchVec<VecNode> nodes(&scratch);
+	{
+		OnFailure context("Missing Expression in Assignment Statement");
+		status = CompileExpr(in, line, (array && !element) ? &nodes : NULL);
+	}
 
-	//If we have a bad relational expression, return error
+	//If there's no expression, thats an error
 	if (!status){
-		//ParseError(line, "Syntactic error in relational expression.");
+		ParseError(line, "Missing Expression in Assignment Statement");
 		return false;
 	}
 
-	//Good first expression, check to see if we have an AND token
-	l = Parser::GetNextToken(in, line);
-
-	//So long as we keep seeing AND, keep processing tokens
-	while (l == AND){
-		Value val;
-		//Check the next relational expression
-		status = RelExpr(in, line, val);
-
-		//If its a bad expression, throw an error and stop
-		if (!status){
-			return false;
+	//Once we're here, we know we have Var := Expr, but we don't know if our types match until the value is stored
+	//idtok is holding the type of the valid variable. Integers and reals are converted to it, any other
+	//mismatch is an error
+	if (element){
+		Check(Emit(line, OP_ISTORE, slot), "Mismatched types in assignment operation");
+	} else if (array){
+		if (nodes.empty()){
+			nodes.push_back(VecNode{ VN_SCALAR, 0 });
 		}
+		Check(EmitArrayAssign(line, slot, nodes), "Mismatched types in assignment operation");
+	} else {
+		Check(EmitStore(line, target), "Mismatched types in assignment operation");
+	}
+	return true;
+}
 
-		//Perform the "AND"ing between retVal and Val
-		retVal = retVal && val;
 
-		//If retVal happens to be an error, that means we had a non-boolean operand somewhere
-		if (retVal.IsErr()){
-			ParseError(line, "Illegal use of a non-boolean operand with AND");
-			return false;
-		}
+//Compiles a call to the routine in entry, whose name has been read already: its arguments and then
+//the call itself. ops are what the expression around a function call has pending, see Index
+//Call ::= IDENT [ ( [ ExprList ] ) ]
+static bool Call(istream& in, int& line, const VarEntry& entry, const ScratchVec<Token>& ops){
+	bool function = (entry.type != PROCEDURE);
+	const char* msg = function ? "Invalid function call" : "Invalid procedure call";
+	//How many arguments ExprList leaves on the stack
+	int count = 0;
 
-		//Refresh the value of l
+	//The arguments are optional, and so are the parentheses when there are none
+	LexItem l = Parser::GetNextToken(in, line);
+	if (l == LPAREN){
 		l = Parser::GetNextToken(in, line);
+		if (l != RPAREN){
+			Parser::PushBackToken(l);
+			bool status;
+			{
+				InsideOperand operand(ops);
+				OnFailure context(msg);
+				status = ExprList(in, line, count);
+			}
+
+			if (!status){
+				ParseError(line, msg);
+				return false;
+			}
+
+			l = Parser::GetNextToken(in, line);
+			if (l != RPAREN){
+				ParseError(line, "Missing Right Parenthesis");
+				return false;
+			}
+		}
+	} else {
+		Parser::PushBackToken(l);
 	}
 
-	//If we got here, we know l wasn't AND, check if it is ERR
-	if (l == ERR) {
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")";
+	if (count != (int)Routines[entry.slot].params.size()){
+		ParseError(line, "Incorrect number of arguments");
+		ParseError(line, msg);
 		return false;
 	}
-	
-	//If we get here, l wasn't AND or an ERR, so push it back to the stream
-	Parser::PushBackToken(l);
 
-	return status;
+	//The arguments are converted to the types of the parameters as the call is made, and anything that
+	//fails inside of the routine fails the call as well
+	Check(Emit(line, OP_CALL, entry.slot, count, function ? 1 : 0), msg, &ops);
+	return true;
 }
 
 
-// RelExpr ::= SimpleExpr [ ( = | < | > ) SimpleExpr ]
-bool RelExpr(istream& in, int& line, Value& retVal){
-	bool status;
-	LexItem l;
-
-	//We should first see a valid SimpleExpr
-	status = SimpleExpr(in, line, retVal);
-
-	//return false if bad
-	if (!status) {
+/**
+ * A procedure call is a statement of its own
+ * CallStmt ::= IDENT [ ( [ ExprList ] ) ]
+*/
+bool CallStmt(istream& in, int& line){
+	LexItem idtok;
+	if (!Var(in, line, idtok)){
 		return false;
 	}
+	return Call(in, line, SymTable[idtok.GetSymbol()], ScratchVec<Token>());
+}
 
-	//If we get here we can optionally see =, < or > once
-	l = Parser::GetNextToken(in, line);
-
-	//If it is one of these, check for the validity of the simpleExpr
-	if (l == EQ || l == GTHAN || l == LTHAN) {
-		Value val;
-		//Process the simpleExpr following this
-		status = SimpleExpr(in, line, val);
-
-		//return false if bad
-		if(!status) {
-			return false;
-		}
-
-		//Now we need to perform the operation, making use of our overloaded operators
-		switch(l.GetToken()){
-			case EQ:
-				retVal = retVal == val;
-				break;
 
-			case GTHAN:
-				retVal = retVal > val;
-				break;
+// Check to see if the variable is valid and has previously been declared
+// Var ::= IDENT
+bool Var(istream& in, int& line, LexItem& idtok){
+	//get the token, check to see if var was declared
+	LexItem l = Parser::GetNextToken(in, line);
 
-			case LTHAN:
-				retVal = retVal < val;
-				break;
-			
-			//We won't ever get here, added to remove compile warnings
-			default:
-				return false;
-		}
+	//If we can find the variable, return true
+	VarEntry* entry = FindVar(l.GetSymbol());
+	if(entry != NULL){
+		//Use idtok to conveniently store the type of the variable using symTable
+		idtok = LexItem(entry->type, l.GetSymbol(), line);
+		return true;
 
-		if(!retVal.IsErr()){
-			return true;
-		} else {
-			ParseError(line, "Bad relational operation");
-			return false;
-		}
-	}
+	//If lexeme is unrecognized, then give this error
+	} else if (l == ERR) {
+		ParseError(line, "Unrecognized Input Pattern");
+		cout << "(" << l.GetToken() << ")" << endl;
+		return false;
 
-	//If lexeme is unknown, throw error
-	if (l == ERR) {
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")";
+	//If we get here, we have a valid variable name that was just not declared. Show appropriate error
+	} else {
+		ParseError(line, "Undeclared Variable");
 		return false;
 	}
 
-	//If we didn't have =, < or > or ERR, push token back and return status
-	Parser::PushBackToken(l);
-
-	//If we end up here, all went well
-	return true;
+	//We should never get here, added to remove compile warnings
+	return false;
 }
 
 
-//SimpleExpr :: Term { ( + | - ) Term }
-bool SimpleExpr(istream& in, int& line, Value& retVal){
-	bool status;
-	LexItem l;
+//Simply calls expr recursively, so long as there are more commas. This will be used in our writeln
+//Each expression leaves its value on the stack, and count is how many there are
+//ExprList:= Expr {,Expr}
+bool ExprList(istream& in, int& line, int& count) {
+	bool status = false;
 
-	//We should see a valid term first
-	status = Term(in, line, retVal);
+	//Call expr to compile the next value
+	{
+		OnFailure context("Missing Expression");
+		status = Expr(in, line);
+	}
 
-	//Throw error if invalid
+	//If expr is bad, no point in continuing
 	if(!status){
+		ParseError(line, "Missing Expression");
 		return false;
 	}
 
-	//once we're here, we can see 0 or many + and -
-	l = Parser::GetNextToken(in, line);
-
-	//So as long as we have plus or minus, we keep processing
-	while (l == PLUS || l == MINUS) {
-		//Secondary value for the other term
-		Value val;
+	//One more value to be printed
+	count++;
 
-		//Process the next term
-		status = Term(in, line, val);
+	//get and analyze next token, if it is a comma we should recursively call this function again
+	LexItem tok = Parser::GetNextToken(in, line);
 
-		//If we have a bad term, throw error
-		if(!status) {
-			return false;
-		}
+	if (tok == COMMA) {
+		status = ExprList(in, line, count);
 
-		//Once we're here, we process the arithmetic accordingly, using our overloaded operators
-		if (l == PLUS){
-			retVal = retVal + val;
-		}
+	} else if(tok.GetToken() == ERR){
+		ParseError(line, "Unrecognized Input Pattern");
+		cout << "(" << tok.GetLexeme() << ")" << endl;
+		return false;
 
-		if (l == MINUS){
-			retVal = retVal - val;
-		}
+	} else {
+		Parser::PushBackToken(tok);
+		return true;
+	}
 
-		//If somehow retVal is now an error, that means something didn't work, so exit accordingly
-		if (retVal.IsErr()){
-			ParseError(line, "Illegal arithmetic operation");
-			return false;
-		}
+	return status;
+}
 
-		//Refresh l
-		l = Parser::GetNextToken(in, line);
-	}
 
-	//If lexeme is unknown, throw error
-	if (l == ERR) {
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")";
-		return false;
-	}
+/**
+ * Expressions are parsed with precedence climbing over an explicit operator and operand stack
+ * instead of one recursive function per precedence level. Nesting depth is only limited by the
+ * heap, and each operand costs one pass through the loop rather than seven nested calls.
+ * The grammar it accepts is still the one from the README:
+ * Expr ::= LogOrExpr ::= LogAndExpr { OR LogAndExpr }
+ * LogAndExpr ::= RelExpr {AND RelExpr }
+ * RelExpr ::= SimpleExpr [ ( = | < | > ) SimpleExpr ]
+ * SimpleExpr :: Term { ( + | - ) Term }
+ * Term ::= SFactor { ( * | / | DIV | MOD ) SFactor }
+ * SFactor ::= [( - | + | NOT )] Factor
+ * Factor ::= IDENT [ [ Expr ] ] | Call | ICONST | RCONST | SCONST | BCONST | (Expr)
+ * The code for an expression leaves its value on the stack. Operators are compiled at exactly the
+ * points the per-level functions used to apply them, so values, errors and the line numbers they
+ * are reported on are unchanged.
+*/
 
-	//Once we're here, we know l wasn't + or -, so we're done
-	//Push l back and return status
-	Parser::PushBackToken(l);
+//How tightly each binary operator binds, higher binds tighter. Anything else is 0
+static int Precedence(Token t){
+	switch(t){
+		case OR:
+			return 1;
 
-	//All went well if we end up here
-	return true;
-}
+		case AND:
+			return 2;
 
+		case EQ:
+		case LTHAN:
+		case GTHAN:
+			return 3;
 
-//Term ::= SFactor { ( * | / | DIV | MOD ) SFactor }
-bool Term(istream& in, int& line, Value& retVal){
-	bool status;
-	LexItem l;
+		case PLUS:
+		case MINUS:
+			return 4;
 
-	//We must first see a valid Sfactor
-	status = SFactor(in, line, retVal);
+		case MULT:
+		case DIV:
+		case IDIV:
+		case MOD:
+			return 5;
 
-	//If SFactor is bad, no point in continuing
-	if (!status) {
-		//ParseError(line, "Bad SFactor in term.");
-		return false;
+		default:
+			return 0;
 	}
+}
 
-	//We can now see 0 or more *, /, DIV, or MODs followed by sfactors
-	l = Parser::GetNextToken(in, line);
-
-	//If we have any of these, process the next sfactor
-	while (l == MULT || l == DIV || l == IDIV || l == MOD) {
-		//Value for storing the other sFactor value
-		Value val;
+//Multiplicative operators are the tightest binding binary operators
+static const int MULT_PREC = 5;
+//Relational operators may not be cascaded
+static const int REL_PREC = 3;
 
-		//Process the other SFactor
-		status = SFactor(in, line, val);
 
-		//If SFactor is bad, no point in continuing
-		if (!status) {
-			ParseError(line, "Missing operand after operator.");
-			return false;
+//Each enclosing multiplicative operator and group reports the failure in turn, adding their messages
+//to msgs
+template <typename Msgs>
+static void Unwind(const ScratchVec<Token>& ops, Msgs& msgs){
+	size_t i = ops.size();
+	for(;;){
+		if (i > 0 && Precedence(ops[i - 1]) == MULT_PREC){
+			msgs.push_back("Missing operand after operator.");
 		}
 
-		//Now we need to use our overloaded operators to process our values
-		switch(l.GetToken()){
-			case MULT:
-				retVal = retVal * val;
-				break;
-			
-			case DIV:
-				retVal = retVal / val;
-				break;
-
-			case IDIV:
-				retVal = retVal.idiv(val);
-				break;
-			
-			case MOD:
-				retVal = retVal % val;
-				break;
-			
-			//We won't ever get here, added to remove compile warnings on vocareum
-			default:
-				return false;
+		while (i > 0 && ops[i - 1] != LPAREN){
+			i--;
 		}
-
-		//If we get here and retVal is now Err, throw error
-		if(retVal.IsErr()){
-			ParseError(line, "Runtime Error: Illegal operand use");
-			return false;
+		if (i == 0){
+			break;
 		}
 
-		//Refresh l
-		l = Parser::GetNextToken(in, line);
+		i--;
+		msgs.push_back("Invalid Expression.");
 	}
+}
 
-	//If we get here, we've had valid sfactors and l is no longer *. /, MOD or DIV
-	//make sure l isn't an ERR
-	if (l == ERR) {
-		ParseError(line, "Unrecognized input pattern.");
-		cout << "(" << l.GetLexeme() << ")" << endl;
-		return false;
-	}
 
-	//If no error, push token back and return status
-	Parser::PushBackToken(l);
+//What is known about an operand while its expression is compiled. A whole array's steps in the
+//whole-array expression start at first
+struct Operand {
+	bool array;
+	int first;
+};
+
+
+//Pops the operator on top of the stack and compiles it, to be applied to the top two operands
+//If either of them is a whole array, the operator becomes a step of the whole-array expression instead
+static bool ApplyOperator(ScratchVec<Token>& ops, ScratchVec<Operand>& operands, ScratchVec<VecNode>* whole, int line){
+	Token op = ops.back();
+	ops.pop_back();
+
+	//Our overloaded operators give an error Value when the operands are wrong for the operation,
+	//which is reported like this
+	OpCode code;
+	const char* msg;
+	switch(op){
+		case OR:
+			code = OP_OR;
+			msg = "Illegal use of non-boolean operand with OR";
+			break;
 
-	//If we get here, all went well
-	return true;
-}
+		case AND:
+			code = OP_AND;
+			msg = "Illegal use of a non-boolean operand with AND";
+			break;
+
+		case EQ:
+		case GTHAN:
+		case LTHAN:
+			code = (op == EQ) ? OP_EQ : (op == GTHAN) ? OP_GTHAN : OP_LTHAN;
+			msg = "Bad relational operation";
+			break;
 
+		case PLUS:
+		case MINUS:
+			code = (op == PLUS) ? OP_PLUS : OP_MINUS;
+			msg = "Illegal arithmetic operation";
+			break;
 
-// SFactor can have an optional sign in front of it
-// SFactor ::= [( - | + | NOT )] Factor
-bool SFactor(istream& in, int& line, Value& retVal){
-	//Get the token for processing
-	LexItem l = Parser::GetNextToken(in, line); 
+		case MULT:
+		case DIV:
+		case IDIV:
+		case MOD:
+			code = (op == MULT) ? OP_MULT : (op == DIV) ? OP_DIV : (op == IDIV) ? OP_IDIV : OP_MOD;
+			msg = "Runtime Error: Illegal operand use";
+			break;
 
-	//Plus is a "1" in factor
-	if (l == PLUS){
-		return Factor(in, line, retVal, 1);
+		//We won't ever get here, only operators are pushed
+		default:
+			return false;
 	}
 
-	//Negative is a "2" in factor
-	if (l == MINUS) {
-		return Factor(in, line, retVal, 2);
+	Operand right = operands.back();
+	operands.pop_back();
+	Operand& left = operands.back();
+
+	if (!left.array && !right.array){
+		Check(Emit(line, code), msg, &ops);
+		return true;
 	}
 
-	//NOT is a "3" in factor
-	if (l == NOT) {
-		return Factor(in, line, retVal, 3);
+	//Arrays are only combined element by element, there is no comparing them as a whole
+	if (code == OP_EQ || code == OP_GTHAN || code == OP_LTHAN){
+		ParseError(line, "Illegal relational operation on whole arrays");
+		return false;
 	}
 
-	//If l is not +, - or NOT, push token back and let factor handle it
-	Parser::PushBackToken(l);
-	
-	//0 means we found no plus, minus or NOT
-	return Factor(in, line, retVal, 0);
+	//A scalar operand's code has already left its value on the stack, it only needs a step that
+	//stands for it. A scalar on the left goes in front of all of the steps on the right
+	if (!right.array){
+		whole->push_back(VecNode{ VN_SCALAR, 0 });
+	}
+	if (!left.array){
+		whole->insert(whole->begin() + right.first, VecNode{ VN_SCALAR, 0 });
+		left = Operand{ true, right.first };
+	}
+	whole->push_back(VecNode{ VN_OP, code });
+	return true;
 }
 
 
-//Factor must be a predeclared identifier or a constant, or an optional expr in parenthesis
+//Factor must be a predeclared identifier or a constant. Parenthesized expressions are handled by Expr
 //Sign is 0 if no sign, 1 if positive(+), 2 if negative(-), 3 if NOT
-//Factor ::= IDENT | ICONST | RCONST | SCONST | BCONST | (Expr)
-bool Factor(istream& in, int& line, Value& retVal, int sign){
+//ops are the operators pending in Expr, for reporting a variable that turns out to have no value
+//An array without an index is a whole array, which is only allowed if there is a whole-array
+//expression to add it to, and operand says whether it was one
+//Factor ::= IDENT [ [ Expr ] ] | Call | ICONST | RCONST | SCONST | BCONST
+static bool Factor(istream& in, int& line, LexItem& l, int sign, const ScratchVec<Token>& ops, ScratchVec<VecNode>* whole, Operand& operand){
 	bool status;
-	//get and check our first token
-	LexItem l = Parser::GetNextToken(in, line);
 
 	//If the token is an error, no use in further processing
 	if (l == ERR){
@@ -1306,14 +2553,31 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 		return false;
 	}
 
-	//If we have an identifier, we want retVal to be whatever stored value it has from tempsResults
+	//The builtin eof, unless the program has declared something of that name. Unlike a variable it may
+	//have a NOT in front of it, for the loop that reads until the input runs out
+	if (l == IDENT && l.GetSymbol() == SYM_EOF && FindVar(SYM_EOF) == NULL){
+		if (sign == 1 || sign == 2){
+			ParseError(line, "Illegal use of +/- sign before eof.");
+			return false;
+		}
+
+		Emit(line, OP_EOF);
+		//NOT eof is eof = false
+		if (sign == 3){
+			EmitConst(line, Value(false));
+			Emit(line, OP_EQ);
+		}
+		return true;
+	}
+
+	//If we have an identifier, we want whatever stored value it has from tempsResults
 	if (l == IDENT){
 		//Idents should not have a sign at all
 		if (sign != 0){
 			ParseError(line, "Illegal use of a sign before an identifier.");
 			return false;
 		}
-		
+
 		//If we get here, ident was fine, push back and let Var handle it
 		Parser::PushBackToken(l);
 
@@ -1328,8 +2592,42 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 			return false;
 		}
 
-		//Otherwise, make retVal the stored value of the Var using idTok
-		retVal = TempsResults[idTok.GetLexeme()];
+		const VarEntry& entry = SymTable[idTok.GetSymbol()];
+		//A function is called for its result, a procedure has none
+		if (entry.kind == VK_ROUTINE){
+			if (entry.type == PROCEDURE){
+				ParseError(line, "Illegal use of a procedure in an expression");
+				return false;
+			}
+			return Call(in, line, entry, ops);
+		}
+
+		if (entry.kind == VK_ARRAY){
+			l = Parser::GetNextToken(in, line);
+
+			//One element, which is an illegal factor if the index is bad
+			if (l == LBRACKET){
+				if (!Index(in, line, ops)){
+					return false;
+				}
+				Check(Emit(line, OP_INDEX, entry.slot), "Array index out of bounds", &ops);
+				return true;
+			}
+
+			Parser::PushBackToken(l);
+			if (whole == NULL){
+				ParseError(line, "Illegal use of a whole array");
+				return false;
+			}
+			whole->push_back(VecNode{ VN_ARRAY, entry.slot });
+			operand = Operand{ true, (int)whole->size() - 1 };
+			return true;
+		}
+
+		//Otherwise, load the stored value of the Var using idTok. A variable that was never assigned
+		//is an illegal factor
+		Check(EmitLoad(line, entry), "Illegal Factor", &ops);
+		return true;
 	}
 
 	//Check SCONST
@@ -1340,8 +2638,10 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 			return false;
 		}
 
-		//if we pass this condition then its true, return a value with the SCONST
-		retVal = Value(l.GetLexeme());
+		//if we pass this condition then its true, the constant is the SCONST
+		//It shares the lexer's interned copy of the text
+		EmitConst(line, Value(Rope(l.GetSymbol())));
+		return true;
 	}
 
 	//Check RCONST and ICONST
@@ -1352,6 +2652,8 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 			return false;
 		}
 
+		Value retVal;
+
 		//construct the appropriate value, no sign and a positive sign have same meaning
 		if(sign == 0 || sign == 1){
 			if(l == ICONST){
@@ -1375,8 +2677,11 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 				retVal = val * Value(stof(l.GetLexeme()));
 			}
 		}
+
+		EmitConst(line, retVal);
+		return true;
 	}
-	
+
 
 	//Check BCONST
 	if (l == BCONST){
@@ -1389,44 +2694,125 @@ bool Factor(istream& in, int& line, Value& retVal, int sign){
 		//Used for storing our bools
 		bool result = false;
 
-		if(l.GetLexeme() == "true"){
+		if(l.GetSymbol() == SYM_TRUE){
 			result = true;
 		}
 
-		//No sign, simply return boolean
-		if(sign == 0){
-			retVal = Value(result);
+		//No sign, simply the boolean, otherwise its complement
+		EmitConst(line, sign == 3 ? !Value(result) : Value(result));
+		return true;
+	}
+
+	//Anything else can't start a factor
+	ParseError(line, "Illegal Factor");
+	return false;
+}
+
+
+//Expr ::= LogOrExpr ::= LogAndExpr { OR LogAndExpr }
+bool Expr(istream& in, int& line){
+	return CompileExpr(in, line, NULL);
+}
+
+//If whole is not NULL, the expression may also be a whole-array expression, one with whole arrays as
+//operands. Its steps are added to whole, and the code compiled for it only computes its scalar
+//operands. whole is left empty if the expression turns out to be a scalar after all
+static bool CompileExpr(istream& in, int& line, ScratchVec<VecNode>* whole){
+	//Operators waiting for their right operand, whose code has not been compiled yet
+	//An LPAREN on the operator stack marks the start of a parenthesized expression
+	ScratchVec<Token> ops(&scratch);
+	//The operands whose operators haven't been applied yet
+	ScratchVec<Operand> operands(&scratch);
+	LexItem l;
+
+	for(;;){
+		//We are at the start of an SFactor, which may have a sign
+		//SFactor ::= [( - | + | NOT )] Factor
+		l = Parser::GetNextToken(in, line);
+		int sign = 0;
+
+		//Plus is a "1" in factor, negative is a "2" and NOT is a "3"
+		if (l == PLUS || l == MINUS || l == NOT){
+			sign = (l == PLUS) ? 1 : (l == MINUS) ? 2 : 3;
+			l = Parser::GetNextToken(in, line);
 		}
 
-		if (sign == 3){
-			retVal = !Value(result);
+		//A parenthesized expression starts a new group, and the sign in front of it has no effect
+		if (l == LPAREN){
+			ops.push_back(LPAREN);
+			continue;
 		}
-	}
 
-	//If we see an lparen, we have an expr
-	if (l == LPAREN){
-		//Evaluate the internal expression
-		status = Expr(in, line, retVal);
+		Operand operand{ false, 0 };
+		if (!Factor(in, line, l, sign, ops, whole, operand)){
+			break;
+		}
+		operands.push_back(operand);
 
-		if(!status){
-			ParseError(line, "Invalid Expression.");
-			return false;
+		//Once we have an operand, keep going until we need another one
+		bool needOperand = false;
+		while (!needOperand){
+			//Multiplicative operators are applied as soon as their right operand is complete
+			if (!ops.empty() && Precedence(ops.back()) == MULT_PREC && !ApplyOperator(ops, operands, whole, line)){
+				break;
+			}
+
+			l = Parser::GetNextToken(in, line);
+
+			//If lexeme is unknown, throw error
+			if (l == ERR) {
+				ParseError(line, "Unrecognized input pattern.");
+				cout << "(" << l.GetLexeme() << ")" << endl;
+				break;
+			}
+
+			//Apply every pending operator in this group that binds at least as tightly as the new one
+			int prec = Precedence(l.GetToken());
+			bool applied = true;
+			while (applied && !ops.empty() && ops.back() != LPAREN && Precedence(ops.back()) >= prec){
+				//A relational operator right after another one ends the expression instead
+				if (prec == REL_PREC && Precedence(ops.back()) == REL_PREC){
+					prec = 0;
+				}
+				applied = ApplyOperator(ops, operands, whole, line);
+			}
+			if (!applied){
+				break;
+			}
+
+			//Another binary operator, go get its right operand
+			if (prec > 0){
+				ops.push_back(l.GetToken());
+				needOperand = true;
+				continue;
+			}
+
+			//Otherwise the innermost group ends here. At the top that is the end of the expression
+			if (ops.empty()){
+				//Put back the token that ended it, it isn't ours to process
+				Parser::PushBackToken(l);
+				return true;
+			}
+
+			//Inside parentheses, ensure that there is a closing rparen
+			ops.pop_back();
+			if (l != RPAREN){
+				ParseError(line, "Missing Right Parenthesis");
+				break;
+			}
 		}
 
-		//Ensure that there is a closing rparen
-		l = Parser::GetNextToken(in, line);
-		if (l != RPAREN){
-			ParseError(line, "Missing Right Parenthesis");
-			return false;
+		if (!needOperand){
+			break;
 		}
 	}
 
-	//Double check, if retVal is error, error should be returned
-	if(retVal.IsErr()){
-		ParseError(line, "Illegal Factor");
-		return false;
+	//If we get here something failed
+	ScratchVec<const char*> msgs(&scratch);
+	Unwind(ops, msgs);
+	for (const char* msg : msgs){
+		ParseError(line, msg);
 	}
 
-	//If we get here, all went well
-	return true;
-}
\ No newline at end of file
+	return false;
+}
@@ -14,27 +14,38 @@ using namespace std;
 #include "lex.h"
 #include "val.h"
 
+class LexPipeline;
+class Batch;
+
 
 extern bool Prog(istream& in, int& line);
 extern bool DeclPart(istream& in, int& line);
 extern bool DeclStmt(istream& in, int& line);
+extern bool RoutineDecl(istream& in, int& line);
 extern bool Stmt(istream& in, int& line);
 extern bool StructuredStmt(istream& in, int& line);
 extern bool CompoundStmt(istream& in, int& line);
 extern bool SimpleStmt(istream& in, int& line);
 extern bool WriteLnStmt(istream& in, int& line);
 extern bool WriteStmt(istream& in, int& line);
+extern bool ReadLnStmt(istream& in, int& line);
 extern bool IfStmt(istream& in, int& line);
+extern bool WhileStmt(istream& in, int& line);
+extern bool ForStmt(istream& in, int& line);
+extern bool CaseStmt(istream& in, int& line);
 extern bool AssignStmt(istream& in, int& line);
+extern bool CallStmt(istream& in, int& line);
 extern bool Var(istream& in, int& line, LexItem & idtok);
-extern bool ExprList(istream& in, int& line);
-extern bool Expr(istream& in, int& line, Value & retVal);
-extern bool LogANDExpr(istream& in, int& line, Value & retVal);
-extern bool RelExpr(istream& in, int& line, Value & retVal);
-extern bool SimpleExpr(istream& in, int& line, Value & retVal);
-extern bool Term(istream& in, int& line, Value & retVal);
-extern bool SFactor(istream& in, int& line, Value & retVal);
-extern bool Factor(istream& in, int& line, Value & retVal, int sign);
+extern bool ExprList(istream& in, int& line, int& count);
+extern bool Expr(istream& in, int& line);
+extern void ParseError(int line, string msg);
+extern void ParseError(int line, const char* msg);
 extern int ErrCount();
+extern void UsePipeline(LexPipeline* pipe);
+extern void UseBatch(Batch* b);
+extern void SetMemoSize(size_t entries);
+extern size_t MemoSize();
+extern void ResetProg();
+extern bool CompileImage(istream& in, int& line, string& image);
 
 #endif /* PARSE_H_ */
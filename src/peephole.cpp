@@ -0,0 +1,335 @@
+/*
+ * peephole.cpp
+ * The peephole pass over the stack machine's code
+ * Like the optimizer, it doesn't allocate once it has seen code as big as what it is given (see
+ * tests/allocs.cpp)
+ */
+
+#include "peephole.h"
+
+#include <algorithm>
+
+using namespace std;
+
+
+//What the pass has done to all the code it has seen so far
+static struct {
+	uint64_t before;
+	uint64_t after;
+	uint64_t pairs;
+	uint64_t fused;
+	uint64_t negations;
+	uint64_t promoted;
+} counts;
+
+
+//Whether each instruction of the code is somewhere it jumps to, with one more for its end
+static vector<char> target;
+//Where each instruction went, or what comes after it if it was taken out
+static vector<int> where;
+//The rewritten code, and for each of its instructions whether it is somewhere the code jumps to and
+//whether it compares a boolean with false
+static vector<Instr> out;
+static vector<char> label;
+static vector<char> negates;
+//The types of the values on the stack after the rewritten code, ERR where it isn't known
+static vector<Token> types;
+
+
+//Whether an instruction may continue at a rather than at the next instruction
+static bool Jumps(OpCode op){
+	return op == OP_JUMP || op == OP_JUMPF || op == OP_JUMPT || (op >= OP_JUMPEQ && op <= OP_JUMPGT)
+		|| op == OP_FORPREP || op == OP_FORNEXT;
+}
+
+static Token TypeOf(const Value& val){
+	return val.IsInt() ? INTEGER : val.IsReal() ? REAL : val.IsBool() ? BOOLEAN : val.IsString() ? STRING : ERR;
+}
+
+//The type of a variable, from its declaration. A variable is converted to that type whenever it is
+//stored to, so a load of it that doesn't fail gives a value of that type
+static Token VarType(const vector<Token>* of, int slot){
+	return of != NULL && slot >= 0 && slot < (int)of->size() ? (*of)[slot] : ERR;
+}
+
+//The type of what a binary operator gives, as the operators in val.cpp work it out
+static Token ResultType(OpCode op, Token left, Token right){
+	switch(op){
+		case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+			return BOOLEAN;
+
+		case OP_PLUS:
+			if (left == STRING && right == STRING){
+				return STRING;
+			}
+			//Fall through
+		case OP_MINUS: case OP_MULT: case OP_DIV:
+			if (left == INTEGER && right == INTEGER){
+				return INTEGER;
+			}
+			return (left == INTEGER || left == REAL) && (right == INTEGER || right == REAL) ? REAL : ERR;
+
+		default:
+			return ERR;
+	}
+}
+
+static void Pop(size_t n){
+	types.resize(types.size() - min(n, types.size()));
+}
+
+//The type of the value n entries down from the top of the stack
+static Token Below(size_t n){
+	return n < types.size() ? types[types.size() - 1 - n] : ERR;
+}
+
+//Appends an instruction to the rewritten code and follows what it does to the stack
+static void Put(const Instr& in, bool at, const Code& code, const OptScope& scope){
+	out.push_back(in);
+	label.push_back(at);
+	negates.push_back(0);
+
+	switch(in.op){
+		case OP_CONST:
+			types.push_back(TypeOf(code.consts[in.a]));
+			break;
+		case OP_LOAD:
+			types.push_back(VarType(scope.globals, in.a));
+			break;
+		case OP_LLOAD:
+			types.push_back(VarType(scope.frame, in.a));
+			break;
+		case OP_DUP:
+			types.push_back(Below(0));
+			break;
+		case OP_READ:
+			types.push_back((Token)in.a);
+			break;
+		case OP_EOF:
+			types.push_back(BOOLEAN);
+			break;
+
+		//Array elements may be integers, reals or booleans
+		case OP_INDEX:
+			Pop(1);
+			types.push_back(ERR);
+			break;
+
+		case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+		case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_IDIV: case OP_MOD: {
+			Token type = ResultType(in.op, Below(1), Below(0));
+			Pop(2);
+			types.push_back(type);
+			break;
+		}
+
+		case OP_STORE: case OP_LSTORE: case OP_JUMPF: case OP_JUMPT: case OP_CASE:
+			Pop(1);
+			break;
+		case OP_ISTORE: case OP_FORPREP: case OP_JUMPEQ: case OP_JUMPLT: case OP_JUMPGT:
+			Pop(2);
+			break;
+		case OP_AEVAL:
+			Pop(in.c);
+			break;
+		case OP_WRITE: case OP_WRITELN:
+			Pop(in.a);
+			break;
+
+		case OP_CALL: case OP_TAILCALL:
+			Pop(in.b);
+			if (in.c == 1){
+				types.push_back(ERR);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+//Takes the last instruction out of the rewritten code, along with the value it pushed
+static void TakeBack(){
+	out.pop_back();
+	label.pop_back();
+	negates.pop_back();
+	Pop(1);
+}
+
+//Whether the last instruction of the rewritten code pushes a constant of the given type, and nothing
+//jumps to it
+static bool LastConst(const Code& code, Token type){
+	return !out.empty() && out.back().op == OP_CONST && !label.back() && TypeOf(code.consts[out.back().a]) == type;
+}
+
+//Makes the integer constant pushed by in a real one
+static void Promote(Code& code, Instr& in){
+	Value val = code.consts[in.a];
+	ConvertFor(val, REAL);
+	code.consts.push_back(val);
+	in.a = code.consts.size() - 1;
+	counts.promoted++;
+}
+
+
+void Peephole(Code& code, const OptScope& scope, bool fusing){
+	if (!OptimizerOn() || !code.origins.empty()){
+		return;
+	}
+	const vector<Instr>& from = code.code;
+	size_t n = from.size();
+	counts.before += n;
+
+	target.assign(n + 1, 0);
+	for (const Instr& in : from){
+		if (Jumps(in.op)){
+			target[in.a] = 1;
+		}
+	}
+	for (const CaseTable& table : code.caseTables){
+		for (int k = 0; k < table.count; k++){
+			if (code.caseTargets[table.first + k] >= 0){
+				target[code.caseTargets[table.first + k]] = 1;
+			}
+		}
+		target[table.otherwise] = 1;
+	}
+
+	where.assign(n + 1, 0);
+	out.clear();
+	label.clear();
+	negates.clear();
+	types.clear();
+
+	//Whether the next instruction put takes the place of one that was jumped to
+	bool carry = false;
+	for (size_t i = 0; i < n; i++){
+		Instr in = from[i];
+		bool at = target[i] || carry;
+		carry = false;
+		where[i] = out.size();
+
+		//The stack may have got here some other way, with values of other types
+		if (at){
+			fill(types.begin(), types.end(), ERR);
+		}
+
+		switch(in.op){
+			//An integer constant stored in a real variable would be converted each time
+			case OP_STORE:
+			case OP_LSTORE:
+				if (!at && in.b == REAL && LastConst(code, INTEGER)){
+					Promote(code, out.back());
+					types.back() = REAL;
+				}
+				break;
+
+			case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV:
+			case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+				if (at){
+					break;
+				}
+				//A boolean compared with true is itself, and one compared with false may be branched on
+				//the other way
+				if (in.op == OP_EQ && Below(1) == BOOLEAN && LastConst(code, BOOLEAN)){
+					if (code.consts[out.back().a].GetBool()){
+						TakeBack();
+						counts.pairs++;
+						continue;
+					}
+					Put(in, at, code, scope);
+					negates.back() = 1;
+					continue;
+				}
+				//An integer constant that meets a real is converted to one first. Either operand may be
+				//the constant, the left one as long as the right one is pushed by one instruction
+				if (Below(1) == REAL && LastConst(code, INTEGER)){
+					Promote(code, out.back());
+					types.back() = REAL;
+				} else if (Below(0) == REAL && out.size() >= 2 && !label.back() && out[out.size() - 2].op == OP_CONST
+						&& (out.back().op == OP_CONST || out.back().op == OP_LOAD || out.back().op == OP_LLOAD)
+						&& TypeOf(code.consts[out[out.size() - 2].a]) == INTEGER){
+					Promote(code, out[out.size() - 2]);
+					types[types.size() - 2] = REAL;
+				}
+				break;
+
+			case OP_JUMPF: {
+				if (at){
+					break;
+				}
+				//What the branch goes on: 0 to jump when the condition is false
+				int when = 0;
+				if (!out.empty() && negates.back()){
+					//The comparison and the false it compared with go, and the boolean is branched on as it
+					//is. It is still on top of the stack, where their result was
+					out.resize(out.size() - 2);
+					label.resize(label.size() - 2);
+					negates.resize(negates.size() - 2);
+					when = 1;
+					counts.negations++;
+				}
+
+				//A branch on a constant always goes the same way. Whatever jumped to the constant goes to
+				//what takes its place
+				if (!out.empty() && out.back().op == OP_CONST && TypeOf(code.consts[out.back().a]) == BOOLEAN){
+					bool jump = code.consts[out.back().a].GetBool() == (when != 0);
+					carry = label.back();
+					TakeBack();
+					counts.pairs++;
+					if (jump){
+						Put(Instr{ OP_JUMP, in.a, 0, 0, -1, in.line }, carry, code, scope);
+						carry = false;
+					}
+					continue;
+				}
+
+				//A comparison branched on straight away does both at once, and can only fail as the
+				//comparison would have
+				OpCode op = out.empty() ? OP_HALT : out.back().op;
+				if (!fusing && (op == OP_EQ || op == OP_LTHAN || op == OP_GTHAN)){
+					Instr& cmp = out.back();
+					cmp.op = (OpCode)(op - OP_EQ + OP_JUMPEQ);
+					cmp.a = in.a;
+					cmp.b = when;
+					Pop(1);
+					counts.fused++;
+					continue;
+				}
+
+				if (when){
+					in.op = OP_JUMPT;
+				}
+				break;
+			}
+
+			default:
+				break;
+		}
+
+		Put(in, at, code, scope);
+	}
+	where[n] = out.size();
+
+	for (Instr& in : out){
+		if (Jumps(in.op)){
+			in.a = where[in.a];
+		}
+	}
+	for (int& at : code.caseTargets){
+		if (at >= 0){
+			at = where[at];
+		}
+	}
+	for (CaseTable& table : code.caseTables){
+		table.otherwise = where[table.otherwise];
+	}
+	code.code.assign(out.begin(), out.end());
+	counts.after += code.code.size();
+}
+
+void ReportPeephole(ostream& out){
+	out << "Peephole: " << counts.before << " instructions before, " << counts.after << " after, "
+		<< counts.pairs << " pushed values popped straight away, " << counts.fused << " comparisons fused with branches, "
+		<< counts.negations << " NOTs folded into branches, " << counts.promoted << " integer constants made real" << endl;
+}
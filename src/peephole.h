@@ -0,0 +1,41 @@
+/*
+ * peephole.h
+ * The peephole pass, which rewrites short runs of the stack machine's instructions into fewer of them
+ * It runs over compiled code once the optimizer (see opt.h) is done with it, looking at each
+ * instruction along with the few just before it:
+ *  - a constant that is pushed only to be popped straight away goes, along with what pops it: a
+ *    branch on a constant condition becomes a jump or nothing at all, and a boolean compared with true
+ *    is left as it is
+ *  - a comparison followed by a branch on its result becomes one instruction that compares and
+ *    branches, like a WHILE's i < n
+ *  - a boolean compared with false, which is what NOT eof compiles to, followed by a branch on the
+ *    result, branches the other way on the boolean itself
+ *  - an integer constant that the machine would convert to a real before using it, since it is stored
+ *    in a real variable or is an operand of an operator whose other operand is a real, is replaced by a
+ *    constant that is that real already
+ * The types of the values on the stack are followed through the code to tell which those are, from the
+ * types of variables and constants. Nothing is rewritten across a place the code jumps to, and nothing
+ * that could fail is taken out, so a failure is reported just where and how it was before.
+*/
+
+#ifndef PEEPHOLE_H_
+#define PEEPHOLE_H_
+
+#include <iostream>
+
+using namespace std;
+
+#include "bytecode.h"
+#include "opt.h"
+
+
+//Rewrites code for the stack machine, see above, if the optimizer is on. Code that is going to be fused
+//for the register machine (see regvm.h) keeps its comparisons apart from its branches, since the
+//register machine compares with its operands where they are
+extern void Peephole(Code& code, const OptScope& scope, bool fusing);
+
+//Prints what the pass has rewritten in the code it has seen so far
+extern void ReportPeephole(ostream& out);
+
+
+#endif /* PEEPHOLE_H_ */
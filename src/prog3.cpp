@@ -5,8 +5,26 @@
 
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 
 #include "parserInterp.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "disasm.h"
+#include "image.h"
+#include "input.h"
+#include "opt.h"
+#include "peephole.h"
+#include "realtime.h"
+#include "regvm.h"
+#include "resultcache.h"
+#include "lexpipe.h"
+#include "scanbuf.h"
+#include "shard.h"
+#include <thread>
+#include <vector>
+#include "stats.h"
 
 using namespace std;
 
@@ -15,14 +33,225 @@ int main(int argc, char *argv[]) {
 
 	istream *in = NULL;
 	ifstream file;
+	//--stats prints the instrumentation counters to stderr once the program is done, --stats=json as JSON
+	bool stats = false;
+	bool statsJson = false;
+	//--pipeline lexes on a separate thread that runs ahead of the parser
+	bool pipelined = false;
+	//--scan=scalar|sse2|avx2 forces a set of scanning kernels, --scan=off reads the input a character at a time
+	bool scanning = true;
+	//--batch=FILE compiles the program once and runs it for each row of initial values in FILE
+	Batch batch;
+	bool batched = false;
+	//--shard-exec runs every file named in worker processes of their own, --shard-exec=N in N of them
+	bool sharded = false;
+	int workers = thread::hardware_concurrency();
+	//--realtime allocates all the memory the program can need before it runs, refusing it if that has no bound
+	bool realtime = false;
+	//--checkpoint-every N saves a snapshot of the program every N times a loop goes round, to the program
+	//file's name followed by .ckpt. --restore FILE carries on from the snapshot in FILE
+	long checkpointEvery = 0;
+	string restoreFrom;
+	//--result-cache replays what the program printed the last time it ran if it can't have printed anything
+	//else, keeping it in the user's cache or in DIR with --result-cache=DIR. --result-cache-stats[=DIR]
+	//prints how often that cache, or the one in DIR, has been used to stderr, once the program is done
+	//if one is given
+	bool cached = false;
+	string cacheDir;
+	bool cacheStats = false;
+	string cacheStatsDir;
+	//--vm=register runs the program on the register machine, --vm=stack on the stack machine it is compiled for
+	bool registers = false;
+	//--opt-report prints what the optimizer took out of the program to stderr once it is done, --opt=off
+	//runs the program as it was compiled
+	bool optReport = false;
+	vector<string> names;
 		
 	for( int i=1; i<argc; i++ ){
 		string arg = argv[i];
+
+		if( arg == "--stats" || arg == "--stats=json" ) {
+			stats = true;
+			statsJson = (arg == "--stats=json");
+			continue;
+		}
+
+		if( arg == "--pipeline" ) {
+			pipelined = true;
+			continue;
+		}
+		
+		if( arg.rfind("--scan=", 0) == 0 ) {
+			string mode = arg.substr(7);
+			if( mode == "off" )
+				scanning = false;
+			else if( mode == "scalar" )
+				SetScanMode(SCAN_SCALAR);
+			else if( mode == "sse2" )
+				SetScanMode(SCAN_SSE2);
+			else if( mode == "avx2" )
+				SetScanMode(SCAN_AVX2);
+			else {
+				cerr << "UNRECOGNIZED FLAG " << arg << endl;
+				return 0;
+			}
+			continue;
+		}
+		
+		//--memo=N keeps at most N results of each pure function, below a million since each one's table is
+		//allocated whole, --memo=off runs every call
+		if( arg.rfind("--memo=", 0) == 0 ) {
+			string size = arg.substr(7);
+			if( size == "off" )
+				SetMemoSize(0);
+			else if( !size.empty() && size.size() <= 6 && size.find_first_not_of("0123456789") == string::npos )
+				SetMemoSize(stoul(size));
+			else {
+				cerr << "UNRECOGNIZED FLAG " << arg << endl;
+				return 0;
+			}
+			continue;
+		}
+		
+		if( arg.rfind("--batch=", 0) == 0 ) {
+			if( batched || !batch.Open(arg.substr(8)) ) {
+				cerr << "CANNOT READ BATCH INPUT " << arg.substr(8) << endl;
+				return 0;
+			}
+			batched = true;
+			continue;
+		}
+		
+		if( arg == "--shard-exec" || arg.rfind("--shard-exec=", 0) == 0 ) {
+			string count = arg.size() > 13 ? arg.substr(13) : "";
+			if( !count.empty() && (count.size() > 4 || count.find_first_not_of("0123456789") != string::npos || stoi(count) == 0) ) {
+				cerr << "UNRECOGNIZED FLAG " << arg << endl;
+				return 0;
+			}
+			if( !count.empty() )
+				workers = stoi(count);
+			sharded = true;
+			continue;
+		}
+		
+		if( arg == "--checkpoint-every" || arg == "--restore" ) {
+			string value = i + 1 < argc ? argv[i + 1] : "";
+			if( value.empty() || (arg == "--checkpoint-every" && (value.size() > 18 || value.find_first_not_of("0123456789") != string::npos || stol(value) == 0)) ) {
+				cerr << "MISSING OR INVALID VALUE FOR " << arg << endl;
+				return 0;
+			}
+			if( arg == "--restore" )
+				restoreFrom = value;
+			else
+				checkpointEvery = stol(value);
+			i++;
+			continue;
+		}
+		
+		if( arg == "--realtime" ) {
+			realtime = true;
+			continue;
+		}
+		
+		if( arg.rfind("--vm=", 0) == 0 ) {
+			string vm = arg.substr(5);
+			if( vm != "stack" && vm != "register" ) {
+				cerr << "UNRECOGNIZED FLAG " << arg << endl;
+				return 0;
+			}
+			registers = (vm == "register");
+			continue;
+		}
+		
+		if( arg == "--opt-report" ) {
+			optReport = true;
+			continue;
+		}
+		
+		//--disasm prints the code of each statement, declaration and routine to stderr as it is ready to run
+		if( arg == "--disasm" ) {
+			ListCodeTo(&cerr);
+			continue;
+		}
+		
+		if( arg.rfind("--opt=", 0) == 0 ) {
+			string mode = arg.substr(6);
+			if( mode != "on" && mode != "off" ) {
+				cerr << "UNRECOGNIZED FLAG " << arg << endl;
+				return 0;
+			}
+			UseOptimizer(mode == "on");
+			continue;
+		}
 		
+		if( arg == "--result-cache-stats" || arg.rfind("--result-cache-stats=", 0) == 0 ) {
+			cacheStats = true;
+			cacheStatsDir = arg.size() > 21 ? arg.substr(21) : "";
+			continue;
+		}
+		
+		if( arg == "--result-cache" || arg.rfind("--result-cache=", 0) == 0 ) {
+			cached = true;
+			cacheDir = arg.size() > 15 ? arg.substr(15) : "";
+			continue;
+		}
+		
+		names.push_back(arg);
+	}
+
+	if( realtime && (batched || sharded) ) {
+		cerr << "CANNOT RUN A BATCH OR SHARDED RUN IN REAL TIME" << endl;
+		return 0;
+	}
+	bool checkpointed = checkpointEvery > 0 || !restoreFrom.empty();
+	if( checkpointed && (batched || sharded || realtime || pipelined) ) {
+		cerr << "CANNOT CHECKPOINT A BATCH, SHARDED, REAL-TIME OR PIPELINED RUN" << endl;
+		return 0;
+	}
+	if( registers && (batched || realtime || checkpointed) ) {
+		cerr << "CANNOT RUN A BATCH, REAL-TIME OR CHECKPOINTED RUN ON THE REGISTER MACHINE" << endl;
+		return 0;
+	}
+	if( registers )
+		UseMachine(VM_REGISTER);
+	if( cached && (batched || sharded || realtime || checkpointed) ) {
+		cerr << "CANNOT CACHE THE RESULT OF A BATCH, SHARDED, REAL-TIME OR CHECKPOINTED RUN" << endl;
+		return 0;
+	}
+
+	if( cacheStatsDir.empty() )
+		cacheStatsDir = cacheDir;
+	if( cacheStats && names.empty() ) {
+		ResultCache::Report(cacheStatsDir, cerr);
+		return 0;
+	}
+
+	if( sharded ) {
+		if( names.empty() ) {
+			cerr << "Missing File Name." << endl;
+			return 0;
+		}
+		if( batched ) {
+			cerr << "CANNOT BATCH A SHARDED RUN" << endl;
+			return 0;
+		}
+		int failed = ShardExec(names, max(workers, 1));
+		cout << "\nRan " << names.size() << " programs, " << failed << " unsuccessful" << endl;
+		if( cacheStats )
+			ResultCache::Report(cacheStatsDir, cerr);
+		return 0;
+	}
+
+	for( const string& arg : names ) {
 		if( in != NULL ) {
 			cerr << "ONLY ONE FILE NAME ALLOWED" << endl;
 			return 0;
 		}
+		else if( arg == "-" ) {
+			//Read the program from standard input, e.g. straight from a generator through a pipe
+			ios::sync_with_stdio(false);
+			in = &cin;
+		}
 		else {
 			file.open(arg.c_str());
 			if( file.is_open() == false ) {
@@ -33,17 +262,111 @@ int main(int argc, char *argv[]) {
 			in = &file;
 		}
 	}
-    if(argc == 1){
+    if(in == NULL){
 		cerr << "Missing File Name." << endl;
 		return 0;
 	}
+
+	if( stats ) {
+		Stats::timing = true;
+		Stats::CountOutput(cout);
+	}
+
+	//Results are kept under the program's text, so all of it is read first
+	ResultCache results;
+	istringstream text;
+	bool replayed = false;
+	bool status;
+	int errors = 0;
+	if( cached ) {
+		text.str(string((istreambuf_iterator<char>(*in)), istreambuf_iterator<char>()));
+		in = &text;
+		results.Open(cacheDir);
+		replayed = results.Replay(text.str(), cout, status, errors);
+	}
+
+	ScanBuf scan(in->rdbuf());
+	istream scanned(&scan);
+	if( scanning )
+		in = &scanned;
+
+	LexPipeline *pipe = NULL;
+	if( pipelined ) {
+		pipe = new LexPipeline(*in, lineNumber);
+		UsePipeline(pipe);
+	}
+	if( batched )
+		UseBatch(&batch);
 	
-    bool status = Prog(*in, lineNumber);
+	if( replayed ) {
+		//Everything the program printed is already out
+	}
+	else if( realtime ) {
+		//The program is compiled as a whole and runs from its image once all of its memory is there
+		ReserveOutput();
+		string image;
+		LoadedImage prog;
+		status = CompileImage(*in, lineNumber, image) && LoadImage(image.data(), image.size(), prog);
+		if( status ) {
+			const char* unbounded = ReserveRealtime(prog);
+			if( unbounded != NULL ) {
+				cerr << "CANNOT RUN IN REAL TIME: " << unbounded << endl;
+				return 0;
+			}
+			status = RunImage(prog) == 0;
+		}
+	}
+	else if( checkpointed ) {
+		//Snapshots are tied to the program's text, so all of it is read first
+		string text((istreambuf_iterator<char>(*in)), istreambuf_iterator<char>());
+		istringstream src(text);
+		ScanBuf textScan(src.rdbuf());
+		istream whole(&textScan);
+		string image;
+		LoadedImage prog;
+		status = CompileImage(whole, lineNumber, image) && LoadImage(image.data(), image.size(), prog);
+		if( status ) {
+			string name = names[0] == "-" ? "stdin" : names[0];
+			int errors = RunCheckpointed(prog, ImageKey(text), checkpointEvery, name + ".ckpt", restoreFrom);
+			if( errors < 0 )
+				return 0;
+			status = errors == 0;
+		}
+	}
+	else
+		status = Prog(*in, lineNumber);
+
+	if( pipe != NULL ) {
+		UsePipeline(NULL);
+		delete pipe;
+	}
+	if( !replayed ) {
+		errors = ErrCount();
+		if( cached )
+			results.Keep(status, errors, InputUsed());
+	}
     
     if( !status ){
-    	cout << "\nUnsuccessful Interpretation " << endl << "Number of Errors " << ErrCount()  << endl;
+    	cout << "\nUnsuccessful Interpretation " << endl << "Number of Errors " << errors  << endl;
+	}
+	else if( batched ){
+		cout << "\nBatch of " << batch.instances << " instances, " << batch.failed << " unsuccessful" << endl;
 	}
 	else{
 		cout << "\nSuccessful Execution" << endl;
 	}
+
+	if( stats ) {
+		{
+			Stats::PhaseTimer timer(PH_FLUSH);
+			Stats::StopCountingOutput(cout);
+		}
+		Stats::Report(cerr, statsJson);
+	}
+	if( optReport ) {
+		ReportOptimizer(cerr);
+		ReportPeephole(cerr);
+	}
+	if( cacheStats )
+		ResultCache::Report(cacheStatsDir, cerr);
 }
@@ -0,0 +1,248 @@
+/*
+ * realtime.cpp
+ * Working out and allocating the memory a program runs in
+ */
+
+#include "realtime.h"
+#include "input.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+
+//How much of standard output is kept before it is written
+static const size_t OUTPUT_BUFFER = 1 << 16;
+static char outputBuffer[OUTPUT_BUFFER];
+
+//Throws away what it is given, so that formatting can be tried out without printing anything
+class Discard : public streambuf {
+protected:
+	int overflow(int c) override { return c; }
+	streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+void ReserveOutput(){
+	setvbuf(stdout, outputBuffer, isatty(1) ? _IOLBF : _IOFBF, OUTPUT_BUFFER);
+
+	//The locale's formatting caches are made the first time a number is printed
+	Discard discard;
+	ostream out(&discard);
+	out << 1 << 1.5 << true << endl;
+}
+
+
+//What one piece of code needs on its own, not counting what the routines it calls need
+struct Need {
+	size_t stack;
+	size_t counters;
+	size_t frames;
+};
+
+//Whether code can make a new string, by reading one or by concatenating. It is checked by following
+//the type of every value on the stack. Expressions have no jumps in them, so between statements the
+//stack is empty and the code can be followed in order. params and locals give the types of frame
+//slots, globals those of variable slots, ERR where nothing is ever stored. A load of one of those
+//always fails, so the value never gets as far as an operator
+static bool MakesStrings(const Code& code, const vector<Routine>& routines, const vector<Token>& globals, const vector<Token>& locals){
+	vector<Token> types;
+	for (const Instr& in : code.code){
+		Token right = ERR, left = ERR;
+		switch (in.op){
+			case OP_CONST: {
+				const Value& val = code.consts[in.a];
+				types.push_back(val.IsString() ? STRING : val.IsReal() ? REAL : val.IsBool() ? BOOLEAN : INTEGER);
+				break;
+			}
+			case OP_LOAD:
+				types.push_back(globals[in.a]);
+				break;
+			case OP_LLOAD:
+				types.push_back(in.a < (int)locals.size() ? locals[in.a] : ERR);
+				break;
+			case OP_DUP:
+				types.push_back(types.empty() ? ERR : types.back());
+				break;
+			case OP_READ:
+				if (in.a == STRING){
+					return true;
+				}
+				types.push_back((Token)in.a);
+				break;
+			case OP_EOF:
+				types.push_back(BOOLEAN);
+				break;
+
+			//Array elements are never strings
+			case OP_INDEX:
+				if (!types.empty()){
+					types.back() = INTEGER;
+				}
+				break;
+
+			case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+			case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_IDIV: case OP_MOD:
+				if (types.size() < 2){
+					return true;
+				}
+				right = types.back();
+				types.pop_back();
+				left = types.back();
+				if (in.op == OP_PLUS && (left == STRING || right == STRING)){
+					return true;
+				}
+				types.back() = (in.op <= OP_GTHAN) ? BOOLEAN : (left == REAL || right == REAL) ? REAL : INTEGER;
+				break;
+
+			case OP_STORE: case OP_LSTORE: case OP_JUMPF: case OP_JUMPT: case OP_CASE:
+				types.resize(types.size() - min(types.size(), (size_t)1));
+				break;
+			case OP_ISTORE: case OP_FORPREP: case OP_JUMPEQ: case OP_JUMPLT: case OP_JUMPGT:
+				types.resize(types.size() - min(types.size(), (size_t)2));
+				break;
+			case OP_AEVAL:
+				types.resize(types.size() - min(types.size(), (size_t)in.c));
+				break;
+			case OP_WRITE: case OP_WRITELN:
+				types.resize(types.size() - min(types.size(), (size_t)in.a));
+				break;
+
+			case OP_CALL: case OP_TAILCALL:
+				types.resize(types.size() - min(types.size(), (size_t)in.b));
+				if (in.c == 1){
+					types.push_back(routines[in.a].type);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	return false;
+}
+
+//The types of a routine's frame slots: its parameters, its result and whatever its code stores
+static vector<Token> FrameTypes(const Routine& routine){
+	vector<Token> types(routine.frameSize, ERR);
+	for (size_t i = 0; i < routine.params.size() && i < types.size(); i++){
+		types[i] = routine.params[i];
+	}
+	if (routine.result >= 0 && routine.result < routine.frameSize){
+		types[routine.result] = routine.type;
+	}
+	for (const Instr& in : routine.code.code){
+		if (in.op == OP_LSTORE && in.a < routine.frameSize){
+			types[in.a] = (Token)in.b;
+		}
+	}
+	return types;
+}
+
+//Adds what code calls to what it needs on its own. Every call goes on top of the code's stack, and
+//a tail call replaces the routine that makes it, so that what it needs counts from the same frame
+static Need WithCalls(const Code& code, Need own, const vector<Need>& needs){
+	Need most = own;
+	for (const Instr& in : code.code){
+		if (in.op == OP_CALL){
+			const Need& callee = needs[in.a];
+			most.stack = max(most.stack, own.stack + callee.stack);
+			most.counters = max(most.counters, own.counters + callee.counters);
+			most.frames = max(most.frames, own.frames + 1 + callee.frames);
+		}
+		else if (in.op == OP_TAILCALL){
+			const Need& callee = needs[in.a];
+			most.stack = max(most.stack, callee.stack);
+			most.counters = max(most.counters, callee.counters);
+			most.frames = max(most.frames, callee.frames);
+		}
+	}
+	return most;
+}
+
+const char* ReserveRealtime(const LoadedImage& prog){
+	const vector<Routine>& routines = prog.routines;
+
+	//The type of every variable slot, from the value it starts out with and what is stored into it
+	vector<Token> globals(prog.slots.size(), ERR);
+	for (size_t i = 0; i < globals.size(); i++){
+		const Value& val = prog.initial[i];
+		globals[i] = val.IsString() ? STRING : val.IsReal() ? REAL : val.IsBool() ? BOOLEAN : val.IsInt() ? INTEGER : ERR;
+	}
+	auto storesOf = [&](const Code& code){
+		for (const Instr& in : code.code){
+			if (in.op == OP_STORE){
+				globals[in.a] = (Token)in.b;
+			}
+		}
+	};
+	for (const BatchUnit& unit : prog.units){
+		storesOf(unit.code);
+	}
+	for (const Routine& routine : routines){
+		storesOf(routine.code);
+	}
+
+	for (const BatchUnit& unit : prog.units){
+		if (MakesStrings(unit.code, routines, globals, vector<Token>())){
+			return "it reads or concatenates strings";
+		}
+	}
+	for (const Routine& routine : routines){
+		if (MakesStrings(routine.code, routines, globals, FrameTypes(routine))){
+			return "it reads or concatenates strings";
+		}
+	}
+
+	//What each routine needs, calls and all, is what it needs on its own plus the most any routine it
+	//calls needs. Worked out over and over until nothing changes, which takes at most one round per
+	//routine unless some chain of calls comes back round to where it started, in which case it would
+	//grow for ever
+	vector<Need> needs(routines.size());
+	for (size_t r = 0; r < routines.size(); r++){
+		needs[r] = Need{ (size_t)routines[r].frameSize + routines[r].code.maxStack, (size_t)routines[r].code.counters, 0 };
+	}
+	bool changed = true;
+	for (size_t round = 0; changed; round++){
+		if (round > routines.size()){
+			return "it calls itself, and nothing bounds how deep";
+		}
+		changed = false;
+		for (size_t r = 0; r < routines.size(); r++){
+			Need own{ (size_t)routines[r].frameSize + routines[r].code.maxStack, (size_t)routines[r].code.counters, 0 };
+			Need need = WithCalls(routines[r].code, own, needs);
+			if (need.stack != needs[r].stack || need.counters != needs[r].counters || need.frames != needs[r].frames){
+				needs[r] = need;
+				changed = true;
+			}
+		}
+	}
+
+	MachineSize size{ 0, 0, 0, 0, 0 };
+	auto add = [&](const Code& code, const Need& need){
+		size.stack = max(size.stack, need.stack);
+		size.counters = max(size.counters, need.counters);
+		size.frames = max(size.frames, need.frames);
+		for (const Instr& in : code.code){
+			if (in.op == OP_AEVAL){
+				const ArrayExpr& expr = code.arrayExprs[in.b];
+				size.arraySteps = max(size.arraySteps, expr.count);
+				size.arrayChunks = max(size.arrayChunks, expr.depth + 2 + in.c);
+			}
+		}
+	};
+	for (const BatchUnit& unit : prog.units){
+		add(unit.code, WithCalls(unit.code, Need{ (size_t)unit.code.maxStack, (size_t)unit.code.counters, 0 }, needs));
+	}
+	for (size_t r = 0; r < routines.size(); r++){
+		add(routines[r].code, needs[r]);
+	}
+
+	if (!Reserve(size)){
+		return "its calls go deeper than the stack allows";
+	}
+	ReserveInput();
+	return NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * realtime.h
+ * Running a program in fixed memory, for control loops that can't wait on the heap
+ * A program that runs in real time is compiled as a whole and loaded from its image (see image.h),
+ * and then its code is checked for the most memory it can ever need: how deep the value stack gets
+ * through every chain of calls, how many loop counters and calls are live at once, and the room its
+ * whole-array expressions work in. All of it is allocated before the first statement runs, along
+ * with the buffers for input and output, so that running the program never allocates at all.
+ * A program whose memory has no bound is refused before it runs. That is one that calls itself other
+ * than as a tail call, since nothing says how deep it goes, or one that reads or concatenates
+ * strings, since the language doesn't declare how long a string can get.
+*/
+
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+using namespace std;
+
+#include "image.h"
+
+
+//Gives standard output a fixed buffer, and formats a number of each type once so that the stream
+//has whatever it keeps for formatting them. Must come before anything is printed
+extern void ReserveOutput();
+
+//Allocates everything a loaded program can need while it runs. Returns NULL if it did, or why the
+//program's memory has no bound, in which case it must not be run in real time
+extern const char* ReserveRealtime(const LoadedImage& prog);
+
+
+#endif /* REALTIME_H_ */
@@ -0,0 +1,322 @@
+/*
+ * regvm.cpp
+ * Fusing code for the register machine, and allocating its registers
+ */
+
+#include "regvm.h"
+
+#include <algorithm>
+
+using namespace std;
+
+
+static Machine machine = VM_STACK;
+
+void UseMachine(Machine m){
+	machine = m;
+}
+
+Machine CurrentMachine(){
+	return machine;
+}
+
+
+//Whether an instruction may continue at a rather than at the next instruction
+static bool Jumps(OpCode op){
+	return op == OP_JUMP || op == OP_JUMPF || op == OP_JUMPT || (op >= OP_JUMPEQ && op <= OP_JUMPGT)
+		|| op == OP_FORPREP || op == OP_FORNEXT;
+}
+
+static bool Binary(OpCode op){
+	return op >= OP_OR && op <= OP_MOD;
+}
+
+//How many values an instruction of the stack machine pops, and how many it pushes
+static void Effect(const Instr& in, int& pops, int& pushes){
+	pops = pushes = 0;
+	switch(in.op){
+		case OP_CONST: case OP_LOAD: case OP_LLOAD: case OP_READ: case OP_EOF:
+			pushes = 1;
+			break;
+		case OP_DUP:
+			pops = 1;
+			pushes = 2;
+			break;
+		case OP_INDEX:
+			pops = pushes = 1;
+			break;
+		case OP_STORE: case OP_LSTORE: case OP_JUMPF: case OP_JUMPT: case OP_CASE:
+			pops = 1;
+			break;
+		case OP_ISTORE: case OP_JUMPEQ: case OP_JUMPLT: case OP_JUMPGT: case OP_FORPREP:
+			pops = 2;
+			break;
+		case OP_AEVAL:
+			pops = in.c;
+			break;
+		case OP_WRITE: case OP_WRITELN:
+			pops = in.a;
+			break;
+		case OP_CALL: case OP_TAILCALL:
+			pops = in.b;
+			pushes = in.c;
+			break;
+		default:
+			if (Binary(in.op)){
+				pops = 2;
+				pushes = 1;
+			}
+			break;
+	}
+}
+
+//Whether a register can be live across an instruction: not across one that runs other code, which
+//uses the same registers, or one that may go somewhere else
+static bool Fence(OpCode op){
+	return Jumps(op) || op == OP_CASE || op == OP_CALL || op == OP_TAILCALL || op == OP_RET || op == OP_HALT;
+}
+
+//A result that could be kept in a register, from the operator that gives it to the one that reads it
+struct Interval {
+	int start;
+	int end;
+	int reg;
+};
+
+//Finds which operators' results are read by other operators, and gives as many of them as it can
+//one of the machine's registers by linear scan, setting inRegister of the operator that gives each
+//one. left and right are set to the instructions that give each operator its operands, -1 if they
+//come from somewhere else
+static void AllocateRegisters(const vector<Instr>& from, const vector<char>& target, vector<int>& left, vector<int>& right, vector<int>& inRegister){
+	size_t n = from.size();
+	left.assign(n, -1);
+	right.assign(n, -1);
+	inRegister.assign(n, -1);
+
+	//How many places up to and including each instruction a register can't be live across, where code
+	//is jumped to among them
+	vector<int> fences(n, 0);
+	for (size_t i = 0; i < n; i++){
+		fences[i] = (i > 0 ? fences[i - 1] : 0) + (target[i] || Fence(from[i].op));
+	}
+
+	//The stack machine's stack, as the instructions that pushed what is on it. Values on it are the
+	//same whichever way the code got somewhere, so what it holds is followed straight down the code
+	vector<Interval> intervals;
+	vector<int> values;
+	for (size_t i = 0; i < n; i++){
+		int pops, pushes;
+		Effect(from[i], pops, pushes);
+		if (Binary(from[i].op) && values.size() >= 2){
+			left[i] = values[values.size() - 2];
+			right[i] = values.back();
+			for (int at : { left[i], right[i] }){
+				if (Binary(from[at].op) && fences[i] == fences[at]){
+					intervals.push_back(Interval{ at, (int)i, -1 });
+				}
+			}
+		}
+		values.resize(values.size() - min((size_t)pops, values.size()));
+		values.insert(values.end(), pushes, i);
+	}
+	sort(intervals.begin(), intervals.end(), [](const Interval& a, const Interval& b){ return a.start < b.start; });
+
+	//A register goes back once the operator that reads it has, so that operator can put its own result
+	//there. When there are none to be had, whichever result is read last stays on the value stack
+	vector<int> active;
+	vector<int> idle;
+	for (int r = REGISTERS - 1; r >= 0; r--){
+		idle.push_back(r);
+	}
+	for (size_t k = 0; k < intervals.size(); k++){
+		Interval& cur = intervals[k];
+		for (size_t a = 0; a < active.size(); ){
+			if (intervals[active[a]].end <= cur.start){
+				idle.push_back(intervals[active[a]].reg);
+				active[a] = active.back();
+				active.pop_back();
+			} else {
+				a++;
+			}
+		}
+		if (!idle.empty()){
+			cur.reg = idle.back();
+			idle.pop_back();
+			active.push_back(k);
+			continue;
+		}
+		auto last = max_element(active.begin(), active.end(), [&](int a, int b){ return intervals[a].end < intervals[b].end; });
+		if (intervals[*last].end > cur.end){
+			swap(cur.reg, intervals[*last].reg);
+			*last = k;
+		}
+	}
+	for (const Interval& interval : intervals){
+		inRegister[interval.start] = interval.reg;
+	}
+}
+
+//A variable or constant that the stack machine would have pushed, and hasn't been yet, in case the
+//instruction that uses it can read it in place. origin is the instruction that pushes it
+struct Pending {
+	int reg;
+	size_t origin;
+};
+
+void FuseOperands(Code& code){
+	if (!code.origins.empty()){
+		return;
+	}
+	code.origins.swap(code.code);
+	const vector<Instr>& from = code.origins;
+	vector<Instr>& to = code.code;
+	to.reserve(from.size());
+	size_t n = from.size();
+
+	//Where the code jumps to. Nothing is left pending across one, since the stack machine's stack is
+	//the same whichever way it was got to
+	vector<char> target(n + 1, 0);
+	for (const Instr& in : from){
+		if (Jumps(in.op)){
+			target[in.a] = 1;
+		}
+	}
+	for (const CaseTable& table : code.caseTables){
+		for (int k = 0; k < table.count; k++){
+			target[code.caseTargets[table.first + k]] = 1;
+		}
+		target[table.otherwise] = 1;
+	}
+
+	vector<int> left, right, inRegister;
+	AllocateRegisters(from, target, left, right, inRegister);
+
+	//Where each instruction went, for those that begin one of the register machine's
+	vector<int> where(n + 1, -1);
+	auto emit = [&](const Instr& in, size_t origin){
+		if (where[origin] < 0){
+			where[origin] = to.size();
+		}
+		to.push_back(in);
+	};
+
+	//The operands not pushed yet are always the top of the stack machine's stack, since anything that
+	//pushes a value pushes everything pending first. push emits all but the last keep of them, as the
+	//instructions that push them
+	vector<Pending> pending;
+	auto push = [&](size_t keep){
+		keep = min(keep, pending.size());
+		for (size_t k = 0; k + keep < pending.size(); k++){
+			emit(from[pending[k].origin], pending[k].origin);
+		}
+		pending.erase(pending.begin(), pending.end() - keep);
+	};
+
+	for (size_t i = 0; i < n; i++){
+		const Instr& in = from[i];
+		if (target[i]){
+			push(0);
+		}
+
+		switch(in.op){
+			case OP_CONST:
+				pending.push_back(Pending{ RegOperand(RK_CONST, in.a), i });
+				continue;
+			case OP_LOAD:
+				pending.push_back(Pending{ RegOperand(RK_SLOT, in.a), i });
+				continue;
+			case OP_LLOAD:
+				pending.push_back(Pending{ RegOperand(RK_LOCAL, in.a), i });
+				continue;
+
+			//A variable or constant stored straight into a variable is copied
+			case OP_STORE:
+			case OP_LSTORE:
+				if (!pending.empty() && pending.back().origin == i - 1){
+					push(1);
+					Instr copy = in;
+					copy.op = OP_RMOVE;
+					copy.a = RegDest(in.op == OP_STORE ? RK_SLOT : RK_LOCAL, in.a, in.b);
+					copy.b = pending[0].reg;
+					copy.c = 0;
+					copy.site = pending[0].origin;
+					pending.clear();
+					emit(copy, copy.site);
+					continue;
+				}
+				break;
+
+			case OP_OR: case OP_AND: case OP_EQ: case OP_LTHAN: case OP_GTHAN:
+			case OP_PLUS: case OP_MINUS: case OP_MULT: case OP_DIV: case OP_IDIV: case OP_MOD: {
+				//Operands read in place must be pushed just before the operator, so that their failures
+				//come in the order the stack machine's would
+				size_t operands = min(pending.size(), (size_t)2);
+				for (size_t k = 0; k < operands; k++){
+					if (pending[pending.size() - operands + k].origin != i - operands + k){
+						operands = 0;
+					}
+				}
+				push(operands);
+
+				//The others are the results of operators, in registers or on the stack with the right one on top
+				int l = left[i] >= 0 ? inRegister[left[i]] : -1;
+				int r = right[i] >= 0 ? inRegister[right[i]] : -1;
+				Instr op = in;
+				op.op = (OpCode)(in.op - OP_OR + OP_ROR);
+				op.a = RegOperand(RK_TEMP, 0);
+				op.c = operands >= 1 ? pending.back().reg : r >= 0 ? RegOperand(RK_REG, r) : RegOperand(RK_TEMP, 1);
+				op.b = operands == 2 ? pending[0].reg : l >= 0 ? RegOperand(RK_REG, l) : RegOperand(RK_TEMP, KindOf(op.c) == RK_TEMP ? 2 : 1);
+				op.site = i - operands;
+				pending.clear();
+
+				//A result that is stored straight into a variable goes there, and one that another
+				//operator reads goes in its register if it was given one
+				if (i + 1 < n && !target[i + 1] && (from[i + 1].op == OP_STORE || from[i + 1].op == OP_LSTORE)){
+					const Instr& store = from[i + 1];
+					op.a = RegDest(store.op == OP_STORE ? RK_SLOT : RK_LOCAL, store.a, store.b);
+					i++;
+				} else if (inRegister[i] >= 0){
+					op.a = RegOperand(RK_REG, inRegister[i]);
+				}
+				emit(op, op.site);
+				continue;
+			}
+
+			default:
+				break;
+		}
+
+		//Everything else runs as it is, with all of its operands pushed
+		push(0);
+		emit(in, i);
+	}
+	push(0);
+	where[n] = to.size();
+
+	//Jumps go to where their targets went. If one of them didn't begin an instruction, which can't
+	//happen, the code is left for the stack machine
+	bool placed = true;
+	auto place = [&](int& at){
+		placed = placed && where[at] >= 0;
+		at = where[at];
+	};
+	for (Instr& in : to){
+		if (Jumps(in.op)){
+			place(in.a);
+		}
+	}
+	vector<int> caseTargets = code.caseTargets;
+	vector<CaseTable> caseTables = code.caseTables;
+	for (int& at : code.caseTargets){
+		place(at);
+	}
+	for (CaseTable& table : code.caseTables){
+		place(table.otherwise);
+	}
+	if (!placed){
+		code.code.swap(code.origins);
+		code.origins.clear();
+		code.caseTargets = move(caseTargets);
+		code.caseTables = move(caseTables);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * regvm.h
+ * The register machine, which runs the same code in fewer instructions
+ * Code is always compiled for the stack machine (see bytecode.h), where an expression like
+ * p := 2 * r pushes both operands, multiplies them and pops the result into p. For the register
+ * machine each operator becomes a three-address instruction, fused with the instructions around it:
+ * an operand that is a variable or a constant is read where it is rather than pushed, and a result
+ * that is stored straight into a variable goes there rather than being pushed and popped. That one is
+ * a single instruction multiplying a constant by r straight into p, and a variable or constant stored
+ * into another variable is one move.
+ * The result of an operator that another operator reads, like p + r in (p + r) * (a - b), is a
+ * temporary, and temporaries are given the machine's registers (see REGISTERS) by linear scan: each
+ * one lives from the operator that gives it to the one that reads it, and goes back to be used again
+ * once it has been read. When there are none left, the temporary that is read last stays on the value
+ * stack instead, as does one that a call, a branch or a place the code jumps to comes in between, since
+ * the registers are the same for every routine. Anything else that isn't read in place stays on the
+ * value stack as well, where the register instructions take it from and push their results to, so that
+ * everything the register machine doesn't have instructions of its own for (calls, output, arrays,
+ * loops and branches) finds its operands where the stack machine would have put them, and runs as it is.
+ * A variable or constant is only read in place by the instruction that uses it, when nothing comes
+ * in between that could change it or fail first. Otherwise it is pushed like the stack machine would.
+ * Failures are reported by the stack machine's instructions that a register instruction does the work
+ * of, which are kept along with it, so they are exactly what the stack machine reports.
+*/
+
+#ifndef REGVM_H_
+#define REGVM_H_
+
+using namespace std;
+
+#include "bytecode.h"
+
+
+enum Machine { VM_STACK, VM_REGISTER };
+
+//Which machine code that is compiled from now on runs on
+extern void UseMachine(Machine machine);
+extern Machine CurrentMachine();
+
+//Fuses the operators of code compiled for the stack machine with their operands and stores, and gives
+//the temporaries between them registers, so that it runs on the register machine. Code that has been
+//fused already is left as it is
+extern void FuseOperands(Code& code);
+
+
+#endif /* REGVM_H_ */
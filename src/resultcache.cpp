@@ -0,0 +1,294 @@
+/*
+ * resultcache.cpp
+ * Kept results of deterministic programs
+ */
+
+#include "resultcache.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+
+//Marks a kept result, and changes whenever the layout of one does
+static const uint32_t RESULT_MAGIC = 0x50335232;
+
+//How much the results in a directory may take up together. A result bigger than a quarter of that
+//isn't kept, so that one program can't push out all the others
+static const uint64_t RESULT_LIMIT = (uint64_t)64 << 20;
+
+//At the start of every kept result, followed by the program's text and then the output. The text is
+//compared with the program's before anything is replayed, since two programs may hash to the same key
+struct ResultHeader {
+	uint32_t magic;
+	uint32_t status;
+	uint64_t key;
+	uint64_t errors;
+	uint64_t textLength;
+	uint64_t length;
+};
+
+//The totals kept in the directory's stats file
+struct ResultTotals {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t uncached;
+	uint64_t evictions;
+};
+
+
+uint64_t ResultKey(const string& text){
+	//The build is hashed in, since another build of the interpreter could print something else
+	uint64_t h = ImageKey(text) ^ (BuildId() * 1099511628211ull);
+	return h != 0 ? h : 1;
+}
+
+//The user's own cache directory
+static string DefaultDir(){
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	if (xdg != NULL && *xdg){
+		return string(xdg) + "/prog3-results";
+	}
+	const char* home = getenv("HOME");
+	if (home != NULL && *home){
+		return string(home) + "/.cache/prog3-results";
+	}
+	return "/tmp/prog3-results-" + to_string(getuid());
+}
+
+static string ResultFile(const string& dir, uint64_t key){
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.out", (unsigned long long)key);
+	return dir + name;
+}
+
+
+//Passes everything on to the stream's own buffer, keeping a copy of it until there is too much to keep
+class ResultCache::RecordingBuf : public streambuf {
+public:
+	streambuf* dest;
+	string output;
+	bool overflowed;
+
+	explicit RecordingBuf(streambuf* d) : dest(d), overflowed(false) {}
+
+protected:
+	void Record(const char* s, size_t n) {
+		if (overflowed || output.size() + n > RESULT_LIMIT / 4){
+			overflowed = true;
+			return;
+		}
+		output.append(s, n);
+	}
+
+	int overflow(int ch) override {
+		if (ch == EOF){
+			return 0;
+		}
+		char c = ch;
+		Record(&c, 1);
+		return dest->sputc(c);
+	}
+
+	streamsize xsputn(const char* s, streamsize n) override {
+		Record(s, n);
+		return dest->sputn(s, n);
+	}
+
+	int sync() override {
+		return dest->pubsync();
+	}
+};
+
+
+ResultCache::~ResultCache(){
+	if (recording != NULL){
+		recorded->rdbuf(recording->dest);
+		delete recording;
+	}
+}
+
+bool ResultCache::Open(const string& where){
+	dir = where.empty() ? DefaultDir() : where;
+	//Each directory on the way is made if it isn't there, the last one for this user alone
+	for (size_t at = dir.find('/', 1); at != string::npos; at = dir.find('/', at + 1)){
+		mkdir(dir.substr(0, at).c_str(), 0755);
+	}
+	if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST){
+		dir.clear();
+		return false;
+	}
+	return true;
+}
+
+bool ResultCache::Replay(const string& text, ostream& out, bool& status, int& errors){
+	key = ResultKey(text);
+	program = text;
+	if (dir.empty()){
+		return false;
+	}
+
+	int fd = open(ResultFile(dir, key).c_str(), O_RDONLY);
+	if (fd >= 0){
+		struct stat st;
+		ResultHeader header;
+		bool found = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header)
+		             && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+		             && header.magic == RESULT_MAGIC && header.key == key && header.textLength == text.size()
+		             && st.st_size - sizeof(header) >= header.textLength
+		             && header.length == st.st_size - sizeof(header) - header.textLength;
+		if (found){
+			void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			found = p != MAP_FAILED;
+			if (found){
+				const char* kept = (const char*)p + sizeof(header);
+				found = memcmp(kept, text.data(), text.size()) == 0;
+				if (found && header.length > 0){
+					out.flush();
+					found = write(1, kept + header.textLength, header.length) == (ssize_t)header.length;
+				}
+				munmap(p, st.st_size);
+			}
+		}
+		if (found){
+			//Touched, so that it counts as used just now
+			futimens(fd, NULL);
+			close(fd);
+			status = header.status != 0;
+			errors = header.errors;
+			Count(1, 0, 0, 0);
+			return true;
+		}
+		close(fd);
+	}
+
+	out.flush();
+	recording = new RecordingBuf(out.rdbuf());
+	recorded = &out;
+	out.rdbuf(recording);
+	return false;
+}
+
+void ResultCache::Keep(bool status, int errors, bool usedInput){
+	if (recording == NULL){
+		return;
+	}
+	recorded->flush();
+	recorded->rdbuf(recording->dest);
+	RecordingBuf* rec = recording;
+	recording = NULL;
+
+	if (usedInput || rec->overflowed){
+		delete rec;
+		Count(0, 0, 1, 0);
+		return;
+	}
+
+	//Written whole to a file of its own, which only takes its place once it is all there
+	ResultHeader header = { RESULT_MAGIC, status, key, (uint64_t)errors, program.size(), rec->output.size() };
+	rec->output.insert(0, program);
+	rec->output.insert(0, (const char*)&header, sizeof(header));
+	string file = ResultFile(dir, key);
+	string temp = file + "." + to_string(getpid());
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool written = fd >= 0 && write(fd, rec->output.data(), rec->output.size()) == (ssize_t)rec->output.size();
+	if (fd >= 0){
+		close(fd);
+	}
+	if (!written || rename(temp.c_str(), file.c_str()) != 0){
+		unlink(temp.c_str());
+	}
+	delete rec;
+
+	Count(0, 1, 0, written ? Evict() : 0);
+}
+
+int ResultCache::Evict(){
+	struct Kept {
+		string file;
+		uint64_t size;
+		struct timespec used;
+	};
+	vector<Kept> kept;
+	uint64_t total = 0;
+
+	DIR* d = opendir(dir.c_str());
+	if (d == NULL){
+		return 0;
+	}
+	while (struct dirent* e = readdir(d)){
+		string name = e->d_name;
+		struct stat st;
+		if (name.size() != 20 || name.compare(16, 4, ".out") != 0 || stat((dir + "/" + name).c_str(), &st) != 0){
+			continue;
+		}
+		kept.push_back(Kept{ dir + "/" + name, (uint64_t)st.st_size, st.st_mtim });
+		total += st.st_size;
+	}
+	closedir(d);
+
+	sort(kept.begin(), kept.end(), [](const Kept& a, const Kept& b){
+		return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+	});
+	int evicted = 0;
+	for (size_t i = 0; i < kept.size() && total > RESULT_LIMIT; i++){
+		if (unlink(kept[i].file.c_str()) == 0){
+			total -= kept[i].size;
+			evicted++;
+		}
+	}
+	return evicted;
+}
+
+void ResultCache::Count(int hits, int misses, int uncached, int evictions){
+	int fd = open((dir + "/stats").c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd < 0){
+		return;
+	}
+	//Every run that uses the directory adds to the same totals
+	flock(fd, LOCK_EX);
+	ResultTotals totals = {};
+	if (pread(fd, &totals, sizeof(totals), 0) != (ssize_t)sizeof(totals)){
+		totals = ResultTotals{};
+	}
+	totals.hits += hits;
+	totals.misses += misses;
+	totals.uncached += uncached;
+	totals.evictions += evictions;
+	if (pwrite(fd, &totals, sizeof(totals), 0) != (ssize_t)sizeof(totals)){
+		ftruncate(fd, 0);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+void ResultCache::Report(const string& where, ostream& out){
+	string d = where.empty() ? DefaultDir() : where;
+	ResultTotals totals = {};
+	int fd = open((d + "/stats").c_str(), O_RDONLY);
+	if (fd >= 0){
+		if (pread(fd, &totals, sizeof(totals), 0) != (ssize_t)sizeof(totals)){
+			totals = ResultTotals{};
+		}
+		close(fd);
+	}
+
+	uint64_t runs = totals.hits + totals.misses + totals.uncached;
+	out << "Result cache " << d << ": " << runs << " runs, hits=" << totals.hits << " misses=" << totals.misses
+	    << " not cacheable=" << totals.uncached << " evictions=" << totals.evictions;
+	if (runs > 0){
+		out << ", hit rate " << (100 * totals.hits + runs / 2) / runs << "%";
+	}
+	out << endl;
+}
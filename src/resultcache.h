@@ -0,0 +1,70 @@
+/*
+ * resultcache.h
+ * A cache on disk of what deterministic programs printed, so that they needn't be run again
+ * The language has no clock and nothing random, so the only thing a program's output can depend on
+ * besides its text is its input. A run that never reads standard input or asks whether it has ended
+ * would therefore print exactly the same thing every time, and what it printed is kept, along with
+ * whether it was successful and how many errors it reported. The next run of the same text replays
+ * the output with a single write and doesn't run the program at all.
+ * Results are kept one to a file in a directory, keyed by a hash of the program's text and of the
+ * build of the interpreter, which could print something else. The text is kept along with the output
+ * and compared with the program's before anything is replayed, so programs whose hashes collide can't
+ * be mistaken for each other. The directory is kept under a size limit by removing the results that
+ * were used longest ago, going by the time each file was last touched. The directory also keeps how
+ * many runs were answered from it, ran and were kept, or couldn't be kept, for every run that used it.
+*/
+
+#ifndef RESULTCACHE_H_
+#define RESULTCACHE_H_
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+
+//The hash a program's result is kept under, never 0
+extern uint64_t ResultKey(const string& text);
+
+class ResultCache {
+	class RecordingBuf;
+
+	string dir;
+	uint64_t key;
+	//The text of the program being run
+	string program;
+	//Installed in the stream being recorded, NULL when there is none
+	RecordingBuf* recording;
+	ostream* recorded;
+
+	//Adds to the totals kept in the directory
+	void Count(int hits, int misses, int uncached, int evictions);
+	//Removes the results used longest ago until the directory is under its limit, returning how many
+	int Evict();
+
+public:
+	ResultCache() : key(0), recording(NULL), recorded(NULL) {}
+	~ResultCache();
+
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	//Uses the cache in dir, or the user's own if dir is empty, making it if it isn't there. False if it
+	//can't be used, in which case nothing is replayed or kept
+	bool Open(const string& dir);
+
+	//Writes the output kept for the program with the given text to standard output, and sets whether it
+	//was successful and how many errors it reported. False if there is none, in which case the program
+	//has to run, and what it prints to out is recorded
+	bool Replay(const string& text, ostream& out, bool& status, int& errors);
+
+	//Stops recording, and keeps what was printed unless the program used its input
+	void Keep(bool status, int errors, bool usedInput);
+
+	//Prints the totals kept in the cache in dir, or the user's own if dir is empty
+	static void Report(const string& dir, ostream& out);
+};
+
+
+#endif /* RESULTCACHE_H_ */
@@ -0,0 +1,144 @@
+/*
+ * rope.cpp
+ * Concatenation, flattening and freeing of Ropes
+ * A program that builds a string in a loop makes a chain of concatenations as long as the loop, so
+ * nothing here recurses over the tree.
+ */
+
+#include "rope.h"
+#include "stats.h"
+#include "strops.h"
+
+#include <vector>
+
+using namespace std;
+
+//Concatenations up to this long are copied into a new leaf straight away, a node would cost more
+#define SHORT_CONCAT 32
+
+
+Rope::Rope(const string& s) : node(NULL) {
+	if (s.empty()){
+		return;
+	}
+	node = new Node{ 1, s.size(), NULL, NULL, s, NULL, SYM_EMPTY, NULL };
+	node->text = &node->flat;
+	Stats::CountString(node->flat);
+}
+
+
+Rope::Rope(SymbolId sym) : node(NULL) {
+	const string& s = SymbolName(sym);
+	if (s.empty()){
+		return;
+	}
+	node = new Node{ 1, s.size(), NULL, NULL, string(), &s, sym, NULL };
+}
+
+
+//Frees a node that nothing refers to any more, and whatever only it was holding on to
+void Rope::Free(Node* n){
+	Node* dead = n;
+	n->nextDead = NULL;
+	while (dead != NULL){
+		Node* cur = dead;
+		dead = cur->nextDead;
+
+		Node* halves[2] = { cur->left, cur->right };
+		for (Node* h : halves){
+			if (h != NULL && --h->refs == 0){
+				h->nextDead = dead;
+				dead = h;
+			}
+		}
+		delete cur;
+	}
+}
+
+
+//Gathers the text of a concatenation into the node itself, which then no longer needs its halves
+void Rope::Flatten(Node* n){
+	string text;
+	text.reserve(n->length);
+
+	vector<const Node*> pending;
+	pending.push_back(n);
+	while (!pending.empty()){
+		const Node* cur = pending.back();
+		pending.pop_back();
+
+		if (cur->text != NULL){
+			text += *cur->text;
+		} else {
+			pending.push_back(cur->right);
+			pending.push_back(cur->left);
+		}
+	}
+
+	n->flat = move(text);
+	n->text = &n->flat;
+	Stats::CountString(n->flat);
+	Release(n->left);
+	Release(n->right);
+	n->left = n->right = NULL;
+}
+
+
+const string& Rope::Str() const{
+	static const string empty;
+	if (node == NULL){
+		return empty;
+	}
+	if (node->text == NULL){
+		Flatten(node);
+	}
+	return *node->text;
+}
+
+
+Rope Rope::Concat(const Rope& a, const Rope& b){
+	if (a.node == NULL){
+		return b;
+	}
+	if (b.node == NULL){
+		return a;
+	}
+
+	Rope r;
+	size_t length = a.node->length + b.node->length;
+	if (length <= SHORT_CONCAT){
+		r.node = new Node{ 1, length, NULL, NULL, a.Str() + b.Str(), NULL, SYM_EMPTY, NULL };
+		r.node->text = &r.node->flat;
+		return r;
+	}
+
+	a.node->refs++;
+	b.node->refs++;
+	r.node = new Node{ 1, length, a.node, b.node, string(), NULL, SYM_EMPTY, NULL };
+	return r;
+}
+
+
+bool Rope::Equals(const Rope& other) const{
+	if (node == other.node){
+		return true;
+	}
+	if (Length() != other.Length()){
+		return false;
+	}
+	//Both are non-empty from here on, the empty string has no node
+	if (node->sym != SYM_EMPTY && other.node->sym != SYM_EMPTY){
+		return node->sym == other.node->sym;
+	}
+	return StrEqual(Str().data(), other.Str().data(), Length());
+}
+
+
+int Rope::Compare(const Rope& other) const{
+	if (node == other.node){
+		return 0;
+	}
+	const string& a = Str();
+	const string& b = other.Str();
+	return StrCompare(a.data(), a.size(), b.data(), b.size());
+}
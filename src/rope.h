@@ -0,0 +1,107 @@
+/*
+ * rope.h
+ * Immutable, reference-counted strings for string Values
+ * Copying a Rope only bumps a reference count, so assigning string variables never copies the
+ * characters. Concatenation makes a new node that points at both halves instead of copying them,
+ * so building a long string one piece at a time is linear overall. The characters of a concatenation
+ * are only gathered into one buffer, once, when someone needs to see them as a whole, e.g. to print
+ * or compare them.
+ * Reference counts are not atomic. Like Values themselves, a Rope belongs to one interpreter thread.
+*/
+
+#ifndef ROPE_H_
+#define ROPE_H_
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+#include "symtab.h"
+
+
+class Rope {
+	struct Node {
+		int refs;
+		size_t length;
+		//The two halves of a concatenation, NULL in a leaf and in a concatenation that has been flattened
+		Node* left;
+		Node* right;
+		//The text of a leaf, or of a concatenation once it has been flattened
+		string flat;
+		//Where the text is: flat, the interning table's copy for a string constant, or NULL for a
+		//concatenation that hasn't been flattened
+		const string* text;
+		//The interned symbol of a string constant, SYM_EMPTY for any other string. Two interned
+		//strings are equal exactly when their symbols are
+		SymbolId sym;
+		//Links nodes waiting to be freed, see Release
+		Node* nextDead;
+	};
+
+	//NULL for the empty string, so that empty and non-string Values cost nothing
+	Node* node;
+
+	//Drops a reference. Values are copied and overwritten all the time, and most of them are not
+	//strings, so this much is inlined
+	static void Release(Node* n) {
+		if (n != NULL && --n->refs == 0){
+			Free(n);
+		}
+	}
+	static void Free(Node* n);
+	static void Flatten(Node* n);
+
+public:
+	Rope() : node(NULL) {}
+	explicit Rope(const string& s);
+	//A string constant, sharing the text the lexer interned
+	explicit Rope(SymbolId sym);
+
+	Rope(const Rope& other) : node(other.node) {
+		if (node != NULL){
+			node->refs++;
+		}
+	}
+	Rope(Rope&& other) noexcept : node(other.node) { other.node = NULL; }
+
+	Rope& operator=(const Rope& other) {
+		if (other.node != NULL){
+			other.node->refs++;
+		}
+		Release(node);
+		node = other.node;
+		return *this;
+	}
+	Rope& operator=(Rope&& other) noexcept {
+		if (this != &other){
+			Release(node);
+			node = other.node;
+			other.node = NULL;
+		}
+		return *this;
+	}
+
+	~Rope() { Release(node); }
+
+	size_t Length() const { return node == NULL ? 0 : node->length; }
+
+	//The whole string, flattening it first if it is a concatenation
+	const string& Str() const;
+
+	//a followed by b. Neither one is copied unless the result is short
+	static Rope Concat(const Rope& a, const Rope& b);
+
+	//Comparisons, see strops.h. Equality checks for the same node, the same symbol and the same
+	//length before it looks at any characters
+	bool Equals(const Rope& other) const;
+	int Compare(const Rope& other) const;
+
+	friend ostream& operator<<(ostream& out, const Rope& r) {
+		return out << r.Str();
+	}
+};
+
+
+#endif /* ROPE_H_ */
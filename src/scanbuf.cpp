@@ -0,0 +1,284 @@
+/*
+ * scanbuf.cpp
+ * Scanning kernels and the block-reading stream buffer used by the lexer
+ */
+
+#include "scanbuf.h"
+#include "strops.h"
+#include "arrayops.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+using namespace std;
+
+
+//Scalar kernels, always available and used for the tails of the vector kernels
+
+static inline bool IsSpace(unsigned char c){
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static size_t SpaceScalar(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	while (p < end && IsSpace(*p)){
+		if (*p == '\n'){
+			newlines++;
+		}
+		p++;
+	}
+	return p - start;
+}
+
+static size_t CommentScalar(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	while (p < end && *p != '}'){
+		if (*p == '\n'){
+			newlines++;
+		}
+		p++;
+	}
+	return p - start;
+}
+
+static size_t StringScalar(const char* p, const char* end){
+	const char* start = p;
+	while (p < end && *p != '\'' && *p != '\n'){
+		p++;
+	}
+	return p - start;
+}
+
+
+#ifdef SCAN_X86
+
+//SSE2 kernels, 16 bytes at a time. A set bit in a mask marks a byte that stops the scan
+
+static inline unsigned SpaceMask16(__m128i v){
+	//isspace is ' ' or '\t' through '\r', which is (c - '\t') <= 4 as an unsigned byte
+	__m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i inRange = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+	__m128i space = _mm_or_si128(inRange, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	return ~(unsigned)_mm_movemask_epi8(space) & 0xFFFF;
+}
+
+static size_t SpaceSSE2(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	const __m128i nl = _mm_set1_epi8('\n');
+	while (end - p >= 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned stop = SpaceMask16(v);
+		unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (stop){
+			int k = __builtin_ctz(stop);
+			newlines += __builtin_popcount(lines & ((1u << k) - 1));
+			return (p - start) + k;
+		}
+		newlines += __builtin_popcount(lines);
+		p += 16;
+	}
+	return (p - start) + SpaceScalar(p, end, newlines);
+}
+
+static size_t CommentSSE2(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i close = _mm_set1_epi8('}');
+	while (end - p >= 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned stop = _mm_movemask_epi8(_mm_cmpeq_epi8(v, close));
+		unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (stop){
+			int k = __builtin_ctz(stop);
+			newlines += __builtin_popcount(lines & ((1u << k) - 1));
+			return (p - start) + k;
+		}
+		newlines += __builtin_popcount(lines);
+		p += 16;
+	}
+	return (p - start) + CommentScalar(p, end, newlines);
+}
+
+static size_t StringSSE2(const char* p, const char* end){
+	const char* start = p;
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i quote = _mm_set1_epi8('\'');
+	while (end - p >= 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		unsigned stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, nl)));
+		if (stop){
+			return (p - start) + __builtin_ctz(stop);
+		}
+		p += 16;
+	}
+	return (p - start) + StringScalar(p, end);
+}
+
+
+//AVX2 kernels, the same thing 32 bytes at a time
+
+__attribute__((target("avx2")))
+static size_t SpaceAVX2(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i four = _mm256_set1_epi8(4);
+	const __m256i blank = _mm256_set1_epi8(' ');
+	while (end - p >= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i shifted = _mm256_sub_epi8(v, tab);
+		__m256i inRange = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, four), shifted);
+		__m256i space = _mm256_or_si256(inRange, _mm256_cmpeq_epi8(v, blank));
+		unsigned stop = ~(unsigned)_mm256_movemask_epi8(space);
+		unsigned lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if (stop){
+			int k = __builtin_ctz(stop);
+			newlines += __builtin_popcount(lines & ((1u << k) - 1));
+			return (p - start) + k;
+		}
+		newlines += __builtin_popcount(lines);
+		p += 32;
+	}
+	return (p - start) + SpaceSSE2(p, end, newlines);
+}
+
+__attribute__((target("avx2")))
+static size_t CommentAVX2(const char* p, const char* end, int& newlines){
+	const char* start = p;
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i close = _mm256_set1_epi8('}');
+	while (end - p >= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		unsigned stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, close));
+		unsigned lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if (stop){
+			int k = __builtin_ctz(stop);
+			newlines += __builtin_popcount(lines & ((1u << k) - 1));
+			return (p - start) + k;
+		}
+		newlines += __builtin_popcount(lines);
+		p += 32;
+	}
+	return (p - start) + CommentSSE2(p, end, newlines);
+}
+
+__attribute__((target("avx2")))
+static size_t StringAVX2(const char* p, const char* end){
+	const char* start = p;
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i quote = _mm256_set1_epi8('\'');
+	while (end - p >= 32){
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		unsigned stop = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, nl)));
+		if (stop){
+			return (p - start) + __builtin_ctz(stop);
+		}
+		p += 32;
+	}
+	return (p - start) + StringSSE2(p, end);
+}
+
+#endif /* SCAN_X86 */
+
+
+//The kernels currently in use
+static size_t (*spaceKernel)(const char*, const char*, int&) = SpaceScalar;
+static size_t (*commentKernel)(const char*, const char*, int&) = CommentScalar;
+static size_t (*stringKernel)(const char*, const char*) = StringScalar;
+
+//Pick the best kernels before main runs
+static ScanMode initialMode = SetScanMode(SCAN_AUTO);
+
+
+ScanMode SetScanMode(ScanMode mode){
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	bool hasAVX2 = __builtin_cpu_supports("avx2");
+
+	if (mode == SCAN_AUTO){
+		mode = hasAVX2 ? SCAN_AVX2 : SCAN_SSE2;
+	}
+	if (mode == SCAN_AVX2 && !hasAVX2){
+		mode = SCAN_SCALAR;
+	}
+
+	switch (mode){
+		case SCAN_AVX2:
+			spaceKernel = SpaceAVX2;
+			commentKernel = CommentAVX2;
+			stringKernel = StringAVX2;
+			break;
+
+		case SCAN_SSE2:
+			spaceKernel = SpaceSSE2;
+			commentKernel = CommentSSE2;
+			stringKernel = StringSSE2;
+			break;
+
+		default:
+			mode = SCAN_SCALAR;
+			spaceKernel = SpaceScalar;
+			commentKernel = CommentScalar;
+			stringKernel = StringScalar;
+			break;
+	}
+#else
+	mode = SCAN_SCALAR;
+#endif
+	SetStringKernels(mode);
+	SetArrayKernels(mode);
+	return mode;
+}
+
+
+const char* ScanModeName(ScanMode mode){
+	switch (mode){
+		case SCAN_SCALAR: return "scalar";
+		case SCAN_SSE2:   return "sse2";
+		case SCAN_AVX2:   return "avx2";
+		default:          return "auto";
+	}
+}
+
+
+size_t ScanSpace(const char* p, const char* end, int& newlines){
+	return spaceKernel(p, end, newlines);
+}
+
+size_t ScanComment(const char* p, const char* end, int& newlines){
+	return commentKernel(p, end, newlines);
+}
+
+size_t ScanString(const char* p, const char* end){
+	return stringKernel(p, end);
+}
+
+
+//One byte in front of every block is kept free for the putback slot
+ScanBuf::ScanBuf(streambuf* source, size_t size) : src(source), buf(size + 1) {
+	setg(buf.data() + 1, buf.data() + 1, buf.data() + 1);
+}
+
+
+ScanBuf::int_type ScanBuf::underflow(){
+	if (gptr() < egptr()){
+		return traits_type::to_int_type(*gptr());
+	}
+
+	//Carry the last character over to the putback slot so that putback works across a refill
+	size_t keep = 0;
+	if (gptr() > eback()){
+		buf[0] = gptr()[-1];
+		keep = 1;
+	}
+
+	streamsize n = src->sgetn(buf.data() + 1, buf.size() - 1);
+	if (n <= 0){
+		return traits_type::eof();
+	}
+
+	setg(buf.data() + 1 - keep, buf.data() + 1, buf.data() + 1 + n);
+	return traits_type::to_int_type(*gptr());
+}
@@ -0,0 +1,57 @@
+/*
+ * scanbuf.h
+ * Buffer-based scanning for the lexer
+ * ScanBuf is a stream buffer that reads its source in large blocks and lets the lexer look
+ * at the block directly, so that runs of whitespace, comment bodies and string literals can
+ * be skipped with vectorized kernels instead of one in.get(ch) per character.
+ * Kernels are chosen once at runtime: AVX2 or SSE2 where the CPU has them, scalar otherwise.
+*/
+
+#ifndef SCANBUF_H_
+#define SCANBUF_H_
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+//Which set of kernels to scan with
+enum ScanMode { SCAN_AUTO, SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+//Selects the kernels, these along with the string comparison ones in strops.h and the array ones in
+//arrayops.h. SCAN_AUTO picks the best the CPU supports. Returns the mode actually used, which falls
+//back to scalar if the requested instruction set is not available
+extern ScanMode SetScanMode(ScanMode mode);
+extern const char* ScanModeName(ScanMode mode);
+
+//The kernels. Each looks at [p, end) and returns how many bytes it passed over
+//Whitespace as in isspace(), counting the newlines among it
+extern size_t ScanSpace(const char* p, const char* end, int& newlines);
+//Everything up to the closing } of a comment, counting newlines
+extern size_t ScanComment(const char* p, const char* end, int& newlines);
+//Everything up to the closing ' or the newline that ends a string constant
+extern size_t ScanString(const char* p, const char* end);
+
+
+class ScanBuf : public streambuf {
+	streambuf* src;
+	vector<char> buf;
+
+protected:
+	int_type underflow() override;
+
+public:
+	explicit ScanBuf(streambuf* source, size_t size = 1 << 16);
+
+	//The part of the current block that hasn't been read yet
+	const char* Cur() const { return gptr(); }
+	const char* End() const { return egptr(); }
+	//Consume n bytes of the current block
+	void Skip(size_t n) { gbump((int)n); }
+};
+
+
+#endif /* SCANBUF_H_ */
@@ -0,0 +1,303 @@
+/*
+ * shard.cpp
+ * The supervisor and worker processes of a sharded run
+ */
+
+#include "shard.h"
+#include "image.h"
+#include "parserInterp.h"
+#include "scanbuf.h"
+#include "spscring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+//How a program ended
+enum JobState { JOB_PENDING, JOB_OK, JOB_FAILED, JOB_CRASHED };
+
+//A worker's share of the programs, those from top up to bottom. Both ends are packed in one word, so
+//that the worker taking from the top and another taking from the bottom agree with a single
+//compare-and-swap. Shares are only ever taken from, never added to
+struct alignas(CACHE_LINE) Share {
+	atomic<uint64_t> ends;
+	//The program the worker is running, -1 between programs
+	atomic<int> running;
+};
+
+struct Job {
+	atomic<int> state;
+	//The signal that ended the worker running a JOB_CRASHED program
+	atomic<int> signal;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shares are shared between processes");
+
+static inline uint64_t Ends(uint32_t top, uint32_t bottom){
+	return (uint64_t)top << 32 | bottom;
+}
+
+
+//Takes the next program from the front of the worker's own share, or once that is empty from the back
+//of whichever share has the most left. -1 when there are none left anywhere
+static int Take(Share* shares, int workers, int w){
+	uint64_t ends = shares[w].ends.load(memory_order_acquire);
+	while ((uint32_t)(ends >> 32) != (uint32_t)ends){
+		uint32_t top = ends >> 32;
+		if (shares[w].ends.compare_exchange_weak(ends, Ends(top + 1, (uint32_t)ends), memory_order_acq_rel)){
+			return top;
+		}
+	}
+
+	for(;;){
+		int victim = -1;
+		uint32_t most = 0;
+		for (int v = 0; v < workers; v++){
+			uint64_t e = shares[v].ends.load(memory_order_acquire);
+			uint32_t left = (uint32_t)e - (uint32_t)(e >> 32);
+			if (left > most){
+				most = left;
+				victim = v;
+				ends = e;
+			}
+		}
+		if (victim < 0){
+			return -1;
+		}
+
+		uint32_t bottom = (uint32_t)ends - 1;
+		if (shares[victim].ends.compare_exchange_strong(ends, Ends(ends >> 32, bottom), memory_order_acq_rel)){
+			return bottom;
+		}
+	}
+}
+
+//Interprets a program from the start, reading it through the lexer's scanning buffer like prog3 does
+static bool Interpret(const string& text, string* image){
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf());
+	istream in(&scan);
+	int line = 1;
+	return image != NULL ? CompileImage(in, line, *image) : Prog(in, line);
+}
+
+//Runs a program file, printing what it prints followed by how it ended, just like prog3 would on its
+//own. False if it was unsuccessful
+static bool RunProgram(const string& file, ImageCache& cache){
+	ifstream in(file.c_str(), ios::binary);
+	if (!in.is_open()){
+		cout << "CANNOT OPEN " << file << endl;
+		return false;
+	}
+	string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+	const char* data = NULL;
+	size_t size = 0;
+	int entry = -1;
+	CacheResult found = cache.Find(ImageKey(text), data, size, entry);
+
+	//Whatever compiling reports goes unseen. A program that doesn't compile as a whole runs as it is
+	//read instead, and reports it then
+	string image;
+	if (found == CACHE_CLAIMED || found == CACHE_BUSY){
+		ostringstream unseen;
+		streambuf* out = cout.rdbuf(unseen.rdbuf());
+		ResetProg();
+		bool compiled = Interpret(text, &image);
+		cout.rdbuf(out);
+
+		if (found == CACHE_CLAIMED && compiled){
+			cache.Publish(entry, image);
+		}
+		else if (found == CACHE_CLAIMED){
+			cache.Refuse(entry);
+		}
+		found = compiled ? CACHE_HIT : CACHE_UNCACHEABLE;
+		data = image.data();
+		size = image.size();
+	}
+
+	ResetProg();
+	LoadedImage prog;
+	bool status;
+	if (found == CACHE_HIT && LoadImage(data, size, prog)){
+		status = RunImage(prog) == 0;
+	} else {
+		status = Interpret(text, NULL);
+	}
+
+	if (!status){
+		cout << "\nUnsuccessful Interpretation " << endl << "Number of Errors " << ErrCount() << endl;
+	} else {
+		cout << "\nSuccessful Execution" << endl;
+	}
+	return status;
+}
+
+//A worker, which runs programs until there are none left to take and then exits. What each program
+//prints goes to a file of its own in dir
+static void Worker(const vector<string>& files, Share* shares, Job* jobs, int workers, int w, ImageCache& cache, const string& dir){
+	//Several programs can't share one input, so they have none
+	int null = open("/dev/null", O_RDONLY);
+	if (null >= 0){
+		dup2(null, 0);
+		close(null);
+	}
+
+	for(;;){
+		int job = Take(shares, workers, w);
+		if (job < 0){
+			break;
+		}
+		shares[w].running.store(job, memory_order_release);
+
+		int fd = open((dir + "/" + to_string(job)).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0){
+			jobs[job].state.store(JOB_FAILED, memory_order_release);
+			shares[w].running.store(-1, memory_order_release);
+			continue;
+		}
+		dup2(fd, 1);
+		close(fd);
+
+		bool ok = RunProgram(files[job], cache);
+		cout.flush();
+		jobs[job].state.store(ok ? JOB_OK : JOB_FAILED, memory_order_release);
+		shares[w].running.store(-1, memory_order_release);
+	}
+	_exit(0);
+}
+
+
+int ShardExec(const vector<string>& files, int workers){
+	int n = files.size();
+	workers = max(1, min(workers, n));
+
+	//Opened before forking, so that every worker shares one mapping of it
+	ImageCache cache;
+	cache.Open();
+
+	const char* tmp = getenv("TMPDIR");
+	string dir = string(tmp != NULL && *tmp ? tmp : "/tmp") + "/prog3-shard-XXXXXX";
+	if (mkdtemp(&dir[0]) == NULL){
+		cerr << "CANNOT MAKE A DIRECTORY FOR OUTPUT IN " << dir.substr(0, dir.rfind('/')) << endl;
+		return n;
+	}
+
+	size_t bytes = workers * sizeof(Share) + n * sizeof(Job);
+	void* shared = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED){
+		cerr << "CANNOT MAP SHARED MEMORY" << endl;
+		rmdir(dir.c_str());
+		return n;
+	}
+	Share* shares = (Share*)shared;
+	Job* jobs = (Job*)(shares + workers);
+	//Each worker starts out with an even, contiguous share of the programs
+	for (int w = 0; w < workers; w++){
+		new (&shares[w]) Share();
+		shares[w].ends.store(Ends((long long)n * w / workers, (long long)n * (w + 1) / workers));
+		shares[w].running.store(-1);
+	}
+	for (int i = 0; i < n; i++){
+		new (&jobs[i]) Job();
+		jobs[i].state.store(JOB_PENDING);
+		jobs[i].signal.store(0);
+	}
+
+	//Anything not yet written would be written again by every worker
+	cout.flush();
+
+	vector<pid_t> pids(workers, -1);
+	int alive = 0;
+	auto start = [&](int w){
+		pid_t pid = fork();
+		if (pid == 0){
+			Worker(files, shares, jobs, workers, w, cache, dir);
+		}
+		pids[w] = pid;
+		alive += pid > 0;
+	};
+	for (int w = 0; w < workers; w++){
+		start(w);
+	}
+
+	//Each crash while a program runs finishes that program, so restarting can't go on for ever, but a
+	//worker that crashes between programs might, so those restarts are limited
+	int idleCrashes = 0;
+	while (alive > 0){
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		int w = find(pids.begin(), pids.end(), pid) - pids.begin();
+		if (w == workers){
+			continue;
+		}
+		alive--;
+		pids[w] = -1;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0){
+			continue;
+		}
+
+		int job = shares[w].running.exchange(-1);
+		if (job >= 0){
+			jobs[job].signal.store(WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+			jobs[job].state.store(JOB_CRASHED);
+		}
+		else if (++idleCrashes > workers){
+			continue;
+		}
+		start(w);
+	}
+
+	int failed = 0;
+	for (int i = 0; i < n; i++){
+		string name = dir + "/" + to_string(i);
+		cout << "--- " << files[i] << " ---" << endl;
+		ifstream out(name.c_str(), ios::binary);
+		if (out.is_open() && out.peek() != EOF){
+			cout << out.rdbuf();
+			out.close();
+		}
+		unlink(name.c_str());
+
+		int state = jobs[i].state.load();
+		if (state == JOB_CRASHED){
+			int sig = jobs[i].signal.load();
+			cout << "\nWorker crashed";
+			if (sig != 0){
+				cout << " with " << strsignal(sig);
+			}
+			cout << endl;
+		}
+		else if (state == JOB_PENDING){
+			cout << "\nNot run, no worker was left to run it" << endl;
+		}
+		failed += state != JOB_OK;
+	}
+	cout.flush();
+
+	rmdir(dir.c_str());
+	munmap(shared, bytes);
+	return failed;
+}
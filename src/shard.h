@@ -0,0 +1,31 @@
+/*
+ * shard.h
+ * Running many programs at once, each in a worker process of its own
+ * The supervisor forks a fixed number of workers and deals the programs out between them, each
+ * worker taking them one at a time from the front of its own share. The shares are kept in a shared
+ * memory segment, and a worker that has run out takes programs from the back of the share that has
+ * the most left, so that no worker sits idle while another has a queue.
+ * Workers run each program from its image in the machine's image cache (see image.h), compiling it
+ * and adding it there if it isn't there yet. A program that doesn't compile as a whole runs as it is
+ * read instead, just as it would on its own.
+ * A worker that crashes takes only itself down: the program it was running is reported as having
+ * failed, and a new worker takes its place and carries on with the rest of its share.
+ * What each program prints is collected in a file of its own and printed under a heading once all of
+ * them are done, in the order they were given.
+*/
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+//Runs each of the program files with the given number of workers, printing what each printed, and
+//returns how many of them were unsuccessful
+extern int ShardExec(const vector<string>& files, int workers);
+
+
+#endif /* SHARD_H_ */
@@ -0,0 +1,88 @@
+/*
+ * spscring.h
+ * Bounded lock-free single-producer/single-consumer ring buffer
+ * The producer and consumer indices live on their own cache lines, and each side keeps a
+ * cached copy of the other side's index so that it only touches the shared line when the
+ * ring looks full (or empty) from its point of view.
+*/
+
+#ifndef SPSCRING_H_
+#define SPSCRING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+//Size of a cache line, used to keep the two sides from false sharing
+#define CACHE_LINE 64
+
+
+template <typename T>
+class SpscRing {
+	//Written only by the producer
+	alignas(CACHE_LINE) atomic<size_t> tail;
+	size_t cachedHead;
+
+	//Written only by the consumer
+	alignas(CACHE_LINE) atomic<size_t> head;
+	size_t cachedTail;
+
+	//Set by either side when no more items will be pushed or popped
+	alignas(CACHE_LINE) atomic<bool> closed;
+
+	vector<T> slots;
+	size_t mask;
+
+public:
+	//Capacity is rounded up to a power of two
+	explicit SpscRing(size_t capacity) : tail(0), cachedHead(0), head(0), cachedTail(0), closed(false) {
+		size_t size = 1;
+		while (size < capacity){
+			size <<= 1;
+		}
+		slots.resize(size);
+		mask = size - 1;
+	}
+
+	//Producer side. Returns false if the ring is full
+	bool TryPush(T&& item){
+		size_t t = tail.load(memory_order_relaxed);
+		if (t - cachedHead > mask){
+			cachedHead = head.load(memory_order_acquire);
+			if (t - cachedHead > mask){
+				return false;
+			}
+		}
+		slots[t & mask] = move(item);
+		tail.store(t + 1, memory_order_release);
+		return true;
+	}
+
+	//Consumer side. Returns false if the ring is empty
+	bool TryPop(T& item){
+		size_t h = head.load(memory_order_relaxed);
+		if (h == cachedTail){
+			cachedTail = tail.load(memory_order_acquire);
+			if (h == cachedTail){
+				return false;
+			}
+		}
+		item = move(slots[h & mask]);
+		head.store(h + 1, memory_order_release);
+		return true;
+	}
+
+	void Close(){
+		closed.store(true, memory_order_release);
+	}
+
+	bool IsClosed() const {
+		return closed.load(memory_order_acquire);
+	}
+};
+
+
+#endif /* SPSCRING_H_ */
@@ -0,0 +1,227 @@
+/*
+ * stats.cpp
+ * Aggregation, timing and reporting for the interpreter's instrumentation counters
+ */
+
+#include <mutex>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include "stats.h"
+
+using namespace std;
+
+//Token names live in lex.cpp
+extern map<Token, string> tokenPrint;
+
+bool Stats::timing = false;
+
+//Global bookkeeping for every thread's counters
+namespace {
+	mutex registryLock;
+	//Counters of threads that have already exited
+	Stats::Counters retired = {};
+
+	const char* phaseNames[PH_COUNT] = { "lex", "parse", "execute", "flush" };
+	const char* typeNames[STATS_VALTYPES] = { "integer", "real", "string", "boolean", "error" };
+
+	//The phase the calling thread is currently in, and when we last charged time to it
+	thread_local int curPhase = -1;
+	thread_local chrono::steady_clock::time_point lastMark;
+
+	void Add(Stats::Counters& to, const Stats::Counters& from){
+		for (int i = 0; i <= DONE; i++){
+			to.tokens[i] += from.tokens[i];
+		}
+		to.charsRead += from.charsRead;
+		to.symLookups += from.symLookups;
+		for (int i = 0; i < STATS_VALTYPES; i++){
+			to.valConstructs[i] += from.valConstructs[i];
+			to.valCopies[i] += from.valCopies[i];
+		}
+		to.strAllocs += from.strAllocs;
+		to.bytesOut += from.bytesOut;
+		to.memoHits += from.memoHits;
+		to.memoMisses += from.memoMisses;
+		to.memoEvictions += from.memoEvictions;
+		to.batchLockstep += from.batchLockstep;
+		to.batchSerial += from.batchSerial;
+		to.batchVector += from.batchVector;
+		to.batchScalar += from.batchScalar;
+		to.instructions += from.instructions;
+		for (int i = 0; i < PH_COUNT; i++){
+			to.phaseNanos[i] += from.phaseNanos[i];
+		}
+	}
+
+	//Charge the time since the last mark to the current phase
+	void Charge(chrono::steady_clock::time_point now){
+		if (curPhase >= 0){
+			Stats::Local().phaseNanos[curPhase] += chrono::duration_cast<chrono::nanoseconds>(now - lastMark).count();
+		}
+		lastMark = now;
+	}
+
+	//A stream buffer that forwards everything to another one, counting bytes on the way
+	class CountingBuf : public streambuf {
+	public:
+		streambuf* dest;
+		explicit CountingBuf(streambuf* d) : dest(d) {}
+
+	protected:
+		int overflow(int ch) override {
+			if (ch == EOF){
+				return 0;
+			}
+			Stats::Local().bytesOut++;
+			return dest->sputc((char)ch);
+		}
+
+		streamsize xsputn(const char* s, streamsize n) override {
+			Stats::Local().bytesOut += n;
+			return dest->sputn(s, n);
+		}
+
+		int sync() override {
+			return dest->pubsync();
+		}
+	};
+
+	//The buffers that CountOutput has installed
+	map<ostream*, CountingBuf*> counting;
+}
+
+
+Stats::LocalCounters::LocalCounters() : c() {
+}
+
+
+Stats::LocalCounters::~LocalCounters(){
+	lock_guard<mutex> guard(registryLock);
+	Add(retired, c);
+}
+
+
+Stats::PhaseTimer::PhaseTimer(Phase p){
+	prev = curPhase;
+	if (!timing){
+		return;
+	}
+	Charge(chrono::steady_clock::now());
+	curPhase = p;
+}
+
+
+Stats::PhaseTimer::~PhaseTimer(){
+	if (!timing){
+		return;
+	}
+	Charge(chrono::steady_clock::now());
+	curPhase = prev;
+}
+
+
+void Stats::CountOutput(ostream& out){
+	if (counting.count(&out)){
+		return;
+	}
+	CountingBuf* buf = new CountingBuf(out.rdbuf());
+	counting[&out] = buf;
+	out.rdbuf(buf);
+}
+
+
+void Stats::StopCountingOutput(ostream& out){
+	auto it = counting.find(&out);
+	if (it == counting.end()){
+		return;
+	}
+	out.flush();
+	out.rdbuf(it->second->dest);
+	delete it->second;
+	counting.erase(it);
+}
+
+
+void Stats::Report(ostream& out, bool json){
+	//Another thread's counters are only read once it has exited, as it may still be bumping them
+	Counters total = Local();
+	{
+		lock_guard<mutex> guard(registryLock);
+		Add(total, retired);
+	}
+
+	uint64_t tokenTotal = 0;
+	for (int i = 0; i <= DONE; i++){
+		tokenTotal += total.tokens[i];
+	}
+
+	if (json){
+		out << "{\n  \"tokens\": {\"total\": " << tokenTotal;
+		for (int i = 0; i <= DONE; i++){
+			if (total.tokens[i]){
+				out << ", \"" << tokenPrint[(Token)i] << "\": " << total.tokens[i];
+			}
+		}
+		out << "},\n";
+		out << "  \"chars_read\": " << total.charsRead << ",\n";
+		out << "  \"symbol_lookups\": " << total.symLookups << ",\n";
+		out << "  \"symbols_interned\": " << SymbolCount() << ",\n";
+		out << "  \"value_constructions\": {";
+		for (int i = 0; i < STATS_VALTYPES; i++){
+			out << (i ? ", " : "") << "\"" << typeNames[i] << "\": " << total.valConstructs[i];
+		}
+		out << "},\n  \"value_copies\": {";
+		for (int i = 0; i < STATS_VALTYPES; i++){
+			out << (i ? ", " : "") << "\"" << typeNames[i] << "\": " << total.valCopies[i];
+		}
+		out << "},\n";
+		out << "  \"string_allocations\": " << total.strAllocs << ",\n";
+		out << "  \"bytes_written\": " << total.bytesOut << ",\n";
+		out << "  \"memo\": {\"hits\": " << total.memoHits << ", \"misses\": " << total.memoMisses
+			<< ", \"evictions\": " << total.memoEvictions << "},\n";
+		out << "  \"batch\": {\"lockstep\": " << total.batchLockstep << ", \"serial\": " << total.batchSerial
+			<< ", \"vector_ops\": " << total.batchVector << ", \"scalar_ops\": " << total.batchScalar << "},\n";
+		out << "  \"instructions\": " << total.instructions << ",\n";
+		out << "  \"phase_ns\": {";
+		for (int i = 0; i < PH_COUNT; i++){
+			out << (i ? ", " : "") << "\"" << phaseNames[i] << "\": " << total.phaseNanos[i];
+		}
+		out << "}\n}" << endl;
+		return;
+	}
+
+	out << "---- Interpreter Statistics ----" << endl;
+	out << "Tokens lexed: " << tokenTotal << endl;
+	for (int i = 0; i <= DONE; i++){
+		if (total.tokens[i]){
+			out << "    " << tokenPrint[(Token)i] << ": " << total.tokens[i] << endl;
+		}
+	}
+	out << "Characters read: " << total.charsRead << endl;
+	out << "Symbol table lookups: " << total.symLookups << endl;
+	out << "Symbols interned: " << SymbolCount() << endl;
+	out << "Value constructions:";
+	for (int i = 0; i < STATS_VALTYPES; i++){
+		out << " " << typeNames[i] << "=" << total.valConstructs[i];
+	}
+	out << endl << "Value copies:";
+	for (int i = 0; i < STATS_VALTYPES; i++){
+		out << " " << typeNames[i] << "=" << total.valCopies[i];
+	}
+	out << endl;
+	out << "String allocations: " << total.strAllocs << endl;
+	out << "Bytes written: " << total.bytesOut << endl;
+	out << "Memoized calls: hits=" << total.memoHits << " misses=" << total.memoMisses
+		<< " evictions=" << total.memoEvictions << endl;
+	out << "Batch instances: lockstep=" << total.batchLockstep << " serial=" << total.batchSerial
+		<< ", lane operators: vector=" << total.batchVector << " scalar=" << total.batchScalar << endl;
+	out << "Instructions run: " << total.instructions << endl;
+	//The times are formatted on their own, so that the caller's stream is left as it was
+	ostringstream times;
+	times << fixed << setprecision(3);
+	for (int i = 0; i < PH_COUNT; i++){
+		times << " " << phaseNames[i] << "=" << total.phaseNanos[i] / 1e6;
+	}
+	out << "Phase times (ms):" << times.str() << endl;
+}
@@ -0,0 +1,97 @@
+/*
+ * stats.h
+ * Hot-path instrumentation counters for the interpreter
+ * Counters are always compiled in and kept per thread, so bumping one is a plain
+ * increment with no locking. A thread's counters are folded into the totals when it exits,
+ * and a report adds the calling thread's own to them.
+*/
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <iostream>
+#include <chrono>
+
+#include "lex.h"
+
+using namespace std;
+
+
+//The phases of interpretation that we keep timing information for
+enum Phase { PH_LEX, PH_PARSE, PH_EXECUTE, PH_FLUSH, PH_COUNT };
+
+//One per value type in val.h (VINT, VREAL, VSTRING, VBOOL, VERR)
+#define STATS_VALTYPES 5
+
+
+namespace Stats {
+	//Every counter we keep. One of these lives in each thread that touches the interpreter
+	struct Counters {
+		uint64_t tokens[DONE + 1];
+		uint64_t charsRead;
+		uint64_t symLookups;
+		uint64_t valConstructs[STATS_VALTYPES];
+		uint64_t valCopies[STATS_VALTYPES];
+		uint64_t strAllocs;
+		uint64_t bytesOut;
+		//Calls to memoized functions answered from the cache or run, and results dropped to make room
+		uint64_t memoHits;
+		uint64_t memoMisses;
+		uint64_t memoEvictions;
+		//Batch instances run in lockstep or on their own, and the operators lanes applied in whole-column
+		//loops or one lane at a time, see batch.h
+		uint64_t batchLockstep;
+		uint64_t batchSerial;
+		uint64_t batchVector;
+		uint64_t batchScalar;
+		//Instructions the machine ran, see bytecode.h
+		uint64_t instructions;
+		uint64_t phaseNanos[PH_COUNT];
+	};
+
+	//A thread's counters, folded into the totals when the thread exits
+	struct LocalCounters {
+		Counters c;
+		LocalCounters();
+		~LocalCounters();
+	};
+
+	//The calling thread's counters
+	inline Counters& Local() {
+		thread_local LocalCounters local;
+		return local.c;
+	}
+
+	//Phase timing reads the clock, so unlike the counters it is only done when asked for
+	extern bool timing;
+
+	//Strings longer than the small string buffer have to go to the heap
+	inline void CountString(const string& s) {
+		if (s.size() > 15) {
+			Local().strAllocs++;
+		}
+	}
+
+	//Scoped timer that charges the time spent inside of it to one phase
+	//Timers nest, and the enclosing phase is paused while an inner one runs
+	class PhaseTimer {
+		int prev;
+	public:
+		explicit PhaseTimer(Phase p);
+		~PhaseTimer();
+	};
+
+	//Wraps the stream's buffer so that every byte written through it is counted
+	void CountOutput(ostream& out);
+	//Puts back the original buffer of a stream given to CountOutput
+	void StopCountingOutput(ostream& out);
+
+	//Sum the counters of the calling thread and of every thread that has exited, and print them, either
+	//as readable text or JSON. Any other thread should be joined first
+	void Report(ostream& out, bool json);
+}
+
+
+#endif /* STATS_H_ */
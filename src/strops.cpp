@@ -0,0 +1,174 @@
+/*
+ * strops.cpp
+ * Scalar, SSE2 and AVX2 string comparison kernels
+ */
+
+#include "strops.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STROPS_X86 1
+#endif
+
+using namespace std;
+
+
+//Loads 8 or 4 bytes from anywhere
+static inline uint64_t Load64(const char* p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t Load32(const char* p){
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+//The first differing byte of two words is the lowest set byte of their XOR
+#define FIRST_BYTE(x) (__builtin_ctzll(x) >> 3)
+#endif
+
+
+//Index of the first byte that differs in the n bytes at a and b, or n if there is none
+//Compares 8 bytes at a time. A tail shorter than a word is done with one more load that overlaps
+//bytes already known to be equal, so there is never a byte-by-byte loop
+static size_t MismatchScalar(const char* a, const char* b, size_t n){
+#ifdef FIRST_BYTE
+	if (n >= 8){
+		size_t i = 0;
+		for (; i + 8 <= n; i += 8){
+			uint64_t x = Load64(a + i) ^ Load64(b + i);
+			if (x){
+				return i + FIRST_BYTE(x);
+			}
+		}
+		if (i < n){
+			uint64_t x = Load64(a + n - 8) ^ Load64(b + n - 8);
+			if (x){
+				return n - 8 + FIRST_BYTE(x);
+			}
+		}
+		return n;
+	}
+	if (n >= 4){
+		uint64_t x = Load32(a) ^ Load32(b);
+		if (x){
+			return FIRST_BYTE(x);
+		}
+		x = Load32(a + n - 4) ^ Load32(b + n - 4);
+		return x ? n - 4 + FIRST_BYTE(x) : n;
+	}
+#endif
+	size_t i = 0;
+	while (i < n && a[i] == b[i]){
+		i++;
+	}
+	return i;
+}
+
+
+#ifdef STROPS_X86
+
+//Bit i set where byte i of the 16 at a and b differ
+static inline unsigned Diff16(const char* a, const char* b){
+	__m128i va = _mm_loadu_si128((const __m128i*)a);
+	__m128i vb = _mm_loadu_si128((const __m128i*)b);
+	return ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+}
+
+static size_t MismatchSSE2(const char* a, const char* b, size_t n){
+	if (n < 16){
+		return MismatchScalar(a, b, n);
+	}
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16){
+		unsigned diff = Diff16(a + i, b + i);
+		if (diff){
+			return i + __builtin_ctz(diff);
+		}
+	}
+	if (i < n){
+		unsigned diff = Diff16(a + n - 16, b + n - 16);
+		if (diff){
+			return n - 16 + __builtin_ctz(diff);
+		}
+	}
+	return n;
+}
+
+__attribute__((target("avx2")))
+static size_t MismatchAVX2(const char* a, const char* b, size_t n){
+	if (n < 32){
+		if (n < 16){
+			return MismatchScalar(a, b, n);
+		}
+		unsigned diff = Diff16(a, b);
+		if (diff){
+			return __builtin_ctz(diff);
+		}
+		diff = Diff16(a + n - 16, b + n - 16);
+		return diff ? n - 16 + __builtin_ctz(diff) : n;
+	}
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32){
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + i));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (diff){
+			return i + __builtin_ctz(diff);
+		}
+	}
+	if (i < n){
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + n - 32));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + n - 32));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (diff){
+			return n - 32 + __builtin_ctz(diff);
+		}
+	}
+	return n;
+}
+
+#endif /* STROPS_X86 */
+
+
+static size_t (*mismatchKernel)(const char*, const char*, size_t) = MismatchScalar;
+
+
+void SetStringKernels(ScanMode mode){
+	switch (mode){
+#ifdef STROPS_X86
+		case SCAN_AVX2:
+			mismatchKernel = MismatchAVX2;
+			break;
+
+		case SCAN_SSE2:
+			mismatchKernel = MismatchSSE2;
+			break;
+#endif
+		default:
+			mismatchKernel = MismatchScalar;
+			break;
+	}
+}
+
+
+bool StrEqual(const char* a, const char* b, size_t n){
+	return a == b || mismatchKernel(a, b, n) == n;
+}
+
+
+int StrCompare(const char* a, size_t alen, const char* b, size_t blen){
+	size_t n = alen < blen ? alen : blen;
+	size_t i = (a == b) ? n : mismatchKernel(a, b, n);
+	if (i < n){
+		return (int)(unsigned char)a[i] - (int)(unsigned char)b[i];
+	}
+	return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
@@ -0,0 +1,30 @@
+/*
+ * strops.h
+ * Comparison kernels for string Values
+ * Equality checks lengths first and then compares 16 or 32 bytes at a time. Ordering finds the
+ * first byte that differs the same way and compares just that byte, as unsigned chars, so the
+ * result is the same as std::string::compare.
+ * The kernels are picked along with the lexer's scanning kernels, see SetScanMode in scanbuf.h.
+*/
+
+#ifndef STROPS_H_
+#define STROPS_H_
+
+#include <cstddef>
+
+#include "scanbuf.h"
+
+using namespace std;
+
+
+//Whether the n bytes at a and b are the same
+extern bool StrEqual(const char* a, const char* b, size_t n);
+
+//Less than 0, 0 or greater than 0 as a orders before, the same as or after b
+extern int StrCompare(const char* a, size_t alen, const char* b, size_t blen);
+
+//Selects the kernels for a mode that SetScanMode has already resolved to one the CPU supports
+extern void SetStringKernels(ScanMode mode);
+
+
+#endif /* STROPS_H_ */
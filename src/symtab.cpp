@@ -0,0 +1,199 @@
+/*
+ * symtab.cpp
+ * The interning table
+ *
+ * Names are found through 64 independent hash tables, the shards, picked by the low bits of the
+ * name's hash. Each shard is an open-addressed table of 64-bit slots holding the name's 32-bit hash
+ * and its symbol ID, so most probes never touch the name itself. Readers only ever load slots and
+ * table pointers, with acquire ordering. Writers take the shard's lock, publish the name first and
+ * the slot second, and grow a shard by building a complete new table before swapping it in. Old
+ * tables are kept around rather than freed, since a reader may still be probing one; a name that
+ * a reader misses in a stale table is found again under the lock.
+ *
+ * Names are kept in a two-level array indexed by symbol ID, filled in chunks that never move.
+ */
+
+#include "symtab.h"
+#include "stats.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+#define SHARD_BITS 6
+#define SHARD_COUNT (1 << SHARD_BITS)
+//Each shard starts with this many slots and doubles when it is 3/4 full
+#define SHARD_START_SLOTS 256
+
+//Names are stored in chunks of 2^CHUNK_BITS, enough chunks for every possible 32-bit ID
+#define CHUNK_BITS 14
+#define CHUNK_SIZE (1u << CHUNK_BITS)
+#define CHUNK_COUNT (1u << (32 - CHUNK_BITS))
+
+
+namespace {
+	struct ShardTable {
+		uint32_t mask;
+		atomic<uint64_t>* slots;
+
+		explicit ShardTable(uint32_t size) : mask(size - 1), slots(new atomic<uint64_t>[size]()) {}
+	};
+
+	struct Shard {
+		mutex lock;
+		atomic<ShardTable*> table;
+		uint32_t count;
+		//Tables that were grown out of, see above
+		vector<ShardTable*> retired;
+
+		Shard() : table(new ShardTable(SHARD_START_SLOTS)), count(0) {}
+	};
+
+	Shard shards[SHARD_COUNT];
+	atomic<atomic<const string*>*> chunks[CHUNK_COUNT];
+	mutex chunkLock;
+	atomic<uint32_t> nextId(0);
+}
+
+
+//FNV-1a, folded down to 32 bits
+static uint32_t Hash(const char* p, size_t len){
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++){
+		h ^= (unsigned char)p[i];
+		h *= 1099511628211ULL;
+	}
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+
+static inline const string* NameOf(SymbolId sym){
+	atomic<const string*>* chunk = chunks[sym >> CHUNK_BITS].load(memory_order_acquire);
+	return chunk[sym & (CHUNK_SIZE - 1)].load(memory_order_acquire);
+}
+
+
+//Looks for the name in one shard table. The slot index comes from the bits above the shard bits
+static bool Find(const ShardTable* t, uint32_t hash, const char* name, size_t len, SymbolId& sym){
+	for (uint32_t i = (hash >> SHARD_BITS) & t->mask; ; i = (i + 1) & t->mask){
+		uint64_t slot = t->slots[i].load(memory_order_acquire);
+		if (slot == 0){
+			return false;
+		}
+		if ((uint32_t)(slot >> 32) == hash){
+			const string* s = NameOf((SymbolId)slot);
+			if (s->size() == len && memcmp(s->data(), name, len) == 0){
+				sym = (SymbolId)slot;
+				return true;
+			}
+		}
+	}
+}
+
+
+static void Place(ShardTable* t, uint64_t slot){
+	uint32_t i = ((uint32_t)(slot >> 32) >> SHARD_BITS) & t->mask;
+	while (t->slots[i].load(memory_order_relaxed) != 0){
+		i = (i + 1) & t->mask;
+	}
+	t->slots[i].store(slot, memory_order_release);
+}
+
+
+//Stores the name of a new symbol where SymbolName can find it
+static void Publish(SymbolId sym, const string* name){
+	uint32_t c = sym >> CHUNK_BITS;
+	atomic<const string*>* chunk = chunks[c].load(memory_order_acquire);
+	if (chunk == NULL){
+		lock_guard<mutex> guard(chunkLock);
+		chunk = chunks[c].load(memory_order_relaxed);
+		if (chunk == NULL){
+			chunk = new atomic<const string*>[CHUNK_SIZE]();
+			chunks[c].store(chunk, memory_order_release);
+		}
+	}
+	chunk[sym & (CHUNK_SIZE - 1)].store(name, memory_order_release);
+}
+
+
+//Adds a name that isn't in the table yet. Called with the shard locked
+static SymbolId Insert(Shard& sh, uint32_t hash, const char* name, size_t len){
+	SymbolId sym = nextId.fetch_add(1, memory_order_relaxed);
+	string* s = new string(name, len);
+	Stats::CountString(*s);
+	Publish(sym, s);
+
+	ShardTable* t = sh.table.load(memory_order_relaxed);
+	if ((sh.count + 1) * 4 > (t->mask + 1) * 3){
+		ShardTable* grown = new ShardTable((t->mask + 1) * 2);
+		for (uint32_t i = 0; i <= t->mask; i++){
+			uint64_t slot = t->slots[i].load(memory_order_relaxed);
+			if (slot != 0){
+				Place(grown, slot);
+			}
+		}
+		sh.table.store(grown, memory_order_release);
+		sh.retired.push_back(t);
+		t = grown;
+	}
+
+	Place(t, ((uint64_t)hash << 32) | sym);
+	sh.count++;
+	return sym;
+}
+
+
+//The empty string and the reserved words, in PredefinedSymbol order
+static bool InternPredefined(){
+	static const char* const names[SYM_PREDEFINED] = {
+		"", "writeln", "write", "if", "else", "then", "div", "mod",
+		"and", "or", "not", "true", "false", "integer", "real",
+		"string", "boolean", "begin", "end", "var", "program",
+		"while", "do", "for", "to", "array", "of", "procedure", "function", "case", "readln",
+		"eof"
+	};
+
+	//The empty string is never put in a shard, so that a zero slot can mean empty
+	Publish(nextId.fetch_add(1), new string());
+	for (int i = 1; i < SYM_PREDEFINED; i++){
+		Intern(names[i], strlen(names[i]));
+	}
+	return true;
+}
+
+static bool predefined = InternPredefined();
+
+
+SymbolId Intern(const char* name, size_t len){
+	if (len == 0){
+		return SYM_EMPTY;
+	}
+
+	uint32_t hash = Hash(name, len);
+	Shard& sh = shards[hash & (SHARD_COUNT - 1)];
+	SymbolId sym;
+
+	//The fast path, no locks
+	if (Find(sh.table.load(memory_order_acquire), hash, name, len, sym)){
+		return sym;
+	}
+
+	lock_guard<mutex> guard(sh.lock);
+	if (Find(sh.table.load(memory_order_relaxed), hash, name, len, sym)){
+		return sym;
+	}
+	return Insert(sh, hash, name, len);
+}
+
+
+const string& SymbolName(SymbolId sym){
+	return *NameOf(sym);
+}
+
+
+size_t SymbolCount(){
+	return nextId.load(memory_order_relaxed);
+}
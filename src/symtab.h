@@ -0,0 +1,47 @@
+/*
+ * symtab.h
+ * Global interning table for lexemes
+ * Every identifier, string constant, reserved word and operator is stored once and named by a 32-bit symbol ID,
+ * so tokens stay small and names can be compared and looked up as integers. There is one table for
+ * the whole process, shared by all threads: finding a name that is already there takes no locks,
+ * and adding a new one locks only the shard the name hashes to.
+*/
+
+#ifndef SYMTAB_H_
+#define SYMTAB_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+
+typedef uint32_t SymbolId;
+
+//Symbols that always exist, interned in this order before anything else. SYM_EMPTY is the empty
+//string, the rest are the reserved words so that the lexer can tell them apart by ID alone, and the
+//names of builtin functions
+enum PredefinedSymbol {
+	SYM_EMPTY,
+	SYM_WRITELN, SYM_WRITE, SYM_IF, SYM_ELSE, SYM_THEN, SYM_DIV, SYM_MOD,
+	SYM_AND, SYM_OR, SYM_NOT, SYM_TRUE, SYM_FALSE, SYM_INTEGER, SYM_REAL,
+	SYM_STRING, SYM_BOOLEAN, SYM_BEGIN, SYM_END, SYM_VAR, SYM_PROGRAM,
+	SYM_WHILE, SYM_DO, SYM_FOR, SYM_TO, SYM_ARRAY, SYM_OF, SYM_PROCEDURE, SYM_FUNCTION, SYM_CASE, SYM_READLN,
+	SYM_EOF,
+	SYM_PREDEFINED
+};
+
+
+//Returns the symbol for the name, adding it to the table the first time it is seen
+extern SymbolId Intern(const char* name, size_t len);
+inline SymbolId Intern(const string& name) { return Intern(name.data(), name.size()); }
+
+//The name of a symbol. The reference stays valid for the life of the program
+extern const string& SymbolName(SymbolId sym);
+
+//How many symbols have been interned so far, the predefined ones included
+extern size_t SymbolCount();
+
+
+#endif /* SYMTAB_H_ */
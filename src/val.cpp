@@ -11,9 +11,16 @@
 using namespace std;
 
 
-//addition may only occur between reals, ints, or a mix of the two
+//addition may only occur between reals, ints, or a mix of the two. Two strings are concatenated
 Value Value::operator+(const Value& op) const{
     switch(GetType()){
+        //Strings can only be added to strings. Neither string is copied, see rope.h
+        case VSTRING:
+            if(op.GetType() == VSTRING){
+                return Value(Rope::Concat(Stemp, op.Stemp));
+            }
+            return Value();
+
         //If we have an int, we can add with either a real or an int
         case VINT:
             if(op.GetType() == VINT){
@@ -243,7 +250,7 @@ Value Value::operator==(const Value& op) const {
                 return Value(GetReal() == op.GetReal());
             
             case VSTRING:
-                return Value(GetString() == op.GetString());
+                return Value(Stemp.Equals(op.Stemp));
 
             case VBOOL:
                 return Value(GetBool() == op.GetBool());
@@ -270,10 +277,17 @@ Value Value::operator==(const Value& op) const {
 }
 
 
-//Comparing "this" with op, numeric types only for >
+//Comparing "this" with op, numeric types or two strings for >
 Value Value::operator>(const Value& op) const{
-    //We can only compare with ints and reals
+    //We can only compare ints and reals with each other, and strings with strings
     switch (GetType()){
+        //Strings are ordered by their characters, the first one that differs decides
+        case VSTRING:
+            if(op.GetType() == VSTRING){
+                return Value(Stemp.Compare(op.Stemp) > 0);
+            }
+            return Value();
+
         case VINT:
             if(op.GetType() == VINT){
                 return Value(GetInt() > op.GetInt());
@@ -302,10 +316,16 @@ Value Value::operator>(const Value& op) const{
 }
 
 
-//Comparing "this" with op, numeric types only for <
+//Comparing "this" with op, numeric types or two strings for <
 Value Value::operator<(const Value& op) const{
-    //We can only compare with ints and reals
+    //We can only compare ints and reals with each other, and strings with strings
     switch (GetType()){
+        case VSTRING:
+            if(op.GetType() == VSTRING){
+                return Value(Stemp.Compare(op.Stemp) < 0);
+            }
+            return Value();
+
         case VINT:
             if(op.GetType() == VINT){
                 return Value(GetInt() < op.GetInt());
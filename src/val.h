@@ -10,6 +10,9 @@
 #include <cmath>
 #include <sstream>
 
+#include "rope.h"
+#include "stats.h"
+
 using namespace std;
 
 enum ValType { VINT, VREAL, VSTRING, VBOOL, VERR };
@@ -19,15 +22,34 @@ class Value {
     bool    Btemp;
     int 	Itemp;
 	double   Rtemp;
-    string	Stemp;
+    //Strings are immutable and shared between copies, see rope.h
+    Rope	Stemp;
     
        
 public:
-    Value() : T(VERR), Btemp(false), Itemp(0), Rtemp(0.0), Stemp("") {}
-    Value(bool vb) : T(VBOOL), Btemp(vb), Itemp(0), Rtemp(0.0), Stemp("") {}
-    Value(int vi) : T(VINT), Btemp(false), Itemp(vi), Rtemp(0.0), Stemp("") {}
-    Value(double vr) : T(VREAL), Btemp(false), Itemp(0), Rtemp(vr), Stemp("") {}
-    Value(string vs) : T(VSTRING), Btemp(false), Itemp(0), Rtemp(0.0), Stemp(vs) {}
+    Value() : T(VERR), Btemp(false), Itemp(0), Rtemp(0.0) { Stats::Local().valConstructs[VERR]++; }
+    Value(bool vb) : T(VBOOL), Btemp(vb), Itemp(0), Rtemp(0.0) { Stats::Local().valConstructs[VBOOL]++; }
+    Value(int vi) : T(VINT), Btemp(false), Itemp(vi), Rtemp(0.0) { Stats::Local().valConstructs[VINT]++; }
+    Value(double vr) : T(VREAL), Btemp(false), Itemp(0), Rtemp(vr) { Stats::Local().valConstructs[VREAL]++; }
+    Value(string vs) : T(VSTRING), Btemp(false), Itemp(0), Rtemp(0.0), Stemp(vs) { Stats::Local().valConstructs[VSTRING]++; }
+    explicit Value(Rope vs) : T(VSTRING), Btemp(false), Itemp(0), Rtemp(0.0), Stemp(move(vs)) { Stats::Local().valConstructs[VSTRING]++; }
+
+    //Copies are counted. Copying a string Value shares the string rather than duplicating it
+    Value(const Value& op) : T(op.T), Btemp(op.Btemp), Itemp(op.Itemp), Rtemp(op.Rtemp), Stemp(op.Stemp) {
+        Stats::Local().valCopies[T]++;
+    }
+    Value(Value&& op) = default;
+
+    Value& operator=(const Value& op) {
+        T = op.T;
+        Btemp = op.Btemp;
+        Itemp = op.Itemp;
+        Rtemp = op.Rtemp;
+        Stemp = op.Stemp;
+        Stats::Local().valCopies[T]++;
+        return *this;
+    }
+    Value& operator=(Value&& op) = default;
     
     
     ValType GetType() const { return T; }
@@ -39,7 +61,9 @@ public:
     
     int GetInt() const { if( IsInt() ) return Itemp; throw "RUNTIME ERROR: Value not an integer"; }
     
-    string GetString() const { if( IsString() ) return Stemp; throw "RUNTIME ERROR: Value not a string"; }
+    const string& GetString() const { if( IsString() ) return Stemp.Str(); throw "RUNTIME ERROR: Value not a string"; }
+    //The string without flattening it, e.g. to compare it with Rope::Equals
+    const Rope& GetRope() const { if( IsString() ) return Stemp; throw "RUNTIME ERROR: Value not a string"; }
     
     double GetReal() const { if( IsReal() ) return Rtemp; throw "RUNTIME ERROR: Value not an integer"; }
     
@@ -62,7 +86,7 @@ public:
 	
 	void SetString(string val)
     {
-    	Stemp = val;
+    	Stemp = Rope(val);
 	}
 	
 	void SetBool(bool val)
@@ -71,7 +95,7 @@ public:
 	}
 	
 	
-    // numeric overloaded add this to op
+    // numeric overloaded add this to op, or concatenation of two strings
     Value operator+(const Value& op) const;
     
     // numeric overloaded subtract op from this
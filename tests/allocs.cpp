@@ -0,0 +1,168 @@
+/*
+ * allocs.cpp
+ * Test that running a program doesn't allocate
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o allocs tests/allocs.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  allocs
+ *
+ * malloc, calloc and realloc are replaced here by versions that count their calls, before handing
+ * them on to glibc's own. Two things are checked with them:
+ *  - A program with no string operations, compiled as a whole (see image.h), runs without a single
+ *    call, the very first time it runs. Everything it needs, from its variables to the stacks of the
+ *    machine, was allocated while it was compiled and loaded.
+ *  - A program interpreted as it is read makes no more calls however many statements it has and
+ *    however many times its loops go round, so that compiling and running a statement doesn't
+ *    allocate once the first few have been. Its literals are the same few over and over, since each
+ *    new name or string constant is kept in the symbol table for good.
+ * Exits with 1 and says which count was wrong if either doesn't hold.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "image.h"
+#include "parserInterp.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+
+//Calls are only counted while counting is set
+static bool counting = false;
+static long calls = 0;
+
+extern "C" void* malloc(size_t size){
+	calls += counting;
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size){
+	calls += counting;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size){
+	calls += counting;
+	return __libc_realloc(p, size);
+}
+
+
+//Throws away what a program prints without allocating anything for it, unlike a stringstream
+class Discard : public streambuf {
+protected:
+	int overflow(int c) override { return c; }
+	streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+//A program with no string operations: stmts copies of a few statements that compute with integers,
+//reals and booleans, branch, select and call, and a loop that goes round iters times
+static string Generate(int stmts, int iters){
+	ostringstream out;
+	out << "program allocs;\n"
+	    << "var\n"
+	    << "\ti, j, k, total : integer := 0;\n"
+	    << "\tr : real := 1.5;\n"
+	    << "\tb : boolean := false;\n"
+	    << "\tv : array [1..8] of integer;\n"
+	    << "function twice(n : integer) : integer;\n"
+	    << "begin\n"
+	    << "\ttwice := n * 2\n"
+	    << "end;\n"
+	    << "procedure bump(n : integer);\n"
+	    << "var\n"
+	    << "\tstep : integer := 1;\n"
+	    << "begin\n"
+	    << "\tif n > 0 then bump(n - step)\n"
+	    << "end;\n"
+	    << "begin\n";
+	for (int s = 0; s < stmts; s++){
+		out << "\ti := i + " << s % 8 << " * 2 - j div 3;\n"
+		    << "\tif (i > 100) and (b = false) then j := j - 1 else r := r * 2.0 + j;\n"
+		    << "\tcase i mod 4 of 0: k := k + 1; 1, 2: k := k - 1 else b := k > 2 end;\n"
+		    << "\tv[" << s % 8 + 1 << "] := twice(i mod 1000);\n"
+		    << "\tbump(" << s % 5 << ");\n";
+	}
+	out << "\tfor k := 1 to " << iters << " do begin\n"
+	    << "\t\tj := j + k mod 7;\n"
+	    << "\t\twhile j > 50 do j := j - twice(3);\n"
+	    << "\t\tb := (j > 3) and (r < 10.0)\n"
+	    << "\tend;\n"
+	    << "\twriteln(i, j, r, b, v[1])\n"
+	    << "end\n";
+	return out.str();
+}
+
+//Counts the calls made while the program is interpreted as it is read
+static long Interpreted(const string& text){
+	ResetProg();
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf());
+	istream in(&scan);
+	int line = 1;
+
+	calls = 0;
+	counting = true;
+	bool status = Prog(in, line);
+	counting = false;
+	if (!status){
+		cerr << "The generated program failed" << endl;
+		_exit(1);
+	}
+	return calls;
+}
+
+
+int main(){
+	Discard discard;
+	streambuf* out = cout.rdbuf(&discard);
+	bool ok = true;
+
+	//Compiled as a whole, then run from its image for the first time
+	{
+		ResetProg();
+		string text = Generate(20, 1000), image;
+		istringstream src(text);
+		ScanBuf scan(src.rdbuf());
+		istream in(&scan);
+		int line = 1;
+		LoadedImage prog;
+		if (!CompileImage(in, line, image) || !LoadImage(image.data(), image.size(), prog)){
+			cout.rdbuf(out);
+			cerr << "The generated program didn't compile" << endl;
+			return 1;
+		}
+
+		calls = 0;
+		counting = true;
+		int errors = RunImage(prog);
+		counting = false;
+		if (errors != 0 || calls != 0){
+			cerr << "Running a compiled program called malloc " << calls << " times" << endl;
+			ok = false;
+		}
+	}
+
+	//Interpreted as it is read: the first run warms up whatever is kept from one program to the next
+	Interpreted(Generate(1, 1));
+	long base = Interpreted(Generate(10, 10));
+	long stmts = Interpreted(Generate(200, 10));
+	long iters = Interpreted(Generate(10, 100000));
+	if (stmts > base || iters > base){
+		cerr << "Interpreting called malloc " << base << " times for 10 statements, " << stmts << " for 200 and "
+		     << iters << " for 10 with a longer loop" << endl;
+		ok = false;
+	}
+
+	cout.rdbuf(out);
+	if (ok){
+		cout << "A compiled program allocated nothing, and interpreting one allocated " << base << " times however long it was" << endl;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+/*
+ * checkpoint.cpp
+ * Test that a program killed partway carries on from its last snapshot as if it had never stopped
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o checkpoint tests/checkpoint.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  checkpoint
+ *
+ * A simulation runs three times, each in a child process with its output going to a file: once all
+ * the way through, once with checkpoints until it is killed after printing more than its first
+ * snapshot has, and once restored from that snapshot with its output appended to what the killed run
+ * printed. The snapshot is taken inside a call, inside a loop, with strings, reals and an array in
+ * play. The output of the last two together must be exactly that of the first, and the snapshot must
+ * be gone once the program has ended.
+ * Exits with 1 and says what went wrong otherwise.
+ */
+
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "image.h"
+#include "parserInterp.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+static const char* SIMULATION =
+	"program sim;\n"
+	"var\n"
+	"\ti, total : integer := 0;\n"
+	"\tx : real := 1.0;\n"
+	"\ttag : string := 'start';\n"
+	"\tv : array [1..10] of integer;\n"
+	"function mix(n, acc : integer) : integer;\n"
+	"begin\n"
+	"\tif n = 0 then mix := acc else mix := mix(n - 1, (acc * 31 + n) mod 1000003)\n"
+	"end;\n"
+	"procedure stepAll(k : integer);\n"
+	"var\n"
+	"\tm : integer := 0;\n"
+	"begin\n"
+	"\tfor m := 1 to 10 do v[m] := (v[m] + k * m) mod 997;\n"
+	"\ttotal := (total + mix(k mod 50, v[k mod 10 + 1])) mod 1000000\n"
+	"end;\n"
+	"begin\n"
+	"\tfor i := 1 to 10 do v[i] := i;\n"
+	"\tfor i := 1 to 200000 do begin\n"
+	"\t\tstepAll(i);\n"
+	"\t\tx := x * 0.999 + 0.5;\n"
+	"\t\tif i mod 10000 = 0 then begin\n"
+	"\t\t\ttag := tag + '.';\n"
+	"\t\t\twriteln(i, ' ', total, ' ', x, ' ', tag)\n"
+	"\t\tend\n"
+	"\tend;\n"
+	"\twriteln('done ', total)\n"
+	"end\n";
+
+
+//How many times loops go round between snapshots
+static const long EVERY = 150000;
+
+//Runs the simulation in a child process with its output appended to out, returning the child
+static pid_t Start(const string& out, long every, const string& snapshot, const string& from){
+	pid_t pid = fork();
+	if (pid != 0){
+		return pid;
+	}
+
+	int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd < 0){
+		_exit(2);
+	}
+	dup2(fd, 1);
+	close(fd);
+
+	istringstream src(SIMULATION);
+	ScanBuf scan(src.rdbuf());
+	istream in(&scan);
+	int line = 1;
+	string image;
+	LoadedImage prog;
+	if (!CompileImage(in, line, image) || !LoadImage(image.data(), image.size(), prog)){
+		_exit(2);
+	}
+	int errors = RunCheckpointed(prog, ImageKey(SIMULATION), every, snapshot, from);
+	cout.flush();
+	_exit(errors == 0 ? 0 : 1);
+}
+
+static bool Finished(pid_t pid){
+	int status;
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static string Contents(const string& file){
+	ifstream in(file.c_str(), ios::binary);
+	return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+static bool Exists(const string& file){
+	struct stat st;
+	return stat(file.c_str(), &st) == 0;
+}
+
+
+int main(){
+	char dir[] = "/tmp/checkpoint-XXXXXX";
+	if (mkdtemp(dir) == NULL){
+		cerr << "Cannot make a directory for the test" << endl;
+		return 1;
+	}
+	string whole = string(dir) + "/whole", resumed = string(dir) + "/resumed", snapshot = string(dir) + "/sim.ckpt";
+	bool ok = true;
+
+	if (!Finished(Start(whole, 0, "", ""))){
+		cerr << "The simulation didn't run" << endl;
+		ok = false;
+	}
+
+	//A snapshot is taken every 1500 or so rounds of the main loop, since each of them goes round the one
+	//in stepAll ten times. The first comes after the line printed at 10000, and the run is killed once
+	//it has printed the line at 20000, before the second, so that line has to be taken back
+	pid_t pid = Start(resumed, EVERY, snapshot, "");
+	while (Contents(resumed).find("20000 ") == string::npos && waitpid(pid, NULL, WNOHANG) == 0){
+		usleep(1000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	if (!Exists(snapshot)){
+		cerr << "The simulation finished before it could be killed" << endl;
+		ok = false;
+	}
+
+	if (ok && !Finished(Start(resumed, EVERY, snapshot, snapshot))){
+		cerr << "The restored simulation didn't run" << endl;
+		ok = false;
+	}
+	if (ok && Contents(resumed) != Contents(whole)){
+		cerr << "Killed and restored, the simulation printed" << endl << Contents(resumed) << "rather than" << endl << Contents(whole);
+		ok = false;
+	}
+	if (ok && Exists(snapshot)){
+		cerr << "The snapshot was left once the simulation ended" << endl;
+		ok = false;
+	}
+
+	unlink(whole.c_str());
+	unlink(resumed.c_str());
+	unlink(snapshot.c_str());
+	unlink((snapshot + ".tmp").c_str());
+	rmdir(dir);
+
+	if (ok){
+		cout << "A simulation killed partway carried on from its snapshot and printed just what it would have" << endl;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,408 @@
+/*
+ * lexdiff.cpp
+ * Differential test for the lexer
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o lexdiff tests/lexdiff.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  lexdiff [--seed N] [--count N] [file...]
+ *
+ * The table-driven lexer in lex.cpp replaced a hand-written state machine. That original lexer is
+ * kept below as the reference, changed only to know the tokens that were added to the language
+ * since (brackets, and the '..' of array bounds). Both are run over a fuzzed corpus and every token,
+ * lexeme and line number has to match. The corpus is made of random strings over an alphabet
+ * weighted towards the characters the lexer cares about (digits and dots for the RCONST edge
+ * cases, quotes, braces, newlines, ':' and '='), plus the given files both as they are and with
+ * random mutations. The table-driven lexer is run both on a plain stream and through a ScanBuf
+ * with tiny blocks, so that tokens split across refills are covered as well.
+ * Exits with 1 and prints the first input that differs if there is a mismatch.
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lex.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+//The original lexer, as it was before the DFA
+static LexItem refNextToken(istream& in, int& linenum)
+{
+	enum TokState { START, INID, INSTRING, ININT, INREAL, INCOMMENT } 
+	lexstate = START;
+	string lexeme;
+	char ch, nextchar;
+	Token tt;
+	bool decimal = false;
+	       
+	
+    while(in.get(ch)) {
+    	
+		switch( lexstate ) {
+		case START:
+			if( ch == '\n' ){
+				linenum++;
+				
+			}	
+                
+			if( isspace(ch) )
+				continue;
+
+			lexeme = ch;
+
+			if( isalpha(ch) ) {
+				lexeme = ch;
+				lexstate = INID;
+				//cout << "in ID " << endl;
+			}
+			else if( ch == '\'' ) {
+				lexstate = INSTRING;
+				
+			}
+			
+			else if( isdigit(ch) ) {
+				lexstate = ININT;
+			}
+			else if( ch == '{' ) {
+				//lexeme += ch;
+				lexstate = INCOMMENT;
+				in.get(ch);
+			}				
+			else {
+				tt = ERR;
+				switch( ch ) {
+				case '+':
+					tt = PLUS;
+                    break;  
+					
+				case '-':
+					tt = MINUS;
+                    break; 
+					
+				case '*':
+								
+					tt = MULT;
+					break;
+
+				case '/':
+					tt = DIV;
+					break;
+									
+				case ':':
+					tt = COLON;
+					nextchar = in.peek();
+					if(nextchar == '='){
+						in.get(ch);
+						lexeme += ch;
+						tt = ASSOP;
+						break;
+					}
+					//error
+					break;
+				
+				case '=':
+					tt = EQ;
+					break;
+				case '(':
+					tt = LPAREN;
+					break;			
+				case ')':
+					tt = RPAREN;
+					break;
+				
+				case ';':
+					tt = SEMICOL;
+					break;
+					
+				case ',':
+					tt = COMMA;
+					break;
+					
+				case '>':
+					tt = GTHAN;
+					break;
+				
+				case '<':
+					tt = LTHAN;
+					break;
+					
+				case '[':
+					tt = LBRACKET;
+					break;
+
+				case ']':
+					tt = RBRACKET;
+					break;
+
+				case '.':
+					tt = DOT;
+					if(in.peek() == '.'){
+						in.get(ch);
+						lexeme += ch;
+						tt = DOTDOT;
+					}
+					break;
+				
+				}
+				return LexItem(tt, lexeme, linenum);
+			}
+			break;	
+
+		case INID:
+			if( isalpha(ch) || isdigit(ch) || ch == '_' || ch == '$') {
+		
+				lexeme += ch;
+			}
+			else {
+				in.putback(ch);
+
+				return id_or_kw(lexeme, linenum);
+				
+			}
+			break;
+					
+		case INSTRING:
+                          
+			if( ch == '\n' ) {
+				return LexItem(ERR, lexeme, linenum);
+			}
+			lexeme += ch;
+			if( ch == '\'' ) {
+				lexeme = lexeme.substr(1, lexeme.length()-2);
+				return LexItem(SCONST, lexeme, linenum);
+			}
+			break;
+
+		case ININT:
+			if( isdigit(ch) ) {
+				lexeme += ch;
+			}
+			else if(ch == '.' && in.peek() == '.') {
+				//An integer followed by '..' as in 1..10
+				in.putback(ch);
+				return LexItem(ICONST, lexeme, linenum);
+			}
+			else if(ch == '.') {
+				lexstate = INREAL;
+				in.putback(ch);
+			}
+			else {
+				in.putback(ch);
+				return LexItem(ICONST, lexeme, linenum);
+			}
+			break;
+		
+		case INREAL:
+				
+			if( ch == '.' && isdigit(in.peek()) && !decimal) {
+				lexeme += ch; decimal = true;
+				
+			}
+			else if(ch == '.' && !isdigit(in.peek()) && !decimal){
+				lexeme += ch;
+				
+				return LexItem(RCONST, lexeme, linenum);
+			}
+			else if(isdigit(ch) && decimal){
+				lexeme += ch;
+			}
+			
+			else if(ch == '.' && decimal){
+				lexeme += ch;
+				return LexItem(ERR, lexeme, linenum);
+			}
+			else {
+				in.putback(ch);
+				return LexItem(RCONST, lexeme, linenum);
+			}
+			
+			break;
+		
+					
+		case INCOMMENT:
+			if(ch == '\n') 
+				linenum++;
+				
+			else if( ch == '}' ) {
+               	//in.get(ch);
+				lexstate = START;
+			}
+					
+			break;
+			
+		
+		}
+	}//end of while loop
+	
+	if( in.eof() )
+		return LexItem(DONE, "", linenum);
+		
+	return LexItem(ERR, "some strange I/O error", linenum);
+}
+
+struct Tok {
+	Token tt;
+	string lexeme;
+	int line;
+
+	bool operator==(const Tok& o) const { return tt == o.tt && lexeme == o.lexeme && line == o.line; }
+};
+
+//No input ever needs more tokens than characters, this just guards against a lexer that loops
+#define MAX_TOKENS(text) ((text).size() + 2)
+
+
+//Lexes all of the text with one of the lexers. Lexing carries on past errors, like the
+//parser never does, to compare as much as possible
+template <typename Lexer>
+static vector<Tok> LexAll(Lexer lex, istream& in, const string& text){
+	vector<Tok> toks;
+	int line = 1;
+	while (toks.size() < MAX_TOKENS(text)){
+		LexItem tok = lex(in, line);
+		toks.push_back({ tok.GetToken(), tok.GetLexeme(), line });
+		if (tok == DONE){
+			break;
+		}
+	}
+	return toks;
+}
+
+
+static uint64_t rngState;
+
+static uint64_t Rand(){
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+
+//Characters to fuzz with, common ones listed more than once
+static const string alphabet =
+	"aaxyzEIfb_$00123456789....''''{{}}\n\n\n  \t\r::==+-*/(),;<>[]!@#\"\\\v\f";
+
+static string RandomText(size_t len){
+	string text;
+	for (size_t i = 0; i < len; i++){
+		uint64_t r = Rand();
+		if (r % 40 == 0){
+			text += (char)(r >> 8);	//any byte at all, NUL and high bytes included
+		} else {
+			text += alphabet[(r >> 8) % alphabet.size()];
+		}
+	}
+	return text;
+}
+
+static string Mutate(string text){
+	int edits = 1 + Rand() % 8;
+	for (int i = 0; i < edits && !text.empty(); i++){
+		size_t at = Rand() % text.size();
+		switch (Rand() % 3){
+			case 0: text[at] = alphabet[Rand() % alphabet.size()]; break;
+			case 1: text.insert(at, 1, alphabet[Rand() % alphabet.size()]); break;
+			default: text.erase(at, 1); break;
+		}
+	}
+	//Cut it short now and then, to end the input in the middle of a token
+	if (Rand() % 4 == 0){
+		text.resize(Rand() % (text.size() + 1));
+	}
+	return text;
+}
+
+
+static void PrintToks(const char* name, const vector<Tok>& toks){
+	cerr << name << ":" << endl;
+	for (const Tok& t : toks){
+		cerr << "  " << LexItem(t.tt, t.lexeme, t.line) << " line " << t.line << endl;
+	}
+}
+
+
+//Runs both lexers over the text and reports whether they agree
+static bool Check(const string& text){
+	istringstream refIn(text);
+	vector<Tok> want = LexAll(refNextToken, refIn, text);
+
+	istringstream plainIn(text);
+	vector<Tok> plain = LexAll(getNextToken, plainIn, text);
+
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf(), 1 + Rand() % 5);
+	istream scanIn(&scan);
+	vector<Tok> scanned = LexAll(getNextToken, scanIn, text);
+
+	if (plain == want && scanned == want){
+		return true;
+	}
+
+	cerr << "MISMATCH on input:" << endl << "[" << text << "]" << endl;
+	PrintToks("original", want);
+	PrintToks(plain == want ? "table-driven (ScanBuf)" : "table-driven", plain == want ? scanned : plain);
+	return false;
+}
+
+
+int main(int argc, char* argv[]){
+	uint64_t seed = 1;
+	long count = 200000;
+	vector<string> corpus;
+
+	for (int i = 1; i < argc; i++){
+		string arg = argv[i];
+		if (arg == "--seed" && i + 1 < argc){
+			seed = strtoull(argv[++i], NULL, 10);
+		} else if (arg == "--count" && i + 1 < argc){
+			count = atol(argv[++i]);
+		} else if (arg.rfind("--", 0) == 0){
+			cerr << "Usage: lexdiff [--seed N] [--count N] [file...]" << endl;
+			return 1;
+		} else {
+			ifstream f(arg, ios::binary);
+			if (!f.is_open()){
+				cerr << "CANNOT OPEN " << arg << endl;
+				return 1;
+			}
+			ostringstream ss;
+			ss << f.rdbuf();
+			corpus.push_back(ss.str());
+		}
+	}
+	rngState = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	for (const string& text : corpus){
+		if (!Check(text)){
+			return 1;
+		}
+	}
+
+	//Pick a different set of kernels now and then, all of them must give the same tokens
+	const ScanMode modes[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+	for (long i = 0; i < count; i++){
+		if (i % 1000 == 0){
+			SetScanMode(modes[(i / 1000) % 3]);
+		}
+		string text;
+		if (!corpus.empty() && i % 2 == 0){
+			text = Mutate(corpus[Rand() % corpus.size()]);
+		} else {
+			text = RandomText(Rand() % 64);
+		}
+		if (!Check(text)){
+			return 1;
+		}
+	}
+
+	cout << "lexdiff: " << corpus.size() << " files and " << count << " fuzzed inputs, no differences" << endl;
+	return 0;
+}
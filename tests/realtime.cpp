@@ -0,0 +1,220 @@
+/*
+ * realtime.cpp
+ * Test that a program run in real time never allocates
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o realtime tests/realtime.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  realtime
+ *
+ * malloc, calloc and realloc are replaced here by versions that abort the test outright once the
+ * program has been given its memory (see realtime.h), so that an allocation anywhere while it runs
+ * fails the test where it happens. The program calls, recurses through tail calls, loops, selects,
+ * works on whole arrays, remembers the results of a pure function, fails at run time in a routine
+ * and prints numbers, booleans and strings. Its output must be what it was when it ran as it was read.
+ * Programs whose memory has no bound must be refused instead.
+ * Exits with 1 and says what went wrong otherwise.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "image.h"
+#include "parserInterp.h"
+#include "realtime.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t size);
+
+//Set while the program runs
+static bool armed = false;
+
+static void Allocated(){
+	armed = false;
+	static const char msg[] = "A program running in real time allocated memory\n";
+	(void)!write(2, msg, sizeof(msg) - 1);
+	abort();
+}
+
+extern "C" void* malloc(size_t size){
+	if (armed){
+		Allocated();
+	}
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size){
+	if (armed){
+		Allocated();
+	}
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* p, size_t size){
+	if (armed){
+		Allocated();
+	}
+	return __libc_realloc(p, size);
+}
+
+
+static const char* BOUNDED =
+	"program control;\n"
+	"var\n"
+	"\ti, j, steps : integer := 0;\n"
+	"\tgain : real := 0.5;\n"
+	"\ton : boolean := true;\n"
+	"\tmode : string := 'idle';\n"
+	"\tv, w : array [1..100] of real;\n"
+	"function sq(n : integer) : integer;\n"
+	"begin\n"
+	"\tsq := n * n\n"
+	"end;\n"
+	"function settle(n, acc : integer) : integer;\n"
+	"begin\n"
+	"\tif n = 0 then settle := acc else settle := settle(n - 1, acc + sq(n mod 10))\n"
+	"end;\n"
+	"procedure report(n : integer; x : real);\n"
+	"begin\n"
+	"\twriteln('step ', n, ': ', x, ' ', on, ' ', mode)\n"
+	"end;\n"
+	"procedure check(n : integer);\n"
+	"var\n"
+	"\tz : integer := 0;\n"
+	"begin\n"
+	"\tif n > 3 then z := n div z\n"
+	"end;\n"
+	"begin\n"
+	"\tfor i := 1 to 100 do begin\n"
+	"\t\tv[i] := i;\n"
+	"\t\tw[i] := 1.0\n"
+	"\tend;\n"
+	"\tfor i := 1 to 1000 do begin\n"
+	"\t\tw := w * gain + v * 0.25 - 1.0;\n"
+	"\t\tcase i mod 4 of 0: mode := 'hold'; 1: mode := 'ramp' else mode := 'idle' end;\n"
+	"\t\tj := settle(i, 0);\n"
+	"\t\tif i mod 250 = 0 then report(j, w[i div 10])\n"
+	"\tend;\n"
+	"\twhile steps < 10 do begin\n"
+	"\t\tsteps := steps + 1;\n"
+	"\t\ton := (steps mod 2 = 0) or (mode = 'hold');\n"
+	"\t\tcheck(steps)\n"
+	"\tend\n"
+	"end\n";
+
+//Programs that can't be bounded: one that recurses other than through a tail call, and one that
+//concatenates strings
+static const char* UNBOUNDED[] = {
+	"program deep;\n"
+	"var\n"
+	"\tn : integer := 0;\n"
+	"function fib(k : integer) : integer;\n"
+	"begin\n"
+	"\tif k < 2 then fib := k else fib := fib(k - 1) + fib(k - 2)\n"
+	"end;\n"
+	"begin\n"
+	"\tn := fib(20)\n"
+	"end\n",
+
+	"program grow;\n"
+	"var\n"
+	"\ts : string := 'a';\n"
+	"\ti : integer := 0;\n"
+	"begin\n"
+	"\tfor i := 1 to 10 do s := s + 'a'\n"
+	"end\n"
+};
+
+
+//Compiles and loads a program, false if it doesn't compile
+static bool Load(const char* text, string& image, LoadedImage& prog){
+	ResetProg();
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf());
+	istream in(&scan);
+	int line = 1;
+	return CompileImage(in, line, image) && LoadImage(image.data(), image.size(), prog);
+}
+
+//What a program prints when it is interpreted as it is read
+static string Interpreted(const char* text){
+	ResetProg();
+	istringstream src(text);
+	ScanBuf scan(src.rdbuf());
+	istream in(&scan);
+	int line = 1;
+	ostringstream out;
+	streambuf* old = cout.rdbuf(out.rdbuf());
+	Prog(in, line);
+	cout.rdbuf(old);
+	return out.str();
+}
+
+
+int main(){
+	//Output goes into a file through standard output's own fixed buffer, to be compared afterwards
+	//with what the program prints as it is read. That comes second, so that nothing the interpreter
+	//keeps from one program to the next is there yet when the program runs in real time
+	ReserveOutput();
+	bool ok = true;
+
+	char name[] = "/tmp/realtime-XXXXXX";
+	int fd = mkstemp(name);
+	if (fd < 0){
+		cerr << "Cannot make a file for the output" << endl;
+		return 1;
+	}
+	unlink(name);
+
+	string image;
+	LoadedImage prog;
+	if (!Load(BOUNDED, image, prog)){
+		cerr << "The bounded program didn't compile" << endl;
+		return 1;
+	}
+	const char* unbounded = ReserveRealtime(prog);
+	if (unbounded != NULL){
+		cerr << "The bounded program was refused, since " << unbounded << endl;
+		return 1;
+	}
+
+	fflush(stdout);
+	int saved = dup(1);
+	dup2(fd, 1);
+	armed = true;
+	RunImage(prog);
+	cout.flush();
+	armed = false;
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+
+	string expected = Interpreted(BOUNDED);
+	string got(lseek(fd, 0, SEEK_END), '\0');
+	if (pread(fd, &got[0], got.size(), 0) != (ssize_t)got.size() || got != expected){
+		cerr << "Running in real time printed" << endl << got << "rather than" << endl << expected;
+		ok = false;
+	}
+	close(fd);
+
+	for (const char* text : UNBOUNDED){
+		LoadedImage refused;
+		if (!Load(text, image, refused) || ReserveRealtime(refused) == NULL){
+			cerr << "A program with no bound wasn't refused:" << endl << text;
+			ok = false;
+		}
+	}
+
+	if (ok){
+		cout << "A program ran in real time without allocating, and " << size(UNBOUNDED) << " with no bound were refused" << endl;
+	}
+	return ok ? 0 : 1;
+}
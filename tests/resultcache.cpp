@@ -0,0 +1,217 @@
+/*
+ * resultcache.cpp
+ * Test that results kept for deterministic programs are replayed exactly and that the cache stays bounded
+ *
+ * Build:  g++ -std=c++17 -O2 -pthread -Isrc -o resultcache tests/resultcache.cpp $(ls src/[a-z]*.cpp | grep -v prog3.cpp)
+ * Usage:  resultcache
+ *
+ * Each run is in a child process of its own with its output going to a file, the way the interpreter
+ * runs with --result-cache. A program that only computes runs twice, and the second run must be
+ * answered from the cache with exactly what the first printed, errors and all. A program that reads its
+ * input runs twice too, and must run both times. Then the cache is filled past its limit with results
+ * that were used long ago, and keeping one more must remove the ones used longest ago, but not the
+ * one that was replayed since. Last, the result of one program is put where another's would be kept,
+ * as if their keys had collided, and the other must run rather than replay it.
+ * Exits with 1 and says what went wrong otherwise.
+ */
+
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "input.h"
+#include "parserInterp.h"
+#include "resultcache.h"
+#include "scanbuf.h"
+
+using namespace std;
+
+
+static const char* COMPUTES =
+	"program computes;\n"
+	"var\n"
+	"\ti, total : integer := 0;\n"
+	"\tx : real := 1.0;\n"
+	"begin\n"
+	"\tfor i := 1 to 1000 do begin\n"
+	"\t\ttotal := (total * 31 + i) mod 1000003;\n"
+	"\t\tx := x * 0.999 + 0.5;\n"
+	"\t\tif i mod 100 = 0 then writeln(i, ' ', total, ' ', x)\n"
+	"\tend;\n"
+	"\ttotal := total div (i - i)\n"
+	"end\n";
+
+static const char* READS =
+	"program reads;\n"
+	"var\n"
+	"\tn : integer;\n"
+	"begin\n"
+	"\treadln(n);\n"
+	"\twriteln(n * 2)\n"
+	"end\n";
+
+static const char* OTHER =
+	"program other;\n"
+	"begin\n"
+	"\twriteln('other')\n"
+	"end\n";
+
+
+//Runs a program in a child process with its output going to out and its input coming from input, using
+//the cache in dir. Returns 1 if it was replayed, 0 if it ran, and -1 if the child failed
+static int Run(const string& dir, const char* program, const string& out, const string& input){
+	pid_t pid = fork();
+	if (pid == 0){
+		int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		int from = open(input.c_str(), O_RDONLY);
+		if (fd < 0 || from < 0){
+			_exit(2);
+		}
+		dup2(fd, 1);
+		dup2(from, 0);
+		close(fd);
+		close(from);
+
+		ResultCache results;
+		results.Open(dir);
+		bool status;
+		int errors;
+		bool replayed = results.Replay(program, cout, status, errors);
+		if (!replayed){
+			istringstream src(program);
+			ScanBuf scan(src.rdbuf());
+			istream in(&scan);
+			int line = 1;
+			status = Prog(in, line);
+			errors = ErrCount();
+			results.Keep(status, errors, InputUsed());
+		}
+		cout << (status ? "successful" : "unsuccessful") << " " << errors << endl;
+		_exit(replayed ? 1 : 0);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) > 1){
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+static string Contents(const string& file){
+	ifstream in(file.c_str(), ios::binary);
+	return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+static bool Exists(const string& file){
+	struct stat st;
+	return stat(file.c_str(), &st) == 0;
+}
+
+static string KeptFile(const string& dir, const char* program){
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.out", (unsigned long long)ResultKey(program));
+	return dir + name;
+}
+
+//Sets when a file was last used to so many seconds after the start of 2000
+static void UsedAt(const string& file, long seconds){
+	struct timespec times[2] = { { 946684800 + seconds, 0 }, { 946684800 + seconds, 0 } };
+	utimensat(AT_FDCWD, file.c_str(), times, 0);
+}
+
+
+int main(){
+	char tmp[] = "/tmp/resultcache-XXXXXX";
+	if (mkdtemp(tmp) == NULL){
+		cerr << "Cannot make a directory for the test" << endl;
+		return 1;
+	}
+	string dir = string(tmp) + "/cache", first = string(tmp) + "/first", second = string(tmp) + "/second";
+	string input = string(tmp) + "/input";
+	ofstream(input.c_str()) << "21" << endl;
+	bool ok = true;
+
+	if (Run(dir, COMPUTES, first, input) != 0 || Run(dir, COMPUTES, second, input) != 1){
+		cerr << "A program that only computes wasn't replayed the second time it ran" << endl;
+		ok = false;
+	}
+	else if (Contents(first) != Contents(second)){
+		cerr << "Replayed, the program printed" << endl << Contents(second) << "rather than" << endl << Contents(first);
+		ok = false;
+	}
+
+	if (Run(dir, READS, first, input) != 0 || Run(dir, READS, second, input) != 0 || Exists(KeptFile(dir, READS))){
+		cerr << "A program that reads its input was kept" << endl;
+		ok = false;
+	}
+	else if (Contents(second) != "42\nsuccessful 0\n"){
+		cerr << "A program that reads its input printed" << endl << Contents(second);
+		ok = false;
+	}
+
+	//Five results of 20MB apiece used long ago, and the one kept above used between the oldest two of
+	//them but replayed since. Keeping one more has to make room by removing the oldest two of the five
+	string computes = KeptFile(dir, COMPUTES);
+	vector<string> old;
+	for (int i = 0; i < 5; i++){
+		char name[32];
+		snprintf(name, sizeof(name), "/%016x.out", 0xA0 + i);
+		old.push_back(dir + name);
+		int fd = open(old.back().c_str(), O_WRONLY | O_CREAT, 0600);
+		if (fd < 0 || ftruncate(fd, 20 << 20) != 0){
+			cerr << "Cannot fill the cache" << endl;
+			ok = false;
+		}
+		close(fd);
+		UsedAt(old.back(), i == 0 ? 0 : 100 + i);
+	}
+	UsedAt(computes, 50);
+	if (Run(dir, COMPUTES, second, input) != 1 || Run(dir, OTHER, first, input) != 0){
+		cerr << "The cache wasn't used once it was full" << endl;
+		ok = false;
+	}
+	else if (Exists(old[0]) || Exists(old[1]) || !Exists(old[2]) || !Exists(old[3]) || !Exists(old[4]) || !Exists(computes) || !Exists(KeptFile(dir, OTHER))){
+		cerr << "Keeping a result in a full cache didn't remove just the ones used longest ago" << endl;
+		ok = false;
+	}
+
+	//The result kept for one program, under the key of another as if their hashes had collided, must not
+	//be replayed for the other one, which has to print what it printed above
+	string otherPrinted = Contents(first);
+	string other = KeptFile(dir, OTHER);
+	string kept = Contents(computes);
+	uint64_t otherKey = ResultKey(OTHER);
+	if (kept.size() >= 16){
+		kept.replace(8, sizeof(otherKey), (const char*)&otherKey, sizeof(otherKey));
+	}
+	ofstream(other.c_str(), ios::binary) << kept;
+	if (Run(dir, OTHER, first, input) != 0 || Contents(first) != otherPrinted){
+		cerr << "The result of another program with the same key was replayed" << endl;
+		ok = false;
+	}
+
+	for (const string& file : old){
+		unlink(file.c_str());
+	}
+	unlink(computes.c_str());
+	unlink(KeptFile(dir, OTHER).c_str());
+	unlink((dir + "/stats").c_str());
+	rmdir(dir.c_str());
+	unlink(first.c_str());
+	unlink(second.c_str());
+	unlink(input.c_str());
+	rmdir(tmp);
+
+	if (ok){
+		cout << "A deterministic program was replayed exactly, one that reads its input ran every time, a full cache made room by removing the results used longest ago, and a result under a colliding key wasn't replayed" << endl;
+	}
+	return ok ? 0 : 1;
+}